@@ -8,6 +8,7 @@
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include <boost/crc.hpp>
+#include <cerrno>
 #include <chrono>
 #include <fstream>
 #include <functional>
@@ -19,6 +20,13 @@
 #include <thread>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_PWRITE 1
+#endif
+
 using boost::asio::ip::udp;
 using namespace std::chrono;
 
@@ -27,6 +35,7 @@ constexpr int MAX_BUFFER_SIZE = 1024; // Max packet payload size
 constexpr int MAX_RETRIES = 5;        // Maximum retransmission attempts
 constexpr int TIMEOUT_MS = 1000;      // Timeout in milliseconds
 constexpr uint8_t ACK_PACKET = 0xFF;  // ACK packet identifier
+constexpr uint64_t DEFAULT_SYNC_INTERVAL = 64 * 1024 * 1024; // Periodic sync
 
 // Ensure consistent memory layout across platforms
 #pragma pack(push, 1)
@@ -120,19 +129,186 @@ std::vector<char> readFileContents(const std::string &filepath) {
   return buffer;
 }
 
-// Save received data to a file
-void saveToFile(const std::vector<char> &data, const std::string &filepath) {
-  std::ofstream file(filepath, std::ios::binary);
-  if (!file) {
-    throw std::runtime_error("Failed to create output file: " + filepath);
+// When the receiver flushes the output file to stable storage
+enum class SyncPolicy {
+  NONE,        // Leave write-back to the kernel
+  ON_COMPLETE, // fsync once after the last packet
+  PERIODIC     // fdatasync every sync interval, plus fsync on completion
+};
+
+// Parse a --sync argument: none, complete, periodic or periodic:<MB>
+SyncPolicy parseSyncPolicy(const std::string &value,
+                           uint64_t &sync_interval_bytes) {
+  if (value == "none") {
+    return SyncPolicy::NONE;
+  }
+  if (value == "complete") {
+    return SyncPolicy::ON_COMPLETE;
+  }
+  if (value == "periodic") {
+    return SyncPolicy::PERIODIC;
+  }
+  // periodic:<MB> with a whole number of megabytes, at least one
+  if (value.compare(0, 9, "periodic:") == 0 && value.size() > 9 &&
+      value.size() <= 9 + 6) {
+    uint64_t megabytes = 0;
+    size_t i = 9;
+    while (i < value.size() && value[i] >= '0' && value[i] <= '9') {
+      megabytes = megabytes * 10 + static_cast<uint64_t>(value[i] - '0');
+      ++i;
+    }
+    if (i == value.size() && megabytes > 0) {
+      sync_interval_bytes = megabytes * 1024 * 1024;
+      return SyncPolicy::PERIODIC;
+    }
   }
+  throw std::runtime_error("Unknown sync policy: " + value);
+}
 
-  file.write(data.data(), data.size());
-  file.close();
+// Output file written in place: each verified payload goes straight to its
+// offset, space is preallocated ahead of the writes, and nothing is held in
+// memory. The final size is only known at the last packet, so space is
+// reserved in PREALLOC_STEP extents and the tail trimmed in finish().
+class FileSink {
+private:
+  static constexpr uint64_t PREALLOC_STEP = 64 * 1024 * 1024;
+
+  std::string filepath_;
+  SyncPolicy sync_policy_;
+  uint64_t sync_interval_bytes_;
+  uint64_t allocated_;         // Bytes reserved on disk
+  uint64_t written_;           // Payload bytes written
+  uint64_t unsynced_;          // Bytes written since the last sync
+#ifdef HAVE_PWRITE
+  int fd_;
+#else
+  std::fstream file_;
+#endif
 
-  std::cout << "Saved " << data.size() << " bytes to file: " << filepath
-            << std::endl;
-}
+public:
+  FileSink(const std::string &filepath,
+           SyncPolicy sync_policy = SyncPolicy::ON_COMPLETE,
+           uint64_t sync_interval_bytes = DEFAULT_SYNC_INTERVAL)
+      : filepath_(filepath), sync_policy_(sync_policy),
+        sync_interval_bytes_(sync_interval_bytes), allocated_(0), written_(0),
+        unsynced_(0) {
+#ifdef HAVE_PWRITE
+    fd_ = ::open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error("Failed to create output file: " + filepath);
+    }
+#else
+    file_.open(filepath, std::ios::binary | std::ios::in | std::ios::out |
+                             std::ios::trunc);
+    if (!file_) {
+      throw std::runtime_error("Failed to create output file: " + filepath);
+    }
+#endif
+  }
+
+  ~FileSink() {
+#ifdef HAVE_PWRITE
+    ::close(fd_);
+#endif
+  }
+
+  FileSink(const FileSink &) = delete;
+  FileSink &operator=(const FileSink &) = delete;
+
+  // Payload bytes written so far
+  uint64_t bytesWritten() const { return written_; }
+
+  // Write one payload at its offset in the file
+  void write(uint64_t offset, const char *data, size_t len) {
+    if (len == 0) {
+      return;
+    }
+    preallocate(offset + len);
+
+#ifdef HAVE_PWRITE
+    while (len > 0) {
+      ssize_t n = ::pwrite(fd_, data, len, static_cast<off_t>(offset));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Failed to write output file: " + filepath_);
+      }
+      data += n;
+      offset += n;
+      len -= n;
+      written_ += n;
+      unsynced_ += n;
+    }
+#else
+    file_.seekp(static_cast<std::streamoff>(offset), std::ios::beg);
+    if (!file_.write(data, len)) {
+      throw std::runtime_error("Failed to write output file: " + filepath_);
+    }
+    written_ += len;
+    unsynced_ += len;
+#endif
+
+    if (sync_policy_ == SyncPolicy::PERIODIC &&
+        unsynced_ >= sync_interval_bytes_) {
+      sync(false);
+    }
+  }
+
+  // Set the final size, drop unused preallocation and apply the sync policy
+  void finish(uint64_t final_size) {
+#ifdef HAVE_PWRITE
+    if (::ftruncate(fd_, static_cast<off_t>(final_size)) != 0) {
+      throw std::runtime_error("Failed to set output file size: " + filepath_);
+    }
+#else
+    file_.flush();
+#endif
+    allocated_ = final_size;
+
+    if (sync_policy_ != SyncPolicy::NONE) {
+      sync(true);
+    }
+
+    std::cout << "Saved " << final_size << " bytes to file: " << filepath_
+              << std::endl;
+  }
+
+private:
+  // Reserve disk space ahead of the write position
+  void preallocate(uint64_t end) {
+    if (end <= allocated_) {
+      return;
+    }
+    uint64_t target = (end + PREALLOC_STEP - 1) / PREALLOC_STEP * PREALLOC_STEP;
+#if defined(__linux__)
+    // KEEP_SIZE reserves blocks without moving EOF; unsupported file
+    // systems just skip preallocation
+    ::fallocate(fd_, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(allocated_),
+                static_cast<off_t>(target - allocated_));
+#endif
+    allocated_ = target;
+  }
+
+  // Flush written data to stable storage
+  void sync(bool full) {
+#ifdef HAVE_PWRITE
+#if defined(__linux__)
+    int rc = full ? ::fsync(fd_) : ::fdatasync(fd_);
+#else
+    (void)full;
+    int rc = ::fsync(fd_);
+#endif
+    if (rc != 0) {
+      std::cerr << "Failed to sync output file: " << filepath_ << std::endl;
+    }
+#else
+    (void)full;
+    file_.flush();
+#endif
+    unsynced_ = 0;
+  }
+};
 
 // UDP Client implementation
 class UdpClient {
@@ -354,15 +530,26 @@ private:
 
   // Buffer for incoming data
   Packet receive_buffer_;
-  std::vector<char> assembled_data_;
+
+  // Payloads are written in place at their file offset
+  std::unique_ptr<FileSink> sink_;
+  uint64_t bytes_received_;
 
 public:
   UdpServer(boost::asio::io_context &io_context, int port,
-            std::string output_filepath = "", bool verbose = false)
+            std::string output_filepath = "", bool verbose = false,
+            SyncPolicy sync_policy = SyncPolicy::ON_COMPLETE,
+            uint64_t sync_interval_bytes = DEFAULT_SYNC_INTERVAL)
       : io_context_(io_context),
         socket_(io_context, udp::endpoint(udp::v4(), port)),
         expected_seq_num_(0), is_running_(true),
-        output_filepath_(output_filepath), verbose_(verbose) {
+        output_filepath_(output_filepath), verbose_(verbose),
+        bytes_received_(0) {
+
+    if (!output_filepath_.empty()) {
+      sink_.reset(
+          new FileSink(output_filepath_, sync_policy, sync_interval_bytes));
+    }
 
     std::cout << "Server started on port " << port << std::endl;
     if (!output_filepath_.empty()) {
@@ -381,9 +568,6 @@ public:
                     boost::asio::placeholders::bytes_transferred));
   }
 
-  // Get the assembled data
-  const std::vector<char> &getAssembledData() const { return assembled_data_; }
-
   // Handle received data
   void handle_receive(const boost::system::error_code &error,
                       size_t bytes_received) {
@@ -430,14 +614,16 @@ public:
         // Process the received data
         if (receive_buffer_.data_size > 0 &&
             receive_buffer_.data_size <= MAX_BUFFER_SIZE) {
-          // Copy received data to our assembled buffer
-          assembled_data_.insert(assembled_data_.end(), receive_buffer_.data,
-                                 receive_buffer_.data +
-                                     receive_buffer_.data_size);
+          // Write the payload at its place in the output file
+          if (sink_) {
+            sink_->write(bytes_received_, receive_buffer_.data,
+                         receive_buffer_.data_size);
+          }
+          bytes_received_ += receive_buffer_.data_size;
 
-          std::cout << "Added " << receive_buffer_.data_size
-                    << " bytes to assembled data (total: "
-                    << assembled_data_.size() << " bytes)" << std::endl;
+          std::cout << "Wrote " << receive_buffer_.data_size
+                    << " bytes to output (total: " << bytes_received_
+                    << " bytes)" << std::endl;
 
           // Flip expected sequence number for next packet (0->1, 1->0)
           expected_seq_num_ = 1 - expected_seq_num_;
@@ -448,9 +634,9 @@ public:
           std::cout << "Last packet received, data reception complete."
                     << std::endl;
 
-          // Save to file if output path was specified
-          if (!output_filepath_.empty()) {
-            saveToFile(assembled_data_, output_filepath_);
+          // Finalize the file before the last ACK goes out
+          if (sink_) {
+            sink_->finish(bytes_received_);
           }
         }
       } else if (receive_buffer_.seq_num != expected_seq_num_) {
@@ -551,6 +737,10 @@ void print_help(const char *program_name) {
   std::cout << "Options:\n";
   std::cout
       << "  -v, --verbose    Enable verbose output with detailed debugging\n";
+  std::cout << "  --sync MODE      Server durability: complete (fsync at end, "
+               "default),\n"
+               "                   periodic[:MB] (fdatasync every MB, default "
+            << DEFAULT_SYNC_INTERVAL / (1024 * 1024) << ") or none\n";
   std::cout << "  -h, --help       Display this help message\n";
   std::cout << "Examples:\n";
   std::cout << "  " << program_name << " --client 127.0.0.1 8080 myfile.txt\n";
@@ -576,12 +766,15 @@ int main(int argc, char *argv[]) {
       return 0;
     }
 
-    // Check for verbose flag (can be anywhere in arguments)
+    // Check for option flags (can be anywhere in arguments)
+    SyncPolicy sync_policy = SyncPolicy::ON_COMPLETE;
+    uint64_t sync_interval = DEFAULT_SYNC_INTERVAL;
     for (int i = 1; i < argc; ++i) {
       std::string arg = argv[i];
       if (arg == "-v" || arg == "--verbose") {
         verbose = true;
-        break;
+      } else if (arg == "--sync" && i + 1 < argc) {
+        sync_policy = parseSyncPolicy(argv[++i], sync_interval);
       }
     }
 
@@ -632,7 +825,8 @@ int main(int argc, char *argv[]) {
 
       // Create IO context and server
       boost::asio::io_context io_context;
-      UdpServer server(io_context, port, output_file, verbose);
+      UdpServer server(io_context, port, output_file, verbose, sync_policy,
+                       sync_interval);
 
       // Start server
       server.start_receive();
@@ -1,42 +1,591 @@
 /**
  * UDP Stop-and-Wait Protocol with Fixed CRC and Latency Measurements
+ * Optional selective-repeat sliding window mode (--window)
+ * Multi-session server: concurrent clients, one socket per thread
  * Cross-platform (Windows, Linux, macOS)
  */
 
 #include <algorithm>
+#include <atomic>
+#include <bitset>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include <boost/crc.hpp>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
 #include <numeric>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
+#include <zlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#define HAVE_PWRITE 1 // pwrite/pread on file descriptors
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__linux__)
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#define HAVE_MMSG 1 // sendmmsg/recvmmsg
+#if __has_include(<linux/errqueue.h>) && __has_include(<linux/net_tstamp.h>)
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#define HAVE_TIMESTAMPING 1 // SO_TIMESTAMPING send/receive stamps
+#endif
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING 1 // Multishot receive with provided buffer rings
+#endif
+#endif
+#endif
 
 using boost::asio::ip::udp;
 using namespace std::chrono;
 
 // Constants
-constexpr int MAX_BUFFER_SIZE = 1024; // Max packet payload size
+constexpr int DEFAULT_PAYLOAD_SIZE = 1024; // Payload unless negotiated
+constexpr int MIN_PAYLOAD_SIZE = 256;      // Lower bound for --payload
+constexpr int MAX_PAYLOAD_SIZE = 8946; // Fills a 9000-byte jumbo frame
+constexpr int IPV4_UDP_HEADERS = 28;   // IPv4 + UDP header bytes
 constexpr int MAX_RETRIES = 5;        // Maximum retransmission attempts
-constexpr int TIMEOUT_MS = 1000;      // Timeout in milliseconds
+constexpr int TIMEOUT_MS = 1000;      // Initial retransmission timeout
+constexpr int MIN_RTO_MS = 20;        // Lower bound for the adaptive RTO
+constexpr int MAX_RTO_MS = 10000;     // Upper bound for the adaptive RTO
 constexpr uint8_t ACK_PACKET = 0xFF;  // ACK packet identifier
 
+// Selective-repeat packet types. Stop-and-wait packets start with a seq_num
+// of 0 or 1, so any first byte above that identifies a typed packet.
+constexpr uint8_t SR_DATA_PACKET = 0xA0; // Selective-repeat data packet
+constexpr uint8_t SR_ACK_PACKET = 0xA1;  // Selective-repeat ACK
+constexpr uint8_t SR_MANIFEST_PACKET = 0xA2; // Multi-stream transfer manifest
+constexpr uint8_t SR_MANIFEST_ACK = 0xA3;    // Manifest accepted/rejected
+constexpr uint8_t SR_BARRIER_PACKET = 0xA4;  // Multi-stream completion query
+constexpr uint8_t SR_BARRIER_ACK = 0xA5;     // Completion status reply
+constexpr uint8_t SR_REPAIR_PACKET = 0xA6;   // FEC repair symbol of a block
+constexpr uint8_t SR_RESUME_QUERY = 0xA7;    // Resumable transfer manifest
+constexpr uint8_t SR_RESUME_REPLY = 0xA8;    // One page of the chunk bitmap
+constexpr uint8_t SR_SIGNATURE_QUERY = 0xA9; // Delta: ask for block signatures
+constexpr uint8_t SR_SIGNATURE_REPLY = 0xAA; // One page of block signatures
+constexpr uint8_t SR_PROBE_PACKET = 0xAB; // Payload handshake / PMTU probe
+constexpr uint8_t SR_PROBE_ACK = 0xAC;    // Probe arrived; server's limit
+constexpr uint8_t SR_DATA_ACK_NOW = 0xAD; // Data packet to be ACKed at once
+constexpr uint8_t SR_MCAST_DATA = 0xAE;  // Multicast data packet, never ACKed
+constexpr uint8_t SR_NACK_PACKET = 0xAF; // Multicast receiver's loss report
+constexpr uint8_t SR_MCAST_FLUSH = 0xB0; // Multicast sender: all data sent
+constexpr int SR_TICK_MS = 10;           // Retransmit scan interval
+constexpr int SR_WHEEL_TICK_US = 1000;   // Retransmit timer resolution
+constexpr int SR_DEFAULT_RECV_WINDOW = 256; // Default receiver window
+constexpr int SR_MAX_WINDOW = 65536;        // Upper bound for --window
+constexpr uint64_t DEFAULT_SYNC_INTERVAL = 64 * 1024 * 1024; // Periodic sync
+constexpr int GSO_MIN_BATCH = 64; // Queue depth needed to fill a GSO send
+constexpr size_t DISK_RING_SLOTS = 4096; // Payloads queued for --disk-thread
+constexpr size_t DISK_SLOT_ALIGN = 64;   // Ring slot alignment (cache line)
+constexpr int DISK_POLL_US = 200; // Disk thread polls this long before sleeping
+constexpr int SR_MAX_RETRIES = 10; // Per-packet retransmissions (RTO backs off)
+constexpr int SR_REORDER_DIVISOR = 4; // Reorder window step: min RTT / 4
+constexpr int SR_REORDER_PERSIST = 16; // Loss episodes a widened window lasts
+constexpr int SR_SACK_BITS = 64;        // Packets one ACK's bitmap covers
+constexpr int DEFAULT_ACK_EVERY = 16;     // Packets acknowledged per ACK
+constexpr int DEFAULT_ACK_DELAY_US = 1000; // Longest an ACK is held back
+constexpr int INITIAL_CWND = 10;   // Congestion window at start, in packets
+constexpr int SESSION_SWEEP_MS = 1000;      // Idle session scan interval
+constexpr int DEFAULT_IDLE_TIMEOUT_S = 30;  // Idle time before a session closes
+constexpr size_t DEFAULT_MAX_SESSIONS = 1024;
+constexpr size_t DEFAULT_SESSION_MEMORY = 64 * 1024 * 1024; // State budget
+// Bounds for --idle-timeout: a session waiting out the longest RTO is not
+// idle. And for --max-sessions and --session-memory (in MB).
+constexpr int MIN_IDLE_TIMEOUT_S = MAX_RTO_MS / 1000 + SESSION_SWEEP_MS / 1000;
+constexpr int MAX_IDLE_TIMEOUT_S = 24 * 60 * 60;
+constexpr int MAX_SESSIONS_LIMIT = 1 << 20;
+constexpr int MAX_SESSION_MEMORY_MB = 1 << 20;
+constexpr int MAX_STREAMS = 64;             // Upper bound for --streams
+constexpr int BARRIER_TIMEOUT_S = 30;       // Wait for the file to be final
+constexpr int FEC_MAX_DATA = 64;            // Upper bound for FEC block size N
+constexpr int FEC_MAX_REPAIR = 16;          // Upper bound for repair count K
+constexpr size_t FEC_MAX_SYMBOL_SIZE = 3 + MAX_PAYLOAD_SIZE; // Largest symbol
+constexpr uint32_t RESUME_CHUNK_PACKETS = 64; // Packets per journal chunk
+constexpr size_t RESUME_PAGE_BYTES = 1024;    // Bitmap bytes per reply
+constexpr int SIGNATURES_PER_PAGE = 84;       // Block signatures per reply
+constexpr int SIGNATURE_WINDOW = 32;          // Signature pages in flight
+constexpr uint32_t DELTA_MIN_BLOCK = 1024;    // Delta block size bounds
+constexpr uint32_t DELTA_MAX_BLOCK = 128 * 1024;
+constexpr size_t DELTA_MAX_LITERAL = 64 * 1024; // Longest literal run written
+constexpr int PROBE_TIMEOUT_MS = 200; // Wait for one probe's ACK
+constexpr int PROBE_ATTEMPTS = 3;     // Probe losses before a size is too big
+constexpr int PROBE_RESOLUTION = 16;  // Payload search stops this close
+
+// Compressed transfers (--compress): the file goes as a stream of frames,
+// one per COMPRESS_BLOCK bytes, built on a worker pool
+constexpr size_t COMPRESS_BLOCK = 128 * 1024; // File bytes per frame
+constexpr size_t COMPRESS_PROBE = 4096;       // Sample tried before a block
+constexpr int COMPRESS_LEVEL = 1;             // zlib level: speed over ratio
+constexpr uint8_t PAYLOAD_RAW = 0;    // SrPacket payload is file bytes
+constexpr uint8_t PAYLOAD_FRAMED = 1; // SrPacket payload is frame stream
+constexpr uint8_t FRAME_STORED = 0;   // Frame holds the block as is
+constexpr uint8_t FRAME_ZLIB = 1;     // Frame holds a zlib stream
+
+// What the file announced by a manifest is
+constexpr uint8_t MANIFEST_PLAIN = 0; // A file, saved like any transfer
+constexpr uint8_t MANIFEST_BASIS = 1; // Full copy, kept as the next delta basis
+constexpr uint8_t MANIFEST_DELTA = 2; // Delta against the receiver's copy
+constexpr uint8_t MANIFEST_TREE_FILE = 3; // Large file of a directory transfer
+constexpr uint8_t MANIFEST_TREE_PACK = 4; // Directory transfer's pack
+
+// Directory transfers: files up to TREE_LARGE_FILE go inside the pack, larger
+// ones as transfers of their own
+constexpr uint64_t TREE_LARGE_FILE = 1024 * 1024;
+constexpr int TREE_WALK_THREADS = 8; // Directory readers (stat-bound)
+constexpr size_t TREE_MAX_PATH = 4096; // Longest relative path in a pack
+
+// Multicast distribution (--multicast / --join): the sender paces data and
+// repairs to one rate, receivers NACK losses per FEC block to the group
+constexpr int MCAST_DEFAULT_RATE_MBIT = 100; // Sender rate, repairs included
+constexpr int MCAST_DEFAULT_TTL = 1;         // Stays on the local network
+constexpr int MCAST_RECV_WINDOW = 8192;      // Receive window with --join
+constexpr int MCAST_DEFAULT_FEC_DATA = 16;   // Repair code without --fec
+constexpr int MCAST_DEFAULT_FEC_REPAIR = 4;
+constexpr int MCAST_NACK_TICK_MS = 5;      // Receiver loss scan interval
+constexpr int MCAST_NACK_BACKOFF_MS = 20;  // Random wait before a NACK
+constexpr int MCAST_NACK_HOLDOFF_MS = 60;  // Wait for repairs after a NACK
+constexpr int MCAST_REPAIR_HOLDOFF_MS = 30; // Sender: NACKs for a block just
+                                            // repaired crossed the repair
+constexpr int MCAST_FLUSH_INTERVAL_MS = 100; // End-of-data announcements
+constexpr int MCAST_FLUSH_ROUNDS = 5; // Quiet flushes before the sender stops
+constexpr int MCAST_NACK_ENTRIES = 32; // Blocks one NACK names
+
+// Low-latency request/response (--echo / --ping): small messages, each
+// answered at once; --busy-poll spins on the socket instead of sleeping in
+// the reactor
+constexpr uint8_t PING_REQUEST = 0xB1; // Ping, to be echoed
+constexpr uint8_t PING_REPLY = 0xB2;   // Echoed ping
+constexpr size_t PING_MAX_MESSAGE = 1400;   // Largest ping, within one MTU
+constexpr size_t PING_DEFAULT_MESSAGE = 64;
+constexpr int PING_TIMEOUT_MS = 1000;  // Ping taken as lost
+constexpr int BUSY_POLL_US = 50;       // SO_BUSY_POLL device poll per receive
+constexpr int BUSY_SPIN_IDLE_US = 2000; // Quiet time before spinning stops
+constexpr int BUSY_SLEEP_MS = 100;     // Sleep slice once quiet (stop checks)
+
+// --bench-net: a transfer slower than BENCH_STALL_RATE bytes/s on average
+// (after BENCH_STALL_GRACE_S) is stopped and reported as stalled
+constexpr uint64_t BENCH_STALL_RATE = 256 * 1024;
+constexpr int BENCH_STALL_GRACE_S = 5;
+// Resends allowed on a lossless, in-order path: none are needed, but a
+// busy host can hold a packet past its reorder window or RTO
+constexpr double BENCH_SPURIOUS_PERCENT = 1.0;
+
+// CPU cycle counter used to cost the send path. Falls back to nanoseconds
+// where there is no timestamp counter.
+inline uint64_t readCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return duration_cast<nanoseconds>(
+             steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Unit reported by readCycleCounter()
+inline const char *cycleCounterUnit() {
+#if defined(__x86_64__) || defined(__i386__)
+  return "cycles";
+#else
+  return "ns";
+#endif
+}
+
+// Fixed-size log-linear latency histogram in the style of HdrHistogram.
+// Values are kept in nanoseconds: exact below SUB_BUCKETS, above that in
+// buckets 1/HALF_BUCKETS of their magnitude wide, so any value comes back
+// within 0.4%. Recording is O(1), memory is constant (about 40 KB) however
+// long the transfer runs, and two histograms merge by adding counts.
+class LatencyHistogram {
+public:
+  static constexpr int SUB_BUCKET_BITS = 8;
+  static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BUCKET_BITS;
+  static constexpr uint64_t HALF_BUCKETS = SUB_BUCKETS / 2;
+  static constexpr int MAX_VALUE_BITS = 44; // ~4.9 hours in nanoseconds
+  static constexpr size_t BUCKETS =
+      SUB_BUCKETS + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * HALF_BUCKETS;
+
+  LatencyHistogram()
+      : counts_(BUCKETS, 0), count_(0), sum_ns_(0.0), min_ns_(UINT64_MAX),
+        max_ns_(0) {}
+
+  // Record one latency in milliseconds
+  void record(double latency_ms) {
+    uint64_t ns = latency_ms > 0.0
+                      ? static_cast<uint64_t>(latency_ms * 1000000.0 + 0.5)
+                      : 0;
+    counts_[bucketOf(ns)]++;
+    count_++;
+    sum_ns_ += ns;
+    min_ns_ = std::min(min_ns_, ns);
+    max_ns_ = std::max(max_ns_, ns);
+  }
+
+  // Add another histogram's samples to this one
+  void merge(const LatencyHistogram &other) {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ns_ += other.sum_ns_;
+    min_ns_ = std::min(min_ns_, other.min_ns_);
+    max_ns_ = std::max(max_ns_, other.max_ns_);
+  }
+
+  uint64_t count() const { return count_; }
+  bool empty() const { return count_ == 0; }
+
+  // Exact mean, minimum and maximum in milliseconds (0 when empty)
+  double mean() const { return count_ ? sum_ns_ / count_ / 1e6 : 0.0; }
+  double min() const { return count_ ? min_ns_ / 1e6 : 0.0; }
+  double max() const { return count_ ? max_ns_ / 1e6 : 0.0; }
+
+  // Value at a percentile (0-100) in milliseconds: the middle of the
+  // bucket holding that rank, clamped to the exact extremes
+  double percentile(double percent) const {
+    if (count_ == 0) {
+      return 0.0;
+    }
+    uint64_t rank = static_cast<uint64_t>(
+        std::ceil(percent / 100.0 * static_cast<double>(count_)));
+    rank = std::max<uint64_t>(1, std::min(rank, count_));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        uint64_t ns = std::max(min_ns_, std::min(max_ns_, middleOf(i)));
+        return ns / 1e6;
+      }
+    }
+    return max();
+  }
+
+  // Visit every non-empty bucket as (middle value in ms, count), in order
+  template <typename Visitor> void forEachBucket(Visitor visit) const {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      if (counts_[i] > 0) {
+        visit(middleOf(i) / 1e6, counts_[i]);
+      }
+    }
+  }
+
+private:
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  double sum_ns_;
+  uint64_t min_ns_;
+  uint64_t max_ns_;
+
+  static size_t bucketOf(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+      return static_cast<size_t>(ns);
+    }
+    int magnitude = 63 - __builtin_clzll(ns);
+    if (magnitude >= MAX_VALUE_BITS) {
+      return BUCKETS - 1;
+    }
+    int shift = magnitude - (SUB_BUCKET_BITS - 1);
+    return static_cast<size_t>(SUB_BUCKETS + (shift - 1) * HALF_BUCKETS +
+                               ((ns >> shift) - HALF_BUCKETS));
+  }
+
+  static uint64_t middleOf(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+      return bucket;
+    }
+    int shift = static_cast<int>((bucket - SUB_BUCKETS) / HALF_BUCKETS) + 1;
+    uint64_t sub = (bucket - SUB_BUCKETS) % HALF_BUCKETS + HALF_BUCKETS;
+    return (sub << shift) + (uint64_t(1) << (shift - 1));
+  }
+};
+
 // Latency statistics structure
 struct LatencyStats {
-  std::vector<double> packet_latencies;         // Latency of each packet in ms
-  std::vector<double> retry_latencies;          // Latency of retries in ms
+  LatencyHistogram packet_latencies; // Latency of each packet
+  LatencyHistogram wire_rtts;      // Kernel-timestamped RTT (--timestamps)
+  LatencyHistogram host_overheads; // User-space RTT less the wire RTT
+  size_t retries;                    // Packets ACKed after a retry
   high_resolution_clock::time_point start_time; // Start time of transfer
   high_resolution_clock::time_point end_time;   // End time of transfer
   size_t total_bytes;                           // Total bytes transferred
+  int window_size;     // Packets allowed in flight (0 = stop-and-wait)
+  int payload_size;    // Data bytes per packet (0 = not recorded)
+  int header_size;     // Protocol header bytes in front of each payload
+  int route_mtu;       // Path MTU the kernel reported (0 = unknown)
+  int mtu_probes;      // Probe packets sent to settle the payload size
+  size_t wire_bytes;   // Payload bytes sent, including retransmissions
+  size_t zero_copy_bytes; // Payload gathered from the file mapping uncopied
+  uint64_t send_cycles; // CPU cycles spent building and sending packets
+  std::string io_mode;  // Datagram I/O path used (per-packet, batched, GSO)
+  std::string congestion_control; // Controller name ("none" = fixed window)
+  double cwnd_sum;      // Sum of congestion window samples, in packets
+  size_t cwnd_samples;  // Number of congestion window samples
+  double final_cwnd;    // Congestion window at the end of the transfer
+  double srtt_ms;       // Smoothed RTT from the RTO estimator
+  double rttvar_ms;     // RTT variation from the RTO estimator
+  double rto_ms;        // Retransmission timeout at the end of the transfer
+  double pacing_rate;   // Last pacing rate in bytes/s (0 = unpaced)
+  std::vector<std::pair<size_t, double>> streams; // Per-stream bytes, seconds
+  std::string checksum; // Payload checksum and the implementation used
+  int fec_data;         // FEC block size N (0 = no FEC)
+  int fec_repair;       // FEC repair packets per block K
+  size_t fec_repairs_sent;  // Repair packets put on the wire
+  size_t fec_recovered;     // Lost packets rebuilt from repair packets
+  size_t retransmitted;     // Packets resent after an ACK timeout
+  size_t fast_retransmits;  // Of those, resent on SACK evidence instead
+  size_t spurious_retransmits; // Resends the original copy made needless
+  size_t ack_packets;       // ACKs received (client) or sent (server)
+  size_t nack_packets;      // Multicast NACKs received (sender) or sent
+  size_t nacks_suppressed;  // Receiver: block reports another's NACK made
+                            // unnecessary
+  uint64_t disk_writes;     // Server --disk-thread: payloads written,
+  uint64_t disk_syscalls;   // the pwritev() calls that wrote them, and
+  size_t disk_ring_drops;   // packets dropped with the ring full
+  uint64_t resumed_bytes;   // Bytes the receiver kept from an earlier run
+  uint64_t delta_file_bytes;    // Delta mode: size of the file (0 = off)
+  uint64_t delta_matched_bytes; // File bytes found in the receiver's copy
+  uint64_t delta_stream_bytes;  // Size of the delta actually sent
+  uint64_t signature_bytes;     // Block signatures fetched from the receiver
+  uint32_t delta_block_size;    // Block size the receiver picked
+  int compress_threads;         // Compression workers (0 = not compressed)
+  uint64_t compress_stream_bytes; // Frame stream sent for the file
+  uint64_t compress_blocks;       // Blocks the file was cut into
+  uint64_t compress_stored;       // Blocks sent uncompressed
+  uint64_t tree_files;       // Directory mode: regular files (0 = off)
+  uint64_t tree_directories; // Directories, the root included
+  uint64_t tree_file_bytes;  // Contents of the files
+  uint64_t tree_separate;    // Files sent as transfers of their own
+
+  LatencyStats()
+      : retries(0), total_bytes(0), window_size(0), payload_size(0),
+        header_size(0), route_mtu(0), mtu_probes(0), wire_bytes(0),
+        zero_copy_bytes(0), send_cycles(0),
+        io_mode("per-packet"), congestion_control("none"), cwnd_sum(0.0),
+        cwnd_samples(0), final_cwnd(0.0), srtt_ms(0.0), rttvar_ms(0.0),
+        rto_ms(0.0), pacing_rate(0.0), fec_data(0), fec_repair(0),
+        fec_repairs_sent(0), fec_recovered(0), retransmitted(0),
+        fast_retransmits(0), spurious_retransmits(0), ack_packets(0),
+        nack_packets(0),
+        nacks_suppressed(0), disk_writes(0), disk_syscalls(0),
+        disk_ring_drops(0), resumed_bytes(0),
+        delta_file_bytes(0), delta_matched_bytes(0), delta_stream_bytes(0),
+        signature_bytes(0), delta_block_size(0),
+        compress_threads(0), compress_stream_bytes(0), compress_blocks(0),
+        compress_stored(0), tree_files(0), tree_directories(0),
+        tree_file_bytes(0), tree_separate(0) {}
+
+  // Record the congestion controller used for this transfer
+  void setCongestionControl(const std::string &name) {
+    congestion_control = name;
+  }
+
+  // Add a congestion window sample (taken on every ACK)
+  void addCwndSample(double cwnd) {
+    cwnd_sum += cwnd;
+    cwnd_samples++;
+    final_cwnd = cwnd;
+  }
+
+  // Record the RTO estimator state
+  void setRttState(double srtt, double rttvar, double rto) {
+    srtt_ms = srtt;
+    rttvar_ms = rttvar;
+    rto_ms = rto;
+  }
+
+  // Record the current pacing rate
+  void setPacingRate(double rate) { pacing_rate = rate; }
+
+  // Record the payload checksum in use
+  void setChecksum(const std::string &name) { checksum = name; }
+
+  // Record the FEC code shape (N data packets, K repair packets)
+  void setFec(int data, int repair) {
+    fec_data = data;
+    fec_repair = repair;
+  }
+
+  // Count a repair packet sent
+  void addFecRepair() { fec_repairs_sent++; }
+
+  // Count packets rebuilt by FEC instead of being resent
+  void addFecRecovered(size_t packets) { fec_recovered += packets; }
+
+  // Count a retransmission
+  void addRetransmission() { retransmitted++; }
+
+  // Count a retransmission triggered by later packets being ACKed
+  void addFastRetransmit() { fast_retransmits++; }
+
+  // Count a retransmission whose original turned out to have arrived
+  void addSpuriousRetransmit() { spurious_retransmits++; }
+
+  // Count an ACK packet
+  void addAckPacket() { ack_packets++; }
+
+  // Add a round trip measured with kernel timestamps, and what user space
+  // added to it on this side (handing the packet over, picking the ACK up)
+  void addWireRtt(double wire_ms, double overhead_ms) {
+    wire_rtts.record(wire_ms);
+    host_overheads.record(overhead_ms);
+  }
+
+  // Count a multicast NACK, and the block reports it left out because
+  // another receiver had already asked for as much
+  void addNackPacket() { nack_packets++; }
+  void addNacksSuppressed(size_t blocks) { nacks_suppressed += blocks; }
+
+  // Record the disk thread's work, and count a packet it had no room for
+  void setDiskWrites(uint64_t writes, uint64_t syscalls) {
+    disk_writes = writes;
+    disk_syscalls = syscalls;
+  }
+  void addDiskRingDrop() { disk_ring_drops++; }
+
+  // Count bytes a resumed transfer did not have to send
+  void addResumed(uint64_t bytes) { resumed_bytes += bytes; }
+
+  // Record what a delta transfer sent in place of the file
+  void setDelta(uint64_t file_bytes, uint64_t matched_bytes,
+                uint64_t stream_bytes, uint64_t signatures,
+                uint32_t block_size) {
+    delta_file_bytes = file_bytes;
+    delta_matched_bytes = matched_bytes;
+    delta_stream_bytes = stream_bytes;
+    signature_bytes = signatures;
+    delta_block_size = block_size;
+  }
 
-  LatencyStats() : total_bytes(0) {}
+  // Record what a compressed transfer sent in place of the file
+  void setCompression(int threads, uint64_t stream_bytes, uint64_t blocks,
+                      uint64_t stored) {
+    compress_threads = threads;
+    compress_stream_bytes = stream_bytes;
+    compress_blocks = blocks;
+    compress_stored = stored;
+  }
+
+  // Record what a directory transfer covered
+  void setTree(uint64_t files, uint64_t directories, uint64_t file_bytes,
+               uint64_t separate) {
+    tree_files = files;
+    tree_directories = directories;
+    tree_file_bytes = file_bytes;
+    tree_separate = separate;
+  }
+
+  // Files per second of a directory transfer
+  double getFileRate() const {
+    double ms = getTotalTransferTime();
+    return ms > 0.0 ? tree_files * 1000.0 / ms : 0.0;
+  }
+
+  // Record one stream of a multi-stream transfer
+  void addStream(size_t bytes, double seconds) {
+    streams.emplace_back(bytes, seconds);
+  }
+
+  // Record the datagram I/O path used for this transfer
+  void setIoMode(const std::string &mode) { io_mode = mode; }
+
+  // Add CPU cycles spent in the send path
+  void addSendCycles(uint64_t cycles) { send_cycles += cycles; }
+
+  // Send path cost per payload byte put on the wire
+  double getCyclesPerByte() const {
+    if (wire_bytes == 0)
+      return 0.0;
+    return static_cast<double>(send_cycles) / wire_bytes;
+  }
+
+  // Record the window size used for this transfer
+  void setWindowSize(int window) { window_size = window; }
+
+  // Record the payload each data packet carries and the header in front
+  void setPayload(int payload, int header) {
+    payload_size = payload;
+    header_size = header;
+  }
+
+  // Record what path MTU discovery saw: the kernel's route MTU and the
+  // number of probe packets it took to settle the payload size
+  void setPathMtu(int mtu, int probes) {
+    route_mtu = mtu;
+    mtu_probes = probes;
+  }
+
+  // Record payload bytes put on the wire (first sends and retransmissions)
+  void addWireBytes(size_t bytes) { wire_bytes += bytes; }
+
+  // Record payload bytes sent from the file mapping without a copy
+  void addZeroCopyBytes(size_t bytes) { zero_copy_bytes += bytes; }
+
+  // Fold in the statistics of another socket or thread: latencies and byte
+  // counts add up, the time span covers both
+  void merge(const LatencyStats &other) {
+    packet_latencies.merge(other.packet_latencies);
+    wire_rtts.merge(other.wire_rtts);
+    host_overheads.merge(other.host_overheads);
+    retries += other.retries;
+    start_time = std::min(start_time, other.start_time);
+    end_time = std::max(end_time, other.end_time);
+    total_bytes += other.total_bytes;
+    wire_bytes += other.wire_bytes;
+    zero_copy_bytes += other.zero_copy_bytes;
+    send_cycles += other.send_cycles;
+    cwnd_sum += other.cwnd_sum;
+    cwnd_samples += other.cwnd_samples;
+    fec_repairs_sent += other.fec_repairs_sent;
+    fec_recovered += other.fec_recovered;
+    retransmitted += other.retransmitted;
+    fast_retransmits += other.fast_retransmits;
+    spurious_retransmits += other.spurious_retransmits;
+    ack_packets += other.ack_packets;
+    nack_packets += other.nack_packets;
+    nacks_suppressed += other.nacks_suppressed;
+    disk_writes += other.disk_writes;
+    disk_syscalls += other.disk_syscalls;
+    disk_ring_drops += other.disk_ring_drops;
+    resumed_bytes += other.resumed_bytes;
+  }
 
   // Record start of transfer
   void startTransfer() { start_time = high_resolution_clock::now(); }
@@ -49,57 +598,34 @@ struct LatencyStats {
 
   // Add a packet latency measurement
   void addLatency(double latency_ms, bool is_retry) {
-    packet_latencies.push_back(latency_ms);
+    packet_latencies.record(latency_ms);
     if (is_retry) {
-      retry_latencies.push_back(latency_ms);
+      retries++;
     }
   }
 
   // Get average latency
-  double getAverageLatency() const {
-    if (packet_latencies.empty())
-      return 0.0;
-    return std::accumulate(packet_latencies.begin(), packet_latencies.end(),
-                           0.0) /
-           packet_latencies.size();
-  }
+  double getAverageLatency() const { return packet_latencies.mean(); }
 
   // Get minimum latency
-  double getMinLatency() const {
-    if (packet_latencies.empty())
-      return 0.0;
-    return *std::min_element(packet_latencies.begin(), packet_latencies.end());
-  }
+  double getMinLatency() const { return packet_latencies.min(); }
 
   // Get maximum latency
-  double getMaxLatency() const {
-    if (packet_latencies.empty())
-      return 0.0;
-    return *std::max_element(packet_latencies.begin(), packet_latencies.end());
-  }
+  double getMaxLatency() const { return packet_latencies.max(); }
 
   // Get median latency (useful to ignore outliers)
-  double getMedianLatency() const {
-    if (packet_latencies.empty())
-      return 0.0;
+  double getMedianLatency() const { return packet_latencies.percentile(50); }
 
-    std::vector<double> sorted_latencies = packet_latencies;
-    std::sort(sorted_latencies.begin(), sorted_latencies.end());
-
-    size_t n = sorted_latencies.size();
-    if (n % 2 == 0) {
-      return (sorted_latencies[n / 2 - 1] + sorted_latencies[n / 2]) / 2.0;
-    } else {
-      return sorted_latencies[n / 2];
-    }
+  // Get latency at a percentile (0-100)
+  double getPercentileLatency(double percent) const {
+    return packet_latencies.percentile(percent);
   }
 
   // Get retry rate
   double getRetryRate() const {
     if (packet_latencies.empty())
       return 0.0;
-    return static_cast<double>(retry_latencies.size()) /
-           packet_latencies.size();
+    return static_cast<double>(retries) / packet_latencies.count();
   }
 
   // Get total transfer time in milliseconds
@@ -116,11 +642,21 @@ struct LatencyStats {
     return total_bytes / seconds;
   }
 
+  // Upper bound on goodput imposed by the window: window * payload / RTT
+  double getWindowLimitedThroughput() const {
+    double avg_rtt_ms = getAverageLatency();
+    if (window_size <= 0 || avg_rtt_ms <= 0.0)
+      return 0.0;
+    return window_size * static_cast<double>(payload_size) /
+           (avg_rtt_ms / 1000.0);
+  }
+
   // Print summary statistics
   void printStats() const {
     std::cout << "\n===== Latency and Performance Statistics =====\n";
-    std::cout << "Total packets sent: " << packet_latencies.size() << std::endl;
-    std::cout << "Total retries: " << retry_latencies.size() << std::endl;
+    std::cout << "Total packets sent: " << packet_latencies.count()
+              << std::endl;
+    std::cout << "Total retries: " << retries << std::endl;
     std::cout << "Retry rate: " << std::fixed << std::setprecision(2)
               << (getRetryRate() * 100) << "%" << std::endl;
     std::cout << "Average packet latency: " << std::fixed
@@ -132,14 +668,235 @@ struct LatencyStats {
               << std::setprecision(2) << getMinLatency() << " ms" << std::endl;
     std::cout << "Maximum packet latency: " << std::fixed
               << std::setprecision(2) << getMaxLatency() << " ms" << std::endl;
+    std::cout << "Latency percentiles: " << std::fixed << std::setprecision(3)
+              << "p50 " << getPercentileLatency(50) << ", p90 "
+              << getPercentileLatency(90) << ", p99 "
+              << getPercentileLatency(99) << ", p99.9 "
+              << getPercentileLatency(99.9) << ", max " << getMaxLatency()
+              << " ms" << std::endl;
     std::cout << "Total transfer time: " << std::fixed << std::setprecision(2)
               << getTotalTransferTime() << " ms" << std::endl;
     std::cout << "Data transferred: " << total_bytes << " bytes" << std::endl;
+    if (resumed_bytes > 0) {
+      std::cout << "Resumed: " << resumed_bytes
+                << " bytes were already at the receiver" << std::endl;
+    }
     std::cout << "Throughput: " << std::fixed << std::setprecision(2)
               << (getThroughput() / 1024) << " KB/s" << std::endl;
 
+    // Packet size: what each datagram costs in headers, and the packet rate
+    // the throughput took at that size
+    if (payload_size > 0) {
+      int datagram = IPV4_UDP_HEADERS + header_size + payload_size;
+      std::cout << "Payload: " << payload_size << " bytes per packet, "
+                << datagram << "-byte IP datagrams (" << std::fixed
+                << std::setprecision(2)
+                << (100.0 * (datagram - payload_size) / datagram)
+                << "% header overhead)" << std::endl;
+      std::cout << "Packet rate: " << std::fixed << std::setprecision(0)
+                << (getThroughput() / payload_size) << " packets/s"
+                << std::endl;
+      if (mtu_probes > 0) {
+        std::cout << "Path MTU: ";
+        if (route_mtu > 0) {
+          std::cout << route_mtu << " bytes (route)";
+        } else {
+          std::cout << "unknown";
+        }
+        std::cout << ", " << mtu_probes << " probe packets" << std::endl;
+      }
+    }
+
+    // Delta mode: what went over the wire against sending the whole file
+    if (delta_file_bytes > 0) {
+      uint64_t sent = delta_stream_bytes + signature_bytes;
+      std::cout << "Delta: " << delta_matched_bytes << " of "
+                << delta_file_bytes << " bytes matched the receiver's copy ("
+                << delta_block_size << "-byte blocks)" << std::endl;
+      std::cout << "Delta sent: " << delta_stream_bytes << " delta + "
+                << signature_bytes << " signature bytes, " << std::fixed
+                << std::setprecision(2)
+                << (100.0 - 100.0 * sent / delta_file_bytes)
+                << "% saved against a full send" << std::endl;
+      if (total_bytes > 0) {
+        std::cout << "Effective throughput: " << std::fixed
+                  << std::setprecision(2)
+                  << (getThroughput() * delta_file_bytes / total_bytes / 1024)
+                  << " KB/s of file" << std::endl;
+      }
+    }
+
+    // Compressed mode: frame stream against the file, and how much of the
+    // file was worth compressing
+    if (compress_threads > 0) {
+      std::cout << "Compression: zlib level " << COMPRESS_LEVEL << " on "
+                << compress_threads << " threads, " << total_bytes << " -> "
+                << compress_stream_bytes << " bytes (" << std::fixed
+                << std::setprecision(2)
+                << (total_bytes > 0
+                        ? 100.0 * compress_stream_bytes / total_bytes
+                        : 100.0)
+                << "%)" << std::endl;
+      std::cout << "Blocks stored uncompressed: " << compress_stored << " of "
+                << compress_blocks << std::endl;
+    }
+
+    // Directory mode: the file rate, and the rate of file contents against
+    // the pack and large-file transfers that carried them
+    if (tree_files > 0) {
+      std::cout << "Directory: " << tree_files << " files ("
+                << tree_separate << " sent on their own) in "
+                << tree_directories << " directories, " << tree_file_bytes
+                << " bytes" << std::endl;
+      double ms = getTotalTransferTime();
+      std::cout << "File rate: " << std::fixed << std::setprecision(1)
+                << getFileRate() << " files/s, " << std::setprecision(2)
+                << (ms > 0.0 ? tree_file_bytes / 1024.0 / 1024.0 / ms * 1000.0
+                             : 0.0)
+                << " MB/s of file contents" << std::endl;
+    }
+
+    // Multi-stream mode: each stream's share and the combined rate
+    if (!streams.empty()) {
+      for (size_t i = 0; i < streams.size(); ++i) {
+        double rate = streams[i].second > 0.0
+                          ? streams[i].first / streams[i].second / 1024
+                          : 0.0;
+        std::cout << "Stream " << i << ": " << streams[i].first
+                  << " bytes in " << std::fixed << std::setprecision(2)
+                  << streams[i].second * 1000.0 << " ms (" << rate
+                  << " KB/s)" << std::endl;
+      }
+      std::cout << "Aggregate throughput: " << std::fixed
+                << std::setprecision(2) << (getThroughput() / 1024)
+                << " KB/s over " << streams.size() << " streams" << std::endl;
+    }
+
+    // Goodput against window size (selective-repeat mode only)
+    if (window_size > 0) {
+      std::cout << "Window size: " << window_size << " packets" << std::endl;
+      std::cout << "Goodput: " << std::fixed << std::setprecision(2)
+                << (getThroughput() / 1024) << " KB/s ("
+                << (getThroughput() / 1024 / window_size)
+                << " KB/s per window slot)" << std::endl;
+      std::cout << "Window-limited bound: " << std::fixed
+                << std::setprecision(2)
+                << (getWindowLimitedThroughput() / 1024) << " KB/s"
+                << std::endl;
+      if (wire_bytes > 0) {
+        std::cout << "Wire efficiency: " << std::fixed << std::setprecision(2)
+                  << (100.0 * total_bytes / wire_bytes) << "% ("
+                  << wire_bytes << " payload bytes on the wire)" << std::endl;
+      }
+    }
+
+    // Kernel timestamps: the RTT between the packet leaving the stack and
+    // its ACK coming in, and the time user space added around them
+    if (!wire_rtts.empty()) {
+      std::cout << "Wire RTT (kernel timestamps): " << std::fixed
+                << std::setprecision(3) << "p50 " << wire_rtts.percentile(50)
+                << ", p99 " << wire_rtts.percentile(99) << ", mean "
+                << wire_rtts.mean() << " ms (" << wire_rtts.count()
+                << " samples)" << std::endl;
+      std::cout << "User-space overhead: " << std::fixed
+                << std::setprecision(3) << "p50 "
+                << host_overheads.percentile(50) << ", p99 "
+                << host_overheads.percentile(99) << ", mean "
+                << host_overheads.mean() << " ms per round trip" << std::endl;
+    }
+
+    // Adaptive retransmission timer and congestion control state
+    if (srtt_ms > 0.0) {
+      std::cout << "Smoothed RTT: " << std::fixed << std::setprecision(2)
+                << srtt_ms << " ms (rttvar " << rttvar_ms << " ms, RTO "
+                << rto_ms << " ms)" << std::endl;
+    }
+    if (window_size > 0) {
+      std::cout << "Congestion control: " << congestion_control << std::endl;
+      if (cwnd_samples > 0) {
+        std::cout << "Congestion window: " << std::fixed
+                  << std::setprecision(1) << final_cwnd << " packets final, "
+                  << (cwnd_sum / cwnd_samples) << " average" << std::endl;
+      }
+      std::cout << "Pacing rate: ";
+      if (pacing_rate > 0.0) {
+        std::cout << std::fixed << std::setprecision(2)
+                  << (pacing_rate / 1024) << " KB/s" << std::endl;
+      } else {
+        std::cout << "unpaced" << std::endl;
+      }
+    }
+
+    // Loss repair: what FEC rebuilt against what had to be resent. The
+    // sender knows its retransmissions, the receiver what it rebuilt.
+    if (fec_data > 0) {
+      std::cout << "FEC: " << fec_data << ":" << fec_repair << " "
+                << (fec_repair == 1 ? "XOR parity" : "Cauchy Reed-Solomon")
+                << ", " << fec_repairs_sent << " repair packets ("
+                << std::fixed << std::setprecision(2)
+                << (100.0 * fec_repair / fec_data) << "% overhead)"
+                << std::endl;
+    }
+    if (fec_data > 0 || retransmitted > 0) {
+      std::cout << "Packets retransmitted: " << retransmitted;
+      if (fast_retransmits > 0) {
+        std::cout << " (" << fast_retransmits << " before their RTO)";
+      }
+      if (spurious_retransmits > 0) {
+        std::cout << ", " << spurious_retransmits << " spurious";
+      }
+      std::cout << std::endl;
+    }
+    if (fec_recovered > 0) {
+      std::cout << "Lost packets rebuilt by FEC: " << fec_recovered
+                << std::endl;
+    }
+
+    // ACK traffic against data packets, to see what coalescing saves
+    if (ack_packets > 0) {
+      std::cout << "ACK packets: " << ack_packets << " ("
+                << std::fixed << std::setprecision(1)
+                << static_cast<double>(packet_latencies.count()) /
+                       ack_packets
+                << " packets per ACK)" << std::endl;
+    }
+    if (nack_packets > 0 || nacks_suppressed > 0) {
+      std::cout << "NACK packets: " << nack_packets;
+      if (nacks_suppressed > 0) {
+        std::cout << " (" << nacks_suppressed
+                  << " block reports suppressed by other receivers)";
+      }
+      std::cout << std::endl;
+    }
+
+    // Cost of the send path, to compare the per-packet, batched and GSO modes
+    std::cout << "Datagram I/O: " << io_mode << std::endl;
+    if (disk_writes > 0 || disk_ring_drops > 0) {
+      std::cout << "Disk thread: " << disk_writes << " payloads in "
+                << disk_syscalls << " pwritev calls, " << disk_ring_drops
+                << " packets dropped on a full ring" << std::endl;
+    }
+    if (!checksum.empty()) {
+      std::cout << "Checksum: " << checksum << std::endl;
+    }
+    if (send_cycles > 0) {
+      std::cout << "Send path cost: " << std::fixed << std::setprecision(2)
+                << getCyclesPerByte() << " " << cycleCounterUnit()
+                << "/byte" << std::endl;
+    }
+    if (zero_copy_bytes > 0) {
+      std::cout << "Zero-copy sends: " << zero_copy_bytes
+                << " payload bytes gathered from the file mapping";
+      if (wire_bytes > 0) {
+        std::cout << " (" << std::fixed << std::setprecision(2)
+                  << (100.0 * zero_copy_bytes / wire_bytes)
+                  << "% of the wire payload)";
+      }
+      std::cout << std::endl;
+    }
+
     // Print histogram of latencies if we have enough data
-    if (packet_latencies.size() > 10) {
+    if (packet_latencies.count() > 10) {
       printLatencyHistogram();
     }
   }
@@ -147,7 +904,7 @@ struct LatencyStats {
   // Print histogram of latencies
   void printLatencyHistogram() const {
     const int NUM_BINS = 10;
-    std::vector<int> histogram(NUM_BINS, 0);
+    std::vector<uint64_t> histogram(NUM_BINS, 0);
 
     // Find min and max for bin sizing
     double min_latency = getMinLatency();
@@ -159,15 +916,15 @@ struct LatencyStats {
       bin_size = 1.0;
     }
 
-    // Count frequencies
-    for (double latency : packet_latencies) {
-      int bin = std::min(NUM_BINS - 1,
-                         static_cast<int>((latency - min_latency) / bin_size));
-      histogram[bin]++;
-    }
+    // Count frequencies, each recorded bucket at its middle value
+    packet_latencies.forEachBucket([&](double latency, uint64_t count) {
+      int bin = static_cast<int>((latency - min_latency) / bin_size);
+      histogram[std::max(0, std::min(NUM_BINS - 1, bin))] += count;
+    });
 
     // Find max count for scaling
-    int max_count = *std::max_element(histogram.begin(), histogram.end());
+    uint64_t max_count =
+        *std::max_element(histogram.begin(), histogram.end());
 
     std::cout << "\nLatency Distribution:\n";
     for (int i = 0; i < NUM_BINS; i++) {
@@ -184,28 +941,288 @@ struct LatencyStats {
                 << std::endl;
     }
   }
+
+  // Machine-readable summary: counts, throughput, latency percentiles and
+  // the non-empty histogram buckets as [latency_ms, count] pairs
+  void writeJson(std::ostream &out) const {
+    out << std::fixed << std::setprecision(6);
+    out << "{\n";
+    out << "  \"packets\": " << packet_latencies.count() << ",\n";
+    out << "  \"retries\": " << retries << ",\n";
+    out << "  \"retransmitted\": " << retransmitted << ",\n";
+    out << "  \"fast_retransmits\": " << fast_retransmits << ",\n";
+    out << "  \"spurious_retransmits\": " << spurious_retransmits << ",\n";
+    out << "  \"ack_packets\": " << ack_packets << ",\n";
+    out << "  \"nack_packets\": " << nack_packets << ",\n";
+    out << "  \"nacks_suppressed\": " << nacks_suppressed << ",\n";
+    out << "  \"disk_ring_drops\": " << disk_ring_drops << ",\n";
+    out << "  \"bytes\": " << total_bytes << ",\n";
+    out << "  \"transfer_ms\": " << getTotalTransferTime() << ",\n";
+    out << "  \"throughput_bytes_per_s\": " << getThroughput() << ",\n";
+    out << "  \"window_size\": " << window_size << ",\n";
+    out << "  \"payload_size\": " << payload_size << ",\n";
+    out << "  \"files\": " << tree_files << ",\n";
+    out << "  \"files_per_s\": " << getFileRate() << ",\n";
+    out << "  \"latency_ms\": {\"mean\": " << getAverageLatency()
+        << ", \"min\": " << getMinLatency()
+        << ", \"p50\": " << getPercentileLatency(50)
+        << ", \"p90\": " << getPercentileLatency(90)
+        << ", \"p99\": " << getPercentileLatency(99)
+        << ", \"p99.9\": " << getPercentileLatency(99.9)
+        << ", \"max\": " << getMaxLatency() << "},\n";
+    out << "  \"wire_rtt_ms\": {\"mean\": " << wire_rtts.mean()
+        << ", \"p50\": " << wire_rtts.percentile(50)
+        << ", \"p99\": " << wire_rtts.percentile(99) << "},\n";
+    out << "  \"host_overhead_ms\": {\"mean\": " << host_overheads.mean()
+        << ", \"p50\": " << host_overheads.percentile(50)
+        << ", \"p99\": " << host_overheads.percentile(99) << "},\n";
+    out << "  \"histogram\": [";
+    bool first = true;
+    packet_latencies.forEachBucket([&](double latency, uint64_t count) {
+      out << (first ? "" : ", ") << "[" << latency << ", " << count << "]";
+      first = false;
+    });
+    out << "]\n";
+    out << "}\n";
+  }
+
+  // Write the JSON summary to a file
+  void writeJsonFile(const std::string &path) const {
+    std::ofstream out(path);
+    if (!out) {
+      throw std::runtime_error("Cannot write statistics to " + path);
+    }
+    writeJson(out);
+    std::cout << "Statistics written to " << path << std::endl;
+  }
 };
 
 // Ensure consistent memory layout across platforms
 #pragma pack(push, 1)
-// Enhanced packet structure with CRC for data verification
+// Enhanced packet structure with CRC for data verification. Only the
+// header and data_size bytes of data go on the wire; the array is room for
+// the largest payload.
 struct Packet {
   uint8_t seq_num;            // Sequence number (0 or 1 for stop-and-wait)
   uint16_t data_size;         // Size of data in bytes
   uint8_t is_last;            // Flag to indicate last packet
   uint32_t crc;               // Checksum for data verification
-  char data[MAX_BUFFER_SIZE]; // Payload data
+  char data[MAX_PAYLOAD_SIZE]; // Payload data
+
+  // Size of the header in front of data
+  static constexpr size_t headerSize() {
+    return sizeof(seq_num) + sizeof(data_size) + sizeof(is_last) +
+           sizeof(crc);
+  }
+
+  // Calculate the total size of the packet with its header and payload
+  size_t getTotalSize() const { return headerSize() + data_size; }
+};
+
+// Selective-repeat data packet with a 32-bit sequence number. Like Packet,
+// a header plus data_size bytes on the wire; a sender keeps packets in
+// slots of headerSize() + payload_size bytes, so data[] past the
+// negotiated payload is never touched.
+struct SrPacket {
+  uint8_t type;               // Always SR_DATA_PACKET
+  uint32_t transfer_id;       // Random per transfer, keys the server session
+  uint32_t seq_num;           // Packet index in the file (network byte order)
+  uint32_t timestamp;         // Sender clock in µs, echoed back in the ACK
+  uint16_t data_size;         // Size of data in bytes
+  uint8_t is_last;            // Flag to indicate last packet
+  uint8_t checksum;           // ChecksumAlgorithm used for crc
+  uint8_t fec_data;           // FEC block size N (0 = no FEC)
+  uint8_t fec_repair;         // FEC repair packets per block K
+  uint8_t encoding;           // PAYLOAD_RAW or PAYLOAD_FRAMED
+  uint16_t payload_size;      // Negotiated payload: the packet's data
+                              // starts at seq_num * payload_size
+  uint32_t crc;               // Checksum for data verification
+  char data[MAX_PAYLOAD_SIZE]; // Payload data
+
+  // Size of the header that precedes the payload
+  static constexpr size_t headerSize() {
+    return sizeof(type) + sizeof(transfer_id) + sizeof(seq_num) +
+           sizeof(timestamp) + sizeof(data_size) + sizeof(is_last) +
+           sizeof(checksum) + sizeof(fec_data) + sizeof(fec_repair) +
+           sizeof(encoding) + sizeof(payload_size) + sizeof(crc);
+  }
 
   // Calculate the total size of the packet with its header and payload
-  size_t getTotalSize() const {
-    return sizeof(seq_num) + sizeof(data_size) + sizeof(is_last) + sizeof(crc) +
-           data_size;
+  size_t getTotalSize() const { return headerSize() + data_size; }
+};
+
+// Selective-repeat acknowledgment. One ACK covers every packet below the
+// cumulative ACK plus the packets its bitmap marks, so the receiver can
+// acknowledge several packets at once and the sender sees the holes.
+struct SrAck {
+  uint8_t type;            // Always SR_ACK_PACKET
+  uint32_t cumulative_ack; // Every packet below it has arrived (network
+                           // byte order, as are the fields below)
+  uint32_t sack_base;      // Bit i of the bitmap stands for sack_base + i
+  uint32_t sack_hi;        // Bitmap of packets received past the
+  uint32_t sack_lo;        // cumulative ACK, high and low words
+  uint32_t ts_echo;        // Timestamp of the newest packet received
+                           // (echoed as sent)
+  uint32_t ack_delay_us;   // Time that packet waited for this ACK
+  uint32_t window;         // Packets accepted past the cumulative ACK
+};
+
+// Control message of a multi-stream transfer. The client announces the
+// file with a manifest before the streams start, and polls with a barrier
+// query until the server reports the whole file written.
+struct SrControl {
+  uint8_t type;          // SR_MANIFEST_PACKET, SR_BARRIER_PACKET or a reply
+  uint32_t transfer_id;  // Shared by every stream (network byte order)
+  uint32_t file_size_hi; // File size, high and low words (network order)
+  uint32_t file_size_lo;
+  uint16_t stream_count; // Streams the file is split over
+  uint16_t payload_size; // Payload bytes per packet
+  uint8_t status;        // Reply: 1 = manifest accepted / file complete,
+                         // 2 = file could not be rebuilt from a delta
+                         // or the directory not unpacked from its pack
+  uint8_t mode;          // MANIFEST_PLAIN, MANIFEST_BASIS, MANIFEST_DELTA,
+                         // MANIFEST_TREE_FILE or MANIFEST_TREE_PACK
+  uint32_t basis_id;     // Delta modes: names the receiver's copy
+};
+
+// FEC repair packet: one coded row over a block of data packets. The
+// sender emits K of them after every N data packets; they are never
+// acknowledged or retransmitted. The symbol is fecSymbolSize() of the
+// transfer's payload; only that much of it is sent.
+struct SrRepair {
+  uint8_t type;          // Always SR_REPAIR_PACKET
+  uint32_t transfer_id;  // Same as the block's data packets
+  uint32_t block_first;  // First sequence number of the block (network order)
+  uint32_t timestamp;    // Sender clock in µs, echoed for recovered packets
+  uint8_t fec_data;      // Block size N
+  uint8_t fec_repair;    // Repair packets per block K
+  uint8_t block_count;   // Data packets in this block (short at range end)
+  uint8_t repair_index;  // Code row carried by this packet
+  uint32_t crc;          // CRC-32C of the symbol
+  uint8_t symbol[FEC_MAX_SYMBOL_SIZE];
+
+  static constexpr size_t headerSize() {
+    return sizeof(type) + sizeof(transfer_id) + sizeof(block_first) +
+           sizeof(timestamp) + sizeof(fec_data) + sizeof(fec_repair) +
+           sizeof(block_count) + sizeof(repair_index) + sizeof(crc);
+  }
+};
+
+// Resumable transfer: the query announces the file like a manifest and asks
+// for one page of the receiver's chunk bitmap; the reply carries it. Bit i
+// (byte i / 8, bit i % 8) is set when chunk i of RESUME_CHUNK_PACKETS
+// packets is already on the receiver's disk. A query is header only.
+struct SrResume {
+  uint8_t type;          // SR_RESUME_QUERY or SR_RESUME_REPLY
+  uint32_t transfer_id;  // Derived from the file, stable across restarts
+  uint32_t file_size_hi; // File size, high and low words (network order)
+  uint32_t file_size_lo;
+  uint16_t stream_count; // Streams the file is split over
+  uint16_t payload_size; // Payload bytes per packet
+  uint32_t page;         // Bitmap page (network order)
+  uint16_t page_bytes;   // Reply: bitmap bytes that follow
+  uint8_t status;        // Reply: 1 = accepted
+  uint8_t bitmap[RESUME_PAGE_BYTES];
+
+  static constexpr size_t headerSize() {
+    return sizeof(type) + sizeof(transfer_id) + sizeof(file_size_hi) +
+           sizeof(file_size_lo) + sizeof(stream_count) +
+           sizeof(payload_size) + sizeof(page) + sizeof(page_bytes) +
+           sizeof(status);
+  }
+};
+
+// Signature of one block of the receiver's copy, for delta transfers: the
+// rolling checksum finds candidate matches, the strong hash confirms them
+struct BlockSignature {
+  uint32_t weak;      // Rolling checksum (network order)
+  uint32_t strong_hi; // XXH64 of the block, high and low words
+  uint32_t strong_lo;
+};
+
+// Delta transfer: the query asks for one page of signatures of the
+// receiver's copy of a file; the reply carries them, with the block size
+// the receiver picked. Only whole blocks get a signature. A query is
+// header only.
+struct SrSignature {
+  uint8_t type;          // SR_SIGNATURE_QUERY or SR_SIGNATURE_REPLY
+  uint32_t transfer_id;  // Echoed in the reply
+  uint32_t basis_id;     // Names the receiver's copy (network order)
+  uint32_t page;         // Signature page (network order)
+  uint32_t file_size_hi; // Reply: size of the receiver's copy
+  uint32_t file_size_lo;
+  uint32_t block_size;   // Reply: bytes per block (network order)
+  uint16_t count;        // Reply: signatures that follow
+  uint8_t status;        // Reply: 1 = there is a copy to diff against
+  BlockSignature signatures[SIGNATURES_PER_PAGE];
+
+  static constexpr size_t headerSize() {
+    return sizeof(type) + sizeof(transfer_id) + sizeof(basis_id) +
+           sizeof(page) + sizeof(file_size_hi) + sizeof(file_size_lo) +
+           sizeof(block_size) + sizeof(count) + sizeof(status);
+  }
+};
+
+// Payload size handshake and path MTU probe. A probe is padded to the size
+// of a data packet carrying payload_size bytes; the ACK is header only and
+// carries the largest payload the server accepts.
+struct SrProbe {
+  uint8_t type;          // SR_PROBE_PACKET or SR_PROBE_ACK
+  uint32_t nonce;        // Picked by the client, echoed in the ACK
+  uint16_t payload_size; // Payload the probe stands for
+  uint16_t max_payload;  // ACK: server's payload limit
+};
+
+// Loss report of a multicast receiver, sent to the group so the sender
+// repairs and the other receivers hold back their own report for the same
+// blocks. Each entry names one FEC block: the data packets missing from it
+// and how many repair packets (beyond those already received) rebuild them.
+struct SrNackEntry {
+  uint32_t block_first; // First sequence number of the block (network order)
+  uint32_t missing_hi;  // Missing packets by index in the block, high and
+  uint32_t missing_lo;  // low words
+  uint8_t needed;       // Repair packets still needed
+};
+
+struct SrNack {
+  uint8_t type;         // Always SR_NACK_PACKET
+  uint32_t transfer_id; // The multicast transfer
+  uint8_t count;        // Entries that follow
+  SrNackEntry entries[MCAST_NACK_ENTRIES];
+
+  static constexpr size_t headerSize() {
+    return sizeof(type) + sizeof(transfer_id) + sizeof(count);
   }
 };
+
+// Any datagram the server can receive; the first byte tells them apart
+union Datagram {
+  uint8_t type; // Stop-and-wait seq_num (0/1) or a packet type
+  Packet legacy;
+  SrPacket sr;
+  SrControl control;
+  SrRepair repair;
+  SrResume resume;
+  SrSignature signature;
+  SrProbe probe;
+  SrNack nack;
+};
 #pragma pack(pop)
 
-// Helper function to debug packet information
-void debugPacket(const Packet &packet, const std::string &prefix) {
+static_assert(IPV4_UDP_HEADERS + SrPacket::headerSize() + MAX_PAYLOAD_SIZE <=
+                  9000,
+              "largest data packet must fit a jumbo frame");
+
+// Symbol FEC codes over: length, last flag, then the payload
+inline size_t fecSymbolSize(int payload_size) { return 3 + payload_size; }
+
+// Helper function to debug packet information; the payload may live outside
+// the packet (data, when set)
+void debugPacket(const Packet &packet, const std::string &prefix,
+                 const char *data = nullptr) {
+  if (!data) {
+    data = packet.data;
+  }
   std::cout << prefix << " - "
             << "seq_num: " << (int)packet.seq_num
             << ", data_size: " << packet.data_size
@@ -218,570 +1235,11650 @@ void debugPacket(const Packet &packet, const std::string &prefix) {
                                   static_cast<size_t>(packet.data_size));
        ++i) {
     std::cout << std::hex << std::setw(2) << std::setfill('0')
-              << static_cast<int>(static_cast<unsigned char>(packet.data[i]))
+              << static_cast<int>(static_cast<unsigned char>(data[i]))
               << " ";
   }
   std::cout << std::dec << std::endl;
 }
 
-// Calculate CRC-32 checksum
-uint32_t calculateCRC(const char *data, size_t length) {
-  boost::crc_32_type result;
-  if (data && length > 0) {
-    result.process_bytes(data, length);
-  }
-  return result.checksum();
-}
+// ---- Packet checksums ----
+//
+// Every algorithm has a portable implementation and, where the CPU allows,
+// a faster one picked at startup. The algorithm travels in each
+// selective-repeat packet, so the receiver verifies with whatever the
+// sender chose.
+
+enum class ChecksumAlgorithm : uint8_t {
+  CRC32 = 0,  // IEEE CRC-32 (same value as boost::crc_32_type)
+  CRC32C = 1, // Castagnoli CRC-32C
+  XXH64 = 2,  // xxHash64 folded to 32 bits (non-cryptographic)
+};
 
-// Conversion functions for endianness
-uint32_t htonl32(uint32_t value) {
-#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return ((value & 0xFF) << 24) | ((value & 0xFF00) << 8) |
-         ((value & 0xFF0000) >> 8) | ((value & 0xFF000000) >> 24);
-#else
-  return value;
-#endif
+constexpr int CHECKSUM_ALGORITHM_COUNT = 3;
+
+// Name used on the command line and in reports
+inline const char *checksumName(ChecksumAlgorithm algorithm) {
+  switch (algorithm) {
+  case ChecksumAlgorithm::CRC32:
+    return "crc32";
+  case ChecksumAlgorithm::CRC32C:
+    return "crc32c";
+  case ChecksumAlgorithm::XXH64:
+    return "xxh64";
+  }
+  return "unknown";
 }
 
-uint32_t ntohl32(uint32_t value) {
-  return htonl32(value); // The conversion is symmetric
+ChecksumAlgorithm parseChecksumAlgorithm(const std::string &name) {
+  for (int i = 0; i < CHECKSUM_ALGORITHM_COUNT; ++i) {
+    ChecksumAlgorithm algorithm = static_cast<ChecksumAlgorithm>(i);
+    if (name == checksumName(algorithm)) {
+      return algorithm;
+    }
+  }
+  throw std::runtime_error("Unknown checksum algorithm: " + name);
 }
 
-// Read file contents into a vector
-std::vector<char> readFileContents(const std::string &filepath) {
-  std::vector<char> buffer;
+// Slicing-by-8 tables for a reflected CRC-32 polynomial: eight bytes per
+// step through eight table lookups instead of one lookup per byte
+template <uint32_t Polynomial> struct CrcTables {
+  uint32_t table[8][256];
 
-  // Open the file in binary mode
-  std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-  if (!file) {
-    throw std::runtime_error("Failed to open file: " + filepath);
+  CrcTables() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ (Polynomial & (0u - (crc & 1)));
+      }
+      table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int slice = 1; slice < 8; ++slice) {
+        table[slice][i] = (table[slice - 1][i] >> 8) ^
+                          table[0][table[slice - 1][i] & 0xFF];
+      }
+    }
   }
 
-  // Get file size by seeking to the end
-  std::streamsize file_size = file.tellg();
-  file.seekg(0, std::ios::beg);
-
-  std::cout << "Reading file: " << filepath << " (" << file_size << " bytes)"
-            << std::endl;
-
-  // Reserve buffer capacity
-  buffer.resize(file_size);
+  static const CrcTables &get() {
+    static const CrcTables tables;
+    return tables;
+  }
 
-  // Read file into buffer
-  if (file_size > 0) {
-    if (!file.read(buffer.data(), file_size)) {
-      throw std::runtime_error("Failed to read file contents: " + filepath);
+  // Continue a CRC over data; crc is the raw (un-inverted) register
+  uint32_t update(uint32_t crc, const char *data, size_t length) const {
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    while (length >= 8) {
+      uint32_t lo, hi;
+      std::memcpy(&lo, p, 4);
+      std::memcpy(&hi, p + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      lo = __builtin_bswap32(lo);
+      hi = __builtin_bswap32(hi);
+#endif
+      lo ^= crc;
+      crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+            table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+            table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+            table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+      p += 8;
+      length -= 8;
     }
+    while (length-- > 0) {
+      crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
   }
+};
 
-  file.close();
-  return buffer;
-}
+typedef CrcTables<0xEDB88320> Crc32Tables;  // IEEE, reflected
+typedef CrcTables<0x82F63B78> Crc32cTables; // Castagnoli, reflected
 
-// Save received data to a file
-void saveToFile(const std::vector<char> &data, const std::string &filepath) {
-  std::ofstream file(filepath, std::ios::binary);
-  if (!file) {
-    throw std::runtime_error("Failed to create output file: " + filepath);
-  }
+uint32_t crc32Slicing(const char *data, size_t length) {
+  return ~Crc32Tables::get().update(0xFFFFFFFF, data, length);
+}
 
-  file.write(data.data(), data.size());
-  file.close();
+uint32_t crc32cSlicing(const char *data, size_t length) {
+  return ~Crc32cTables::get().update(0xFFFFFFFF, data, length);
+}
 
-  std::cout << "Saved " << data.size() << " bytes to file: " << filepath
-            << std::endl;
+// Byte-at-a-time reference, the path every packet used to take
+uint32_t crc32Boost(const char *data, size_t length) {
+  boost::crc_32_type result;
+  if (data && length > 0) {
+    result.process_bytes(data, length);
+  }
+  return result.checksum();
 }
 
-// Compare two data buffers and report differences
-bool verifyData(const std::vector<char> &original,
-                const std::vector<char> &received) {
-  if (original.size() != received.size()) {
-    std::cout << "Data size mismatch: original=" << original.size()
-              << " bytes, received=" << received.size() << " bytes"
-              << std::endl;
-    return false;
-  }
-
-  size_t mismatches = 0;
-  for (size_t i = 0; i < original.size(); ++i) {
-    if (original[i] != received[i]) {
-      if (mismatches < 10) { // Only show the first 10 mismatches
-        std::cout << "Data mismatch at position " << i << ": original=0x"
-                  << std::hex << (int)(unsigned char)original[i]
-                  << ", received=0x" << (int)(unsigned char)received[i]
-                  << std::dec << std::endl;
-      }
-      mismatches++;
+// xxHash64 (seed 0)
+uint64_t xxh64(const char *data, size_t length) {
+  static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+  static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+  static const uint64_t P3 = 0x165667B19E3779F9ULL;
+  static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+  static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  auto round = [&](uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    return rotl(acc, 31) * P1;
+  };
+  auto merge = [&](uint64_t acc, uint64_t value) {
+    acc ^= round(0, value);
+    return acc * P1 + P4;
+  };
+  auto read64 = [](const unsigned char *p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+  };
+
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+  const unsigned char *end = p + length;
+  uint64_t h;
+  if (length >= 32) {
+    uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+    while (end - p >= 32) {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+      p += 32;
     }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+  } else {
+    h = P5;
   }
+  h += length;
 
-  if (mismatches > 0) {
-    std::cout << "Total data mismatches: " << mismatches << " bytes ("
-              << (mismatches * 100.0 / original.size()) << "%)" << std::endl;
-    return false;
+  while (end - p >= 8) {
+    h ^= round(0, read64(p));
+    h = rotl(h, 27) * P1 + P4;
+    p += 8;
+  }
+  if (end - p >= 4) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    h ^= v * P1;
+    h = rotl(h, 23) * P2 + P3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= *p++ * P5;
+    h = rotl(h, 11) * P1;
   }
 
-  std::cout << "Data verification successful: all " << original.size()
-            << " bytes match" << std::endl;
-  return true;
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
 }
 
-// UDP Client implementation
-class UdpClient {
-private:
-  boost::asio::io_context &io_context_;
-  udp::socket socket_;
-  udp::endpoint server_endpoint_;
-  std::vector<char> send_data_;
-  size_t bytes_sent_;
-  uint8_t current_seq_num_;
-  int retry_count_;
-  boost::asio::steady_timer timer_;
-  bool verbose_;
-  LatencyStats latency_stats_;
-  high_resolution_clock::time_point packet_send_time_;
+// xxHash64 folded to the 32-bit checksum field
+uint32_t xxh64Checksum(const char *data, size_t length) {
+  uint64_t h = xxh64(data, length);
+  return static_cast<uint32_t>(h ^ (h >> 32));
+}
 
-  // Current packet being sent
-  Packet send_packet_;
-  uint8_t ack_buffer_;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_CHECKSUMS 1
+
+// CRC-32C with the SSE4.2 crc32 instruction, eight bytes at a time
+__attribute__((target("sse4.2"))) uint32_t crc32cSse42(const char *data,
+                                                        size_t length) {
+  uint64_t crc = 0xFFFFFFFF;
+  while (length >= 8) {
+    uint64_t v;
+    std::memcpy(&v, data, 8);
+    crc = _mm_crc32_u64(crc, v);
+    data += 8;
+    length -= 8;
+  }
+  uint32_t crc32 = static_cast<uint32_t>(crc);
+  while (length-- > 0) {
+    crc32 = _mm_crc32_u8(crc32, static_cast<unsigned char>(*data++));
+  }
+  return ~crc32;
+}
 
-public:
-  UdpClient(boost::asio::io_context &io_context, const std::string &server_ip,
-            int server_port, bool verbose = false)
-      : io_context_(io_context),
-        socket_(io_context, udp::endpoint(udp::v4(), 0)), // Bind to any port
-        server_endpoint_(boost::asio::ip::address::from_string(server_ip),
-                         server_port),
-        bytes_sent_(0), current_seq_num_(0), retry_count_(0),
-        timer_(io_context), verbose_(verbose) {
+// IEEE CRC-32 by carry-less multiplication folding (Intel, "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ"): four 128-bit lanes
+// are folded 64 bytes at a time, then reduced with Barrett reduction.
+// The tail that does not fill 16 bytes goes through the tables.
+__attribute__((target("sse4.1,pclmul"))) uint32_t
+crc32Pclmul(const char *data, size_t length) {
+  if (length < 64) {
+    return crc32Slicing(data, length);
+  }
 
-    // Set up socket buffer sizes
-    socket_.set_option(boost::asio::socket_base::receive_buffer_size(8192));
-    socket_.set_option(boost::asio::socket_base::send_buffer_size(8192));
+  alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+  alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+  alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+  alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+  const char *p = data;
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+  x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+  x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 32));
+  x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(0xFFFFFFFF)));
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+  p += 64;
+  length -= 64;
+
+  // Fold four lanes per 64-byte block
+  while (length >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+    x2 = _mm_xor_si128(
+        _mm_xor_si128(x2, x6),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16)));
+    x3 = _mm_xor_si128(
+        _mm_xor_si128(x3, x7),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 32)));
+    x4 = _mm_xor_si128(
+        _mm_xor_si128(x4, x8),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 48)));
+    p += 64;
+    length -= 64;
+  }
 
-    std::cout << "Client initialized, connecting to " << server_ip << ":"
-              << server_port << std::endl;
+  // Fold the four lanes into one
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+  const __m128i lanes[3] = {x2, x3, x4};
+  for (const __m128i &lane : lanes) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, lane), x5);
   }
 
-  // Send data using stop-and-wait protocol
-  void send_data(const std::vector<char> &data) {
-    send_data_ = data;
-    bytes_sent_ = 0;
-    current_seq_num_ = 0;
+  // Remaining whole 16-byte blocks
+  while (length >= 16) {
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    p += 16;
+    length -= 16;
+  }
 
-    // Start timing the transfer
-    latency_stats_.startTransfer();
+  // 128 -> 64 bits
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  uint32_t crc = static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+
+  return ~Crc32Tables::get().update(crc, p, length);
+}
+#endif
 
-    std::cout << "Starting transfer of " << data.size() << " bytes"
-              << std::endl;
+typedef uint32_t (*ChecksumFunction)(const char *, size_t);
 
-    prepare_next_packet();
-  }
+// One implementation of an algorithm
+struct ChecksumImplementation {
+  ChecksumAlgorithm algorithm;
+  const char *name;
+  ChecksumFunction function;
+  bool supported; // This CPU can run it
+};
 
-  // Get latency statistics
-  const LatencyStats &getLatencyStats() const { return latency_stats_; }
+// Every implementation built in, for the benchmark
+const std::vector<ChecksumImplementation> &checksumImplementations() {
+  static const std::vector<ChecksumImplementation> implementations = [] {
+    std::vector<ChecksumImplementation> list = {
+        {ChecksumAlgorithm::CRC32, "crc32 boost (bytewise)", crc32Boost, true},
+        {ChecksumAlgorithm::CRC32, "crc32 slicing-by-8", crc32Slicing, true},
+        {ChecksumAlgorithm::CRC32C, "crc32c slicing-by-8", crc32cSlicing,
+         true},
+        {ChecksumAlgorithm::XXH64, "xxh64", xxh64Checksum, true},
+    };
+#ifdef HAVE_X86_CHECKSUMS
+    __builtin_cpu_init();
+    list.push_back({ChecksumAlgorithm::CRC32, "crc32 pclmul", crc32Pclmul,
+                    __builtin_cpu_supports("pclmul") &&
+                        __builtin_cpu_supports("sse4.1")});
+    list.push_back({ChecksumAlgorithm::CRC32C, "crc32c sse4.2", crc32cSse42,
+                    __builtin_cpu_supports("sse4.2") != 0});
+#endif
+    return list;
+  }();
+  return implementations;
+}
 
-  // Prepare the next packet to be sent
-  void prepare_next_packet() {
-    if (bytes_sent_ >= send_data_.size()) {
-      // Transfer complete, record end time and stats
-      latency_stats_.endTransfer(send_data_.size());
-      std::cout << "All data sent successfully (" << send_data_.size()
-                << " bytes)" << std::endl;
-      return;
+// Fastest supported implementation per algorithm, chosen once at startup
+const ChecksumImplementation &checksumImplementation(
+    ChecksumAlgorithm algorithm) {
+  static const std::vector<const ChecksumImplementation *> best = [] {
+    std::vector<const ChecksumImplementation *> table(
+        CHECKSUM_ALGORITHM_COUNT, nullptr);
+    // Later entries are the accelerated ones
+    for (const ChecksumImplementation &impl : checksumImplementations()) {
+      if (impl.supported && impl.function != crc32Boost) {
+        table[static_cast<int>(impl.algorithm)] = &impl;
+      }
     }
+    return table;
+  }();
+  return *best[static_cast<int>(algorithm)];
+}
 
-    // Calculate data size for this packet
-    size_t remaining_bytes = send_data_.size() - bytes_sent_;
-    size_t packet_data_size =
-        std::min(remaining_bytes, static_cast<size_t>(MAX_BUFFER_SIZE));
+// Checksum a payload with the given algorithm
+inline uint32_t calculateChecksum(ChecksumAlgorithm algorithm,
+                                  const char *data, size_t length) {
+  return checksumImplementation(algorithm).function(data, length);
+}
 
-    // Create packet
-    send_packet_.seq_num = current_seq_num_;
-    send_packet_.data_size = static_cast<uint16_t>(packet_data_size);
-    send_packet_.is_last =
-        (bytes_sent_ + packet_data_size == send_data_.size()) ? 1 : 0;
+// Calculate CRC-32 checksum
+uint32_t calculateCRC(const char *data, size_t length) {
+  return calculateChecksum(ChecksumAlgorithm::CRC32, data, length);
+}
+
+// Conversion functions for endianness
+uint32_t htonl32(uint32_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return ((value & 0xFF) << 24) | ((value & 0xFF00) << 8) |
+         ((value & 0xFF0000) >> 8) | ((value & 0xFF000000) >> 24);
+#else
+  return value;
+#endif
+}
 
-    // Copy data to packet
-    std::memcpy(send_packet_.data, &send_data_[bytes_sent_], packet_data_size);
+uint32_t ntohl32(uint32_t value) {
+  return htonl32(value); // The conversion is symmetric
+}
 
-    // Calculate CRC (only on the actual data)
-    uint32_t raw_crc = calculateCRC(send_packet_.data, packet_data_size);
-    send_packet_.crc = htonl32(raw_crc); // Convert to network byte order
+// File size carried in a control message (SrControl or SrResume)
+template <typename Message> uint64_t controlFileSize(const Message &control) {
+  return (static_cast<uint64_t>(ntohl32(control.file_size_hi)) << 32) |
+         ntohl32(control.file_size_lo);
+}
 
-    if (verbose_) {
-      debugPacket(send_packet_, "Preparing packet");
-    }
+template <typename Message>
+void setControlFileSize(Message &control, uint64_t size) {
+  control.file_size_hi = htonl32(static_cast<uint32_t>(size >> 32));
+  control.file_size_lo = htonl32(static_cast<uint32_t>(size));
+}
 
-    // Reset retry count
-    retry_count_ = 0;
+// Packets needed for a file; an empty file still needs a last packet
+uint64_t packetCount(uint64_t file_size, int payload_size) {
+  return std::max<uint64_t>(1, (file_size + payload_size - 1) /
+                                   payload_size);
+}
 
-    // Start sending
-    send_packet_with_retry();
-  }
+// Packet range [first, end) sent by one stream of a multi-stream transfer.
+// Client and server both derive the split from the manifest.
+std::pair<uint32_t, uint32_t> streamRange(uint32_t total_packets, int streams,
+                                          int index) {
+  uint64_t first = static_cast<uint64_t>(total_packets) * index / streams;
+  uint64_t end = static_cast<uint64_t>(total_packets) * (index + 1) / streams;
+  return std::make_pair(static_cast<uint32_t>(first),
+                        static_cast<uint32_t>(end));
+}
 
-  // Send the current packet with retry mechanism
-  void send_packet_with_retry() {
-    if (retry_count_ >= MAX_RETRIES) {
-      std::cerr << "Failed to send packet after " << MAX_RETRIES << " attempts"
-                << std::endl;
-      return;
+// ---- Forward error correction ----
+//
+// Each block of N data packets is followed by K repair packets. A repair
+// packet carries one row of a systematic code over the block's symbols
+// (payload length, last flag and payload, zero padded). With K = 1 the code
+// is plain XOR parity; with K > 1 it is a Cauchy Reed-Solomon code over
+// GF(2^8), so any K losses in a block can be rebuilt.
+
+// GF(2^8) arithmetic with the 0x11D polynomial
+struct GaloisField {
+  uint8_t exp[512];
+  uint8_t log[256];
+
+  GaloisField() {
+    int x = 1;
+    for (int i = 0; i < 255; ++i) {
+      exp[i] = static_cast<uint8_t>(x);
+      log[x] = static_cast<uint8_t>(i);
+      x <<= 1;
+      if (x & 0x100) {
+        x ^= 0x11D;
+      }
     }
+    for (int i = 255; i < 512; ++i) {
+      exp[i] = exp[i - 255];
+    }
+    log[0] = 0;
+  }
 
-    // Record send time for latency measurement
-    packet_send_time_ = high_resolution_clock::now();
+  static const GaloisField &get() {
+    static const GaloisField field;
+    return field;
+  }
 
-    if (verbose_ || retry_count_ > 0) {
-      std::cout << "Sending packet with seq_num: " << (int)send_packet_.seq_num
-                << ", size: " << send_packet_.data_size << " bytes"
-                << " (attempt " << retry_count_ + 1 << ")"
-                << " [" << bytes_sent_ << "/" << send_data_.size()
-                << " bytes total]" << std::endl;
+  uint8_t mul(uint8_t a, uint8_t b) const {
+    if (a == 0 || b == 0) {
+      return 0;
     }
-
-    // Send the packet
-    socket_.async_send_to(
-        boost::asio::buffer(&send_packet_, send_packet_.getTotalSize()),
-        server_endpoint_,
-        boost::bind(&UdpClient::handle_send, this,
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
+    return exp[log[a] + log[b]];
   }
 
-  // Handle send completion
-  void handle_send(const boost::system::error_code &error, size_t bytes_sent) {
-    if (!error) {
-      // Wait for ACK
-      wait_for_ack();
-    } else {
-      std::cerr << "Send error: " << error.message() << std::endl;
-      retry_count_++;
+  uint8_t inv(uint8_t a) const { return exp[255 - log[a]]; }
+};
 
-      // Schedule retry with exponential backoff
-      timer_.expires_after(
-          boost::asio::chrono::milliseconds(50 * (1 << retry_count_)));
-      timer_.async_wait(boost::bind(&UdpClient::send_packet_with_retry, this));
+// dst ^= c * src over a region, one byte at a time
+void gfMulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c,
+                    size_t length) {
+  if (c == 0) {
+    return;
+  }
+  if (c == 1) {
+    for (size_t i = 0; i < length; ++i) {
+      dst[i] ^= src[i];
+    }
+    return;
+  }
+  const GaloisField &gf = GaloisField::get();
+  unsigned log_c = gf.log[c];
+  for (size_t i = 0; i < length; ++i) {
+    if (src[i]) {
+      dst[i] ^= gf.exp[gf.log[src[i]] + log_c];
     }
   }
+}
 
-  // Wait for acknowledgment
-  void wait_for_ack() {
-    socket_.async_receive_from(
-        boost::asio::buffer(&ack_buffer_, sizeof(ack_buffer_)),
-        server_endpoint_,
-        boost::bind(&UdpClient::handle_receive_ack, this,
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
+#ifdef HAVE_X86_CHECKSUMS
+// Split-nibble product tables: c * x = low[x & 15] ^ high[x >> 4]
+inline void gfNibbleTables(uint8_t c, uint8_t *low, uint8_t *high) {
+  const GaloisField &gf = GaloisField::get();
+  for (int x = 0; x < 16; ++x) {
+    low[x] = gf.mul(c, static_cast<uint8_t>(x));
+    high[x] = gf.mul(c, static_cast<uint8_t>(x << 4));
+  }
+}
 
-    // Set a timeout for ACK receipt
-    timer_.expires_after(boost::asio::chrono::milliseconds(TIMEOUT_MS));
-    timer_.async_wait(boost::bind(&UdpClient::handle_timeout, this,
-                                  boost::asio::placeholders::error));
+// dst ^= c * src, 16 bytes per step through PSHUFB table lookups
+__attribute__((target("ssse3"))) void
+gfMulAddSsse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length) {
+  if (c == 0) {
+    return;
+  }
+  alignas(16) uint8_t low[16], high[16];
+  gfNibbleTables(c, low, high);
+  const __m128i low_table = _mm_load_si128(reinterpret_cast<__m128i *>(low));
+  const __m128i high_table =
+      _mm_load_si128(reinterpret_cast<__m128i *>(high));
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + i));
+    __m128i lo = _mm_shuffle_epi8(low_table, _mm_and_si128(s, mask));
+    __m128i hi = _mm_shuffle_epi8(
+        high_table, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+    d = _mm_xor_si128(d, _mm_xor_si128(lo, hi));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), d);
   }
+  gfMulAddScalar(dst + i, src + i, c, length - i);
+}
 
-  // Handle received ACK
-  void handle_receive_ack(const boost::system::error_code &error,
-                          size_t bytes_received) {
-    // Cancel the timeout timer
-    timer_.cancel();
+// Same with 32-byte AVX2 registers
+__attribute__((target("avx2"))) void
+gfMulAddAvx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length) {
+  if (c == 0) {
+    return;
+  }
+  alignas(16) uint8_t low[16], high[16];
+  gfNibbleTables(c, low, high);
+  const __m256i low_table = _mm256_broadcastsi128_si256(
+      _mm_load_si128(reinterpret_cast<__m128i *>(low)));
+  const __m256i high_table = _mm256_broadcastsi128_si256(
+      _mm_load_si128(reinterpret_cast<__m128i *>(high)));
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i s =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    __m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i *>(dst + i));
+    __m256i lo = _mm256_shuffle_epi8(low_table, _mm256_and_si256(s, mask));
+    __m256i hi = _mm256_shuffle_epi8(
+        high_table, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+    d = _mm256_xor_si256(d, _mm256_xor_si256(lo, hi));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), d);
+  }
+  gfMulAddScalar(dst + i, src + i, c, length - i);
+}
+#endif
 
-    if (!error && bytes_received == sizeof(uint8_t) &&
-        ack_buffer_ == ACK_PACKET) {
-      // Calculate round-trip time
-      auto now = high_resolution_clock::now();
-      double latency_ms =
-          duration_cast<microseconds>(now - packet_send_time_).count() / 1000.0;
+typedef void (*GfMulAddFunction)(uint8_t *, const uint8_t *, uint8_t, size_t);
 
-      // Record latency statistics
-      latency_stats_.addLatency(latency_ms, retry_count_ > 0);
+// Widest GF(2^8) region multiply this CPU supports, chosen once
+inline void gfMulAdd(uint8_t *dst, const uint8_t *src, uint8_t c,
+                     size_t length) {
+  static const GfMulAddFunction function = [] {
+#ifdef HAVE_X86_CHECKSUMS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return &gfMulAddAvx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+      return &gfMulAddSsse3;
+    }
+#endif
+    return &gfMulAddScalar;
+  }();
+  function(dst, src, c, length);
+}
 
-      if (verbose_) {
-        std::cout << "Received ACK for seq_num: " << (int)send_packet_.seq_num
-                  << " (latency: " << std::fixed << std::setprecision(2)
-                  << latency_ms << " ms)" << std::endl;
-      }
+// Coefficient of data packet `index` in repair row `row` of an N:K code.
+// K = 1 is XOR parity; otherwise the Cauchy matrix 1 / (x_row + y_index)
+// with x = row and y = FEC_MAX_REPAIR + index, so every square submatrix
+// is invertible.
+inline uint8_t fecCoefficient(int repair_count, int row, int index) {
+  if (repair_count == 1) {
+    return 1;
+  }
+  return GaloisField::get().inv(
+      static_cast<uint8_t>(row ^ (FEC_MAX_REPAIR + index)));
+}
 
-      // Update bytes sent
-      bytes_sent_ += send_packet_.data_size;
+// Add one data packet's symbol (length, last flag, payload) into a repair
+// accumulator with coefficient c
+inline void fecAccumulate(uint8_t *accumulator, uint8_t c, uint16_t length,
+                          uint8_t is_last, const char *data) {
+  uint8_t header[3] = {static_cast<uint8_t>(length & 0xFF),
+                       static_cast<uint8_t>(length >> 8), is_last};
+  gfMulAddScalar(accumulator, header, c, sizeof(header));
+  gfMulAdd(accumulator + sizeof(header),
+           reinterpret_cast<const uint8_t *>(data), c, length);
+}
 
-      // Show progress if not verbose (verbose mode already shows per-packet
-      // progress)
-      if (!verbose_ && send_data_.size() > MAX_BUFFER_SIZE) {
-        // Only show progress every 5% or 10 packets, whichever comes first
-        static size_t last_percentage = 0;
-        static int packet_count = 0;
+// Solve for up to K lost symbols of a block. rows[a] is the repair row
+// of residuals[a] (repair symbol minus the received packets' share),
+// lost[b] the block index of each missing packet. Recovered symbols of
+// symbol_size bytes are written to out (lost.size() symbols).
+void fecSolve(int repair_count, const std::vector<int> &rows,
+              const std::vector<const uint8_t *> &residuals,
+              const std::vector<int> &lost, size_t symbol_size,
+              std::vector<uint8_t> &out) {
+  const GaloisField &gf = GaloisField::get();
+  size_t n = lost.size();
+
+  // Invert the n x n submatrix by Gauss-Jordan elimination
+  std::vector<uint8_t> a(n * n), inv(n * n, 0);
+  for (size_t r = 0; r < n; ++r) {
+    for (size_t c = 0; c < n; ++c) {
+      a[r * n + c] = fecCoefficient(repair_count, rows[r], lost[c]);
+    }
+    inv[r * n + r] = 1;
+  }
+  for (size_t col = 0; col < n; ++col) {
+    size_t pivot = col;
+    while (a[pivot * n + col] == 0) {
+      pivot++; // A Cauchy submatrix is never singular
+    }
+    if (pivot != col) {
+      for (size_t c = 0; c < n; ++c) {
+        std::swap(a[pivot * n + c], a[col * n + c]);
+        std::swap(inv[pivot * n + c], inv[col * n + c]);
+      }
+    }
+    uint8_t scale = gf.inv(a[col * n + col]);
+    for (size_t c = 0; c < n; ++c) {
+      a[col * n + c] = gf.mul(a[col * n + c], scale);
+      inv[col * n + c] = gf.mul(inv[col * n + c], scale);
+    }
+    for (size_t r = 0; r < n; ++r) {
+      uint8_t factor = a[r * n + col];
+      if (r == col || factor == 0) {
+        continue;
+      }
+      for (size_t c = 0; c < n; ++c) {
+        a[r * n + c] ^= gf.mul(factor, a[col * n + c]);
+        inv[r * n + c] ^= gf.mul(factor, inv[col * n + c]);
+      }
+    }
+  }
 
-        packet_count++;
-        size_t current_percentage = (bytes_sent_ * 100) / send_data_.size();
+  out.assign(n * symbol_size, 0);
+  for (size_t b = 0; b < n; ++b) {
+    for (size_t r = 0; r < n; ++r) {
+      gfMulAdd(&out[b * symbol_size], residuals[r], inv[b * n + r],
+               symbol_size);
+    }
+  }
+}
 
-        if (current_percentage >= last_percentage + 5 || packet_count >= 10) {
-          std::cout << "Progress: " << current_percentage << "% ("
-                    << bytes_sent_ << "/" << send_data_.size() << " bytes)"
-                    << " [latency: " << std::fixed << std::setprecision(2)
-                    << latency_ms << " ms]" << std::endl;
-          last_percentage = current_percentage;
-          packet_count = 0;
-        }
-      }
+// Parse an --fec N:K value
+void parseFecShape(const std::string &value, int &data, int &repair) {
+  size_t colon = value.find(':');
+  if (colon == std::string::npos) {
+    throw std::runtime_error("FEC shape must be N:K, got: " + value);
+  }
+  data = std::stoi(value.substr(0, colon));
+  repair = std::stoi(value.substr(colon + 1));
+  if (data < 1 || data > FEC_MAX_DATA || repair < 1 ||
+      repair > FEC_MAX_REPAIR) {
+    throw std::runtime_error("FEC shape out of range (N 1.." +
+                             std::to_string(FEC_MAX_DATA) + ", K 1.." +
+                             std::to_string(FEC_MAX_REPAIR) + "): " + value);
+  }
+}
 
-      // Flip sequence number for next packet
-      current_seq_num_ = 1 - current_seq_num_;
+// Receiver state of one FEC block: the received data packets' share of
+// every repair row, and the repair symbols seen so far
+struct FecBlock {
+  uint32_t block;          // Block number, counted from the range start
+  bool used;
+  bool done;               // Complete or rebuilt; later packets are ignored
+  int count;               // Data packets in the block (N until known)
+  int data_received;
+  uint64_t data_mask;      // Received data packets, by index in the block
+  uint32_t repair_mask;    // Received repair rows
+  uint32_t timestamp;      // Of the latest repair, echoed for rebuilt packets
+  std::vector<uint8_t> partial; // K symbols: sum of coefficient * data
+  std::vector<uint8_t> repairs; // K received repair symbols
+};
 
-      // Move to next packet
-      prepare_next_packet();
-    } else if (!error) {
-      std::cerr << "Received invalid ACK, retrying..." << std::endl;
-      retry_count_++;
-      send_packet_with_retry();
-    } else if (error != boost::asio::error::operation_aborted) {
-      // If error is not due to timer cancellation
-      std::cerr << "ACK receive error: " << error.message() << std::endl;
-      retry_count_++;
-      send_packet_with_retry();
+// Receiver side of FEC for one packet range. Blocks live in a ring sized
+// to the receive window, so memory stays bounded; a block that falls out of
+// the ring before it can be rebuilt is left to retransmission.
+class FecDecoder {
+public:
+  FecDecoder(int data, int repair, uint32_t first_packet, int window,
+             int payload_size)
+      : data_(data), repair_(repair), first_packet_(first_packet),
+        symbol_size_(fecSymbolSize(payload_size)),
+        blocks_(window / data + 2) {
+    for (FecBlock &block : blocks_) {
+      block.used = false;
+      block.partial.resize(repair_ * symbol_size_);
+      block.repairs.resize(repair_ * symbol_size_);
     }
   }
 
-  // Handle timeout waiting for ACK
-  void handle_timeout(const boost::system::error_code &error) {
-    if (!error) { // if operation hasn't been cancelled
-      std::cout << "ACK timeout, retransmitting..." << std::endl;
+  int data() const { return data_; }
+  int repair() const { return repair_; }
+  size_t symbolSize() const { return symbol_size_; }
 
-      // Cancel any pending receive operation
-      socket_.cancel();
+  // Bytes of state, charged to the session memory budget
+  static size_t footprint(int data, int repair, int window,
+                          int payload_size) {
+    return (window / data + 2) *
+           (sizeof(FecBlock) + 2 * repair * fecSymbolSize(payload_size));
+  }
 
-      // Increment retry counter and retransmit
-      retry_count_++;
-      send_packet_with_retry();
+  // Fold a newly received data packet into its block. Returns the block,
+  // or null when it is already done or has left the ring.
+  FecBlock *addData(uint32_t seq_num, const SrPacket &packet) {
+    uint32_t position = seq_num - first_packet_;
+    int index = position % data_;
+    FecBlock *block = slot(position / data_);
+    if (!block || block->done || (block->data_mask >> index) & 1) {
+      return nullptr;
+    }
+    block->data_mask |= uint64_t(1) << index;
+    block->data_received++;
+    if (packet.is_last) {
+      block->count = index + 1;
+    }
+    for (int row = 0; row < repair_; ++row) {
+      fecAccumulate(&block->partial[row * symbol_size_],
+                    fecCoefficient(repair_, row, index), packet.data_size,
+                    packet.is_last, packet.data);
+    }
+    return block;
+  }
+
+  // Store a repair symbol (already verified, symbolSize() bytes). Returns
+  // its block, or null when the block is already done or has left the
+  // ring.
+  FecBlock *addRepair(const SrRepair &repair) {
+    uint32_t position = ntohl32(repair.block_first) - first_packet_;
+    if (position % data_ != 0 || repair.block_count == 0 ||
+        repair.block_count > data_ || repair.repair_index >= repair_) {
+      return nullptr;
+    }
+    FecBlock *block = slot(position / data_);
+    if (!block || block->done ||
+        (block->repair_mask >> repair.repair_index) & 1) {
+      return nullptr;
+    }
+    block->repair_mask |= uint32_t(1) << repair.repair_index;
+    block->count = repair.block_count;
+    block->timestamp = repair.timestamp;
+    std::memcpy(&block->repairs[repair.repair_index * symbol_size_],
+                repair.symbol, symbol_size_);
+    return block;
+  }
+
+  // Repair symbols stored for the block holding seq_num and not yet used
+  // (0 once the block is done or has left the ring)
+  int repairsHeld(uint32_t seq_num) const {
+    uint32_t number = (seq_num - first_packet_) / data_;
+    const FecBlock &block = blocks_[number % blocks_.size()];
+    if (!block.used || block.block != number || block.done) {
+      return 0;
+    }
+    return static_cast<int>(std::bitset<32>(block.repair_mask).count());
+  }
+
+  // Rebuild the block's missing data packets once enough symbols are in.
+  // deliver(seq_num, data, size, is_last) is called for each one; returns
+  // the number rebuilt.
+  template <typename Deliver> int recover(FecBlock &block, Deliver deliver) {
+    int missing = block.count - block.data_received;
+    if (block.done || missing < 0) {
+      return 0;
+    }
+    if (missing == 0) {
+      block.done = true;
+      return 0;
+    }
+    if (static_cast<int>(std::bitset<32>(block.repair_mask).count()) <
+        missing) {
+      return 0;
+    }
+
+    std::vector<int> lost, rows;
+    for (int index = 0; index < block.count; ++index) {
+      if (!((block.data_mask >> index) & 1)) {
+        lost.push_back(index);
+      }
+    }
+    for (int row = 0; static_cast<int>(rows.size()) < missing; ++row) {
+      if ((block.repair_mask >> row) & 1) {
+        rows.push_back(row);
+      }
+    }
+
+    // Residual of each row: repair symbol minus the received packets' share
+    std::vector<const uint8_t *> residuals;
+    for (int row : rows) {
+      uint8_t *repair = &block.repairs[row * symbol_size_];
+      const uint8_t *partial = &block.partial[row * symbol_size_];
+      for (size_t i = 0; i < symbol_size_; ++i) {
+        repair[i] ^= partial[i];
+      }
+      residuals.push_back(repair);
+    }
+    std::vector<uint8_t> symbols;
+    fecSolve(repair_, rows, residuals, lost, symbol_size_, symbols);
+    block.done = true;
+
+    int rebuilt = 0;
+    for (size_t b = 0; b < lost.size(); ++b) {
+      const uint8_t *symbol = &symbols[b * symbol_size_];
+      uint16_t size = static_cast<uint16_t>(symbol[0] | (symbol[1] << 8));
+      if (size > symbol_size_ - 3) {
+        continue; // Inconsistent block; let retransmission handle it
+      }
+      deliver(first_packet_ + block.block * data_ + lost[b],
+              reinterpret_cast<const char *>(symbol + 3), size, symbol[2]);
+      rebuilt++;
+    }
+    return rebuilt;
+  }
+
+private:
+  int data_;
+  int repair_;
+  uint32_t first_packet_;
+  size_t symbol_size_;
+  std::vector<FecBlock> blocks_;
+
+  // Ring slot of a block, recycled from an older block if needed; null if
+  // a newer block already holds it
+  FecBlock *slot(uint32_t number) {
+    FecBlock &block = blocks_[number % blocks_.size()];
+    if (block.used && block.block > number) {
+      return nullptr;
+    }
+    if (!block.used || block.block < number) {
+      block.block = number;
+      block.used = true;
+      block.done = false;
+      block.count = data_;
+      block.data_received = 0;
+      block.data_mask = 0;
+      block.repair_mask = 0;
+      block.timestamp = 0;
+      std::fill(block.partial.begin(), block.partial.end(), 0);
+    }
+    return &block;
+  }
+};
+
+// Read file contents into a vector
+std::vector<char> readFileContents(const std::string &filepath) {
+  std::vector<char> buffer;
+
+  // Open the file in binary mode
+  std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+  if (!file) {
+    throw std::runtime_error("Failed to open file: " + filepath);
+  }
+
+  // Get file size by seeking to the end
+  std::streamsize file_size = file.tellg();
+  file.seekg(0, std::ios::beg);
+
+  std::cout << "Reading file: " << filepath << " (" << file_size << " bytes)"
+            << std::endl;
+
+  // Reserve buffer capacity
+  buffer.resize(file_size);
+
+  // Read file into buffer
+  if (file_size > 0) {
+    if (!file.read(buffer.data(), file_size)) {
+      throw std::runtime_error("Failed to read file contents: " + filepath);
+    }
+  }
+
+  file.close();
+  return buffer;
+}
+
+// Read-only streaming view of the file being sent. The file is memory-mapped
+// where the platform allows it and otherwise read in bounded chunks, so the
+// sender's memory use does not depend on the file size.
+class FileSource {
+private:
+  static constexpr size_t CHUNK_SIZE = 4 * 1024 * 1024; // Chunked read size
+  static constexpr size_t RELEASE_STEP = 8 * 1024 * 1024; // madvise stride
+
+  std::string filepath_;
+  uint64_t size_;
+
+  // Memory-mapped mode
+  const char *mapping_;
+  uint64_t released_; // Bytes at the front already dropped from memory
+
+  // Chunked mode: two slots so retransmits just behind the read position
+  // don't force a reload
+  std::ifstream file_;
+  std::vector<char> chunks_[2];
+  uint64_t chunk_offsets_[2];
+  int next_slot_;
+
+public:
+  explicit FileSource(const std::string &filepath)
+      : filepath_(filepath), size_(0), mapping_(nullptr), released_(0),
+        chunk_offsets_{UINT64_MAX, UINT64_MAX}, next_slot_(0) {
+#ifdef HAVE_MMAP
+    int fd = ::open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open file: " + filepath);
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      size_ = static_cast<uint64_t>(st.st_size);
+      void *addr = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr != MAP_FAILED) {
+        mapping_ = static_cast<const char *>(addr);
+        // Sequential access lets the kernel read ahead aggressively
+        ::madvise(addr, size_, MADV_SEQUENTIAL);
+      }
+    }
+    ::close(fd);
+#endif
+
+    if (!mapping_) {
+      // Fall back to bounded chunked reads
+      file_.open(filepath, std::ios::binary | std::ios::ate);
+      if (!file_) {
+        throw std::runtime_error("Failed to open file: " + filepath);
+      }
+      size_ = static_cast<uint64_t>(file_.tellg());
+    }
+
+    std::cout << "Opened file: " << filepath << " (" << size_ << " bytes, "
+              << (mapping_ ? "memory-mapped" : "chunked reads") << ")"
+              << std::endl;
+  }
+
+  ~FileSource() {
+#ifdef HAVE_MMAP
+    if (mapping_) {
+      ::munmap(const_cast<char *>(mapping_), size_);
+    }
+#endif
+  }
+
+  FileSource(const FileSource &) = delete;
+  FileSource &operator=(const FileSource &) = delete;
+
+  // Total file size in bytes
+  uint64_t size() const { return size_; }
+
+  // The len bytes at offset inside the memory mapping, for senders that
+  // hand them to the kernel without copying; null for chunked reads
+  const char *span(uint64_t offset, size_t len) const {
+    if (!mapping_ || offset + len > size_) {
+      return nullptr;
+    }
+    return mapping_ + offset;
+  }
+
+  // Copy len bytes starting at offset into dst
+  void read(uint64_t offset, char *dst, size_t len) {
+    if (len == 0) {
+      return;
+    }
+    if (offset + len > size_) {
+      throw std::runtime_error("Read past end of file: " + filepath_);
+    }
+
+    if (mapping_) {
+      std::memcpy(dst, mapping_ + offset, len);
+      return;
+    }
+
+    // Chunked mode: a packet may straddle two chunks
+    while (len > 0) {
+      const std::vector<char> &chunk = load_chunk(offset);
+      uint64_t chunk_start = chunk_offsets_[&chunk == &chunks_[0] ? 0 : 1];
+      size_t in_chunk = std::min<uint64_t>(len, chunk_start + chunk.size() -
+                                                    offset);
+      std::memcpy(dst, chunk.data() + (offset - chunk_start), in_chunk);
+      dst += in_chunk;
+      offset += in_chunk;
+      len -= in_chunk;
+    }
+  }
+
+  // Start release() tracking at offset, for a reader that only covers the
+  // file from there (one stream of a multi-stream transfer)
+  void releaseFrom(uint64_t offset) {
+#ifdef HAVE_MMAP
+    static const uint64_t page_size = ::sysconf(_SC_PAGESIZE);
+    released_ = offset / page_size * page_size;
+#endif
+  }
+
+  // Tell the source that bytes before offset will not be read again, so
+  // mapped pages can be dropped and resident memory stays flat
+  void release(uint64_t offset) {
+#ifdef HAVE_MMAP
+    if (!mapping_ || offset < released_ + RELEASE_STEP) {
+      return;
+    }
+    static const uint64_t page_size = ::sysconf(_SC_PAGESIZE);
+    uint64_t end = offset / page_size * page_size;
+    ::madvise(const_cast<char *>(mapping_) + released_, end - released_,
+              MADV_DONTNEED);
+    released_ = end;
+#else
+    (void)offset;
+#endif
+  }
+
+private:
+  // Return the chunk covering offset, reading it if not cached
+  const std::vector<char> &load_chunk(uint64_t offset) {
+    for (int slot = 0; slot < 2; ++slot) {
+      if (chunk_offsets_[slot] != UINT64_MAX && offset >= chunk_offsets_[slot] &&
+          offset < chunk_offsets_[slot] + chunks_[slot].size()) {
+        return chunks_[slot];
+      }
+    }
+
+    int slot = next_slot_;
+    next_slot_ = 1 - next_slot_;
+
+    size_t chunk_size = std::min<uint64_t>(CHUNK_SIZE, size_ - offset);
+    chunks_[slot].resize(chunk_size);
+    file_.clear();
+    file_.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+    if (!file_.read(chunks_[slot].data(), chunk_size)) {
+      throw std::runtime_error("Failed to read file contents: " + filepath_);
+    }
+    chunk_offsets_[slot] = offset;
+    return chunks_[slot];
+  }
+};
+
+// When the receiver flushes the output file to stable storage
+enum class SyncPolicy {
+  NONE,        // Leave write-back to the kernel
+  ON_COMPLETE, // fsync once after the last packet
+  PERIODIC     // fdatasync every sync interval, plus fsync on completion
+};
+
+// Parse a --sync argument: none, complete, periodic or periodic:<MB>
+SyncPolicy parseSyncPolicy(const std::string &value,
+                           uint64_t &sync_interval_bytes) {
+  if (value == "none") {
+    return SyncPolicy::NONE;
+  }
+  if (value == "complete") {
+    return SyncPolicy::ON_COMPLETE;
+  }
+  if (value == "periodic") {
+    return SyncPolicy::PERIODIC;
+  }
+  // periodic:<MB> with a whole number of megabytes, at least one
+  if (value.compare(0, 9, "periodic:") == 0 && value.size() > 9 &&
+      value.size() <= 9 + 6) {
+    uint64_t megabytes = 0;
+    size_t i = 9;
+    while (i < value.size() && value[i] >= '0' && value[i] <= '9') {
+      megabytes = megabytes * 10 + static_cast<uint64_t>(value[i] - '0');
+      ++i;
+    }
+    if (i == value.size() && megabytes > 0) {
+      sync_interval_bytes = megabytes * 1024 * 1024;
+      return SyncPolicy::PERIODIC;
+    }
+  }
+  throw std::runtime_error("Unknown sync policy: " + value);
+}
+
+// Asynchronous writer a FileSink can hand payloads to (the io_uring
+// engine). It only takes buffers it can keep alive until the write is done.
+class WriteOffload {
+public:
+  virtual ~WriteOffload() {}
+
+  // Start writing len bytes at offset; false leaves the write to the caller
+  virtual bool write(int fd, uint64_t offset, const char *data,
+                     size_t len) = 0;
+
+  // Wait for every write started on fd; false when one of them failed
+  virtual bool drain(int fd) = 0;
+
+  // Flush fd's data to stable storage after the writes started so far,
+  // without waiting; false leaves the sync to the caller
+  virtual bool sync(int fd) {
+    (void)fd;
+    return false;
+  }
+};
+
+// Output file written in place: each verified payload goes straight to its
+// offset, space is preallocated ahead of the writes, and nothing is held in
+// memory. The final size is only known at the last packet, so space is
+// reserved in PREALLOC_STEP extents and the tail trimmed in finish().
+class FileSink {
+private:
+  static constexpr uint64_t PREALLOC_STEP = 64 * 1024 * 1024;
+
+  std::string filepath_;
+  SyncPolicy sync_policy_;
+  uint64_t sync_interval_bytes_;
+  uint64_t allocated_;         // Bytes reserved on disk
+  uint64_t written_;           // Payload bytes written
+  uint64_t unsynced_;          // Bytes written since the last sync
+#ifdef HAVE_PWRITE
+  int fd_;
+  WriteOffload *offload_;      // Asynchronous writes, when set
+#else
+  std::fstream file_;
+#endif
+
+public:
+  // A resumed transfer keeps what is already in the file (truncate false)
+  FileSink(const std::string &filepath,
+           SyncPolicy sync_policy = SyncPolicy::ON_COMPLETE,
+           uint64_t sync_interval_bytes = DEFAULT_SYNC_INTERVAL,
+           bool truncate = true)
+      : filepath_(filepath), sync_policy_(sync_policy),
+        sync_interval_bytes_(sync_interval_bytes), allocated_(0), written_(0),
+        unsynced_(0) {
+#ifdef HAVE_PWRITE
+    offload_ = nullptr;
+    fd_ = ::open(filepath.c_str(),
+                 O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error("Failed to create output file: " + filepath);
+    }
+#else
+    if (!truncate) {
+      // Create the file if needed without clearing it
+      std::ofstream(filepath, std::ios::binary | std::ios::app);
+    }
+    file_.open(filepath, std::ios::binary | std::ios::in | std::ios::out |
+                             (truncate ? std::ios::trunc
+                                       : std::ios::openmode()));
+    if (!file_) {
+      throw std::runtime_error("Failed to create output file: " + filepath);
+    }
+#endif
+  }
+
+  ~FileSink() {
+#ifdef HAVE_PWRITE
+    if (offload_) {
+      offload_->drain(fd_);
+    }
+    ::close(fd_);
+#endif
+  }
+
+  FileSink(const FileSink &) = delete;
+  FileSink &operator=(const FileSink &) = delete;
+
+  // Payload bytes written so far
+  uint64_t bytesWritten() const { return written_; }
+
+  // Hand writes to an asynchronous writer from now on (null: write here).
+  // Only the thread driving the writer may write to the sink then.
+  void setOffload(WriteOffload *offload) {
+#ifdef HAVE_PWRITE
+    drain();
+    offload_ = offload;
+#else
+    (void)offload;
+#endif
+  }
+
+  // Write one payload at its offset in the file
+  void write(uint64_t offset, const char *data, size_t len) {
+    if (len == 0) {
+      return;
+    }
+    preallocate(offset + len);
+
+#ifdef HAVE_PWRITE
+    if (offload_ && offload_->write(fd_, offset, data, len)) {
+      written_ += len;
+      unsynced_ += len;
+      len = 0;
+    }
+    while (len > 0) {
+      ssize_t n = ::pwrite(fd_, data, len, static_cast<off_t>(offset));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Failed to write output file: " + filepath_);
+      }
+      data += n;
+      offset += n;
+      len -= n;
+      written_ += n;
+      unsynced_ += n;
+    }
+#else
+    file_.seekp(static_cast<std::streamoff>(offset), std::ios::beg);
+    if (!file_.write(data, len)) {
+      throw std::runtime_error("Failed to write output file: " + filepath_);
+    }
+    written_ += len;
+    unsynced_ += len;
+#endif
+
+    if (sync_policy_ == SyncPolicy::PERIODIC &&
+        unsynced_ >= sync_interval_bytes_) {
+      sync(false);
+    }
+  }
+
+  // Read back up to len bytes at offset; returns the bytes read, short at
+  // the end of the file
+  size_t read(uint64_t offset, char *dst, size_t len) {
+    size_t total = 0;
+#ifdef HAVE_PWRITE
+    drain();
+    while (total < len) {
+      ssize_t n = ::pread(fd_, dst + total, len - total,
+                          static_cast<off_t>(offset + total));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      total += n;
+    }
+#else
+    file_.clear();
+    file_.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+    file_.read(dst, len);
+    total = static_cast<size_t>(file_.gcount());
+    file_.clear();
+#endif
+    return total;
+  }
+
+  // Set the final size, drop unused preallocation and apply the sync policy
+  void finish(uint64_t final_size) {
+#ifdef HAVE_PWRITE
+    drain();
+    if (::ftruncate(fd_, static_cast<off_t>(final_size)) != 0) {
+      throw std::runtime_error("Failed to set output file size: " + filepath_);
+    }
+#else
+    file_.flush();
+#endif
+    allocated_ = final_size;
+
+    if (sync_policy_ != SyncPolicy::NONE) {
+      sync(true);
+    }
+
+    std::cout << "Saved " << final_size << " bytes to file: " << filepath_
+              << std::endl;
+  }
+
+private:
+#ifdef HAVE_PWRITE
+  // Wait for asynchronous writes before the file is synced, read or sized
+  void drain() {
+    if (offload_ && !offload_->drain(fd_)) {
+      throw std::runtime_error("Failed to write output file: " + filepath_);
+    }
+  }
+#endif
+
+  // Reserve disk space ahead of the write position
+  void preallocate(uint64_t end) {
+    if (end <= allocated_) {
+      return;
+    }
+    uint64_t target = (end + PREALLOC_STEP - 1) / PREALLOC_STEP * PREALLOC_STEP;
+#if defined(HAVE_PWRITE) && defined(__linux__)
+    // KEEP_SIZE reserves blocks without moving EOF; unsupported file
+    // systems just skip preallocation
+    ::fallocate(fd_, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(allocated_),
+                static_cast<off_t>(target - allocated_));
+#endif
+    allocated_ = target;
+  }
+
+  // Flush written data to stable storage. A periodic sync goes to the
+  // asynchronous writer when it takes one.
+  void sync(bool full) {
+#ifdef HAVE_PWRITE
+    if (!full && offload_ && offload_->sync(fd_)) {
+      unsynced_ = 0;
+      return;
+    }
+    drain();
+#if defined(__linux__)
+    int rc = full ? ::fsync(fd_) : ::fdatasync(fd_);
+#else
+    (void)full;
+    int rc = ::fsync(fd_);
+#endif
+    if (rc != 0) {
+      std::cerr << "Failed to sync output file: " << filepath_ << std::endl;
+    }
+#else
+    (void)full;
+    file_.flush();
+#endif
+    unsynced_ = 0;
+  }
+};
+
+// Disk stage of the server (--disk-thread): payloads are copied into a
+// pool of preallocated, cache-line aligned slots and handed to a writer
+// thread through a single-producer single-consumer ring, so a slow disk
+// never holds up the socket. The network thread is the only producer and
+// the writer thread the only consumer; neither allocates once the pool is
+// built. Runs of ring entries that continue each other in the same file go
+// out as one pwritev(). When the ring is full the server drops new packets
+// unacknowledged and advertises only the free slots as its window.
+class DiskWriter : public WriteOffload {
+public:
+  DiskWriter(size_t slots, size_t slot_size)
+      : slots_(slots), stride_((slot_size + DISK_SLOT_ALIGN - 1) /
+                               DISK_SLOT_ALIGN * DISK_SLOT_ALIGN),
+        pool_(nullptr), entries_(slots), head_(0), tail_(0), sleeping_(false),
+        stopping_(false), error_fd_(-1), writes_(0), syscalls_(0) {
+#ifdef HAVE_MMAP
+    // Page-aligned pool, touched once so no page fault waits for a packet
+    if (::posix_memalign(&pool_, 4096, slots_ * stride_) != 0) {
+      throw std::runtime_error("Failed to allocate the disk ring");
+    }
+    std::memset(pool_, 0, slots_ * stride_);
+    thread_ = std::thread(&DiskWriter::run, this);
+#else
+    throw std::runtime_error("Disk writer thread not supported here");
+#endif
+  }
+
+  ~DiskWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    std::free(pool_);
+  }
+
+  DiskWriter(const DiskWriter &) = delete;
+  DiskWriter &operator=(const DiskWriter &) = delete;
+
+  // Free ring slots, as seen by the producer
+  size_t freeSlots() const {
+    return slots_ - static_cast<size_t>(
+                        head_.load(std::memory_order_relaxed) -
+                        tail_.load(std::memory_order_acquire));
+  }
+
+  bool full() const { return freeSlots() == 0; }
+
+  // Payloads written, and the pwritev() calls that wrote them
+  uint64_t writes() const { return writes_.load(); }
+  uint64_t syscalls() const { return syscalls_.load(); }
+
+  bool write(int fd, uint64_t offset, const char *data,
+             size_t len) override {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (len > stride_ || head - tail_.load(std::memory_order_acquire) ==
+                             slots_) {
+      return false;
+    }
+    size_t index = static_cast<size_t>(head % slots_);
+    std::memcpy(slot(index), data, len);
+    entries_[index] = {fd, offset, len};
+    // Sequentially consistent with the writer's check before it sleeps, so
+    // either it sees this entry or we see it asleep
+    head_.store(head + 1, std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      wake_.notify_one();
+    }
+    return true;
+  }
+
+  // Periodic syncs run on the writer thread too, queued as an empty entry
+  bool sync(int fd) override {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == slots_) {
+      return false;
+    }
+    entries_[head % slots_] = {fd, 0, 0};
+    head_.store(head + 1, std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      wake_.notify_one();
+    }
+    return true;
+  }
+
+  bool drain(int fd) override {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    while (tail_.load(std::memory_order_acquire) != head) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wake_.notify_one();
+      }
+      std::this_thread::sleep_for(microseconds(50));
+    }
+    int failed = fd;
+    return !error_fd_.compare_exchange_strong(failed, -1);
+  }
+
+private:
+  struct Entry {
+    int fd;
+    uint64_t offset;
+    size_t len;
+  };
+
+  size_t slots_;
+  size_t stride_; // Slot size rounded up to DISK_SLOT_ALIGN
+  void *pool_;
+  std::vector<Entry> entries_;
+  std::atomic<uint64_t> head_; // Next entry the producer fills
+  std::atomic<uint64_t> tail_; // Next entry the writer takes
+  std::atomic<bool> sleeping_; // Writer is waiting for entries
+  bool stopping_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::atomic<int> error_fd_; // File a write failed on (-1 = none)
+  std::atomic<uint64_t> writes_;
+  std::atomic<uint64_t> syscalls_;
+  std::thread thread_;
+
+  char *slot(size_t index) {
+    return static_cast<char *>(pool_) + index * stride_;
+  }
+
+#ifdef HAVE_MMAP
+  void run() {
+    constexpr int MAX_IOV = 64;
+    struct iovec iov[MAX_IOV];
+    for (;;) {
+      uint64_t tail = tail_.load(std::memory_order_relaxed);
+      uint64_t head = head_.load(std::memory_order_acquire);
+      if (tail == head) {
+        // Packets come in bursts: poll a little before paying for a sleep
+        // and the producer's wake-up call
+        auto poll_end = steady_clock::now() + microseconds(DISK_POLL_US);
+        while (head_.load(std::memory_order_acquire) == tail &&
+               steady_clock::now() < poll_end) {
+          std::this_thread::yield();
+        }
+        if (head_.load(std::memory_order_acquire) != tail) {
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        sleeping_.store(true, std::memory_order_seq_cst);
+        wake_.wait(lock, [&]() {
+          return stopping_ || head_.load(std::memory_order_seq_cst) != tail;
+        });
+        sleeping_.store(false, std::memory_order_relaxed);
+        if (stopping_ && head_.load(std::memory_order_acquire) == tail) {
+          return;
+        }
+        continue;
+      }
+
+      // One pwritev() for a run of entries that continue each other
+      const Entry &first = entries_[tail % slots_];
+      if (first.len == 0) {
+#if defined(__linux__)
+        int rc = ::fdatasync(first.fd);
+#else
+        int rc = ::fsync(first.fd);
+#endif
+        if (rc != 0) {
+          std::cerr << "Failed to sync output file" << std::endl;
+        }
+        tail_.store(tail + 1, std::memory_order_release);
+        continue;
+      }
+      int count = 0;
+      uint64_t end = first.offset;
+      while (tail + count != head && count < MAX_IOV) {
+        const Entry &entry = entries_[(tail + count) % slots_];
+        if (entry.fd != first.fd || entry.offset != end || entry.len == 0) {
+          break;
+        }
+        iov[count].iov_base = slot((tail + count) % slots_);
+        iov[count].iov_len = entry.len;
+        end += entry.len;
+        count++;
+      }
+      write_run(first.fd, first.offset, iov, count);
+      writes_.fetch_add(count, std::memory_order_relaxed);
+      tail_.store(tail + count, std::memory_order_release);
+    }
+  }
+
+  void write_run(int fd, uint64_t offset, struct iovec *iov, int count) {
+    while (count > 0) {
+      syscalls_.fetch_add(1, std::memory_order_relaxed);
+      ssize_t n = ::pwritev(fd, iov, count, static_cast<off_t>(offset));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        error_fd_.store(fd);
+        return;
+      }
+      offset += n;
+      // Short write: skip what went out and continue with the rest
+      while (count > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        count--;
+      }
+      if (count > 0) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+        iov->iov_len -= n;
+      }
+    }
+  }
+#endif
+};
+
+// Chunk bitmap of a resumable transfer, as the sender sees it after the
+// resume query: bit i is set when chunk i is already at the receiver
+struct ResumeBitmap {
+  std::vector<uint8_t> bits;
+  uint32_t total_packets;
+
+  static uint64_t chunkCount(uint64_t packets) {
+    return (packets + RESUME_CHUNK_PACKETS - 1) / RESUME_CHUNK_PACKETS;
+  }
+
+  bool chunkPresent(uint64_t chunk) const {
+    return (bits[chunk / 8] >> (chunk % 8)) & 1;
+  }
+
+  // Whether every packet of [first, end) is at the receiver
+  bool rangePresent(uint32_t first, uint32_t end) const {
+    for (uint64_t chunk = first / RESUME_CHUNK_PACKETS;
+         chunk * RESUME_CHUNK_PACKETS < end; ++chunk) {
+      if (!chunkPresent(chunk)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Packets already at the receiver
+  uint64_t presentPackets() const {
+    uint64_t present = 0;
+    for (uint64_t chunk = 0; chunk < chunkCount(total_packets); ++chunk) {
+      if (chunkPresent(chunk)) {
+        present += std::min<uint64_t>(RESUME_CHUNK_PACKETS,
+                                      total_packets -
+                                          chunk * RESUME_CHUNK_PACKETS);
+      }
+    }
+    return present;
+  }
+};
+
+// Sidecar journal of a resumable transfer (<output>.journal): which chunks
+// of RESUME_CHUNK_PACKETS packets are complete in the output file, and the
+// CRC-32C of each. It is a memory-mapped file, so it survives a crash or a
+// restart of the receiver; when it is reopened every chunk it marks present
+// is checked against the output file, so a chunk whose data never reached
+// the disk is simply sent again.
+class ResumeJournal {
+private:
+  static constexpr char MAGIC[8] = {'U', 'D', 'P', 'R', 'S', 'M', '0', '1'};
+
+  struct Header {
+    char magic[8];
+    uint32_t transfer_id;
+    uint32_t chunk_packets;
+    uint32_t payload_size;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t chunks;
+  };
+
+  std::string path_;
+  int payload_size_; // Bytes per packet, so per chunk
+  uint32_t total_packets_;
+  uint64_t chunks_;
+  size_t mapped_size_;
+  char *mapping_;
+  uint32_t *crcs_;  // Per-chunk CRC-32C
+  uint8_t *bitmap_; // Chunk present bits
+  std::unordered_map<uint64_t, uint32_t> pending_; // Packets per open chunk
+
+public:
+  // Open the journal for a transfer, or start a new one when there is none
+  // or it belongs to another file or payload size. The sink must be the
+  // transfer's output file, opened without truncation.
+  ResumeJournal(const std::string &path, uint32_t transfer_id,
+                uint64_t file_size, int payload_size, FileSink &sink)
+      : path_(path), payload_size_(payload_size),
+        total_packets_(
+            static_cast<uint32_t>(packetCount(file_size, payload_size))),
+        chunks_(ResumeBitmap::chunkCount(total_packets_)), mapped_size_(0),
+        mapping_(nullptr), crcs_(nullptr), bitmap_(nullptr) {
+#ifdef HAVE_MMAP
+    mapped_size_ =
+        sizeof(Header) + chunks_ * sizeof(uint32_t) + (chunks_ + 7) / 8;
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open journal: " + path);
+    }
+    struct stat st;
+    bool reuse = ::fstat(fd, &st) == 0 &&
+                 static_cast<size_t>(st.st_size) == mapped_size_;
+    if (!reuse && (::ftruncate(fd, 0) != 0 ||
+                   ::ftruncate(fd, static_cast<off_t>(mapped_size_)) != 0)) {
+      ::close(fd);
+      throw std::runtime_error("Failed to size journal: " + path);
+    }
+    void *addr = ::mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      throw std::runtime_error("Failed to map journal: " + path);
+    }
+    mapping_ = static_cast<char *>(addr);
+    crcs_ = reinterpret_cast<uint32_t *>(mapping_ + sizeof(Header));
+    bitmap_ = reinterpret_cast<uint8_t *>(crcs_ + chunks_);
+
+    Header &header = *reinterpret_cast<Header *>(mapping_);
+    if (!reuse || std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        header.transfer_id != transfer_id ||
+        header.chunk_packets != RESUME_CHUNK_PACKETS ||
+        header.payload_size != static_cast<uint32_t>(payload_size) ||
+        header.file_size != file_size || header.chunks != chunks_) {
+      // Someone else's journal, or none: start over
+      std::memset(mapping_, 0, mapped_size_);
+      std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+      header.transfer_id = transfer_id;
+      header.chunk_packets = RESUME_CHUNK_PACKETS;
+      header.payload_size = static_cast<uint32_t>(payload_size);
+      header.file_size = file_size;
+      header.chunks = chunks_;
+      return;
+    }
+    verify(sink);
+#else
+    (void)transfer_id;
+    (void)file_size;
+    (void)sink;
+    throw std::runtime_error("Resumable transfers need memory-mapped files");
+#endif
+  }
+
+  ~ResumeJournal() {
+#ifdef HAVE_MMAP
+    if (mapping_) {
+      ::munmap(mapping_, mapped_size_);
+    }
+#endif
+  }
+
+  ResumeJournal(const ResumeJournal &) = delete;
+  ResumeJournal &operator=(const ResumeJournal &) = delete;
+
+  // Bytes of the mapping, charged to the session memory budget
+  size_t footprint() const { return mapped_size_; }
+
+  bool chunkPresent(uint64_t chunk) const {
+    return (bitmap_[chunk / 8] >> (chunk % 8)) & 1;
+  }
+
+  bool hasPacket(uint32_t seq_num) const {
+    return chunkPresent(seq_num / RESUME_CHUNK_PACKETS);
+  }
+
+  // First packet in [first, end) not on disk yet (end if none)
+  uint32_t firstMissing(uint32_t first, uint32_t end) const {
+    while (first < end && hasPacket(first)) {
+      first = (first / RESUME_CHUNK_PACKETS + 1) * RESUME_CHUNK_PACKETS;
+    }
+    return std::min(first, end);
+  }
+
+  // Count a packet written to the sink; a chunk that is now complete is
+  // read back, checksummed and marked present
+  void addPacket(uint32_t seq_num, FileSink &sink) {
+    uint64_t chunk = seq_num / RESUME_CHUNK_PACKETS;
+    if (chunkPresent(chunk)) {
+      return;
+    }
+    uint32_t &count = pending_[chunk];
+    if (++count < packetsIn(chunk)) {
+      return;
+    }
+    pending_.erase(chunk);
+    std::vector<char> data(chunkBytes(chunk));
+    if (sink.read(chunkOffset(chunk), data.data(), data.size()) !=
+        data.size()) {
+      return;
+    }
+    crcs_[chunk] = calculateChecksum(ChecksumAlgorithm::CRC32C, data.data(),
+                                     data.size());
+    bitmap_[chunk / 8] |= static_cast<uint8_t>(1 << (chunk % 8));
+  }
+
+  // Payload bytes in chunks marked present
+  uint64_t presentBytes() const {
+    uint64_t bytes = 0;
+    for (uint64_t chunk = 0; chunk < chunks_; ++chunk) {
+      if (chunkPresent(chunk)) {
+        bytes += chunkBytes(chunk);
+      }
+    }
+    return bytes;
+  }
+
+  // Copy one page of the bitmap; returns its length in bytes
+  size_t page(uint32_t index, uint8_t *out) const {
+    size_t bytes = (chunks_ + 7) / 8;
+    size_t offset = static_cast<size_t>(index) * RESUME_PAGE_BYTES;
+    if (offset >= bytes) {
+      return 0;
+    }
+    size_t length = std::min(RESUME_PAGE_BYTES, bytes - offset);
+    std::memcpy(out, bitmap_ + offset, length);
+    return length;
+  }
+
+  // The transfer is complete: the journal is no longer needed
+  void remove() {
+    if (std::remove(path_.c_str()) != 0) {
+      std::cerr << "Failed to remove journal: " << path_ << std::endl;
+    }
+  }
+
+private:
+  uint32_t packetsIn(uint64_t chunk) const {
+    return static_cast<uint32_t>(std::min<uint64_t>(
+        RESUME_CHUNK_PACKETS, total_packets_ - chunk * RESUME_CHUNK_PACKETS));
+  }
+
+  uint64_t chunkOffset(uint64_t chunk) const {
+    return chunk * RESUME_CHUNK_PACKETS * payload_size_;
+  }
+
+  size_t chunkBytes(uint64_t chunk) const {
+    const Header &header = *reinterpret_cast<const Header *>(mapping_);
+    return static_cast<size_t>(
+        std::min<uint64_t>(RESUME_CHUNK_PACKETS * payload_size_,
+                           header.file_size - chunkOffset(chunk)));
+  }
+
+  // Drop every chunk whose data does not match its recorded CRC
+  void verify(FileSink &sink) {
+    std::vector<char> data(RESUME_CHUNK_PACKETS * payload_size_);
+    uint64_t present = 0, discarded = 0;
+    for (uint64_t chunk = 0; chunk < chunks_; ++chunk) {
+      if (!chunkPresent(chunk)) {
+        continue;
+      }
+      size_t length = chunkBytes(chunk);
+      if (sink.read(chunkOffset(chunk), data.data(), length) == length &&
+          calculateChecksum(ChecksumAlgorithm::CRC32C, data.data(),
+                            length) == crcs_[chunk]) {
+        present++;
+        continue;
+      }
+      bitmap_[chunk / 8] &= static_cast<uint8_t>(~(1 << (chunk % 8)));
+      discarded++;
+    }
+    std::cout << "Journal " << path_ << ": " << present << "/" << chunks_
+              << " chunks verified";
+    if (discarded > 0) {
+      std::cout << ", " << discarded << " failed their CRC and will be resent";
+    }
+    std::cout << std::endl;
+  }
+};
+
+constexpr char ResumeJournal::MAGIC[8];
+
+// Transfer ID of a resumable transfer: the same file (name, size and
+// modification time) maps to the same ID on every run, so the receiver
+// finds its journal again
+uint32_t resumeTransferId(const std::string &filepath, uint64_t file_size) {
+  std::string name = filepath.substr(filepath.find_last_of("/\\") + 1);
+  int64_t mtime = 0;
+#ifdef HAVE_MMAP
+  struct stat st;
+  if (::stat(filepath.c_str(), &st) == 0) {
+    mtime = static_cast<int64_t>(st.st_mtime);
+  }
+#endif
+  std::ostringstream key;
+  key << name << '\0' << file_size << '\0' << mtime;
+  std::string bytes = key.str();
+  uint32_t id = calculateChecksum(ChecksumAlgorithm::XXH64, bytes.data(),
+                                  bytes.size());
+  return id ? id : 1;
+}
+
+// ---- Delta transfers ----
+//
+// rsync's algorithm: the receiver signs every block of its copy of the file
+// with a rolling checksum and a strong hash, and the sender slides a window
+// over the new file. Wherever the window matches a block it sends a
+// reference to that block instead of the bytes; everything else goes as
+// literals. The delta is a stream of instructions, in network byte order:
+//
+//   header  "UDPDLT01", new file size (8), block size (4), basis size (8)
+//   'C'     first block (4), block count (4)  copy blocks of the basis
+//   'L'     length (4), bytes                 literal bytes
+//   'E'                                       end of the delta
+
+// rsync's rolling checksum of a window of n bytes: a is the byte sum and
+// b = sum of (n - i) * x[i], both wrapping. Sliding the window is O(1).
+struct RollingChecksum {
+  uint32_t a;
+  uint32_t b;
+
+  uint32_t value() const { return (a & 0xFFFF) | (b << 16); }
+
+  // Drop byte `out` from the front of a window of `length` bytes and
+  // append byte `in`
+  void roll(uint8_t out, uint8_t in, uint32_t length) {
+    a += static_cast<uint32_t>(in) - out;
+    b += a - length * static_cast<uint32_t>(out);
+  }
+};
+
+// Checksum of a whole window, a byte at a time
+RollingChecksum weakChecksumScalar(const uint8_t *data, size_t length) {
+  RollingChecksum sum = {0, 0};
+  for (size_t i = 0; i < length; ++i) {
+    sum.a += data[i];
+    sum.b += sum.a;
+  }
+  return sum;
+}
+
+#ifdef HAVE_X86_CHECKSUMS
+// Same sums 32 bytes per step: PSADBW adds up the bytes, PMADDUBSW weighs
+// them by their distance to the end of the step (32 down to 1), and the
+// byte sum before each step counts 32 more for every step it precedes
+__attribute__((target("avx2"))) RollingChecksum
+weakChecksumAvx2(const uint8_t *data, size_t length) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i weights = _mm256_setr_epi8(
+      32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15,
+      14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  __m256i sums = zero;     // Byte sums, 64-bit lanes
+  __m256i prefix = zero;   // Byte sums before each step, 64-bit lanes
+  __m256i weighted = zero; // Weighted sums within the steps, 32-bit lanes
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    prefix = _mm256_add_epi64(prefix, sums);
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(x, zero));
+    weighted = _mm256_add_epi32(
+        weighted, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+  }
+
+  alignas(32) uint64_t sum_lanes[4], prefix_lanes[4];
+  alignas(32) uint32_t weighted_lanes[8];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(sum_lanes), sums);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(prefix_lanes), prefix);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(weighted_lanes), weighted);
+  RollingChecksum sum = {0, 0};
+  uint32_t prefix_sum = 0;
+  for (int lane = 0; lane < 4; ++lane) {
+    sum.a += static_cast<uint32_t>(sum_lanes[lane]);
+    prefix_sum += static_cast<uint32_t>(prefix_lanes[lane]);
+  }
+  sum.b = 32 * prefix_sum;
+  for (int lane = 0; lane < 8; ++lane) {
+    sum.b += weighted_lanes[lane];
+  }
+  for (; i < length; ++i) {
+    sum.a += data[i];
+    sum.b += sum.a;
+  }
+  return sum;
+}
+#endif
+
+typedef RollingChecksum (*WeakChecksumFunction)(const uint8_t *, size_t);
+
+// Rolling checksum of a whole window with the widest vectors this CPU
+// supports, chosen once. Sliding byte by byte stays scalar; whole windows
+// are summed for every signature and after every match.
+inline RollingChecksum weakChecksum(const char *data, size_t length) {
+  static const WeakChecksumFunction function = [] {
+#ifdef HAVE_X86_CHECKSUMS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return &weakChecksumAvx2;
+    }
+#endif
+    return &weakChecksumScalar;
+  }();
+  return function(reinterpret_cast<const uint8_t *>(data), length);
+}
+
+// Block size for a basis of the given size: about its square root, as in
+// rsync, so signature and literal overheads stay balanced; a power of two
+// between DELTA_MIN_BLOCK and DELTA_MAX_BLOCK
+inline uint32_t deltaBlockSize(uint64_t basis_size) {
+  uint32_t block = DELTA_MIN_BLOCK;
+  while (block < DELTA_MAX_BLOCK &&
+         static_cast<uint64_t>(block) * block < basis_size) {
+    block *= 2;
+  }
+  return block;
+}
+
+// Names the receiver's copy of a file: only the file name counts, so every
+// new version is diffed against the last one sent
+uint32_t deltaBasisId(const std::string &filepath) {
+  std::string name = filepath.substr(filepath.find_last_of("/\\") + 1);
+  uint32_t id =
+      calculateChecksum(ChecksumAlgorithm::XXH64, name.data(), name.size());
+  return id ? id : 1;
+}
+
+// Scratch file the sender encodes a delta (or packs a directory) into: in
+// TMPDIR (or /tmp) where the platform has mkstemp, next to the file
+// otherwise. kind names it ("delta", "tree").
+std::string scratchPath(const std::string &filepath, const std::string &kind) {
+#ifdef HAVE_MMAP
+  const char *dir = std::getenv("TMPDIR");
+  std::string path =
+      std::string(dir && *dir ? dir : "/tmp") + "/udp_" + kind + "_XXXXXX";
+  (void)filepath;
+  int fd = ::mkstemp(&path[0]);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create a " + kind + " file in " +
+                             path);
+  }
+  ::close(fd);
+  return path;
+#else
+  return filepath + "." + kind;
+#endif
+}
+
+// Signatures of the receiver's blocks, hashed on the rolling checksum. It
+// takes 24 bytes per block; with blocks of about sqrt(size) that stays
+// small for any file size.
+class SignatureIndex {
+private:
+  struct Entry {
+    uint32_t weak;
+    uint64_t strong;
+  };
+
+  std::vector<Entry> blocks_;
+  std::vector<uint32_t> heads_; // Bucket -> first block + 1 (0 = empty)
+  std::vector<uint32_t> next_;  // Block -> next block in the bucket + 1
+  int shift_;                   // Hash bits taken from the top
+
+  uint32_t bucket(uint32_t weak) const {
+    return (weak * 0x9E3779B1u) >> shift_;
+  }
+
+public:
+  SignatureIndex() : shift_(31) {}
+
+  // Make room for count signatures; buckets outnumber blocks four to one,
+  // so most windows that match nothing stop at an empty bucket
+  void reset(uint32_t count) {
+    blocks_.assign(count, Entry{0, 0});
+    next_.assign(count, 0);
+    int bits = 10;
+    while (bits < 30 && (uint64_t(1) << bits) < uint64_t(count) * 4) {
+      bits++;
+    }
+    heads_.assign(size_t(1) << bits, 0);
+    shift_ = 32 - bits;
+  }
+
+  uint32_t size() const { return static_cast<uint32_t>(blocks_.size()); }
+
+  void set(uint32_t block, uint32_t weak, uint64_t strong) {
+    blocks_[block] = Entry{weak, strong};
+  }
+
+  // Hash the blocks once every signature is in. Inserting from the back
+  // keeps each bucket in block order.
+  void build() {
+    std::fill(heads_.begin(), heads_.end(), 0);
+    for (uint32_t block = size(); block-- > 0;) {
+      uint32_t b = bucket(blocks_[block].weak);
+      next_[block] = heads_[b];
+      heads_[b] = block + 1;
+    }
+  }
+
+  // Block matching the window at data (with rolling checksum weak), or -1.
+  // The strong hash is only computed once the weak one matches. `preferred`
+  // (the block after the last match) wins, so copy runs stay unbroken.
+  int64_t find(uint32_t weak, const char *data, size_t length,
+               uint32_t preferred) const {
+    if (blocks_.empty()) {
+      return -1;
+    }
+    uint32_t entry = heads_[bucket(weak)];
+    if (entry == 0) {
+      return -1;
+    }
+    bool hashed = false;
+    uint64_t strong = 0;
+    if (preferred < size() && blocks_[preferred].weak == weak) {
+      strong = xxh64(data, length);
+      hashed = true;
+      if (blocks_[preferred].strong == strong) {
+        return preferred;
+      }
+    }
+    for (; entry != 0; entry = next_[entry - 1]) {
+      const Entry &candidate = blocks_[entry - 1];
+      if (candidate.weak != weak) {
+        continue;
+      }
+      if (!hashed) {
+        strong = xxh64(data, length);
+        hashed = true;
+      }
+      if (candidate.strong == strong) {
+        return entry - 1;
+      }
+    }
+    return -1;
+  }
+};
+
+// Fill a signature reply with one page of signatures of the file at path.
+// False when there is no file there with a whole block to diff against.
+bool readSignaturePage(const std::string &path, uint32_t page,
+                       SrSignature &reply) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    return false;
+  }
+  uint64_t size = static_cast<uint64_t>(file.tellg());
+  uint32_t block_size = deltaBlockSize(size);
+  uint64_t blocks = size / block_size;
+  if (blocks == 0 || blocks > UINT32_MAX) {
+    return false;
+  }
+  setControlFileSize(reply, size);
+  reply.block_size = htonl32(block_size);
+
+  uint64_t first = static_cast<uint64_t>(page) * SIGNATURES_PER_PAGE;
+  uint64_t count =
+      first < blocks
+          ? std::min<uint64_t>(SIGNATURES_PER_PAGE, blocks - first)
+          : 0;
+  std::vector<char> block(block_size);
+  file.seekg(static_cast<std::streamoff>(first * block_size), std::ios::beg);
+  for (uint64_t i = 0; i < count; ++i) {
+    if (!file.read(block.data(), block_size)) {
+      return false;
+    }
+    uint64_t strong = xxh64(block.data(), block_size);
+    reply.signatures[i].weak =
+        htonl32(weakChecksum(block.data(), block_size).value());
+    reply.signatures[i].strong_hi =
+        htonl32(static_cast<uint32_t>(strong >> 32));
+    reply.signatures[i].strong_lo = htonl32(static_cast<uint32_t>(strong));
+  }
+  reply.count = static_cast<uint16_t>(count);
+  return true;
+}
+
+// What encoding a delta produced
+struct DeltaSummary {
+  uint64_t matched_bytes; // New file bytes found in the receiver's copy
+  uint64_t literal_bytes; // New file bytes sent as they are
+  uint64_t delta_bytes;   // Size of the delta stream
+};
+
+// Writes delta instructions to a file, merging references to consecutive
+// blocks into one copy
+class DeltaWriter {
+public:
+  static constexpr char MAGIC[8] = {'U', 'D', 'P', 'D', 'L', 'T', '0', '1'};
+
+private:
+  std::string path_;
+  std::ofstream out_;
+  uint32_t run_first_; // Copy run not written yet
+  uint32_t run_count_;
+  uint64_t bytes_;
+
+public:
+  DeltaWriter(const std::string &path, uint64_t new_size,
+              uint32_t block_size, uint64_t basis_size)
+      : path_(path), out_(path, std::ios::binary | std::ios::trunc),
+        run_first_(0), run_count_(0), bytes_(0) {
+    if (!out_) {
+      throw std::runtime_error("Failed to create delta file: " + path);
+    }
+    put(MAGIC, sizeof(MAGIC));
+    put64(new_size);
+    put32(block_size);
+    put64(basis_size);
+  }
+
+  // Reference one block of the basis
+  void copy(uint32_t block) {
+    if (run_count_ > 0 && block == run_first_ + run_count_ &&
+        run_count_ < UINT32_MAX) {
+      run_count_++;
+      return;
+    }
+    flush_run();
+    run_first_ = block;
+    run_count_ = 1;
+  }
+
+  // Bytes the basis does not have
+  void literal(const char *data, size_t length) {
+    if (length == 0) {
+      return;
+    }
+    flush_run();
+    put("L", 1);
+    put32(static_cast<uint32_t>(length));
+    put(data, length);
+  }
+
+  // End the delta; returns its size
+  uint64_t finish() {
+    flush_run();
+    put("E", 1);
+    out_.flush();
+    if (!out_) {
+      throw std::runtime_error("Failed to write delta file: " + path_);
+    }
+    return bytes_;
+  }
+
+private:
+  void flush_run() {
+    if (run_count_ == 0) {
+      return;
+    }
+    put("C", 1);
+    put32(run_first_);
+    put32(run_count_);
+    run_count_ = 0;
+  }
+
+  void put(const char *data, size_t length) {
+    out_.write(data, length);
+    bytes_ += length;
+  }
+
+  void put32(uint32_t value) {
+    value = htonl32(value);
+    put(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  void put64(uint64_t value) {
+    put32(static_cast<uint32_t>(value >> 32));
+    put32(static_cast<uint32_t>(value));
+  }
+};
+
+constexpr char DeltaWriter::MAGIC[8];
+
+// Encode the file behind source as a delta against the receiver's blocks
+// into delta_path. The file is read once through a window buffer that holds
+// at most one literal run and one block beyond it, so memory does not grow
+// with the file.
+DeltaSummary encodeDelta(FileSource &source, const SignatureIndex &index,
+                         uint32_t block_size, uint64_t basis_size,
+                         const std::string &delta_path) {
+  const uint64_t file_size = source.size();
+  DeltaWriter writer(delta_path, file_size, block_size, basis_size);
+  DeltaSummary summary = {0, 0, 0};
+
+  std::vector<char> buffer(4 * 1024 * 1024 + DELTA_MAX_LITERAL +
+                           2 * static_cast<size_t>(block_size));
+  uint64_t buffer_offset = 0; // File offset of buffer[0]
+  size_t filled = 0;          // Bytes in the buffer
+  size_t pos = 0;             // Window start
+  size_t literal = 0;         // Start of the literal run not written yet
+  bool summed = false;        // checksum covers the window at pos
+  RollingChecksum checksum = {0, 0};
+  uint32_t preferred = UINT32_MAX;
+
+  auto flush_literal = [&](size_t end) {
+    writer.literal(buffer.data() + literal, end - literal);
+    summary.literal_bytes += end - literal;
+    literal = end;
+  };
+
+  for (;;) {
+    // Keep the window and the byte after it in the buffer, dropping what
+    // was already encoded
+    if (pos + block_size >= filled && buffer_offset + filled < file_size) {
+      std::memmove(buffer.data(), buffer.data() + literal, filled - literal);
+      buffer_offset += literal;
+      filled -= literal;
+      pos -= literal;
+      literal = 0;
+      size_t n = static_cast<size_t>(std::min<uint64_t>(
+          buffer.size() - filled, file_size - buffer_offset - filled));
+      source.read(buffer_offset + filled, buffer.data() + filled, n);
+      filled += n;
+      source.release(buffer_offset);
+    }
+    if (pos + block_size > filled) {
+      break; // Less than a block left
+    }
+
+    if (!summed) {
+      checksum = weakChecksum(buffer.data() + pos, block_size);
+      summed = true;
+    }
+    int64_t block = index.find(checksum.value(), buffer.data() + pos,
+                               block_size, preferred);
+    if (block >= 0) {
+      flush_literal(pos);
+      writer.copy(static_cast<uint32_t>(block));
+      summary.matched_bytes += block_size;
+      preferred = static_cast<uint32_t>(block) + 1;
+      pos += block_size;
+      literal = pos;
+      summed = false;
+      continue;
+    }
+
+    if (pos + block_size < filled) {
+      checksum.roll(static_cast<uint8_t>(buffer[pos]),
+                    static_cast<uint8_t>(buffer[pos + block_size]),
+                    block_size);
+    }
+    pos++;
+    if (pos - literal >= DELTA_MAX_LITERAL) {
+      flush_literal(pos);
+    }
+  }
+
+  // The tail shorter than a block goes as literals
+  while (literal < filled) {
+    flush_literal(std::min(filled, literal + DELTA_MAX_LITERAL));
+  }
+  summary.delta_bytes = writer.finish();
+  return summary;
+}
+
+// Rebuild a file from the receiver's copy (the basis) and a delta into
+// output_path, streaming both; returns the new file's size. Throws if the
+// delta is malformed or was made against a different copy.
+uint64_t applyDelta(const std::string &delta_path,
+                    const std::string &basis_path,
+                    const std::string &output_path, SyncPolicy sync_policy,
+                    uint64_t sync_interval_bytes) {
+  std::ifstream delta(delta_path, std::ios::binary);
+  if (!delta) {
+    throw std::runtime_error("Failed to open delta file: " + delta_path);
+  }
+  std::ifstream basis(basis_path, std::ios::binary | std::ios::ate);
+  if (!basis) {
+    throw std::runtime_error("Failed to open delta basis: " + basis_path);
+  }
+  uint64_t actual_basis_size = static_cast<uint64_t>(basis.tellg());
+
+  auto get = [&](char *dst, size_t length) {
+    if (!delta.read(dst, length)) {
+      throw std::runtime_error("Truncated delta file: " + delta_path);
+    }
+  };
+  auto get32 = [&]() {
+    uint32_t value;
+    get(reinterpret_cast<char *>(&value), sizeof(value));
+    return ntohl32(value);
+  };
+  auto get64 = [&]() {
+    uint64_t high = get32();
+    return (high << 32) | get32();
+  };
+
+  char magic[8];
+  get(magic, sizeof(magic));
+  if (std::memcmp(magic, DeltaWriter::MAGIC, sizeof(magic)) != 0) {
+    throw std::runtime_error("Not a delta file: " + delta_path);
+  }
+  uint64_t new_size = get64();
+  uint32_t block_size = get32();
+  uint64_t basis_size = get64();
+  if (basis_size != actual_basis_size ||
+      block_size != deltaBlockSize(basis_size)) {
+    throw std::runtime_error("Delta was made against another copy of " +
+                             basis_path);
+  }
+  uint64_t blocks = basis_size / block_size;
+
+  FileSink sink(output_path, sync_policy, sync_interval_bytes);
+  std::vector<char> buffer(
+      std::max<size_t>(DELTA_MAX_LITERAL,
+                       std::max<size_t>(1, 1024 * 1024 / block_size) *
+                           block_size));
+  uint64_t offset = 0;
+  for (;;) {
+    char op;
+    get(&op, 1);
+    if (op == 'E') {
+      break;
+    }
+    if (op == 'C') {
+      uint64_t first = get32();
+      uint64_t count = get32();
+      if (first + count > blocks ||
+          offset + count * block_size > new_size) {
+        throw std::runtime_error("Bad block reference in delta file: " +
+                                 delta_path);
+      }
+      basis.seekg(static_cast<std::streamoff>(first * block_size),
+                  std::ios::beg);
+      uint64_t remaining = count * block_size;
+      while (remaining > 0) {
+        size_t n =
+            static_cast<size_t>(std::min<uint64_t>(buffer.size(), remaining));
+        if (!basis.read(buffer.data(), n)) {
+          throw std::runtime_error("Failed to read delta basis: " +
+                                   basis_path);
+        }
+        sink.write(offset, buffer.data(), n);
+        offset += n;
+        remaining -= n;
+      }
+    } else if (op == 'L') {
+      uint32_t length = get32();
+      if (length > buffer.size() || offset + length > new_size) {
+        throw std::runtime_error("Bad literal in delta file: " + delta_path);
+      }
+      get(buffer.data(), length);
+      sink.write(offset, buffer.data(), length);
+      offset += length;
+    } else {
+      throw std::runtime_error("Bad instruction in delta file: " +
+                               delta_path);
+    }
+  }
+  if (offset != new_size) {
+    throw std::runtime_error("Delta file does not cover the whole file: " +
+                             delta_path);
+  }
+  sink.finish(new_size);
+  return new_size;
+}
+
+// ---- Compressed transfers ----
+//
+// The file is cut into COMPRESS_BLOCK-byte blocks, each encoded on its own
+// as a frame so that blocks compress and decompress in parallel. The frames
+// go back to back as the transfer's payload stream:
+//
+//   raw size (4), stored size (4), method (1), stored bytes
+//
+// in network byte order. FRAME_ZLIB frames hold a zlib stream; blocks that
+// do not compress are sent as FRAME_STORED so the receiver skips them.
+
+#pragma pack(push, 1)
+struct FrameHeader {
+  uint32_t raw_size;    // File bytes in the block (network order)
+  uint32_t stored_size; // Bytes that follow the header (network order)
+  uint8_t method;       // FRAME_STORED or FRAME_ZLIB
+};
+#pragma pack(pop)
+
+// Fixed set of threads running queued jobs in any order. Jobs must not
+// throw. The destructor runs whatever is still queued, then joins.
+class WorkerPool {
+private:
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<std::function<void()>> jobs_;
+  bool stopping_;
+
+public:
+  // threads <= 0 starts one per core
+  explicit WorkerPool(int threads) : stopping_(false) {
+    if (threads <= 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (int i = 0; i < threads; ++i) {
+      threads_.emplace_back(&WorkerPool::run, this);
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  int size() const { return static_cast<int>(threads_.size()); }
+
+  void submit(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(std::move(job));
+    }
+    wake_.notify_one();
+  }
+
+private:
+  void run() {
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+          return;
+        }
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      job();
+    }
+  }
+};
+
+// Encode one block as a frame. A block whose first COMPRESS_PROBE bytes do
+// not shrink by a sixteenth is stored without trying the rest, as is one
+// the whole attempt saves less than a thirty-second of: inflating it would
+// cost the receiver more than the bytes saved. Returns the method used.
+uint8_t encodeFrame(const char *raw, size_t raw_size,
+                    std::vector<char> &frame) {
+  uLong bound = ::compressBound(static_cast<uLong>(raw_size));
+  frame.resize(sizeof(FrameHeader) + std::max<size_t>(bound, raw_size));
+  Bytef *out = reinterpret_cast<Bytef *>(frame.data() + sizeof(FrameHeader));
+  const Bytef *in = reinterpret_cast<const Bytef *>(raw);
+
+  bool worth_trying = true;
+  if (raw_size > COMPRESS_PROBE) {
+    uLongf probe = bound;
+    worth_trying = ::compress2(out, &probe, in, COMPRESS_PROBE,
+                               COMPRESS_LEVEL) == Z_OK &&
+                   probe < COMPRESS_PROBE - COMPRESS_PROBE / 16;
+  }
+
+  uint8_t method = FRAME_STORED;
+  size_t stored_size = raw_size;
+  if (worth_trying) {
+    uLongf length = bound;
+    if (::compress2(out, &length, in, static_cast<uLong>(raw_size),
+                    COMPRESS_LEVEL) == Z_OK &&
+        length < raw_size - raw_size / 32) {
+      method = FRAME_ZLIB;
+      stored_size = length;
+    }
+  }
+  if (method == FRAME_STORED) {
+    std::memcpy(out, raw, raw_size);
+  }
+
+  FrameHeader header;
+  header.raw_size = htonl32(static_cast<uint32_t>(raw_size));
+  header.stored_size = htonl32(static_cast<uint32_t>(stored_size));
+  header.method = method;
+  std::memcpy(frame.data(), &header, sizeof(header));
+  frame.resize(sizeof(FrameHeader) + stored_size);
+  return method;
+}
+
+// Sender side of a compressed transfer: workers compress blocks a bounded
+// distance ahead of the send window, and the window takes the frame stream
+// in packet-sized pieces, in order. Memory is a ring of two frames per
+// worker, whatever the file size.
+class BlockCompressor {
+private:
+  struct Slot {
+    std::vector<char> frame;
+    bool done; // Built and not yet handed out completely
+  };
+
+  FileSource &source_;
+  std::mutex source_mutex_; // Chunked FileSource reads are not thread-safe
+  uint64_t blocks_;
+  std::vector<Slot> slots_; // Block b is built in slot b % slots_.size()
+
+  std::mutex mutex_;
+  uint64_t next_block_;   // Next block to hand to a worker
+  uint64_t head_block_;   // Block being handed out
+  size_t head_offset_;    // Bytes of the head frame already handed out
+  uint64_t raw_taken_;    // File bytes of the blocks handed out
+  uint64_t stream_bytes_; // Frame bytes handed out
+  uint64_t stored_blocks_; // Blocks that went out uncompressed
+  bool waiting_;           // The sender is waiting on a frame
+  bool cancelled_;         // Being destroyed: skip queued blocks
+  std::string error_;      // A block could not be read
+  std::function<void()> on_ready_;
+
+  WorkerPool pool_; // Last: joined before the slots go away
+
+public:
+  // threads <= 0 uses one per core
+  BlockCompressor(FileSource &source, int threads)
+      : source_(source),
+        blocks_((source.size() + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK),
+        next_block_(0), head_block_(0), head_offset_(0), raw_taken_(0),
+        stream_bytes_(0), stored_blocks_(0), waiting_(false),
+        cancelled_(false), pool_(threads) {
+    slots_.resize(2 * pool_.size() + 2);
+    for (Slot &slot : slots_) {
+      slot.done = false;
+    }
+  }
+
+  ~BlockCompressor() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+  }
+
+  BlockCompressor(const BlockCompressor &) = delete;
+  BlockCompressor &operator=(const BlockCompressor &) = delete;
+
+  // Upper bound on the frame stream's size, for a file of file_size bytes
+  static uint64_t maxStreamBytes(uint64_t file_size) {
+    return file_size + (file_size + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK *
+                           sizeof(FrameHeader);
+  }
+
+  // Start compressing. on_ready is called from a worker thread whenever a
+  // frame ready() was waiting for has been built.
+  void start(std::function<void()> on_ready) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    on_ready_ = std::move(on_ready);
+    refill();
+  }
+
+  // Whether take() can fill length bytes or end the stream. If not, the
+  // ready callback fires once more frames are built. Throws if a block
+  // could not be read.
+  bool ready(size_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_.empty()) {
+      throw std::runtime_error("Compression failed: " + error_);
+    }
+    size_t available = 0;
+    for (uint64_t block = head_block_; block < next_block_; ++block) {
+      const Slot &slot = slots_[block % slots_.size()];
+      if (!slot.done) {
+        break;
+      }
+      available += slot.frame.size();
+      if (block == head_block_) {
+        available -= head_offset_;
+      }
+      if (available >= length || block + 1 == blocks_) {
+        return true;
+      }
+    }
+    if (head_block_ == blocks_) {
+      return true;
+    }
+    waiting_ = true;
+    return false;
+  }
+
+  // Copy up to length bytes of the frame stream to dst; call only after
+  // ready(length). last is set when the stream ends with these bytes.
+  size_t take(char *dst, size_t length, bool &last) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t taken = 0;
+    while (taken < length && head_block_ < blocks_) {
+      Slot &slot = slots_[head_block_ % slots_.size()];
+      if (!slot.done) {
+        break;
+      }
+      size_t n = std::min(length - taken, slot.frame.size() - head_offset_);
+      std::memcpy(dst + taken, slot.frame.data() + head_offset_, n);
+      taken += n;
+      head_offset_ += n;
+      if (head_offset_ == slot.frame.size()) {
+        slot.done = false;
+        raw_taken_ += std::min<uint64_t>(
+            COMPRESS_BLOCK, source_.size() - head_block_ * COMPRESS_BLOCK);
+        head_block_++;
+        head_offset_ = 0;
+        refill();
+      }
+    }
+    stream_bytes_ += taken;
+    last = head_block_ == blocks_;
+    return taken;
+  }
+
+  int threads() const { return pool_.size(); }
+  uint64_t blocks() const { return blocks_; }
+
+  // File bytes whose frames have been handed out
+  uint64_t rawBytesTaken() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return raw_taken_;
+  }
+
+  uint64_t streamBytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stream_bytes_;
+  }
+
+  uint64_t storedBlocks() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stored_blocks_;
+  }
+
+private:
+  // Keep every free slot busy (mutex_ held)
+  void refill() {
+    while (next_block_ < blocks_ &&
+           next_block_ - head_block_ < slots_.size()) {
+      uint64_t block = next_block_++;
+      pool_.submit([this, block]() { build(block); });
+    }
+  }
+
+  // Worker: read and encode one block into its slot
+  void build(uint64_t block) {
+    Slot &slot = slots_[block % slots_.size()];
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (cancelled_) {
+        return;
+      }
+    }
+
+    uint64_t offset = block * COMPRESS_BLOCK;
+    size_t raw_size = static_cast<size_t>(
+        std::min<uint64_t>(COMPRESS_BLOCK, source_.size() - offset));
+    thread_local std::vector<char> raw;
+    raw.resize(raw_size);
+    uint8_t method = FRAME_STORED;
+    std::string error;
+    try {
+      {
+        std::lock_guard<std::mutex> lock(source_mutex_);
+        source_.read(offset, raw.data(), raw_size);
+      }
+      method = encodeFrame(raw.data(), raw_size, slot.frame);
+    } catch (const std::exception &e) {
+      error = e.what(); // The file shrank under us
+    }
+
+    std::function<void()> wake;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!error.empty()) {
+        error_ = error;
+      } else {
+        slot.done = true;
+        if (method == FRAME_STORED) {
+          stored_blocks_++;
+        }
+      }
+      if (waiting_) {
+        waiting_ = false;
+        wake = on_ready_;
+      }
+    }
+    if (wake) {
+      wake();
+    }
+  }
+};
+
+// Receiver side of a compressed transfer: takes the frame stream in order
+// and hands each complete frame to the worker pool, which inflates it and
+// writes the block at its file offset. At most two frames per worker are
+// queued; feed() waits for the pool beyond that. Without a pool frames are
+// decoded inline.
+class FrameDecoder {
+private:
+  FileSink *sink_;   // Null when no output file is written
+  WorkerPool *pool_;
+  size_t max_pending_;
+
+  // Frame being collected (network thread only)
+  char header_[sizeof(FrameHeader)];
+  size_t header_have_;
+  FrameHeader frame_header_; // Host byte order once complete
+  std::shared_ptr<std::vector<char>> frame_;
+  size_t frame_have_;
+  uint64_t raw_offset_;   // File offset of the frame being collected
+  uint64_t stream_bytes_; // Frame stream bytes fed so far
+  bool corrupt_;
+
+  std::mutex sink_mutex_;
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  size_t pending_;    // Frames queued or being decoded
+  std::string error_; // First failure
+
+public:
+  FrameDecoder(FileSink *sink, WorkerPool *pool)
+      : sink_(sink), pool_(pool), max_pending_(pool ? 2 * pool->size() : 1),
+        header_have_(0), frame_header_(), frame_have_(0), raw_offset_(0),
+        stream_bytes_(0), corrupt_(false), pending_(0) {}
+
+  ~FrameDecoder() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this]() { return pending_ == 0; });
+  }
+
+  FrameDecoder(const FrameDecoder &) = delete;
+  FrameDecoder &operator=(const FrameDecoder &) = delete;
+
+  // Memory a decoder can hold, to charge to the session budget
+  static size_t footprint(const WorkerPool *pool) {
+    size_t frames = pool ? 2 * pool->size() : 1;
+    return sizeof(FrameDecoder) + (frames + 1) * 2 * COMPRESS_BLOCK;
+  }
+
+  uint64_t streamBytes() const { return stream_bytes_; }
+
+  // Take the next bytes of the frame stream
+  void feed(const char *data, size_t len) {
+    stream_bytes_ += len;
+    while (len > 0 && !corrupt_) {
+      if (header_have_ < sizeof(FrameHeader)) {
+        size_t n = std::min(len, sizeof(FrameHeader) - header_have_);
+        std::memcpy(header_ + header_have_, data, n);
+        header_have_ += n;
+        data += n;
+        len -= n;
+        if (header_have_ < sizeof(FrameHeader) || !start_frame()) {
+          continue;
+        }
+      }
+      size_t n = std::min<size_t>(len, frame_header_.stored_size - frame_have_);
+      std::memcpy(frame_->data() + frame_have_, data, n);
+      frame_have_ += n;
+      data += n;
+      len -= n;
+      if (frame_have_ == frame_header_.stored_size) {
+        submit();
+      }
+    }
+  }
+
+  // Wait for the last frames to be written; returns the file size. Throws
+  // if the stream was corrupt or ended inside a frame.
+  uint64_t finish() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this]() { return pending_ == 0; });
+    if (!error_.empty()) {
+      throw std::runtime_error(error_);
+    }
+    if (header_have_ > 0) {
+      throw std::runtime_error("Compressed stream ends inside a frame");
+    }
+    return raw_offset_;
+  }
+
+private:
+  // A frame header is complete: check it and make room for the frame
+  bool start_frame() {
+    std::memcpy(&frame_header_, header_, sizeof(FrameHeader));
+    frame_header_.raw_size = ntohl32(frame_header_.raw_size);
+    frame_header_.stored_size = ntohl32(frame_header_.stored_size);
+    const FrameHeader &h = frame_header_;
+    if (h.raw_size == 0 || h.raw_size > COMPRESS_BLOCK ||
+        h.stored_size == 0 ||
+        h.stored_size > ::compressBound(h.raw_size) ||
+        (h.method == FRAME_STORED && h.stored_size != h.raw_size) ||
+        (h.method != FRAME_STORED && h.method != FRAME_ZLIB)) {
+      corrupt_ = true;
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = "Corrupt frame header at file offset " +
+               std::to_string(raw_offset_);
+      return false;
+    }
+    frame_ = std::make_shared<std::vector<char>>(h.stored_size);
+    frame_have_ = 0;
+    return true;
+  }
+
+  // Queue the collected frame, once the pool has room for it
+  void submit() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_.wait(lock, [this]() { return pending_ < max_pending_; });
+      pending_++;
+    }
+    std::shared_ptr<std::vector<char>> frame = std::move(frame_);
+    uint8_t method = frame_header_.method;
+    uint32_t raw_size = frame_header_.raw_size;
+    uint64_t offset = raw_offset_;
+    raw_offset_ += raw_size;
+    header_have_ = 0;
+
+    auto job = [this, frame, method, raw_size, offset]() {
+      decode(*frame, method, raw_size, offset);
+    };
+    if (pool_) {
+      pool_->submit(job);
+    } else {
+      job();
+    }
+  }
+
+  // Worker: inflate one frame and write its block
+  void decode(const std::vector<char> &frame, uint8_t method,
+              uint32_t raw_size, uint64_t offset) {
+    std::string error;
+    try {
+      const char *raw = frame.data();
+      std::vector<char> buffer;
+      if (method == FRAME_ZLIB) {
+        buffer.resize(raw_size);
+        uLongf length = raw_size;
+        if (::uncompress(reinterpret_cast<Bytef *>(buffer.data()), &length,
+                         reinterpret_cast<const Bytef *>(frame.data()),
+                         static_cast<uLong>(frame.size())) != Z_OK ||
+            length != raw_size) {
+          throw std::runtime_error("Corrupt compressed block at file offset " +
+                                   std::to_string(offset));
+        }
+        raw = buffer.data();
+      }
+      if (sink_) {
+        std::lock_guard<std::mutex> lock(sink_mutex_);
+        sink_->write(offset, raw, raw_size);
+      }
+    } catch (const std::exception &e) {
+      error = e.what();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error.empty() && error_.empty()) {
+      error_ = error;
+    }
+    pending_--;
+    idle_.notify_all();
+  }
+};
+
+// Compare two data buffers and report differences
+bool verifyData(const std::vector<char> &original,
+                const std::vector<char> &received) {
+  if (original.size() != received.size()) {
+    std::cout << "Data size mismatch: original=" << original.size()
+              << " bytes, received=" << received.size() << " bytes"
+              << std::endl;
+    return false;
+  }
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < original.size(); ++i) {
+    if (original[i] != received[i]) {
+      if (mismatches < 10) { // Only show the first 10 mismatches
+        std::cout << "Data mismatch at position " << i << ": original=0x"
+                  << std::hex << (int)(unsigned char)original[i]
+                  << ", received=0x" << (int)(unsigned char)received[i]
+                  << std::dec << std::endl;
+      }
+      mismatches++;
+    }
+  }
+
+  if (mismatches > 0) {
+    std::cout << "Total data mismatches: " << mismatches << " bytes ("
+              << (mismatches * 100.0 / original.size()) << "%)" << std::endl;
+    return false;
+  }
+
+  std::cout << "Data verification successful: all " << original.size()
+            << " bytes match" << std::endl;
+  return true;
+}
+
+// ---- Directory transfers ----
+//
+// A directory goes as one pack plus one transfer per large file. The pack
+// is the tree's index with the small files inline, every entry as
+//
+//   kind (1), path length (2), path, size (8), mode (4), mtime (8),
+//   checksum (8), transfer ID (4), then size content bytes for TREE_PACKED
+//
+// in network byte order, after a magic and the entry count. Paths are
+// relative and start with the name of the directory sent; entries are
+// sorted by path, so a directory comes before what it holds. mtime is in
+// nanoseconds and the checksum is the XXH64 of the contents. TREE_SEPARATE
+// entries name the transfer that carried the file, which the sender
+// completes before the pack; the receiver unpacks the tree once the pack is
+// complete.
+
+constexpr uint8_t TREE_DIRECTORY = 0; // Directory, no contents
+constexpr uint8_t TREE_PACKED = 1;    // Small file, contents inline
+constexpr uint8_t TREE_SEPARATE = 2;  // Large file, sent on its own
+constexpr char TREE_MAGIC[8] = {'U', 'D', 'P', 'T', 'R', 'E', '0', '1'};
+
+// One directory or regular file of a directory transfer
+struct TreeEntry {
+  uint8_t kind;         // TREE_DIRECTORY, TREE_PACKED or TREE_SEPARATE
+  std::string path;     // Relative, '/'-separated
+  uint64_t size;        // File size (0 for directories)
+  uint32_t mode;        // Permission bits
+  int64_t mtime_ns;     // Modification time
+  uint64_t checksum;    // XXH64 of the contents (files only)
+  uint32_t transfer_id; // TREE_SEPARATE: the transfer carrying the file
+
+  // Bytes of the entry's header in the pack
+  size_t headerSize() const { return 35 + path.size(); }
+};
+
+// What a directory transfer covered
+struct TreeSummary {
+  uint64_t files;       // Regular files
+  uint64_t directories;
+  uint64_t file_bytes;  // Their contents
+  uint64_t separate;    // Files sent (or received) on their own
+  uint64_t pack_bytes;  // Size of the pack
+};
+
+// Whether path names a directory
+bool isDirectory(const std::string &path) {
+#ifdef HAVE_MMAP
+  struct stat st;
+  return ::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#else
+  (void)path;
+  return false;
+#endif
+}
+
+// Create path as a directory, along with any missing parents; throws if
+// some part of it exists and is not a directory
+void makeDirectories(const std::string &path) {
+#ifdef HAVE_MMAP
+  size_t end = 0;
+  do {
+    end = path.find('/', end + 1);
+    std::string prefix = path.substr(0, end);
+    if (::mkdir(prefix.c_str(), 0755) != 0 &&
+        !(errno == EEXIST && isDirectory(prefix))) {
+      throw std::runtime_error("Failed to create directory: " + prefix);
+    }
+  } while (end != std::string::npos);
+#else
+  throw std::runtime_error("Cannot create directory here: " + path);
+#endif
+}
+
+// What a walked entry that is neither a file nor a directory is
+const char *oddFileKind(mode_t mode) {
+#ifdef HAVE_MMAP
+  if (S_ISLNK(mode)) {
+    return "symbolic link";
+  }
+  if (S_ISFIFO(mode)) {
+    return "FIFO";
+  }
+  if (S_ISSOCK(mode)) {
+    return "socket";
+  }
+  if (S_ISCHR(mode) || S_ISBLK(mode)) {
+    return "device";
+  }
+#else
+  (void)mode;
+#endif
+  return "special file";
+}
+
+// Why a pack path is not safe to create under the output directory, or
+// an empty string if it is: relative, at most TREE_MAX_PATH bytes, with no
+// NUL or backslash and no empty, "." or ".." component
+std::string treePathProblem(const std::string &path) {
+  if (path.empty()) {
+    return "empty path";
+  }
+  if (path.size() > TREE_MAX_PATH) {
+    return "path longer than " + std::to_string(TREE_MAX_PATH) + " bytes";
+  }
+  if (path[0] == '/') {
+    return "absolute path";
+  }
+  if (path.find('\0') != std::string::npos) {
+    return "NUL in name";
+  }
+  if (path.find('\\') != std::string::npos) {
+    return "backslash in name";
+  }
+  size_t start = 0;
+  for (;;) {
+    size_t end = path.find('/', start);
+    std::string part = path.substr(start, end - start);
+    if (part.empty() || part == "." || part == "..") {
+      return "empty, . or .. component";
+    }
+    if (end == std::string::npos) {
+      return "";
+    }
+    start = end + 1;
+  }
+}
+
+// List the tree under root with TREE_WALK_THREADS readers sharing a queue
+// of directories, each stat-ing its own entries; paths start with the
+// root's name, and parent is set to the directory holding the root. Files
+// over TREE_LARGE_FILE are marked TREE_SEPARATE. Anything but regular files
+// and directories (links, devices), and any entry whose path the receiver
+// would refuse, is skipped and listed in skipped as "path: reason", sorted
+// by path.
+std::vector<TreeEntry> walkTree(const std::string &root, std::string &parent,
+                                std::vector<std::string> &skipped) {
+#ifdef HAVE_MMAP
+  char resolved[PATH_MAX];
+  if (!::realpath(root.c_str(), resolved) || !isDirectory(resolved)) {
+    throw std::runtime_error("Not a directory: " + root);
+  }
+  std::string base = resolved;
+  std::string name = base.substr(base.find_last_of('/') + 1);
+  if (name.empty()) {
+    throw std::runtime_error("Cannot send the root directory");
+  }
+  std::string problem = treePathProblem(name);
+  if (!problem.empty()) {
+    throw std::runtime_error("Cannot send " + root + ": " + problem);
+  }
+  parent = base.substr(0, base.size() - name.size());
+
+  struct stat st;
+  ::stat(base.c_str(), &st);
+  auto entryFor = [](uint8_t kind, const std::string &path,
+                     const struct stat &info) {
+    TreeEntry entry;
+    entry.kind = kind;
+    entry.path = path;
+    entry.size = kind == TREE_DIRECTORY ? 0 : info.st_size;
+    entry.mode = info.st_mode & 07777;
+#if defined(__linux__)
+    entry.mtime_ns = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 +
+                     info.st_mtim.tv_nsec;
+#else
+    entry.mtime_ns = static_cast<int64_t>(info.st_mtime) * 1000000000;
+#endif
+    entry.checksum = 0;
+    entry.transfer_id = 0;
+    return entry;
+  };
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::vector<TreeEntry> entries(1, entryFor(TREE_DIRECTORY, name, st));
+  std::vector<std::string> pending(1, name); // Directories not read yet
+  int busy = 0;                              // Directories being read
+  std::string error;
+  skipped.clear();
+
+  auto walker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [&]() { return !pending.empty() || busy == 0; });
+      if (pending.empty()) {
+        return; // Nothing queued and nobody left to queue more
+      }
+      std::string dir = pending.back();
+      pending.pop_back();
+      busy++;
+      lock.unlock();
+
+      std::vector<TreeEntry> found;
+      std::vector<std::string> subdirs;
+      std::vector<std::string> odd;
+      std::string failure;
+      std::string full = base + dir.substr(name.size());
+      DIR *handle = ::opendir(full.c_str());
+      if (!handle) {
+        failure = "Failed to read directory: " + full;
+      } else {
+        while (struct dirent *item = ::readdir(handle)) {
+          if (std::strcmp(item->d_name, ".") == 0 ||
+              std::strcmp(item->d_name, "..") == 0) {
+            continue;
+          }
+          std::string path = dir + "/" + item->d_name;
+          struct stat info;
+          if (::fstatat(::dirfd(handle), item->d_name, &info,
+                        AT_SYMLINK_NOFOLLOW) != 0) {
+            failure = "Failed to stat " + full + "/" + item->d_name;
+            break;
+          }
+          std::string problem = treePathProblem(path);
+          if (!problem.empty()) {
+            odd.push_back(path + ": " + problem);
+          } else if (S_ISDIR(info.st_mode)) {
+            found.push_back(entryFor(TREE_DIRECTORY, path, info));
+            subdirs.push_back(path);
+          } else if (S_ISREG(info.st_mode)) {
+            found.push_back(entryFor(static_cast<uint64_t>(info.st_size) >
+                                             TREE_LARGE_FILE
+                                         ? TREE_SEPARATE
+                                         : TREE_PACKED,
+                                     path, info));
+          } else {
+            odd.push_back(path + ": " + oddFileKind(info.st_mode) +
+                          ", neither a file nor a directory");
+          }
+        }
+        ::closedir(handle);
+      }
+
+      lock.lock();
+      busy--;
+      entries.insert(entries.end(), found.begin(), found.end());
+      pending.insert(pending.end(), subdirs.begin(), subdirs.end());
+      skipped.insert(skipped.end(), odd.begin(), odd.end());
+      if (!failure.empty() && error.empty()) {
+        error = failure;
+      }
+      wake.notify_all();
+    }
+  };
+
+  std::vector<std::thread> walkers;
+  for (int i = 0; i < TREE_WALK_THREADS; ++i) {
+    walkers.emplace_back(walker);
+  }
+  for (std::thread &thread : walkers) {
+    thread.join();
+  }
+  if (!error.empty()) {
+    throw std::runtime_error(error);
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const TreeEntry &a, const TreeEntry &b) {
+              return a.path < b.path;
+            });
+  std::sort(skipped.begin(), skipped.end());
+  return entries;
+#else
+  (void)root;
+  (void)parent;
+  (void)skipped;
+  throw std::runtime_error("Directory transfers are not supported here");
+#endif
+}
+
+// Serialize an entry's header into out
+void putTreeHeader(const TreeEntry &entry, std::vector<char> &out) {
+  auto put = [&](const void *data, size_t length) {
+    const char *bytes = static_cast<const char *>(data);
+    out.insert(out.end(), bytes, bytes + length);
+  };
+  auto put32 = [&](uint32_t value) {
+    value = htonl32(value);
+    put(&value, sizeof(value));
+  };
+  auto put64 = [&](uint64_t value) {
+    put32(static_cast<uint32_t>(value >> 32));
+    put32(static_cast<uint32_t>(value));
+  };
+  put(&entry.kind, 1);
+  out.push_back(static_cast<char>(entry.path.size() >> 8));
+  out.push_back(static_cast<char>(entry.path.size()));
+  put(entry.path.data(), entry.path.size());
+  put64(entry.size);
+  put32(entry.mode);
+  put64(static_cast<uint64_t>(entry.mtime_ns));
+  put64(entry.checksum);
+  put32(entry.transfer_id);
+}
+
+// Build the pack of a tree listed by walkTree, under parent, into
+// pack_path. Every entry's offset follows from the sizes alone, so the
+// files are read, checksummed and written to the pack on a worker pool in
+// any order. Large files are only read for their checksum. Throws if a file
+// changed size since the walk.
+TreeSummary writeTreePack(const std::string &parent,
+                          std::vector<TreeEntry> &entries,
+                          const std::string &pack_path) {
+  TreeSummary summary = {0, 0, 0, 0, 0};
+  std::vector<uint64_t> offsets(entries.size());
+  uint64_t offset = sizeof(TREE_MAGIC) + 8;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const TreeEntry &entry = entries[i];
+    offsets[i] = offset;
+    offset += entry.headerSize() + (entry.kind == TREE_PACKED ? entry.size
+                                                               : 0);
+    if (entry.kind == TREE_DIRECTORY) {
+      summary.directories++;
+    } else {
+      summary.files++;
+      summary.file_bytes += entry.size;
+      summary.separate += entry.kind == TREE_SEPARATE;
+    }
+  }
+  summary.pack_bytes = offset;
+
+  FileSink sink(pack_path, SyncPolicy::NONE);
+  std::mutex sink_mutex;
+  std::vector<char> header(TREE_MAGIC, TREE_MAGIC + sizeof(TREE_MAGIC));
+  uint64_t count = entries.size();
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    header.push_back(static_cast<char>(count >> shift));
+  }
+  sink.write(0, header.data(), header.size());
+
+  std::atomic<size_t> failures(0);
+  std::string first_error;
+  {
+    WorkerPool readers(0);
+    for (size_t i = 0; i < entries.size(); ++i) {
+      readers.submit([&, i]() {
+        TreeEntry &entry = entries[i];
+        try {
+          std::vector<char> record;
+          if (entry.kind == TREE_PACKED) {
+            std::vector<char> data(entry.size);
+            std::ifstream file(parent + entry.path, std::ios::binary);
+            if (!file.read(data.data(), data.size()) ||
+                file.peek() != std::ifstream::traits_type::eof()) {
+              throw std::runtime_error("File changed while packing: " +
+                                       parent + entry.path);
+            }
+            entry.checksum = xxh64(data.data(), data.size());
+            record.reserve(entry.headerSize() + data.size());
+            putTreeHeader(entry, record);
+            record.insert(record.end(), data.begin(), data.end());
+          } else {
+            if (entry.kind == TREE_SEPARATE) {
+              FileSource source(parent + entry.path);
+              const char *data = source.span(0, source.size());
+              if (source.size() != entry.size || !data) {
+                throw std::runtime_error("File changed while packing: " +
+                                         parent + entry.path);
+              }
+              entry.checksum = xxh64(data, source.size());
+            }
+            putTreeHeader(entry, record);
+          }
+          std::lock_guard<std::mutex> lock(sink_mutex);
+          sink.write(offsets[i], record.data(), record.size());
+        } catch (const std::exception &e) {
+          std::lock_guard<std::mutex> lock(sink_mutex);
+          if (failures++ == 0) {
+            first_error = e.what();
+          }
+        }
+      });
+    }
+  }
+  if (failures > 0) {
+    throw std::runtime_error(first_error);
+  }
+  sink.finish(summary.pack_bytes);
+  return summary;
+}
+
+// Where the receiver keeps the pack (suffix ".pack") or a large file
+// (".part") of a directory transfer until the tree is unpacked
+std::string treeTransferPath(const std::string &directory,
+                             uint32_t transfer_id, const char *suffix) {
+  std::ostringstream name;
+  name << directory << "/tree_" << std::hex << transfer_id << suffix;
+  return name.str();
+}
+
+// Rebuild the tree from a received pack under directory: directories
+// first, in order, then the files on a pool of writers, each file written
+// whole (or its part file moved into place) and given its permission bits
+// (never setuid, setgid or sticky) and mtime, then the directories' own,
+// deepest first. Every file is checked against its checksum. Throws if the
+// pack is malformed or any file failed; the files that made it stay.
+TreeSummary unpackTree(const std::string &pack_path,
+                       const std::string &directory, SyncPolicy sync_policy) {
+#ifdef HAVE_MMAP
+  TreeSummary summary = {0, 0, 0, 0, 0};
+  FileSource pack(pack_path);
+  summary.pack_bytes = pack.size();
+  const char *data = pack.span(0, pack.size());
+  if (!data || pack.size() < sizeof(TREE_MAGIC) + 8 ||
+      std::memcmp(data, TREE_MAGIC, sizeof(TREE_MAGIC)) != 0) {
+    throw std::runtime_error("Not a directory pack: " + pack_path);
+  }
+
+  // Parse the index; contents stay in the mapping
+  uint64_t offset = sizeof(TREE_MAGIC);
+  auto need = [&](uint64_t length) {
+    if (pack.size() - offset < length) {
+      throw std::runtime_error("Truncated directory pack: " + pack_path);
+    }
+  };
+  auto get32 = [&]() {
+    need(4);
+    uint32_t value;
+    std::memcpy(&value, data + offset, sizeof(value));
+    offset += sizeof(value);
+    return ntohl32(value);
+  };
+  auto get64 = [&]() {
+    uint64_t high = get32();
+    return (high << 32) | get32();
+  };
+  uint64_t count = get64();
+  std::vector<TreeEntry> entries;
+  std::vector<uint64_t> contents; // Offset of each entry's inline contents
+  while (entries.size() < count) {
+    TreeEntry entry;
+    need(3);
+    entry.kind = static_cast<uint8_t>(data[offset]);
+    size_t length = static_cast<uint8_t>(data[offset + 1]) << 8 |
+                    static_cast<uint8_t>(data[offset + 2]);
+    offset += 3;
+    need(length);
+    entry.path.assign(data + offset, length);
+    offset += length;
+    entry.size = get64();
+    // Only permission bits: a sender must not plant setuid, setgid or
+    // sticky files on the receiver
+    entry.mode = get32() & 0777;
+    entry.mtime_ns = static_cast<int64_t>(get64());
+    entry.checksum = get64();
+    entry.transfer_id = get32();
+    if (entry.kind > TREE_SEPARATE || !treePathProblem(entry.path).empty() ||
+        (entries.empty() && entry.kind != TREE_DIRECTORY)) {
+      throw std::runtime_error("Bad entry in directory pack: " + entry.path);
+    }
+    contents.push_back(offset);
+    if (entry.kind == TREE_PACKED) {
+      need(entry.size);
+      offset += entry.size;
+    }
+    entries.push_back(entry);
+  }
+
+  auto applyTimes = [](const std::string &path, const TreeEntry &entry) {
+    struct timespec times[2];
+    times[0].tv_sec = static_cast<time_t>(entry.mtime_ns / 1000000000);
+    times[0].tv_nsec = static_cast<long>(entry.mtime_ns % 1000000000);
+    times[1] = times[0];
+    ::chmod(path.c_str(), entry.mode);
+    ::utimensat(AT_FDCWD, path.c_str(), times, 0);
+  };
+
+  for (const TreeEntry &entry : entries) {
+    if (entry.kind != TREE_DIRECTORY) {
+      continue;
+    }
+    std::string path = directory + "/" + entry.path;
+    if (::mkdir(path.c_str(), 0755) != 0 &&
+        !(errno == EEXIST && isDirectory(path))) {
+      throw std::runtime_error("Failed to create directory: " + path);
+    }
+    summary.directories++;
+  }
+
+  std::mutex mutex;
+  std::atomic<size_t> failures(0);
+  std::string first_error;
+  {
+    WorkerPool writers(0);
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (entries[i].kind == TREE_DIRECTORY) {
+        continue;
+      }
+      summary.files++;
+      summary.file_bytes += entries[i].size;
+      summary.separate += entries[i].kind == TREE_SEPARATE;
+      writers.submit([&, i]() {
+        const TreeEntry &entry = entries[i];
+        std::string path = directory + "/" + entry.path;
+        try {
+          if (entry.kind == TREE_PACKED) {
+            const char *bytes = data + contents[i];
+            if (xxh64(bytes, entry.size) != entry.checksum) {
+              throw std::runtime_error("Checksum mismatch: " + path);
+            }
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) {
+              throw std::runtime_error("Failed to create " + path);
+            }
+            uint64_t written = 0;
+            while (written < entry.size) {
+              ssize_t n = ::write(fd, bytes + written, entry.size - written);
+              if (n < 0 && errno == EINTR) {
+                continue;
+              }
+              if (n <= 0) {
+                ::close(fd);
+                throw std::runtime_error("Failed to write " + path);
+              }
+              written += n;
+            }
+#if !defined(__linux__)
+            if (sync_policy != SyncPolicy::NONE) {
+              ::fsync(fd);
+            }
+#endif
+            ::close(fd);
+          } else {
+            std::string part =
+                treeTransferPath(directory, entry.transfer_id, ".part");
+            {
+              FileSource source(part);
+              const char *bytes = source.span(0, source.size());
+              if (source.size() != entry.size ||
+                  (entry.size > 0 &&
+                   (!bytes || xxh64(bytes, entry.size) != entry.checksum))) {
+                throw std::runtime_error("Checksum mismatch: " + path);
+              }
+            }
+            if (std::rename(part.c_str(), path.c_str()) != 0) {
+              throw std::runtime_error("Failed to move " + part + " to " +
+                                       path);
+            }
+          }
+          applyTimes(path, entry);
+        } catch (const std::exception &e) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (failures++ == 0) {
+            first_error = e.what();
+          }
+        }
+      });
+    }
+  }
+
+  // Writing into a directory moves its mtime, so directories come last
+  for (size_t i = entries.size(); i-- > 0;) {
+    if (entries[i].kind == TREE_DIRECTORY) {
+      applyTimes(directory + "/" + entries[i].path, entries[i]);
+    }
+  }
+
+  // One flush for the whole tree rather than an fsync per file
+#if defined(__linux__)
+  if (sync_policy != SyncPolicy::NONE) {
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      ::syncfs(fd);
+      ::close(fd);
+    }
+  }
+#endif
+
+  if (failures > 0) {
+    throw std::runtime_error(first_error + " (" + std::to_string(failures) +
+                             " files failed)");
+  }
+  return summary;
+#else
+  (void)pack_path;
+  (void)directory;
+  (void)sync_policy;
+  throw std::runtime_error("Directory transfers are not supported here");
+#endif
+}
+
+// Batched datagram I/O on an Asio UDP socket. On Linux a batch of queued
+// datagrams goes out with one sendmmsg() and up to batch_size datagrams come
+// in with one recvmmsg(); elsewhere it falls back to one call per datagram.
+// Read readiness comes from socket.async_wait(), so batching runs on the
+// same io_context as everything else. Queued send buffers are referenced,
+// not copied, and must stay valid until flush(); a datagram may be queued
+// as a header plus a payload held elsewhere, which the kernel gathers from
+// both places (scatter/gather I/O). If the socket is in
+// non-blocking mode, datagrams that don't fit in the send buffer are dropped
+// rather than waited for.
+//
+// With enableGso(), runs of equally sized datagrams to the same peer are
+// handed to the kernel as one UDP_SEGMENT super-buffer of up to 64 KB.
+// With enableGro(), coalesced receives are split back into datagrams.
+class BatchedUdpIO {
+private:
+  static constexpr size_t MAX_GSO_BYTES = 65507;   // Max UDP payload
+  static constexpr size_t MAX_GSO_SEGMENTS = 64;   // Kernel UDP_MAX_SEGMENTS
+  static constexpr size_t GRO_SLOT_SIZE = 65536;   // Coalesced receive size
+
+  // One datagram of the last receive(), possibly cut from a GRO buffer
+  struct Segment {
+    const char *data;
+    size_t length;
+    size_t slot; // Receive slot it came from (for the sender address)
+  };
+
+  udp::socket &socket_;
+  size_t batch_size_;
+  size_t slot_size_;
+  bool gso_;
+  bool gro_;
+
+  // Receive slots, filled by receive()
+  std::vector<char> recv_storage_;
+  std::vector<udp::endpoint> recv_senders_;
+  std::vector<Segment> segments_;
+  bool receive_full_; // Last receive() filled every slot
+
+  // Queued sends: each datagram is send_data_ followed by send_tails_
+  std::vector<const void *> send_data_;
+  std::vector<size_t> send_lengths_;
+  std::vector<const void *> send_tails_;
+  std::vector<size_t> send_tail_lengths_;
+  std::vector<udp::endpoint> send_targets_;
+
+#ifdef HAVE_MMSG
+  // Control buffer for one UDP_SEGMENT / UDP_GRO message
+  union SegmentControl {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  };
+
+  std::vector<struct mmsghdr> recv_msgs_;
+  std::vector<struct iovec> recv_iovs_;
+  std::vector<struct sockaddr_storage> recv_addrs_;
+  std::vector<SegmentControl> recv_controls_;
+  std::vector<struct mmsghdr> send_msgs_;
+  std::vector<struct iovec> send_iovs_;        // Two per datagram at most
+  std::vector<size_t> send_message_first_;     // First datagram of a message
+  std::vector<SegmentControl> send_controls_;
+#endif
+
+  uint64_t syscalls_;  // Send/receive syscalls issued
+  uint64_t datagrams_; // Datagrams moved by those syscalls
+
+public:
+  BatchedUdpIO(udp::socket &socket, size_t batch_size, size_t slot_size)
+      : socket_(socket), batch_size_(batch_size), slot_size_(slot_size),
+        gso_(false), gro_(false), receive_full_(false), syscalls_(0),
+        datagrams_(0) {
+    send_data_.reserve(batch_size);
+    send_lengths_.reserve(batch_size);
+    send_tails_.reserve(batch_size);
+    send_tail_lengths_.reserve(batch_size);
+    send_targets_.reserve(batch_size);
+    allocate_receive_slots();
+
+#ifdef HAVE_MMSG
+    send_msgs_.resize(batch_size);
+    send_iovs_.resize(batch_size * 2);
+    send_message_first_.resize(batch_size + 1);
+    send_controls_.resize(batch_size);
+#endif
+  }
+
+  BatchedUdpIO(const BatchedUdpIO &) = delete;
+  BatchedUdpIO &operator=(const BatchedUdpIO &) = delete;
+
+  size_t batchSize() const { return batch_size_; }
+  uint64_t syscalls() const { return syscalls_; }
+  uint64_t datagrams() const { return datagrams_; }
+  bool gsoEnabled() const { return gso_; }
+  bool groEnabled() const { return gro_; }
+
+  // Turn on UDP generic segmentation offload for sends. Returns false (and
+  // keeps plain batching) when the kernel does not support it.
+  bool enableGso() {
+#if defined(HAVE_MMSG) && defined(UDP_SEGMENT)
+    int probe = 0; // Per-socket default off; each send sets its own size
+    gso_ = ::setsockopt(socket_.native_handle(), SOL_UDP, UDP_SEGMENT, &probe,
+                        sizeof(probe)) == 0;
+#endif
+    return gso_;
+  }
+
+  // Turn on UDP generic receive offload. Returns false when unsupported.
+  bool enableGro() {
+#if defined(HAVE_MMSG) && defined(UDP_GRO)
+    int on = 1;
+    if (::setsockopt(socket_.native_handle(), SOL_UDP, UDP_GRO, &on,
+                     sizeof(on)) == 0) {
+      gro_ = true;
+      slot_size_ = std::max(slot_size_, GRO_SLOT_SIZE);
+      allocate_receive_slots();
+    }
+#endif
+    return gro_;
+  }
+
+  // Datagram i of the last receive()
+  const char *data(size_t i) const { return segments_[i].data; }
+  size_t length(size_t i) const { return segments_[i].length; }
+  const udp::endpoint &sender(size_t i) const {
+    return recv_senders_[segments_[i].slot];
+  }
+
+  // Whether the socket may still hold datagrams after the last receive()
+  bool mayHaveMore() const { return receive_full_; }
+
+  // Wait until the socket is readable, then call handler(error)
+  template <typename Handler> void async_wait_readable(Handler handler) {
+    socket_.async_wait(udp::socket::wait_read, handler);
+  }
+
+  // Queue a datagram; a full batch is flushed immediately
+  void queue(const void *data, size_t len, const udp::endpoint &to) {
+    queue(data, len, nullptr, 0, to);
+  }
+
+  // Queue a datagram made of a header and a payload in separate buffers
+  void queue(const void *header, size_t header_len, const void *payload,
+             size_t payload_len, const udp::endpoint &to) {
+    if (send_data_.size() == batch_size_) {
+      flush();
+    }
+    send_data_.push_back(header);
+    send_lengths_.push_back(header_len);
+    send_tails_.push_back(payload);
+    send_tail_lengths_.push_back(payload_len);
+    send_targets_.push_back(to);
+  }
+
+  // Number of datagrams waiting for flush()
+  size_t queued() const { return send_data_.size(); }
+
+  // Send all queued datagrams
+  void flush() {
+    size_t count = send_data_.size();
+    if (count == 0) {
+      return;
+    }
+
+#ifdef HAVE_MMSG
+    // Build one message per datagram, or per GSO run of datagrams
+    size_t messages = 0;
+    size_t iovs = 0;
+    for (size_t i = 0; i < count;) {
+      size_t run = gso_ ? gso_run_length(i) : 1;
+
+      struct mmsghdr &msg = send_msgs_[messages];
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_hdr.msg_name = send_targets_[i].data();
+      msg.msg_hdr.msg_namelen = send_targets_[i].size();
+      msg.msg_hdr.msg_iov = &send_iovs_[iovs];
+      for (size_t j = i; j < i + run; ++j) {
+        send_iovs_[iovs].iov_base = const_cast<void *>(send_data_[j]);
+        send_iovs_[iovs].iov_len = send_lengths_[j];
+        iovs++;
+        if (send_tail_lengths_[j] > 0) {
+          send_iovs_[iovs].iov_base = const_cast<void *>(send_tails_[j]);
+          send_iovs_[iovs].iov_len = send_tail_lengths_[j];
+          iovs++;
+        }
+      }
+      msg.msg_hdr.msg_iovlen = &send_iovs_[iovs] - msg.msg_hdr.msg_iov;
+      send_message_first_[messages] = i;
+
+#ifdef UDP_SEGMENT
+      if (run > 1) {
+        // The kernel cuts the buffer every gso_size bytes; only the last
+        // segment may be shorter
+        SegmentControl &control = send_controls_[messages];
+        msg.msg_hdr.msg_control = control.buf;
+        msg.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg.msg_hdr);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gso_size = static_cast<uint16_t>(datagram_length(i));
+        std::memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+      }
+#endif
+
+      messages++;
+      i += run;
+    }
+    send_message_first_[messages] = count;
+
+    int fd = socket_.native_handle();
+    size_t sent = 0;
+    while (sent < messages) {
+      int n = ::sendmmsg(fd, &send_msgs_[sent], messages - sent, 0);
+      syscalls_++;
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+            !socket_.non_blocking()) {
+          // Asio keeps the descriptor non-blocking; wait for buffer space
+          boost::system::error_code ignored;
+          socket_.wait(udp::socket::wait_write, ignored);
+          continue;
+        }
+        if (gso_ && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+          // The device or route can't segment: resend the rest unsegmented
+          std::cerr << "UDP GSO send failed (" << std::strerror(errno)
+                    << "), falling back to plain batching" << std::endl;
+          gso_ = false;
+          resend_unsegmented(sent);
+          break;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          std::cerr << "sendmmsg error: " << std::strerror(errno)
+                    << std::endl;
+        }
+        break; // Datagram semantics: drop the rest, retransmits recover
+      }
+      datagrams_ += send_message_first_[sent + n] - send_message_first_[sent];
+      sent += n;
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+      send_one(i);
+    }
+#endif
+
+    send_data_.clear();
+    send_lengths_.clear();
+    send_tails_.clear();
+    send_tail_lengths_.clear();
+    send_targets_.clear();
+  }
+
+  // Read up to batch_size datagrams (or GRO buffers) without blocking;
+  // returns the number of datagrams available through data()/length()
+  size_t receive() {
+    segments_.clear();
+    receive_full_ = false;
+
+#ifdef HAVE_MMSG
+    for (size_t i = 0; i < batch_size_; ++i) {
+      std::memset(&recv_msgs_[i].msg_hdr, 0, sizeof(recv_msgs_[i].msg_hdr));
+      recv_msgs_[i].msg_hdr.msg_name = &recv_addrs_[i];
+      recv_msgs_[i].msg_hdr.msg_namelen = sizeof(recv_addrs_[i]);
+      recv_msgs_[i].msg_hdr.msg_iov = &recv_iovs_[i];
+      recv_msgs_[i].msg_hdr.msg_iovlen = 1;
+      if (gro_) {
+        recv_msgs_[i].msg_hdr.msg_control = recv_controls_[i].buf;
+        recv_msgs_[i].msg_hdr.msg_controllen = sizeof(recv_controls_[i].buf);
+      }
+    }
+
+    int n = ::recvmmsg(socket_.native_handle(), recv_msgs_.data(), batch_size_,
+                       MSG_DONTWAIT, nullptr);
+    syscalls_++;
+    if (n <= 0) {
+      return 0;
+    }
+    receive_full_ = static_cast<size_t>(n) == batch_size_;
+
+    for (int i = 0; i < n; ++i) {
+      struct msghdr &hdr = recv_msgs_[i].msg_hdr;
+      udp::endpoint &sender = recv_senders_[i];
+      std::memcpy(sender.data(), &recv_addrs_[i], hdr.msg_namelen);
+      sender.resize(hdr.msg_namelen);
+
+      // A GRO buffer carries its segment size in a control message
+      size_t length = recv_msgs_[i].msg_len;
+      size_t segment_size = length;
+#ifdef UDP_GRO
+      if (gro_) {
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&hdr); cm;
+             cm = CMSG_NXTHDR(&hdr, cm)) {
+          if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int gso_size;
+            std::memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+            if (gso_size > 0) {
+              segment_size = gso_size;
+            }
+          }
+        }
+      }
+#endif
+
+      const char *base = &recv_storage_[i * slot_size_];
+      if (length == 0) {
+        segments_.push_back({base, 0, static_cast<size_t>(i)});
+        continue;
+      }
+      for (size_t offset = 0; offset < length; offset += segment_size) {
+        segments_.push_back({base + offset,
+                             std::min(segment_size, length - offset),
+                             static_cast<size_t>(i)});
+      }
+    }
+    datagrams_ += segments_.size();
+    return segments_.size();
+#else
+    size_t count = 0;
+    while (count < batch_size_ && socket_.available() > 0) {
+      boost::system::error_code error;
+      size_t len = socket_.receive_from(
+          boost::asio::buffer(&recv_storage_[count * slot_size_], slot_size_),
+          recv_senders_[count], 0, error);
+      syscalls_++;
+      if (error) {
+        break;
+      }
+      segments_.push_back({&recv_storage_[count * slot_size_], len, count});
+      count++;
+    }
+    receive_full_ = count == batch_size_;
+    datagrams_ += count;
+    return count;
+#endif
+  }
+
+private:
+  // Bytes on the wire for queued datagram i
+  size_t datagram_length(size_t i) const {
+    return send_lengths_[i] + send_tail_lengths_[i];
+  }
+
+  // Send queued datagram i on its own, header and payload gathered
+  void send_one(size_t i) {
+    boost::array<boost::asio::const_buffer, 2> buffers = {
+        {boost::asio::buffer(send_data_[i], send_lengths_[i]),
+         boost::asio::buffer(send_tails_[i], send_tail_lengths_[i])}};
+    boost::system::error_code error;
+    socket_.send_to(buffers, send_targets_[i], 0, error);
+    syscalls_++;
+    if (!error) {
+      datagrams_++;
+    }
+  }
+
+  // Size the receive slots (grows to GRO_SLOT_SIZE once GRO is on)
+  void allocate_receive_slots() {
+    recv_storage_.assign(batch_size_ * slot_size_, 0);
+    recv_senders_.resize(batch_size_);
+    segments_.reserve(batch_size_);
+#ifdef HAVE_MMSG
+    recv_msgs_.resize(batch_size_);
+    recv_iovs_.resize(batch_size_);
+    recv_addrs_.resize(batch_size_);
+    recv_controls_.resize(batch_size_);
+    for (size_t i = 0; i < batch_size_; ++i) {
+      recv_iovs_[i].iov_base = &recv_storage_[i * slot_size_];
+      recv_iovs_[i].iov_len = slot_size_;
+    }
+#endif
+  }
+
+#ifdef HAVE_MMSG
+  // Number of queued datagrams from index first that can share one GSO send:
+  // same peer, same size (the last may be shorter), at most 64 KB in total
+  size_t gso_run_length(size_t first) const {
+    size_t segment_size = datagram_length(first);
+    size_t total = segment_size;
+    size_t run = 1;
+    while (first + run < send_data_.size() && run < MAX_GSO_SEGMENTS) {
+      size_t next = first + run;
+      size_t length = datagram_length(next);
+      if (send_targets_[next] != send_targets_[first] ||
+          length > segment_size || total + length > MAX_GSO_BYTES) {
+        break;
+      }
+      total += length;
+      run++;
+      if (length < segment_size) {
+        break; // A short datagram can only end a run
+      }
+    }
+    return run;
+  }
+
+  // GSO fallback: send queued datagrams from message index first onwards
+  // one per message
+  void resend_unsegmented(size_t first_message) {
+    for (size_t i = send_message_first_[first_message];
+         i < send_data_.size(); ++i) {
+      send_one(i);
+    }
+  }
+#endif
+};
+
+// Kernel timestamps for a UDP socket (SO_TIMESTAMPING, software stamps):
+// when each datagram left the stack for the device and when each one came
+// in from it. Against the user-space clock around the same send and
+// receive, they split a round trip into time on the wire (and in the
+// peer) and time this process took to hand packets over and pick them
+// up. Send stamps come back on the socket's error queue, tagged by the
+// kernel with a running count of the datagrams sent on the socket
+// (SOF_TIMESTAMPING_OPT_ID); noteSend() keeps the same count, so every
+// datagram sent while timestamping is on must be noted, and GSO (one
+// stamp for many datagrams) must stay off.
+class KernelTimestamps {
+private:
+  static constexpr size_t TAG_SLOTS = 65536; // Sends remembered by count
+  static constexpr size_t CONTROL_SIZE = 512;
+
+  udp::socket &socket_;
+  uint32_t next_key_;          // Kernel's count for the next datagram
+  std::vector<uint32_t> tags_; // Caller's tag per count, modulo TAG_SLOTS
+
+public:
+  static constexpr uint32_t UNTAGGED = UINT32_MAX; // Not to be reported
+
+  explicit KernelTimestamps(udp::socket &socket)
+      : socket_(socket), next_key_(0), tags_(TAG_SLOTS, UNTAGGED) {}
+
+  KernelTimestamps(const KernelTimestamps &) = delete;
+  KernelTimestamps &operator=(const KernelTimestamps &) = delete;
+
+  // Turn timestamping on. Returns false when the kernel does not support
+  // it.
+  bool enable() {
+#ifdef HAVE_TIMESTAMPING
+    int fd = socket_.native_handle();
+    // Off first, so that the kernel's count starts again from zero
+    int flags = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+            SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+            SOF_TIMESTAMPING_OPT_TSONLY;
+    if (::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                     sizeof(flags)) != 0) {
+      return false;
+    }
+    next_key_ = 0;
+    std::fill(tags_.begin(), tags_.end(), UNTAGGED);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Count a datagram about to be sent; its send stamp is reported with
+  // tag. Returns the kernel's key for it.
+  uint32_t noteSend(uint32_t tag) {
+    tags_[next_key_ % TAG_SLOTS] = tag;
+    return next_key_++;
+  }
+
+  // Read every send stamp waiting on the error queue, calling
+  // sent(tag, key, ns) for the tagged ones. A tag is only remembered for
+  // TAG_SLOTS sends, so callers check the key against their own.
+  template <typename Sent> void drainSent(Sent sent) {
+#ifdef HAVE_TIMESTAMPING
+    int fd = socket_.native_handle();
+    char control[CONTROL_SIZE];
+    while (true) {
+      struct msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        return; // Queue empty
+      }
+      int64_t ns = 0;
+      const struct sock_extended_err *err = nullptr;
+      for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+           cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET &&
+            cm->cmsg_type == SCM_TIMESTAMPING) {
+          ns = stampNanos(cm);
+        } else if ((cm->cmsg_level == IPPROTO_IP &&
+                    cm->cmsg_type == IP_RECVERR) ||
+                   (cm->cmsg_level == IPPROTO_IPV6 &&
+                    cm->cmsg_type == IPV6_RECVERR)) {
+          err = reinterpret_cast<const struct sock_extended_err *>(
+              CMSG_DATA(cm));
+        }
+      }
+      if (ns == 0 || err == nullptr ||
+          err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ||
+          err->ee_info != SCM_TSTAMP_SND) {
+        continue;
+      }
+      uint32_t tag = tags_[err->ee_data % TAG_SLOTS];
+      if (tag != UNTAGGED) {
+        sent(tag, err->ee_data, ns);
+      }
+    }
+#else
+    (void)sent;
+#endif
+  }
+
+  // Receive one datagram without blocking, with the time it came in from
+  // the device (rx_ns, 0 if the kernel gave none). Returns its length, or
+  // -1 when nothing is waiting.
+  ssize_t receive(void *data, size_t len, int64_t &rx_ns) {
+    rx_ns = 0;
+#ifdef HAVE_TIMESTAMPING
+    char control[CONTROL_SIZE];
+    struct iovec iov = {data, len};
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = ::recvmsg(socket_.native_handle(), &msg, MSG_DONTWAIT);
+    if (n < 0) {
+      return -1;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+        rx_ns = stampNanos(cm);
+      }
+    }
+    return n;
+#else
+    (void)data;
+    (void)len;
+    return -1;
+#endif
+  }
+
+private:
+#ifdef HAVE_TIMESTAMPING
+  // Software stamp of an SCM_TIMESTAMPING message, in ns (CLOCK_REALTIME)
+  static int64_t stampNanos(struct cmsghdr *cm) {
+    struct scm_timestamping stamps;
+    std::memcpy(&stamps, CMSG_DATA(cm), sizeof(stamps));
+    return static_cast<int64_t>(stamps.ts[0].tv_sec) * 1000000000 +
+           stamps.ts[0].tv_nsec;
+  }
+#endif
+};
+
+#ifdef HAVE_IO_URING
+// io_uring I/O for a UDP socket, driven through the raw system calls:
+// - one multishot recvmsg keeps receiving into a ring of provided buffers,
+//   so a busy socket costs no receive syscalls at all
+// - sends are copied into slots, queued as SQEs and submitted together by
+//   flush()
+// - a payload still sitting in a receive buffer is written to its file by
+//   a write SQE straight from that buffer (WriteOffload); the buffer goes
+//   back to the ring when the write completes
+// The ring's descriptor is readable while completions are waiting, which
+// is how the owner's io_context learns there is work, so timers and
+// everything else keep running on the same thread. The constructor throws
+// when the kernel lacks io_uring or one of these features.
+class UringUdpIO : public WriteOffload {
+private:
+  static constexpr unsigned SQ_ENTRIES = 256;
+  static constexpr unsigned CQ_ENTRIES = 4096;
+  static constexpr unsigned BUFFER_COUNT = 1024; // Power of two
+  static constexpr uint16_t BUFFER_GROUP = 0;
+  static constexpr size_t SEND_SLOTS = 512;
+  static constexpr size_t SEND_SLOT_SIZE = 64; // ACKs and other small sends
+
+  // What a completion belongs to, in the top byte of user_data
+  static constexpr uint64_t TAG_RECEIVE = 1ull << 56;
+  static constexpr uint64_t TAG_SEND = 2ull << 56;
+  static constexpr uint64_t TAG_WRITE = 3ull << 56;
+  static constexpr uint64_t TAG_CANCEL = 4ull << 56;
+  static constexpr uint64_t TAG_MASK = 0xffull << 56;
+
+  // One datagram of the last receive(), inside a provided buffer
+  struct Segment {
+    const char *data;
+    size_t length;
+    uint16_t buffer;
+  };
+
+  // A queued send: the kernel reads all of it when the SQE runs
+  struct SendSlot {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    char data[SEND_SLOT_SIZE];
+  };
+
+  // A payload write in flight, one per buffer at most
+  struct WriteOp {
+    int fd;
+    uint64_t offset;
+    const char *data;
+    size_t length;
+  };
+
+  udp::socket &socket_;
+  boost::asio::posix::stream_descriptor ring_descriptor_;
+  int ring_fd_;
+  size_t buffer_size_;
+
+  // Shared ring memory
+  void *sq_ring_;
+  size_t sq_ring_size_;
+  void *cq_ring_;
+  size_t cq_ring_size_;
+  struct io_uring_sqe *sqes_;
+  size_t sqes_size_;
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned sq_mask_;
+  unsigned *sq_array_;
+  unsigned *sq_flags_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe *cqes_;
+  unsigned to_submit_;
+
+  // Provided receive buffers and the ring handing them to the kernel. The
+  // ring is addressed as plain io_uring_buf entries: in C++ the header's
+  // flexible array lands 8 bytes in. Its tail overlays entry 0's resv.
+  std::vector<char> buffers_;
+  struct io_uring_buf *buffer_ring_;
+  size_t buffer_ring_size_;
+  uint16_t buffer_tail_;
+  // A buffer returns to the kernel once it is out of the current batch
+  // and no write still reads from it
+  std::vector<char> buffer_in_batch_;
+  std::vector<char> buffer_writing_;
+  std::vector<WriteOp> writes_;      // Indexed by buffer
+  std::unordered_map<int, size_t> writes_in_flight_; // Per file descriptor
+  std::unordered_map<int, bool> write_failed_;
+
+  struct msghdr recv_msg_; // Multishot template: room for the address
+  bool receive_armed_;
+  bool stopping_;
+
+  // Completions reaped outside receive() wait here (res, flags)
+  std::deque<std::pair<int, uint32_t>> deferred_;
+
+  std::vector<Segment> segments_;
+  std::vector<udp::endpoint> senders_;
+  std::vector<uint16_t> batch_buffers_; // Buffers of the last receive()
+
+  std::vector<SendSlot> send_slots_;
+  std::vector<size_t> free_send_slots_;
+
+  uint64_t syscalls_;
+  uint64_t datagrams_;
+
+  static int setup(unsigned entries, struct io_uring_params *params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+  }
+
+  static int enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+                                      min_complete, flags, nullptr, 0));
+  }
+
+  static int registerRing(int fd, unsigned opcode, void *arg,
+                          unsigned count) {
+    return static_cast<int>(
+        ::syscall(__NR_io_uring_register, fd, opcode, arg, count));
+  }
+
+  static std::string failure(const std::string &what) {
+    return what + ": " + std::strerror(errno);
+  }
+
+public:
+  UringUdpIO(boost::asio::io_context &io_context, udp::socket &socket,
+             size_t datagram_size)
+      : socket_(socket), ring_descriptor_(io_context), ring_fd_(-1),
+        sq_ring_(MAP_FAILED), sq_ring_size_(0), cq_ring_(MAP_FAILED),
+        cq_ring_size_(0), sqes_(nullptr), sqes_size_(0), to_submit_(0),
+        buffer_ring_(nullptr), buffer_ring_size_(0), buffer_tail_(0),
+        receive_armed_(false), stopping_(false), syscalls_(0),
+        datagrams_(0) {
+    // Each buffer takes the recvmsg header, the sender address and one
+    // datagram
+    buffer_size_ = sizeof(struct io_uring_recvmsg_out) +
+                   sizeof(struct sockaddr_storage) + datagram_size;
+    buffer_size_ = (buffer_size_ + 63) / 64 * 64;
+
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = CQ_ENTRIES;
+    ring_fd_ = setup(SQ_ENTRIES, &params);
+    if (ring_fd_ < 0) {
+      throw std::runtime_error(failure("io_uring_setup"));
+    }
+    try {
+      map_rings(params);
+      register_buffers();
+    } catch (...) {
+      release();
+      throw;
+    }
+    ring_descriptor_.assign(ring_fd_);
+
+    send_slots_.resize(SEND_SLOTS);
+    for (size_t i = SEND_SLOTS; i > 0; --i) {
+      free_send_slots_.push_back(i - 1);
+    }
+    std::memset(&recv_msg_, 0, sizeof(recv_msg_));
+    recv_msg_.msg_namelen = sizeof(struct sockaddr_storage);
+    segments_.reserve(BUFFER_COUNT);
+    senders_.resize(BUFFER_COUNT);
+    arm_receive();
+    flush();
+  }
+
+  ~UringUdpIO() {
+    // Stop the multishot receive and let sends and writes finish before
+    // the memory they point into goes away
+    if (receive_armed_) {
+      struct io_uring_sqe *sqe = next_sqe();
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = TAG_RECEIVE;
+      sqe->user_data = TAG_CANCEL;
+    }
+    stopping_ = true;
+    flush();
+    for (int i = 0; i < 1000 && (receive_armed_ || pending_io()); ++i) {
+      wait_for_completion();
+    }
+    ring_descriptor_.release();
+    release();
+  }
+
+  UringUdpIO(const UringUdpIO &) = delete;
+  UringUdpIO &operator=(const UringUdpIO &) = delete;
+
+  uint64_t syscalls() const { return syscalls_; }
+  uint64_t datagrams() const { return datagrams_; }
+
+  // Datagram i of the last receive()
+  const char *data(size_t i) const { return segments_[i].data; }
+  size_t length(size_t i) const { return segments_[i].length; }
+  const udp::endpoint &sender(size_t i) const { return senders_[i]; }
+
+  // Wait until completions are ready, then call handler(error)
+  template <typename Handler> void async_wait_readable(Handler handler) {
+    ring_descriptor_.async_wait(
+        boost::asio::posix::stream_descriptor::wait_read, handler);
+  }
+
+  // Abandon the pending async_wait_readable()
+  void cancel() { ring_descriptor_.cancel(); }
+
+  // Reap the completions that are ready; returns the number of datagrams
+  // available through data()/length()/sender(). Buffers of the previous
+  // receive() go back to the kernel first, except those still being
+  // written.
+  size_t receive() {
+    for (uint16_t buffer : batch_buffers_) {
+      buffer_in_batch_[buffer] = 0;
+      if (!buffer_writing_[buffer]) {
+        recycle(buffer);
+      }
+    }
+    batch_buffers_.clear();
+    segments_.clear();
+
+    // Completions overflowed past the CQ are flushed by entering the ring
+    if (__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) {
+      enter(ring_fd_, 0, 0, IORING_ENTER_GETEVENTS);
+      syscalls_++;
+    }
+    while (!deferred_.empty()) {
+      on_receive(deferred_.front().first, deferred_.front().second);
+      deferred_.pop_front();
+    }
+    reap(false);
+
+    if (!receive_armed_ && !stopping_) {
+      arm_receive();
+    }
+    publish_buffers();
+    flush();
+    datagrams_ += segments_.size();
+    return segments_.size();
+  }
+
+  // Queue a small datagram (copied); larger ones, or any when every slot is
+  // busy, are sent right away
+  void queue(const void *data, size_t len, const udp::endpoint &to) {
+    if (len > SEND_SLOT_SIZE || free_send_slots_.empty()) {
+      boost::system::error_code error;
+      socket_.send_to(boost::asio::buffer(data, len), to, 0, error);
+      syscalls_++;
+      return;
+    }
+    size_t index = free_send_slots_.back();
+    free_send_slots_.pop_back();
+    SendSlot &slot = send_slots_[index];
+    std::memcpy(slot.data, data, len);
+    std::memcpy(&slot.addr, to.data(), to.size());
+    slot.iov.iov_base = slot.data;
+    slot.iov.iov_len = len;
+    std::memset(&slot.msg, 0, sizeof(slot.msg));
+    slot.msg.msg_name = &slot.addr;
+    slot.msg.msg_namelen = to.size();
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socket_.native_handle();
+    sqe->addr = reinterpret_cast<uint64_t>(&slot.msg);
+    sqe->len = 1;
+    sqe->user_data = TAG_SEND | index;
+  }
+
+  // Submit everything queued with one io_uring_enter()
+  void flush() {
+    while (to_submit_ > 0) {
+      int n = enter(ring_fd_, to_submit_, 0, 0);
+      syscalls_++;
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+          // Completion queue full: make room and retry
+          wait_for_completion();
+          continue;
+        }
+        std::cerr << failure("io_uring_enter") << std::endl;
+        break;
+      }
+      to_submit_ -= std::min<unsigned>(to_submit_, n);
+    }
+  }
+
+  // WriteOffload: write a payload that lives in one of the receive buffers
+  // of the current batch; anything else is left to the caller
+  bool write(int fd, uint64_t offset, const char *data, size_t len) override {
+    if (data < buffers_.data() ||
+        data + len > buffers_.data() + buffers_.size()) {
+      return false;
+    }
+    size_t buffer = (data - buffers_.data()) / buffer_size_;
+    if (buffer_writing_[buffer]) {
+      return false;
+    }
+    buffer_writing_[buffer] = 1;
+    writes_[buffer] = WriteOp{fd, offset, data, len};
+    writes_in_flight_[fd]++;
+
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(len);
+    sqe->off = offset;
+    sqe->user_data = TAG_WRITE | buffer;
+    return true;
+  }
+
+  // WriteOffload: wait for the writes to fd
+  bool drain(int fd) override {
+    flush();
+    while (writes_in_flight_[fd] > 0) {
+      wait_for_completion();
+    }
+    bool ok = !write_failed_[fd];
+    writes_in_flight_.erase(fd);
+    write_failed_.erase(fd);
+    return ok;
+  }
+
+private:
+  void map_rings(const struct io_uring_params &params) {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+      errno = ENOSYS;
+      throw std::runtime_error(failure("io_uring too old"));
+    }
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      throw std::runtime_error(failure("io_uring ring mmap"));
+    }
+    cq_ring_ = sq_ring_;
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      throw std::runtime_error(failure("io_uring SQE mmap"));
+    }
+    sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+    char *sq = static_cast<char *>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    sq_flags_ = reinterpret_cast<unsigned *>(sq + params.sq_off.flags);
+    char *cq = static_cast<char *>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  }
+
+  // Register the provided buffer ring (IORING_REGISTER_PBUF_RING) and fill
+  // it with every buffer
+  void register_buffers() {
+    buffers_.assign(BUFFER_COUNT * buffer_size_, 0);
+    buffer_in_batch_.assign(BUFFER_COUNT, 0);
+    buffer_writing_.assign(BUFFER_COUNT, 0);
+    writes_.resize(BUFFER_COUNT);
+    buffer_ring_size_ = BUFFER_COUNT * sizeof(struct io_uring_buf);
+    void *ring = ::mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+      throw std::runtime_error(failure("buffer ring mmap"));
+    }
+    buffer_ring_ = static_cast<struct io_uring_buf *>(ring);
+
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+    reg.ring_entries = BUFFER_COUNT;
+    reg.bgid = BUFFER_GROUP;
+    if (registerRing(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+      throw std::runtime_error(failure("provided buffer ring"));
+    }
+    for (unsigned i = 0; i < BUFFER_COUNT; ++i) {
+      recycle(static_cast<uint16_t>(i));
+    }
+    publish_buffers();
+  }
+
+  void release() {
+    if (buffer_ring_) {
+      ::munmap(buffer_ring_, buffer_ring_size_);
+    }
+    if (sqes_) {
+      ::munmap(sqes_, sqes_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      ::munmap(sq_ring_, sq_ring_size_);
+    }
+    if (ring_fd_ >= 0) {
+      ::close(ring_fd_);
+    }
+  }
+
+  // Next free SQE, zeroed; submits first when the queue is full
+  struct io_uring_sqe *next_sqe() {
+    unsigned tail = *sq_tail_;
+    while (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >=
+           sq_mask_ + 1) {
+      flush();
+    }
+    unsigned index = tail & sq_mask_;
+    struct io_uring_sqe *sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    to_submit_++;
+    return sqe;
+  }
+
+  // Hand a buffer back to the kernel (visible after publish_buffers())
+  void recycle(uint16_t buffer) {
+    struct io_uring_buf &entry =
+        buffer_ring_[buffer_tail_ & (BUFFER_COUNT - 1)];
+    entry.addr =
+        reinterpret_cast<uint64_t>(&buffers_[buffer * buffer_size_]);
+    entry.len = static_cast<uint32_t>(buffer_size_);
+    entry.bid = buffer;
+    buffer_tail_++;
+  }
+
+  void publish_buffers() {
+    __atomic_store_n(&buffer_ring_[0].resv, buffer_tail_, __ATOMIC_RELEASE);
+  }
+
+  void arm_receive() {
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = socket_.native_handle();
+    sqe->addr = reinterpret_cast<uint64_t>(&recv_msg_);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = TAG_RECEIVE;
+    receive_armed_ = true;
+  }
+
+  bool pending_io() const {
+    if (free_send_slots_.size() != SEND_SLOTS) {
+      return true;
+    }
+    for (const auto &writes : writes_in_flight_) {
+      if (writes.second > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Block until at least one completion arrives and reap it; receive
+  // completions are kept for the next receive()
+  void wait_for_completion() {
+    int n = enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS);
+    syscalls_++;
+    if (n < 0 && errno != EINTR) {
+      std::cerr << failure("io_uring_enter") << std::endl;
+      return;
+    }
+    reap(true);
+  }
+
+  // Process every completion in the queue
+  void reap(bool defer_receives) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe &cqe = cqes_[head & cq_mask_];
+      uint64_t tag = cqe.user_data & TAG_MASK;
+      uint64_t index = cqe.user_data & ~TAG_MASK;
+      if (tag == TAG_RECEIVE) {
+        if (defer_receives) {
+          deferred_.emplace_back(cqe.res, cqe.flags);
+          if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            receive_armed_ = false;
+          }
+        } else {
+          on_receive(cqe.res, cqe.flags);
+        }
+      } else if (tag == TAG_SEND) {
+        free_send_slots_.push_back(index);
+      } else if (tag == TAG_WRITE) {
+        on_write(static_cast<uint16_t>(index), cqe.res);
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  void on_receive(int res, uint32_t flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+      receive_armed_ = false; // Out of buffers or cancelled; re-armed later
+    }
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+      if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        std::cerr << "io_uring receive error: " << std::strerror(-res)
+                  << std::endl;
+      }
+      return;
+    }
+    uint16_t buffer = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+    if (buffer >= BUFFER_COUNT) {
+      return;
+    }
+    buffer_in_batch_[buffer] = 1;
+    batch_buffers_.push_back(buffer);
+    if (res < 0) {
+      return;
+    }
+    char *base = &buffers_[buffer * buffer_size_];
+    const struct io_uring_recvmsg_out *out =
+        reinterpret_cast<const struct io_uring_recvmsg_out *>(base);
+    if (out->flags & MSG_TRUNC) {
+      return; // Larger than any valid datagram
+    }
+    size_t header = sizeof(*out) + recv_msg_.msg_namelen;
+    size_t length = std::min<size_t>(out->payloadlen,
+                                     static_cast<size_t>(res) - header);
+    udp::endpoint &sender = senders_[segments_.size()];
+    std::memcpy(sender.data(), base + sizeof(*out),
+                std::min<size_t>(out->namelen, sizeof(sockaddr_storage)));
+    sender.resize(out->namelen);
+    segments_.push_back({base + header, length, buffer});
+  }
+
+  void on_write(uint16_t buffer, int res) {
+    const WriteOp &op = writes_[buffer];
+    size_t done = res < 0 ? 0 : static_cast<size_t>(res);
+    if (res < 0) {
+      std::cerr << "io_uring write failed: " << std::strerror(-res)
+                << std::endl;
+      write_failed_[op.fd] = true;
+    }
+    // A short write is finished the ordinary way
+    while (res >= 0 && done < op.length) {
+      ssize_t n = ::pwrite(op.fd, op.data + done, op.length - done,
+                           static_cast<off_t>(op.offset + done));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        std::cerr << failure("Output write failed") << std::endl;
+        write_failed_[op.fd] = true;
+        break;
+      }
+      done += n;
+    }
+    writes_in_flight_[op.fd]--;
+    buffer_writing_[buffer] = 0;
+    if (!buffer_in_batch_[buffer]) {
+      recycle(buffer);
+      publish_buffers();
+    }
+  }
+};
+#endif
+
+// Retransmission timeout estimator (Jacobson/Karels, RFC 6298). RTT
+// samples come from ACK timestamps, so retransmitted packets are sampled too.
+class RttEstimator {
+private:
+  double srtt_ms_;   // Smoothed RTT
+  double rttvar_ms_; // RTT variation
+  double rto_ms_;    // Current retransmission timeout
+  bool has_sample_;
+
+public:
+  RttEstimator()
+      : srtt_ms_(0.0), rttvar_ms_(0.0), rto_ms_(TIMEOUT_MS),
+        has_sample_(false) {}
+
+  // Fold in one RTT measurement
+  void addSample(double rtt_ms) {
+    if (rtt_ms < 0.0) {
+      return;
+    }
+    if (!has_sample_) {
+      srtt_ms_ = rtt_ms;
+      rttvar_ms_ = rtt_ms / 2.0;
+      has_sample_ = true;
+    } else {
+      // alpha = 1/8, beta = 1/4
+      rttvar_ms_ = 0.75 * rttvar_ms_ + 0.25 * std::abs(srtt_ms_ - rtt_ms);
+      srtt_ms_ = 0.875 * srtt_ms_ + 0.125 * rtt_ms;
+    }
+    rto_ms_ = clamp(srtt_ms_ + std::max<double>(SR_TICK_MS, 4.0 * rttvar_ms_));
+  }
+
+  // Double the timeout after an expiry (stop-and-wait backoff)
+  void backoff() { rto_ms_ = clamp(rto_ms_ * 2.0); }
+
+  // Timeout for a packet already retransmitted `retries` times
+  double rtoFor(int retries) const {
+    return clamp(rto_ms_ * static_cast<double>(1u << std::min(retries, 16)));
+  }
+
+  double rto() const { return rto_ms_; }
+  double srtt() const { return srtt_ms_; }
+  double rttvar() const { return rttvar_ms_; }
+  bool hasSample() const { return has_sample_; }
+
+private:
+  static double clamp(double rto_ms) {
+    return std::min<double>(std::max<double>(rto_ms, MIN_RTO_MS), MAX_RTO_MS);
+  }
+};
+
+// What a congestion controller learns from one acknowledged packet
+struct AckSample {
+  size_t bytes;         // Payload bytes newly acknowledged
+  double rtt_ms;        // RTT of this packet (from the echoed timestamp)
+  double delivery_rate; // Bytes/s delivered while this packet was in flight
+  bool app_limited;     // Too few packets in flight to fill the path, so
+                        // the rate says little about the bottleneck
+  bool round_start;     // First ACK of a new round trip
+  uint32_t in_flight;   // Packets still unacknowledged
+  high_resolution_clock::time_point now;
+};
+
+// Pluggable congestion control for the selective-repeat sender. The
+// controller sets the congestion window (packets in flight, further capped
+// by --window) and the pacing rate packets are spread out at.
+class CongestionController {
+public:
+  virtual ~CongestionController() {}
+
+  // Short name for reports
+  virtual const char *name() const = 0;
+
+  // Called for every newly acknowledged packet
+  virtual void onAck(const AckSample &sample) = 0;
+
+  // Called once per loss episode (retransmission timeout)
+  virtual void onLoss() = 0;
+
+  // Called when every retransmission of the last loss episode turned out
+  // to be needless: take back what onLoss() did
+  virtual void undoLoss() = 0;
+
+  // Congestion window in packets
+  virtual double cwnd() const = 0;
+
+  // Pacing rate in bytes per second, 0 for unpaced
+  virtual double pacingRate(double srtt_ms) const = 0;
+};
+
+// Classic slow start plus additive-increase/multiplicative-decrease, paced
+// at a multiple of cwnd/srtt like Linux TCP pacing
+class AimdController : public CongestionController {
+private:
+  double cwnd_;
+  double ssthresh_;
+  double max_cwnd_;
+  double packet_bytes_; // Payload per packet, to turn cwnd into bytes
+  double prior_cwnd_;     // Before the last onLoss(), for undoLoss()
+  double prior_ssthresh_;
+
+public:
+  AimdController(double max_cwnd, int packet_bytes)
+      : cwnd_(std::min<double>(INITIAL_CWND, max_cwnd)), ssthresh_(max_cwnd),
+        max_cwnd_(max_cwnd), packet_bytes_(packet_bytes), prior_cwnd_(cwnd_),
+        prior_ssthresh_(ssthresh_) {}
+
+  const char *name() const override { return "aimd"; }
+
+  void onAck(const AckSample &) override {
+    if (cwnd_ < ssthresh_) {
+      cwnd_ += 1.0; // Slow start: double per round trip
+    } else {
+      cwnd_ += 1.0 / cwnd_; // Congestion avoidance: one packet per RTT
+    }
+    cwnd_ = std::min(cwnd_, max_cwnd_);
+  }
+
+  void onLoss() override {
+    prior_cwnd_ = cwnd_;
+    prior_ssthresh_ = ssthresh_;
+    ssthresh_ = std::max(cwnd_ / 2.0, 2.0);
+    cwnd_ = ssthresh_;
+  }
+
+  void undoLoss() override {
+    cwnd_ = std::max(cwnd_, prior_cwnd_);
+    ssthresh_ = std::max(ssthresh_, prior_ssthresh_);
+  }
+
+  double cwnd() const override { return cwnd_; }
+
+  double pacingRate(double srtt_ms) const override {
+    if (srtt_ms <= 0.0) {
+      return 0.0;
+    }
+    double gain = cwnd_ < ssthresh_ ? 2.0 : 1.2;
+    return gain * cwnd_ * packet_bytes_ / (srtt_ms / 1000.0);
+  }
+};
+
+// BBR-style model-based controller: estimates bottleneck bandwidth (windowed
+// max of delivery rate) and min RTT, paces at gain * bandwidth and keeps
+// about two BDPs in flight. Loss does not shrink the window.
+class BbrController : public CongestionController {
+private:
+  enum Mode { STARTUP, DRAIN, PROBE_BW };
+
+  static constexpr double HIGH_GAIN = 2.885; // 2/ln(2)
+  static constexpr int BW_WINDOW_ROUNDS = 10;
+  static constexpr double MIN_RTT_WINDOW_S = 10.0;
+
+  Mode mode_;
+  double max_cwnd_;
+  double packet_bytes_; // Payload per packet, to turn bytes into packets
+  std::deque<std::pair<uint64_t, double>> bw_samples_; // (round, rate)
+  double btl_bw_;      // Bottleneck bandwidth estimate, bytes/s
+  double min_rtt_ms_;  // Min RTT over MIN_RTT_WINDOW_S
+  high_resolution_clock::time_point min_rtt_stamp_;
+  uint64_t round_count_;
+  double full_bw_;     // Bandwidth at the last STARTUP growth check
+  int full_bw_rounds_; // Rounds without 25% growth
+  int cycle_index_;    // PROBE_BW gain cycle position
+  high_resolution_clock::time_point cycle_stamp_;
+  double pacing_gain_;
+  double cwnd_gain_;
+
+public:
+  BbrController(double max_cwnd, int packet_bytes)
+      : mode_(STARTUP), max_cwnd_(max_cwnd), packet_bytes_(packet_bytes),
+        btl_bw_(0.0), min_rtt_ms_(0.0),
+        round_count_(0), full_bw_(0.0), full_bw_rounds_(0), cycle_index_(0),
+        pacing_gain_(HIGH_GAIN), cwnd_gain_(HIGH_GAIN) {}
+
+  const char *name() const override { return "bbr"; }
+
+  void onAck(const AckSample &sample) override {
+    if (sample.round_start) {
+      round_count_++;
+    }
+    update_bandwidth(sample.delivery_rate, sample.app_limited);
+    update_min_rtt(sample.rtt_ms, sample.now);
+
+    switch (mode_) {
+    case STARTUP:
+      // Leave STARTUP once bandwidth stops growing by 25% per round
+      if (sample.round_start) {
+        if (btl_bw_ >= full_bw_ * 1.25) {
+          full_bw_ = btl_bw_;
+          full_bw_rounds_ = 0;
+        } else if (++full_bw_rounds_ >= 3) {
+          mode_ = DRAIN;
+          pacing_gain_ = 1.0 / HIGH_GAIN;
+          cwnd_gain_ = HIGH_GAIN;
+        }
+      }
+      break;
+    case DRAIN:
+      // Drain the queue built in STARTUP down to one BDP
+      if (sample.in_flight <= bdpPackets()) {
+        enter_probe_bw(sample.now);
+      }
+      break;
+    case PROBE_BW:
+      // Cycle gains 1.25, 0.75, then 1.0 x6, one min RTT per phase
+      if (duration_cast<microseconds>(sample.now - cycle_stamp_).count() >
+          min_rtt_ms_ * 1000.0) {
+        static const double gains[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+        cycle_index_ = (cycle_index_ + 1) % 8;
+        pacing_gain_ = gains[cycle_index_];
+        cycle_stamp_ = sample.now;
+      }
+      break;
+    }
+  }
+
+  void onLoss() override {}
+
+  void undoLoss() override {}
+
+  double cwnd() const override {
+    if (btl_bw_ <= 0.0 || min_rtt_ms_ <= 0.0) {
+      return std::min<double>(INITIAL_CWND, max_cwnd_);
+    }
+    return std::min(max_cwnd_, std::max(4.0, cwnd_gain_ * bdpPackets()));
+  }
+
+  double pacingRate(double srtt_ms) const override {
+    if (btl_bw_ <= 0.0) {
+      // No estimate yet: initial window per smoothed RTT at STARTUP gain
+      if (srtt_ms <= 0.0) {
+        return 0.0;
+      }
+      return HIGH_GAIN * INITIAL_CWND * packet_bytes_ / (srtt_ms / 1000.0);
+    }
+    return pacing_gain_ * btl_bw_;
+  }
+
+private:
+  // Bandwidth-delay product in packets
+  double bdpPackets() const {
+    return btl_bw_ * (min_rtt_ms_ / 1000.0) / packet_bytes_;
+  }
+
+  // Windowed max filter over the last BW_WINDOW_ROUNDS rounds. An
+  // app-limited sample only counts when it raises the estimate.
+  void update_bandwidth(double rate, bool app_limited) {
+    if (rate <= 0.0 || (app_limited && rate < btl_bw_)) {
+      return;
+    }
+    while (!bw_samples_.empty() &&
+           (bw_samples_.back().second <= rate ||
+            bw_samples_.front().first + BW_WINDOW_ROUNDS < round_count_)) {
+      if (bw_samples_.back().second <= rate) {
+        bw_samples_.pop_back();
+      } else {
+        bw_samples_.pop_front();
+      }
+    }
+    bw_samples_.emplace_back(round_count_, rate);
+    btl_bw_ = bw_samples_.front().second;
+  }
+
+  // Windowed min filter over MIN_RTT_WINDOW_S seconds
+  void update_min_rtt(double rtt_ms, high_resolution_clock::time_point now) {
+    if (rtt_ms <= 0.0) {
+      return;
+    }
+    bool expired = duration_cast<milliseconds>(now - min_rtt_stamp_).count() >
+                   MIN_RTT_WINDOW_S * 1000.0;
+    if (min_rtt_ms_ <= 0.0 || rtt_ms <= min_rtt_ms_ || expired) {
+      min_rtt_ms_ = rtt_ms;
+      min_rtt_stamp_ = now;
+    }
+  }
+
+  void enter_probe_bw(high_resolution_clock::time_point now) {
+    mode_ = PROBE_BW;
+    cwnd_gain_ = 2.0;
+    cycle_index_ = 0;
+    pacing_gain_ = 1.25;
+    cycle_stamp_ = now;
+  }
+};
+
+// Create a congestion controller by name ("none" returns null). Windows
+// are counted in packets of packet_bytes payload.
+std::unique_ptr<CongestionController>
+makeCongestionController(const std::string &name, double max_cwnd,
+                         int packet_bytes) {
+  if (name == "aimd") {
+    return std::unique_ptr<CongestionController>(
+        new AimdController(max_cwnd, packet_bytes));
+  }
+  if (name == "bbr") {
+    return std::unique_ptr<CongestionController>(
+        new BbrController(max_cwnd, packet_bytes));
+  }
+  if (name != "none") {
+    throw std::runtime_error("Unknown congestion controller: " + name);
+  }
+  return nullptr;
+}
+
+// Microsecond clock carried in packet timestamps (wraps every ~71 minutes;
+// only differences are used)
+inline uint32_t timestampMicros() {
+  return static_cast<uint32_t>(
+      duration_cast<microseconds>(steady_clock::now().time_since_epoch())
+          .count());
+}
+
+// Outcome of the payload handshake
+struct PayloadNegotiation {
+  int payload_size; // Data bytes every packet of the transfer carries
+  int server_max;   // Largest payload the server accepts
+  int route_mtu;    // Kernel's path MTU towards the server (0 = unknown)
+  int probes;       // Probe packets sent, lost ones included
+};
+
+// Settle the payload size with the server before a transfer, PLPMTUD
+// style: each probe is padded to the size of the data packet it stands
+// for and sent with DF set, so an acknowledged size is known to cross the
+// path unfragmented. The first probe, at the default size, doubles as the
+// handshake and learns the server's limit. The largest size that both
+// ends and the route allow goes next; if it is lost, a binary search
+// narrows the size down to PROBE_RESOLUTION bytes. A size only counts as
+// too big after PROBE_ATTEMPTS losses in a row.
+PayloadNegotiation negotiatePayload(const std::string &server_ip,
+                                    int server_port, int wanted) {
+  boost::asio::io_context context;
+  udp::socket socket(context, udp::endpoint(udp::v4(), 0));
+  socket.connect(udp::endpoint(
+      boost::asio::ip::address::from_string(server_ip), server_port));
+  PayloadNegotiation result = {DEFAULT_PAYLOAD_SIZE, 0, 0, 0};
+
+#ifdef __linux__
+  // Probe mode sets DF but ignores the cached path MTU, so a probe is
+  // only refused locally when it exceeds the interface MTU
+  int pmtu = IP_PMTUDISC_PROBE;
+  setsockopt(socket.native_handle(), IPPROTO_IP, IP_MTU_DISCOVER, &pmtu,
+             sizeof(pmtu));
+  int mtu = 0;
+  socklen_t length = sizeof(mtu);
+  if (getsockopt(socket.native_handle(), IPPROTO_IP, IP_MTU, &mtu,
+                 &length) == 0) {
+    result.route_mtu = mtu;
+  }
+#endif
+
+  std::random_device random;
+  SrProbe request;
+  std::memset(&request, 0, sizeof(request));
+  request.type = SR_PROBE_PACKET;
+  request.nonce = htonl32(random());
+  std::vector<char> buffer(SrPacket::headerSize() + MAX_PAYLOAD_SIZE, 0);
+
+  // Whether the server acknowledged a probe for this payload
+  auto probe = [&](int payload) {
+    request.payload_size = static_cast<uint16_t>(payload);
+    std::memcpy(buffer.data(), &request, sizeof(request));
+    size_t datagram = SrPacket::headerSize() + payload;
+    for (int attempt = 0; attempt < PROBE_ATTEMPTS; ++attempt) {
+      result.probes++;
+      boost::system::error_code error;
+      socket.send(boost::asio::buffer(buffer.data(), datagram), 0, error);
+      if (error == boost::asio::error::message_size) {
+        break; // Larger than the local interface: no use retrying
+      }
+
+      // Wait for the matching ACK, skipping stale ones
+      auto deadline = steady_clock::now() + milliseconds(PROBE_TIMEOUT_MS);
+      while (!error) {
+        SrProbe reply;
+        bool done = false;
+        size_t n = 0;
+        socket.async_receive(
+            boost::asio::buffer(&reply, sizeof(reply)),
+            [&](const boost::system::error_code &e, size_t bytes) {
+              done = true;
+              error = e;
+              n = bytes;
+            });
+        context.restart();
+        context.run_until(deadline);
+        if (!done) {
+          socket.cancel();
+          context.restart();
+          context.run();
+          break;
+        }
+        if (!error && n == sizeof(reply) && reply.type == SR_PROBE_ACK &&
+            reply.nonce == request.nonce &&
+            reply.payload_size == request.payload_size) {
+          result.server_max = reply.max_payload;
+          std::cout << "Probe: " << payload << "-byte payload ("
+                    << IPV4_UDP_HEADERS + datagram
+                    << "-byte datagram) acknowledged" << std::endl;
+          return true;
+        }
+      }
+    }
+    std::cout << "Probe: " << payload << "-byte payload ("
+              << IPV4_UDP_HEADERS + datagram << "-byte datagram) lost"
+              << std::endl;
+    return false;
+  };
+
+  int best = std::min(wanted, DEFAULT_PAYLOAD_SIZE);
+  if (!probe(best)) {
+    throw std::runtime_error("No reply to the payload handshake");
+  }
+  int ceiling = std::min(wanted, result.server_max);
+  if (result.route_mtu > 0) {
+    ceiling = std::min<int>(ceiling, result.route_mtu - IPV4_UDP_HEADERS -
+                                         SrPacket::headerSize());
+  }
+  if (ceiling > best) {
+    if (probe(ceiling)) {
+      best = ceiling;
+    } else {
+      int too_big = ceiling;
+      while (too_big - best > PROBE_RESOLUTION) {
+        int middle = best + (too_big - best) / 2;
+        if (probe(middle)) {
+          best = middle;
+        } else {
+          too_big = middle;
+        }
+      }
+    }
+  }
+  result.payload_size =
+      std::max(MIN_PAYLOAD_SIZE, std::min(best, result.server_max));
+  return result;
+}
+
+// Hierarchical timing wheel (Varghese and Lauck) for per-packet timers.
+// Timers hang in intrusive per-slot lists, so scheduling and cancelling
+// cost O(1) however many are outstanding, and one periodic tick fires
+// everything that came due since the last one. Level 0 has a slot per
+// tick; each level above is SLOTS times coarser, and its timers move
+// down when the level below comes round to them; timers beyond the top
+// level wait in its farthest slot and are placed again from there. Time
+// is counted in ticks of the caller's choosing.
+class TimerWheel {
+public:
+  // Embedded in whatever the timer belongs to; key identifies it to the
+  // expiry callback
+  struct Node {
+    Node *prev = nullptr;
+    Node *next = nullptr;
+    uint64_t expires = 0; // Tick the timer is due at
+    uint32_t key = 0;
+  };
+
+  static constexpr int LEVELS = 4;
+  static constexpr int BITS = 6; // SLOTS = 64 per level
+  static constexpr uint64_t SLOTS = uint64_t(1) << BITS;
+
+  explicit TimerWheel(uint64_t now = 0) : now_(now), size_(0) { clear(); }
+
+  // Lists point at their heads: neither copyable nor movable
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  // Forget every timer (their nodes are left as they are)
+  void clear() {
+    for (auto &level : slots_) {
+      for (Node &head : level) {
+        head.prev = head.next = &head;
+      }
+    }
+    size_ = 0;
+  }
+
+  uint64_t now() const { return now_; }
+  size_t size() const { return size_; }
+  static bool pending(const Node &node) { return node.next != nullptr; }
+
+  // Arm (or re-arm) a timer for tick `expires`; a tick already passed
+  // means the next one
+  void schedule(Node &node, uint64_t expires) {
+    if (pending(node)) {
+      unlink(node);
+    }
+    node.expires = std::max(expires, now_ + 1);
+    place(node);
+    size_++;
+  }
+
+  void cancel(Node &node) {
+    if (pending(node)) {
+      unlink(node);
+    }
+  }
+
+  // Move time forward to tick `to`, calling expired(node) for every timer
+  // that comes due, in tick order. The node is disarmed before the call,
+  // which may schedule or cancel any timer. Returns the timers fired.
+  template <typename Expired> size_t advance(uint64_t to, Expired expired) {
+    size_t fired = 0;
+    while (now_ < to) {
+      now_++;
+      for (int level = 1; level < LEVELS; ++level) {
+        if (now_ & ((uint64_t(1) << (BITS * level)) - 1)) {
+          break;
+        }
+        cascade(slots_[level][(now_ >> (BITS * level)) & (SLOTS - 1)]);
+      }
+      Node &head = slots_[0][now_ & (SLOTS - 1)];
+      while (head.next != &head) {
+        Node *node = head.next;
+        unlink(*node);
+        expired(*node);
+        fired++;
+      }
+    }
+    return fired;
+  }
+
+private:
+  uint64_t now_;
+  size_t size_;
+  Node slots_[LEVELS][SLOTS]; // List heads
+
+  // Hang a node in the slot its distance from now falls in
+  void place(Node &node) {
+    uint64_t delta = node.expires > now_ ? node.expires - now_ : 0;
+    int level = 0;
+    while (level + 1 < LEVELS && delta >= (uint64_t(1) << (BITS * (level + 1)))) {
+      level++;
+    }
+    uint64_t tick = node.expires;
+    if (delta >= (uint64_t(1) << (BITS * LEVELS))) {
+      tick = now_ + (uint64_t(1) << (BITS * LEVELS)) - 1;
+    }
+    Node &head = slots_[level][(tick >> (BITS * level)) & (SLOTS - 1)];
+    node.prev = head.prev;
+    node.next = &head;
+    head.prev->next = &node;
+    head.prev = &node;
+  }
+
+  void unlink(Node &node) {
+    node.prev->next = node.next;
+    node.next->prev = node.prev;
+    node.prev = node.next = nullptr;
+    size_--;
+  }
+
+  // A higher level's slot came round: spread its timers over the levels
+  // below
+  void cascade(Node &head) {
+    Node list;
+    list.prev = list.next = &list;
+    if (head.next != &head) {
+      list.next = head.next;
+      list.prev = head.prev;
+      list.next->prev = &list;
+      list.prev->next = &list;
+      head.prev = head.next = &head;
+    }
+    while (list.next != &list) {
+      Node *node = list.next;
+      list.next = node->next;
+      node->next->prev = &list;
+      place(*node);
+    }
+  }
+};
+
+// Per-packet state kept by the selective-repeat sender
+struct InFlightPacket {
+  SrPacket *packet;                            // Header as sent on the wire
+  const char *payload; // packet->data, or the bytes in the file mapping
+  high_resolution_clock::time_point send_time; // Time of the last send
+  int retries;                                 // Retransmissions so far
+  uint32_t prior_timestamp; // Timestamp of the copy sent before the last
+  bool acked;                                  // ACK received
+  uint64_t delivered;                          // Bytes delivered at send
+  high_resolution_clock::time_point delivered_time; // When that was reached
+  high_resolution_clock::time_point first_sent_time; // Send time of the
+                                                     // packet delivered then
+  bool app_limited; // Sent with too few packets in flight to fill the path
+  TimerWheel::Node timer; // Retransmission timeout, keyed by seq_num
+  uint32_t tx_key;        // --timestamps: kernel's count for the last send
+  int64_t kernel_tx_ns;   // and its send stamp (0 = not reported yet)
+};
+
+// UDP Client implementation
+class UdpClient {
+private:
+  boost::asio::io_context &io_context_;
+  udp::socket socket_;
+  udp::endpoint server_endpoint_;
+  FileSource *source_; // File being sent, streamed packet by packet
+  size_t bytes_sent_;
+  uint8_t current_seq_num_;
+  int retry_count_;
+  boost::asio::steady_timer timer_;
+  bool verbose_;
+  LatencyStats latency_stats_;
+  high_resolution_clock::time_point packet_send_time_;
+
+  // Current packet being sent; its payload is in send_packet_.data or the
+  // file mapping
+  Packet send_packet_;
+  const char *send_payload_;
+  uint8_t ack_buffer_;
+
+  // Selective-repeat state (window_size_ == 0 selects stop-and-wait)
+  int window_size_;
+  uint32_t send_base_;    // Oldest unacknowledged sequence number
+  uint32_t next_seq_num_; // Next sequence number to be sent
+  uint32_t total_packets_; // End of the packet range being sent
+  uint32_t transfer_id_;   // Tells this transfer apart at the server
+  uint64_t range_offset_;  // File offset of the first packet sent
+  uint64_t range_bytes_;   // Bytes in the range (the whole file by default)
+  ChecksumAlgorithm checksum_; // Payload checksum, recorded in each packet
+  int payload_size_;           // Negotiated data bytes per packet
+  std::deque<InFlightPacket> in_flight_; // Indexed by seq_num - send_base_
+  // Retransmission timers of the unacknowledged packets in in_flight_,
+  // counted in SR_WHEEL_TICK_US ticks since wheel_origin_
+  TimerWheel rto_wheel_;
+  high_resolution_clock::time_point wheel_origin_;
+  std::vector<uint32_t> expired_; // Sequence numbers timed out this tick
+  std::vector<char> packet_ring_; // Window of packets, seq % window_size_
+  SrAck sr_ack_buffer_;
+  udp::endpoint ack_endpoint_;
+  size_t last_progress_percentage_;
+  bool transfer_failed_;
+
+  // Batched send/ACK path (sendmmsg/recvmmsg), null for per-packet I/O
+  std::unique_ptr<BatchedUdpIO> batch_io_;
+
+  // Kernel send/receive stamps for the RTT split (--timestamps), null when
+  // off. ACKs are then read with recvmsg() to get their stamps.
+  std::unique_ptr<KernelTimestamps> stamps_;
+
+  // Adaptive retransmission timeout (both modes) and congestion control
+  // (selective-repeat mode, null for a fixed unpaced window)
+  RttEstimator rtt_;
+  std::unique_ptr<CongestionController> cc_;
+  boost::asio::steady_timer pacing_timer_;
+  steady_clock::time_point next_send_time_; // Pacing release time
+  bool pacing_wait_;                        // pacing_timer_ is armed
+  uint32_t recovery_point_;  // Timeouts below this are in the current episode
+  uint32_t peer_window_end_; // Receiver accepts packets below this
+  high_resolution_clock::time_point newest_acked_send_; // Last sent of
+                                                        // the ACKed ones
+  high_resolution_clock::duration newest_acked_rtt_;    // and its RTT
+  uint32_t loss_scan_;       // Packets below this were checked for loss
+  double min_rtt_ms_;        // Lowest RTT sample, sizes the reorder window
+  int reorder_steps_;        // Reorder window in min RTT / 4 steps
+  int reorder_quiet_;        // Loss episodes since the window last widened
+  bool undo_possible_;       // No resend of this episode was needed yet
+  int undo_pending_;         // Resends of this episode not shown needless
+  uint64_t delivered_;       // Payload bytes acknowledged so far
+  high_resolution_clock::time_point delivered_time_; // Time of last delivery
+  high_resolution_clock::time_point first_sent_time_; // Send time of the
+                                                      // last one delivered
+  uint64_t next_round_delivered_; // delivered_ that ends the current round
+
+  // Forward error correction: K repair packets after every N data packets
+  // (fec_data_ == 0 disables it). Each repair row is accumulated as the
+  // block's packets go out, so nothing is buffered.
+  int fec_data_;
+  int fec_repair_;
+  uint32_t range_first_;              // Blocks are counted from here
+  uint32_t fec_block_first_;          // First packet of the current block
+  int fec_block_count_;               // Packets added to the current block
+  std::vector<uint8_t> fec_rows_;     // K repair symbols being built
+  std::deque<SrRepair> fec_pending_;  // Repair packets awaiting a batch flush
+
+  // Resumed transfer: chunks the receiver already has (null otherwise)
+  const ResumeBitmap *resume_;
+  uint64_t resumed_bytes_; // Bytes skipped because the receiver has them
+
+  // Compressed transfer: packets carry the frame stream instead of the
+  // file (null otherwise)
+  BlockCompressor *compressor_;
+
+public:
+  UdpClient(boost::asio::io_context &io_context, const std::string &server_ip,
+            int server_port, bool verbose = false, int window_size = 0,
+            int batch_size = 0, bool gso = false,
+            const std::string &congestion_control = "none",
+            ChecksumAlgorithm checksum = ChecksumAlgorithm::CRC32C,
+            int fec_data = 0, int fec_repair = 0,
+            int payload_size = DEFAULT_PAYLOAD_SIZE, bool timestamps = false)
+      : io_context_(io_context),
+        socket_(io_context, udp::endpoint(udp::v4(), 0)), // Bind to any port
+        server_endpoint_(boost::asio::ip::address::from_string(server_ip),
+                         server_port),
+        source_(nullptr), bytes_sent_(0), current_seq_num_(0),
+        retry_count_(0), timer_(io_context), verbose_(verbose),
+        send_payload_(nullptr), window_size_(window_size),
+        send_base_(0), next_seq_num_(0), total_packets_(0), transfer_id_(0),
+        range_offset_(0), range_bytes_(0), checksum_(checksum),
+        payload_size_(payload_size),
+        wheel_origin_(high_resolution_clock::now()),
+        last_progress_percentage_(0), transfer_failed_(false),
+        pacing_timer_(io_context), pacing_wait_(false), recovery_point_(0),
+        peer_window_end_(0), loss_scan_(0), min_rtt_ms_(0.0),
+        reorder_steps_(1), reorder_quiet_(0), undo_possible_(false),
+        undo_pending_(0), delivered_(0),
+        next_round_delivered_(0), fec_data_(0), fec_repair_(0),
+        range_first_(0), fec_block_first_(0),
+        fec_block_count_(0), resume_(nullptr), resumed_bytes_(0),
+        compressor_(nullptr) {
+
+    // Set up socket buffer sizes; a sliding window needs room for a full
+    // window of packets (and their ACKs) in the kernel buffers
+    int buffer_size = 8192;
+    if (window_size_ > 0) {
+      buffer_size = std::max(
+          buffer_size, window_size_ * static_cast<int>(packetBytes()));
+      packet_ring_.resize(window_size_ * packetBytes());
+    }
+    socket_.set_option(
+        boost::asio::socket_base::receive_buffer_size(buffer_size));
+    socket_.set_option(boost::asio::socket_base::send_buffer_size(buffer_size));
+
+#ifdef __linux__
+    // Payloads above the default were sized by path MTU discovery: keep
+    // the DF bit set so a shrinking path shows up as EMSGSIZE rather than
+    // as silent fragmentation
+    if (payload_size_ > DEFAULT_PAYLOAD_SIZE) {
+      int pmtu = IP_PMTUDISC_DO;
+      setsockopt(socket_.native_handle(), IPPROTO_IP, IP_MTU_DISCOVER, &pmtu,
+                 sizeof(pmtu));
+    }
+#endif
+
+    latency_stats_.setWindowSize(window_size_);
+    latency_stats_.setPayload(payload_size_, window_size_ > 0
+                                                 ? SrPacket::headerSize()
+                                                 : Packet::headerSize());
+
+    std::cout << "Client initialized, connecting to " << server_ip << ":"
+              << server_port << std::endl;
+    if (window_size_ > 0) {
+      std::cout << "Selective-repeat mode, window size: " << window_size_
+                << " packets" << std::endl;
+      if (timestamps) {
+        stamps_.reset(new KernelTimestamps(socket_));
+        if (stamps_->enable()) {
+          std::cout << "Kernel timestamps enabled (SO_TIMESTAMPING)"
+                    << std::endl;
+        } else {
+          std::cout << "Kernel timestamps not supported, RTTs are "
+                       "user-space only"
+                    << std::endl;
+          stamps_.reset();
+        }
+      }
+      // One send stamp covers a whole GSO super-buffer
+      if (gso && stamps_) {
+        std::cout << "UDP GSO off: kernel timestamps need one send per "
+                     "datagram"
+                  << std::endl;
+        gso = false;
+      }
+      // GSO needs a queue deep enough to fill a 64 KB super-buffer
+      if (gso && batch_size < GSO_MIN_BATCH) {
+        batch_size = GSO_MIN_BATCH;
+      }
+      if (batch_size > 0) {
+        batch_io_.reset(
+            new BatchedUdpIO(socket_, batch_size, sizeof(SrAck)));
+        std::cout << "Batched I/O, up to " << batch_size
+                  << " datagrams per syscall" << std::endl;
+        latency_stats_.setIoMode("batched sendmmsg");
+      }
+      if (gso) {
+        if (batch_io_->enableGso()) {
+          std::cout << "UDP GSO enabled" << std::endl;
+          latency_stats_.setIoMode("UDP GSO");
+        } else {
+          std::cout << "UDP GSO not supported, using plain batching"
+                    << std::endl;
+        }
+      }
+
+      latency_stats_.setChecksum(
+          std::string(checksumName(checksum_)) + " (" +
+          checksumImplementation(checksum_).name + ")");
+
+      cc_ = makeCongestionController(congestion_control, window_size_,
+                                     payload_size_);
+      if (cc_) {
+        std::cout << "Congestion control: " << cc_->name() << std::endl;
+        latency_stats_.setCongestionControl(cc_->name());
+      }
+
+      if (fec_data > 0) {
+        fec_data_ = fec_data;
+        fec_repair_ = fec_repair;
+        fec_rows_.resize(fec_repair_ * fecSymbolSize(payload_size_));
+        latency_stats_.setFec(fec_data_, fec_repair_);
+        std::cout << "FEC: " << fec_repair_ << " repair packets per "
+                  << fec_data_ << " data packets" << std::endl;
+      }
+    } else {
+      if (congestion_control != "none") {
+        std::cerr << "Congestion control needs --window, ignoring --cc"
+                  << std::endl;
+      }
+      if (fec_data > 0) {
+        std::cerr << "FEC needs --window, ignoring --fec" << std::endl;
+      }
+    }
+  }
+
+  // Send a file using stop-and-wait or selective-repeat protocol. Packets
+  // are read from the source as they are sent; the source must outlive
+  // io_context.run().
+  void send_file(FileSource &source) {
+    source_ = &source;
+    bytes_sent_ = 0;
+    current_seq_num_ = 0;
+
+    // Start timing the transfer
+    latency_stats_.startTransfer();
+
+    std::cout << "Starting transfer of " << source_->size() << " bytes"
+              << std::endl;
+
+    if (window_size_ > 0) {
+      uint64_t packets = packetCount(
+          compressor_ ? BlockCompressor::maxStreamBytes(source_->size())
+                      : source_->size(),
+          payload_size_);
+      if (packets > UINT32_MAX) {
+        throw std::runtime_error(
+            "File too large for 32-bit sequence numbers");
+      }
+      std::random_device random;
+      do {
+        transfer_id_ = random(); // 0 is reserved for stop-and-wait sessions
+      } while (transfer_id_ == 0);
+
+      // The frame stream's length is only known once its last frame is
+      // built, so the range stays open until then
+      if (compressor_) {
+        compressor_->start([this]() {
+          boost::asio::post(io_context_,
+                            boost::bind(&UdpClient::handle_frames_ready,
+                                        this));
+        });
+        packets = UINT32_MAX;
+      }
+      start_selective_repeat(0, static_cast<uint32_t>(packets));
+    } else {
+      prepare_next_packet();
+    }
+  }
+
+  // Send packets [first, end) of a file as one stream of a multi-stream
+  // transfer announced under transfer_id (selective-repeat mode only)
+  void send_range(FileSource &source, uint32_t first, uint32_t end,
+                  uint32_t transfer_id) {
+    source_ = &source;
+    bytes_sent_ = 0;
+    transfer_id_ = transfer_id;
+    latency_stats_.startTransfer();
+    start_selective_repeat(first, end);
+  }
+
+  // Skip the packets a resumed transfer's receiver already has. The bitmap
+  // must outlive the transfer.
+  void setResumeBitmap(const ResumeBitmap *bitmap) { resume_ = bitmap; }
+
+  // Send the file compressed (selective-repeat mode, single stream). The
+  // compressor reads the same source and must outlive io_context.run().
+  void setCompressor(BlockCompressor *compressor) { compressor_ = compressor; }
+
+  // Whether the transfer was abandoned after too many retransmissions
+  bool transferFailed() const { return transfer_failed_; }
+
+  // Record how the payload size was settled, for the statistics report
+  void setPathMtu(int route_mtu, int probes) {
+    latency_stats_.setPathMtu(route_mtu, probes);
+  }
+
+  // Get latency statistics
+  const LatencyStats &getLatencyStats() const { return latency_stats_; }
+
+  // Prepare the next packet to be sent
+  void prepare_next_packet() {
+    // An empty file still goes out as a single empty last packet
+    if (bytes_sent_ >= source_->size() &&
+        (source_->size() > 0 || current_seq_num_ != 0)) {
+      // Transfer complete, record end time and stats
+      latency_stats_.endTransfer(source_->size());
+      latency_stats_.setRttState(rtt_.srtt(), rtt_.rttvar(), rtt_.rto());
+      std::cout << "All data sent successfully (" << source_->size()
+                << " bytes)" << std::endl;
+      return;
+    }
+
+    // Calculate data size for this packet
+    size_t remaining_bytes = source_->size() - bytes_sent_;
+    size_t packet_data_size =
+        std::min(remaining_bytes, static_cast<size_t>(payload_size_));
+
+    // Create packet
+    send_packet_.seq_num = current_seq_num_;
+    send_packet_.data_size = static_cast<uint16_t>(packet_data_size);
+    send_packet_.is_last =
+        (bytes_sent_ + packet_data_size == source_->size()) ? 1 : 0;
+
+    // Send the payload from the file mapping, or read it into the packet
+    send_payload_ = source_->span(bytes_sent_, packet_data_size);
+    if (send_payload_) {
+      latency_stats_.addZeroCopyBytes(packet_data_size);
+    } else {
+      source_->read(bytes_sent_, send_packet_.data, packet_data_size);
+      send_payload_ = send_packet_.data;
+    }
+
+    // Calculate CRC (only on the actual data)
+    uint32_t raw_crc = calculateCRC(send_payload_, packet_data_size);
+    send_packet_.crc = htonl32(raw_crc); // Convert to network byte order
+
+    if (verbose_) {
+      debugPacket(send_packet_, "Preparing packet", send_payload_);
+    }
+
+    // Reset retry count
+    retry_count_ = 0;
+
+    // Start sending
+    send_packet_with_retry();
+  }
+
+  // Send the current packet with retry mechanism
+  void send_packet_with_retry() {
+    if (retry_count_ >= MAX_RETRIES) {
+      std::cerr << "Failed to send packet after " << MAX_RETRIES << " attempts"
+                << std::endl;
+      return;
+    }
+
+    // Record send time for latency measurement
+    packet_send_time_ = high_resolution_clock::now();
+
+    if (verbose_ || retry_count_ > 0) {
+      std::cout << "Sending packet with seq_num: " << (int)send_packet_.seq_num
+                << ", size: " << send_packet_.data_size << " bytes"
+                << " (attempt " << retry_count_ + 1 << ")"
+                << " [" << bytes_sent_ << "/" << source_->size()
+                << " bytes total]" << std::endl;
+    }
+
+    // Send the packet, header and payload gathered
+    boost::array<boost::asio::const_buffer, 2> buffers = {
+        {boost::asio::buffer(&send_packet_, Packet::headerSize()),
+         boost::asio::buffer(send_payload_, send_packet_.data_size)}};
+    socket_.async_send_to(
+        buffers, server_endpoint_,
+        boost::bind(&UdpClient::handle_send, this,
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred));
+  }
+
+  // Handle send completion
+  void handle_send(const boost::system::error_code &error, size_t bytes_sent) {
+    if (!error) {
+      // Wait for ACK
+      wait_for_ack();
+    } else {
+      std::cerr << "Send error: " << error.message() << std::endl;
+      retry_count_++;
+
+      // Schedule retry after the backed-off retransmission timeout
+      timer_.expires_after(rtoDuration(rtt_.rtoFor(retry_count_)));
+      timer_.async_wait(boost::bind(&UdpClient::send_packet_with_retry, this));
+    }
+  }
+
+  // Wait for acknowledgment
+  void wait_for_ack() {
+    socket_.async_receive_from(
+        boost::asio::buffer(&ack_buffer_, sizeof(ack_buffer_)),
+        server_endpoint_,
+        boost::bind(&UdpClient::handle_receive_ack, this,
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred));
+
+    // Set a timeout for ACK receipt from the RTT estimate
+    timer_.expires_after(rtoDuration(rtt_.rto()));
+    timer_.async_wait(boost::bind(&UdpClient::handle_timeout, this,
+                                  boost::asio::placeholders::error));
+  }
+
+  // Handle received ACK
+  void handle_receive_ack(const boost::system::error_code &error,
+                          size_t bytes_received) {
+    // Cancel the timeout timer
+    timer_.cancel();
+
+    if (!error && bytes_received == sizeof(uint8_t) &&
+        ack_buffer_ == ACK_PACKET) {
+      // Calculate round-trip time
+      auto now = high_resolution_clock::now();
+      double latency_ms =
+          duration_cast<microseconds>(now - packet_send_time_).count() / 1000.0;
+
+      // Record latency statistics
+      latency_stats_.addLatency(latency_ms, retry_count_ > 0);
+
+      // Karn's rule: an ACK for a retransmitted packet is ambiguous
+      if (retry_count_ == 0) {
+        rtt_.addSample(latency_ms);
+      }
+
+      if (verbose_) {
+        std::cout << "Received ACK for seq_num: " << (int)send_packet_.seq_num
+                  << " (latency: " << std::fixed << std::setprecision(2)
+                  << latency_ms << " ms)" << std::endl;
+      }
+
+      // Update bytes sent
+      bytes_sent_ += send_packet_.data_size;
+      source_->release(bytes_sent_);
+
+      // Show progress if not verbose (verbose mode already shows per-packet
+      // progress)
+      if (!verbose_ && source_->size() > static_cast<size_t>(payload_size_)) {
+        // Only show progress every 5% or 10 packets, whichever comes first
+        static size_t last_percentage = 0;
+        static int packet_count = 0;
+
+        packet_count++;
+        size_t current_percentage = (bytes_sent_ * 100) / source_->size();
+
+        if (current_percentage >= last_percentage + 5 || packet_count >= 10) {
+          std::cout << "Progress: " << current_percentage << "% ("
+                    << bytes_sent_ << "/" << source_->size() << " bytes)"
+                    << " [latency: " << std::fixed << std::setprecision(2)
+                    << latency_ms << " ms]" << std::endl;
+          last_percentage = current_percentage;
+          packet_count = 0;
+        }
+      }
+
+      // Flip sequence number for next packet
+      current_seq_num_ = 1 - current_seq_num_;
+
+      // Move to next packet
+      prepare_next_packet();
+    } else if (!error) {
+      std::cerr << "Received invalid ACK, retrying..." << std::endl;
+      retry_count_++;
+      send_packet_with_retry();
+    } else if (error != boost::asio::error::operation_aborted) {
+      // If error is not due to timer cancellation
+      std::cerr << "ACK receive error: " << error.message() << std::endl;
+      retry_count_++;
+      send_packet_with_retry();
+    }
+  }
+
+  // Handle timeout waiting for ACK
+  void handle_timeout(const boost::system::error_code &error) {
+    if (!error) { // if operation hasn't been cancelled
+      std::cout << "ACK timeout, retransmitting..." << std::endl;
+
+      // Cancel any pending receive operation
+      socket_.cancel();
+
+      // Back off the timeout, increment retry counter and retransmit
+      rtt_.backoff();
+      retry_count_++;
+      send_packet_with_retry();
+    }
+  }
+
+  // Convert a timeout in milliseconds to a timer duration
+  static boost::asio::chrono::microseconds rtoDuration(double rto_ms) {
+    return boost::asio::chrono::microseconds(
+        static_cast<int64_t>(rto_ms * 1000.0));
+  }
+
+  // ---- Selective-repeat mode ----
+
+  // Set up the window over packets [first, end) and start sending
+  void start_selective_repeat(uint32_t first, uint32_t end) {
+    total_packets_ = end;
+    range_offset_ = static_cast<uint64_t>(first) * payload_size_;
+    range_bytes_ =
+        std::min<uint64_t>(source_->size(),
+                           static_cast<uint64_t>(end) * payload_size_) -
+        range_offset_;
+    if (first > 0) {
+      source_->releaseFrom(range_offset_);
+    }
+    send_base_ = first;
+    next_seq_num_ = first;
+    range_first_ = first;
+    fec_block_count_ = 0;
+    resumed_bytes_ = 0;
+    in_flight_.clear();
+    rto_wheel_.clear();
+    delivered_ = 0;
+    delivered_time_ = high_resolution_clock::now();
+    first_sent_time_ = delivered_time_;
+    next_round_delivered_ = 0;
+    recovery_point_ = 0;
+    peer_window_end_ = end; // Until the receiver advertises its window
+    newest_acked_send_ = high_resolution_clock::time_point();
+    newest_acked_rtt_ = high_resolution_clock::duration::zero();
+    loss_scan_ = first;
+    undo_possible_ = false;
+    next_send_time_ = steady_clock::now();
+
+    receive_sr_ack();
+    schedule_retransmit_tick();
+    fill_window();
+  }
+
+  // Bytes one packet takes on the wire and in the window
+  size_t packetBytes() const {
+    return SrPacket::headerSize() + payload_size_;
+  }
+
+  // Window slot holding a packet. The window never spans more than
+  // window_size_ packets, so a slot is free again by the time its next
+  // sequence number is sent.
+  SrPacket *packet_slot(uint32_t seq_num) {
+    return reinterpret_cast<SrPacket *>(
+        &packet_ring_[(seq_num % window_size_) * packetBytes()]);
+  }
+
+  // Packets allowed in flight: --window, capped by the congestion window
+  // and by what the receiver last said it has room for
+  uint32_t send_window() const {
+    uint32_t window = static_cast<uint32_t>(window_size_);
+    if (cc_) {
+      window = std::min(window, std::max<uint32_t>(
+                                    1, static_cast<uint32_t>(cc_->cwnd())));
+    }
+    // A closed window still lets one packet through as a probe, so the
+    // ACK that reopens it is not waited for in vain
+    window = std::min(window, peer_window_end_ > send_base_
+                                  ? peer_window_end_ - send_base_
+                                  : 1);
+    return window;
+  }
+
+  // Packets per ACKed in-order run: the receiver's default --ack-every,
+  // or half the send window when that is smaller, so that at least two
+  // ACKs come back per window. With fewer in flight, an ACK would wait out
+  // the receiver's ACK delay.
+  uint32_t ack_run() const {
+    return std::max<uint32_t>(
+        1, std::min<uint32_t>(DEFAULT_ACK_EVERY, send_window() / 2));
+  }
+
+  // Send new packets until the window is full, or until the pacing rate
+  // says to wait
+  void fill_window() {
+    uint64_t start_cycles = readCycleCounter();
+    auto now = steady_clock::now();
+    double rate = cc_ ? cc_->pacingRate(rtt_.srtt()) : 0.0;
+    nanoseconds packet_gap(0);
+    if (rate > 0.0) {
+      // Allow a burst of up to 1 ms (and at least two packets) after idling
+      packet_gap = nanoseconds(
+          static_cast<int64_t>(1e9 * packetBytes() / rate) + 1);
+      nanoseconds credit = std::max<nanoseconds>(milliseconds(1),
+                                                 packet_gap * 2);
+      next_send_time_ = std::max(next_send_time_, now - credit);
+    }
+
+    while (next_seq_num_ < total_packets_ &&
+           next_seq_num_ - send_base_ < send_window()) {
+      // Compressed transfer: wait for the workers when the next packet's
+      // worth of frames is not built yet
+      if (compressor_ && !compressor_->ready(payload_size_)) {
+        break;
+      }
+      if (rate > 0.0) {
+        if (next_send_time_ > now) {
+          schedule_pacing();
+          break;
+        }
+        next_send_time_ += packet_gap;
+      }
+
+      uint64_t offset = static_cast<uint64_t>(next_seq_num_) * payload_size_;
+      size_t packet_data_size = 0;
+      if (!compressor_) {
+        packet_data_size = std::min<uint64_t>(source_->size() - offset,
+                                              payload_size_);
+      }
+
+      // Already at the receiver: slide past it, or hold its place as
+      // acknowledged behind packets still in flight
+      if (already_delivered(next_seq_num_)) {
+        resumed_bytes_ += packet_data_size;
+        if (in_flight_.empty()) {
+          bytes_sent_ += packet_data_size;
+          send_base_++;
+        } else {
+          in_flight_.emplace_back();
+          in_flight_.back().acked = true;
+          in_flight_.back().packet = packet_slot(next_seq_num_);
+          in_flight_.back().payload = in_flight_.back().packet->data;
+          in_flight_.back().packet->data_size =
+              static_cast<uint16_t>(packet_data_size);
+        }
+        next_seq_num_++;
+        continue;
+      }
+
+      in_flight_.emplace_back();
+      InFlightPacket &entry = in_flight_.back();
+      entry.retries = 0;
+      entry.acked = false;
+      entry.packet = packet_slot(next_seq_num_);
+      entry.payload = nullptr;
+
+      SrPacket &packet = *entry.packet;
+      packet.type = SR_DATA_PACKET;
+      packet.transfer_id = htonl32(transfer_id_);
+      packet.seq_num = htonl32(next_seq_num_);
+      if (compressor_) {
+        bool last = false;
+        packet_data_size =
+            compressor_->take(packet.data, payload_size_, last);
+        if (last) {
+          total_packets_ = next_seq_num_ + 1;
+        }
+        packet.encoding = PAYLOAD_FRAMED;
+      } else {
+        // Mapped file: the packet is sent gathered from its header and the
+        // mapping, so the payload is never copied in user space
+        entry.payload = source_->span(offset, packet_data_size);
+        if (entry.payload) {
+          latency_stats_.addZeroCopyBytes(packet_data_size);
+        } else {
+          source_->read(offset, packet.data, packet_data_size);
+        }
+        packet.encoding = PAYLOAD_RAW;
+      }
+      if (!entry.payload) {
+        entry.payload = packet.data;
+      }
+      packet.data_size = static_cast<uint16_t>(packet_data_size);
+      packet.payload_size = static_cast<uint16_t>(payload_size_);
+      packet.is_last = (next_seq_num_ + 1 == total_packets_) ? 1 : 0;
+      packet.checksum = static_cast<uint8_t>(checksum_);
+      packet.fec_data = static_cast<uint8_t>(fec_data_);
+      packet.fec_repair = static_cast<uint8_t>(fec_repair_);
+      packet.crc = htonl32(
+          calculateChecksum(checksum_, entry.payload, packet_data_size));
+
+      // The packet that ends each ACK run, the last of a paced burst and
+      // the last of the file ask for their ACK at once: the receiver would
+      // otherwise hold back an ACK the sender waits for, which looks like
+      // a slower path to the congestion controller
+      next_seq_num_++;
+      bool burst_end = rate > 0.0 && next_send_time_ > now;
+      transmit(entry, next_seq_num_ % ack_run() == 0 || burst_end ||
+                          next_seq_num_ == total_packets_);
+      if (fec_data_ > 0) {
+        add_to_fec_block(packet, entry.payload);
+      }
+    }
+    flush_sends();
+    latency_stats_.addSendCycles(readCycleCounter() - start_cycles);
+  }
+
+  // Whether a resumed transfer can skip a packet: its whole FEC block (or
+  // the packet itself, without FEC) is at the receiver. The final block is
+  // always sent, so the transfer still ends on an ACK.
+  bool already_delivered(uint32_t seq_num) const {
+    if (!resume_) {
+      return false;
+    }
+    uint32_t block = fec_data_ > 0 ? fec_data_ : 1;
+    uint32_t first = range_first_ + (seq_num - range_first_) / block * block;
+    uint32_t end = static_cast<uint32_t>(
+        std::min<uint64_t>(static_cast<uint64_t>(first) + block,
+                           total_packets_));
+    return end < total_packets_ && resume_->rangePresent(first, end);
+  }
+
+  // Fold a first-time packet into the repair rows of its block; the block's
+  // repair packets go out right after its last data packet
+  void add_to_fec_block(const SrPacket &packet, const char *payload) {
+    uint32_t seq_num = ntohl32(packet.seq_num);
+    int index = (seq_num - range_first_) % fec_data_;
+    if (index == 0) {
+      std::fill(fec_rows_.begin(), fec_rows_.end(), 0);
+      fec_block_first_ = seq_num;
+      fec_block_count_ = 0;
+    }
+    size_t symbol_size = fecSymbolSize(payload_size_);
+    for (int row = 0; row < fec_repair_; ++row) {
+      fecAccumulate(&fec_rows_[row * symbol_size],
+                    fecCoefficient(fec_repair_, row, index), packet.data_size,
+                    packet.is_last, payload);
+    }
+    fec_block_count_++;
+    if (index + 1 == fec_data_ || seq_num + 1 == total_packets_) {
+      send_fec_repairs();
+    }
+  }
+
+  // Put the current block's K repair packets on the wire. They are not
+  // tracked in the window: a lost repair packet is never resent.
+  void send_fec_repairs() {
+    uint32_t timestamp = timestampMicros();
+    size_t symbol_size = fecSymbolSize(payload_size_);
+    size_t repair_bytes = SrRepair::headerSize() + symbol_size;
+    for (int row = 0; row < fec_repair_; ++row) {
+      fec_pending_.emplace_back();
+      SrRepair &repair = fec_pending_.back();
+      repair.type = SR_REPAIR_PACKET;
+      repair.transfer_id = htonl32(transfer_id_);
+      repair.block_first = htonl32(fec_block_first_);
+      repair.timestamp = timestamp;
+      repair.fec_data = static_cast<uint8_t>(fec_data_);
+      repair.fec_repair = static_cast<uint8_t>(fec_repair_);
+      repair.block_count = static_cast<uint8_t>(fec_block_count_);
+      repair.repair_index = static_cast<uint8_t>(row);
+      std::memcpy(repair.symbol, &fec_rows_[row * symbol_size], symbol_size);
+      repair.crc = htonl32(calculateChecksum(
+          ChecksumAlgorithm::CRC32C,
+          reinterpret_cast<const char *>(repair.symbol), symbol_size));
+
+      latency_stats_.addWireBytes(symbol_size);
+      latency_stats_.addFecRepair();
+      if (stamps_) {
+        stamps_->noteSend(KernelTimestamps::UNTAGGED);
+      }
+
+      if (batch_io_) {
+        batch_io_->queue(&repair, repair_bytes, server_endpoint_);
+        continue;
+      }
+      boost::system::error_code error;
+      socket_.send_to(boost::asio::buffer(&repair, repair_bytes),
+                      server_endpoint_, 0, error);
+      if (error) {
+        std::cerr << "Send error: " << error.message() << std::endl;
+      }
+      fec_pending_.pop_back();
+    }
+  }
+
+  // Resume fill_window() when the pacing schedule allows the next packet
+  void schedule_pacing() {
+    if (pacing_wait_) {
+      return;
+    }
+    pacing_wait_ = true;
+    pacing_timer_.expires_at(next_send_time_);
+    pacing_timer_.async_wait(boost::bind(&UdpClient::handle_pacing, this,
+                                         boost::asio::placeholders::error));
+  }
+
+  void handle_pacing(const boost::system::error_code &error) {
+    pacing_wait_ = false;
+    if (error || send_base_ == total_packets_ || transfer_failed_) {
+      return;
+    }
+    fill_window();
+  }
+
+  // The compressor built the frames fill_window() was waiting for
+  void handle_frames_ready() {
+    if (send_base_ == total_packets_ || transfer_failed_) {
+      return;
+    }
+    fill_window();
+  }
+
+  // Put one window entry on the wire; ack_now asks the receiver not to
+  // hold back its ACK
+  void transmit(InFlightPacket &entry, bool ack_now) {
+    entry.packet->type = ack_now ? SR_DATA_ACK_NOW : SR_DATA_PACKET;
+    entry.send_time = high_resolution_clock::now();
+    entry.prior_timestamp = entry.retries > 0 ? entry.packet->timestamp : 0;
+    entry.packet->timestamp = timestampMicros();
+    entry.delivered = delivered_;
+    entry.delivered_time = delivered_time_;
+    entry.first_sent_time = first_sent_time_;
+    entry.app_limited = next_seq_num_ - send_base_ < ack_run();
+
+    // Each retransmission doubles the packet's timeout
+    entry.timer.key = ntohl32(entry.packet->seq_num);
+    rto_wheel_.schedule(entry.timer,
+                        wheelTick(entry.send_time +
+                                      rtoDuration(rtt_.rtoFor(entry.retries)),
+                                  true));
+
+    if (verbose_) {
+      std::cout << "Sending packet with seq_num: "
+                << ntohl32(entry.packet->seq_num)
+                << ", size: " << entry.packet->data_size << " bytes"
+                << " (attempt " << entry.retries + 1 << ")" << std::endl;
+    }
+
+    latency_stats_.addWireBytes(entry.packet->data_size);
+    if (stamps_) {
+      entry.tx_key = stamps_->noteSend(ntohl32(entry.packet->seq_num));
+      entry.kernel_tx_ns = 0;
+    }
+
+    // Batch mode: the window entry stays put until flush_sends()
+    if (batch_io_) {
+      batch_io_->queue(entry.packet, SrPacket::headerSize(), entry.payload,
+                       entry.packet->data_size, server_endpoint_);
+      return;
+    }
+
+    // Synchronous send: the window entry owns the header, the payload is in
+    // the entry or the file mapping, and UDP sends only block while the
+    // kernel buffer drains
+    boost::array<boost::asio::const_buffer, 2> buffers = {
+        {boost::asio::buffer(entry.packet, SrPacket::headerSize()),
+         boost::asio::buffer(entry.payload, entry.packet->data_size)}};
+    boost::system::error_code error;
+    socket_.send_to(buffers, server_endpoint_, 0, error);
+    if (error) {
+      std::cerr << "Send error: " << error.message() << std::endl;
+    }
+  }
+
+  // Push out everything queued for a batched send
+  void flush_sends() {
+    if (batch_io_) {
+      bool gso = batch_io_->gsoEnabled();
+      batch_io_->flush();
+      if (gso && !batch_io_->gsoEnabled()) {
+        latency_stats_.setIoMode("batched sendmmsg (GSO fallback)");
+      }
+      fec_pending_.clear();
+    }
+  }
+
+  // Wait for the next selective-repeat ACK
+  void receive_sr_ack() {
+    // Also woken by send stamps arriving on the error queue
+    if (stamps_) {
+      socket_.async_wait(udp::socket::wait_read,
+                         boost::bind(&UdpClient::handle_sr_ack_stamped, this,
+                                     boost::asio::placeholders::error));
+      return;
+    }
+    if (batch_io_) {
+      batch_io_->async_wait_readable(
+          boost::bind(&UdpClient::handle_sr_ack_batch, this,
+                      boost::asio::placeholders::error));
+      return;
+    }
+
+    socket_.async_receive_from(
+        boost::asio::buffer(&sr_ack_buffer_, sizeof(sr_ack_buffer_)),
+        ack_endpoint_,
+        boost::bind(&UdpClient::handle_sr_ack, this,
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred));
+  }
+
+  // Handle a selective-repeat ACK: mark the packet and slide the window
+  void handle_sr_ack(const boost::system::error_code &error,
+                     size_t bytes_received) {
+    if (error) {
+      if (error != boost::asio::error::operation_aborted) {
+        std::cerr << "ACK receive error: " << error.message() << std::endl;
+        receive_sr_ack();
+      }
+      return;
+    }
+
+    process_sr_ack(reinterpret_cast<const char *>(&sr_ack_buffer_),
+                   bytes_received);
+    if (advance_window()) {
+      receive_sr_ack();
+    }
+  }
+
+  // Batch mode: drain every pending ACK, then slide the window once
+  void handle_sr_ack_batch(const boost::system::error_code &error) {
+    if (error) {
+      if (error != boost::asio::error::operation_aborted) {
+        std::cerr << "ACK receive error: " << error.message() << std::endl;
+        receive_sr_ack();
+      }
+      return;
+    }
+
+    size_t count;
+    while ((count = batch_io_->receive()) > 0) {
+      for (size_t i = 0; i < count; ++i) {
+        process_sr_ack(batch_io_->data(i), batch_io_->length(i));
+      }
+      if (!batch_io_->mayHaveMore()) {
+        break; // Socket drained
+      }
+    }
+
+    if (advance_window()) {
+      receive_sr_ack();
+    }
+  }
+
+  // Timestamping mode: file the send stamps that came back, then drain
+  // every pending ACK with its receive stamp and slide the window once
+  void handle_sr_ack_stamped(const boost::system::error_code &error) {
+    if (error) {
+      if (error != boost::asio::error::operation_aborted) {
+        std::cerr << "ACK receive error: " << error.message() << std::endl;
+        receive_sr_ack();
+      }
+      return;
+    }
+
+    stamps_->drainSent([this](uint32_t seq_num, uint32_t key, int64_t ns) {
+      if (seq_num >= send_base_ && seq_num < next_seq_num_) {
+        InFlightPacket &entry = in_flight_[seq_num - send_base_];
+        if (entry.tx_key == key) {
+          entry.kernel_tx_ns = ns;
+        }
+      }
+    });
+    int64_t rx_ns;
+    ssize_t len;
+    while ((len = stamps_->receive(&sr_ack_buffer_, sizeof(sr_ack_buffer_),
+                                   rx_ns)) >= 0) {
+      process_sr_ack(reinterpret_cast<const char *>(&sr_ack_buffer_), len,
+                     rx_ns);
+    }
+
+    if (advance_window()) {
+      receive_sr_ack();
+    }
+  }
+
+  // Mark every packet one ACK datagram covers as acknowledged: those below
+  // its cumulative ACK and those its bitmap marks. rx_ns is the ACK's
+  // kernel receive stamp in timestamping mode, 0 otherwise.
+  void process_sr_ack(const char *data, size_t bytes_received,
+                      int64_t rx_ns = 0) {
+    SrAck ack;
+    if (bytes_received != sizeof(SrAck) ||
+        static_cast<uint8_t>(data[0]) != SR_ACK_PACKET) {
+      std::cerr << "Received invalid ACK, ignoring" << std::endl;
+      return;
+    }
+    std::memcpy(&ack, data, sizeof(ack));
+    latency_stats_.addAckPacket();
+
+    uint32_t cumulative = ntohl32(ack.cumulative_ack);
+    uint32_t sack_base = ntohl32(ack.sack_base);
+    uint64_t sack_bits = (static_cast<uint64_t>(ntohl32(ack.sack_hi)) << 32) |
+                         ntohl32(ack.sack_lo);
+    // An ACK that is not stale has the receiver's current window, which
+    // may have shrunk (a server whose disk fell behind); stale ones can
+    // only widen it
+    uint32_t window_end = cumulative + ntohl32(ack.window);
+    if (cumulative >= send_base_) {
+      peer_window_end_ = window_end;
+    } else {
+      peer_window_end_ = std::max(peer_window_end_, window_end);
+    }
+
+    // One RTT sample per ACK. The echoed timestamp belongs to the copy the
+    // receiver saw, so retransmitted packets give valid samples as well;
+    // the time the receiver held the ACK back is not part of the RTT.
+    uint32_t elapsed = timestampMicros() - ack.ts_echo;
+    uint32_t delay = ntohl32(ack.ack_delay_us);
+    double rtt_ms = (elapsed > delay ? elapsed - delay : elapsed) / 1000.0;
+    bool sampled = false;
+
+    auto deliver = [&](uint32_t seq_num) {
+      if (seq_num < send_base_ || seq_num >= next_seq_num_) {
+        return;
+      }
+      InFlightPacket &entry = in_flight_[seq_num - send_base_];
+      if (entry.acked) {
+        return;
+      }
+      if (!sampled) {
+        rtt_.addSample(rtt_ms);
+        min_rtt_ms_ = min_rtt_ms_ > 0.0 ? std::min(min_rtt_ms_, rtt_ms)
+                                        : rtt_ms;
+        sampled = true;
+      }
+      entry.acked = true;
+      rto_wheel_.cancel(entry.timer);
+      auto latency = high_resolution_clock::now() - entry.send_time;
+      double latency_ms =
+          duration_cast<microseconds>(latency).count() / 1000.0;
+      latency_stats_.addLatency(latency_ms, entry.retries > 0);
+      // The packet this ACK answers, if its send stamp is in: the same
+      // round trip between the kernel's stamps, less the receiver's delay
+      if (rx_ns > 0 && entry.kernel_tx_ns > 0 &&
+          entry.packet->timestamp == ack.ts_echo) {
+        double wire_ms = (rx_ns - entry.kernel_tx_ns) / 1e6 - delay / 1000.0;
+        if (wire_ms > 0.0 && wire_ms <= rtt_ms) {
+          latency_stats_.addWireRtt(wire_ms, rtt_ms - wire_ms);
+        }
+      }
+      on_delivered(entry, rtt_ms);
+
+      // A resent packet whose ACK echoes an earlier copy was never lost.
+      // Only an ACK for the latest copy dates the packet's delivery.
+      bool ambiguous = false;
+      if (entry.retries > 0 && ack.ts_echo != entry.packet->timestamp) {
+        ambiguous = true;
+        if (entry.prior_timestamp != 0 &&
+            ack.ts_echo == entry.prior_timestamp) {
+          on_spurious_retransmit();
+        }
+      } else if (entry.retries > 0) {
+        undo_possible_ = false; // This resend was needed
+      }
+      if (!ambiguous && entry.send_time >= newest_acked_send_) {
+        newest_acked_send_ = entry.send_time;
+        newest_acked_rtt_ = latency;
+      }
+
+      if (verbose_) {
+        std::cout << "Received ACK for seq_num: " << seq_num
+                  << " (latency: " << std::fixed << std::setprecision(2)
+                  << latency_ms << " ms)" << std::endl;
+      }
+    };
+    uint32_t cumulative_end = std::min(cumulative, next_seq_num_);
+    for (uint32_t seq_num = send_base_; seq_num < cumulative_end; ++seq_num) {
+      deliver(seq_num);
+    }
+    for (int bit = 0; bit < SR_SACK_BITS; ++bit) {
+      if ((sack_bits >> bit) & 1) {
+        deliver(sack_base + bit);
+      }
+    }
+
+    detect_losses();
+  }
+
+  // Time-based loss detection (RACK): a packet is lost once a packet sent
+  // after it has been ACKed and it has gone unacknowledged for the newest
+  // ACKed packet's RTT plus a reorder window. Jitter and reordering inside
+  // the window cost nothing; the window starts at a quarter of the min
+  // RTT and widens whenever a resend turns out to be needless. Losses are
+  // resent straight away instead of at their RTO. Each packet is judged
+  // on its first copy only; a resent copy that is lost again waits for its
+  // RTO. Also run from the retransmit tick, for packets at the tail.
+  void detect_losses() {
+    if (!rtt_.hasSample()) {
+      return;
+    }
+    auto now = high_resolution_clock::now();
+    auto overdue = newest_acked_rtt_ + reorder_window();
+    bool resent = false;
+    uint32_t seq_num = std::max(loss_scan_, send_base_);
+    for (; seq_num < next_seq_num_; ++seq_num) {
+      InFlightPacket &entry = in_flight_[seq_num - send_base_];
+      if (entry.acked || entry.retries > 0) {
+        continue;
+      }
+      // First copies go out in sequence order, so once one is too recent
+      // to judge, every later one is as well
+      if (entry.send_time >= newest_acked_send_ ||
+          now - entry.send_time < overdue) {
+        break;
+      }
+
+      // Same loss episode rule as the RTO scan
+      if (seq_num >= recovery_point_) {
+        start_loss_episode();
+      }
+
+      if (verbose_) {
+        std::cout << "Packet " << seq_num << " passed by later ACKs, "
+                  << "retransmitting..." << std::endl;
+      }
+      entry.retries++;
+      undo_pending_++;
+      latency_stats_.addRetransmission();
+      latency_stats_.addFastRetransmit();
+      transmit(entry, true);
+      resent = true;
+    }
+    loss_scan_ = seq_num;
+    if (resent) {
+      flush_sends();
+    }
+  }
+
+  // Reorder tolerance: reorder_steps_ quarters of the min RTT, at most one
+  // smoothed RTT
+  high_resolution_clock::duration reorder_window() const {
+    double window_ms = std::min(
+        min_rtt_ms_ * reorder_steps_ / SR_REORDER_DIVISOR, rtt_.srtt());
+    return duration_cast<high_resolution_clock::duration>(
+        microseconds(static_cast<int64_t>(window_ms * 1000.0)));
+  }
+
+  // One window reduction per loss episode (a window's worth of sends). A
+  // widened reorder window narrows again after SR_REORDER_PERSIST episodes
+  // without a needless resend.
+  void start_loss_episode() {
+    if (cc_) {
+      cc_->onLoss();
+    }
+    recovery_point_ = next_seq_num_;
+    undo_possible_ = true;
+    undo_pending_ = 0;
+    if (++reorder_quiet_ >= SR_REORDER_PERSIST) {
+      reorder_steps_ = 1;
+      reorder_quiet_ = 0;
+    }
+  }
+
+  // The original copy of a resent packet arrived after all: the packet was
+  // reordered, not lost. Widen the reorder window, and once every resend
+  // of the loss episode proved needless, take back the window reduction.
+  void on_spurious_retransmit() {
+    latency_stats_.addSpuriousRetransmit();
+    if (min_rtt_ms_ * reorder_steps_ / SR_REORDER_DIVISOR < rtt_.srtt()) {
+      reorder_steps_++;
+    }
+    reorder_quiet_ = 0;
+    if (cc_ && undo_possible_ && undo_pending_ > 0 && --undo_pending_ == 0) {
+      cc_->undoLoss();
+      undo_possible_ = false;
+      recovery_point_ = 0; // The next loss starts an episode of its own
+    }
+  }
+
+  // Feed a newly acknowledged packet to the congestion controller. The
+  // delivery rate is taken over the longer of the send and ACK intervals,
+  // as in BBR: ACKs the receiver held back stretch the ACK interval, and a
+  // burst of ACKs for packets paced out over a longer time shrinks it.
+  void on_delivered(const InFlightPacket &entry, double rtt_ms) {
+    auto now = high_resolution_clock::now();
+    delivered_ += entry.packet->data_size;
+    delivered_time_ = now;
+    first_sent_time_ = entry.send_time;
+    if (!cc_) {
+      return;
+    }
+
+    AckSample sample;
+    sample.bytes = entry.packet->data_size;
+    sample.rtt_ms = rtt_ms;
+    auto interval = std::max(entry.send_time - entry.first_sent_time,
+                             now - entry.delivered_time);
+    double interval_s =
+        duration_cast<microseconds>(interval).count() / 1000000.0;
+    sample.delivery_rate =
+        interval_s > 0.0 ? (delivered_ - entry.delivered) / interval_s : 0.0;
+    sample.app_limited = entry.app_limited;
+    sample.round_start = entry.delivered >= next_round_delivered_;
+    if (sample.round_start) {
+      next_round_delivered_ = delivered_;
+    }
+    sample.in_flight = next_seq_num_ - send_base_;
+    sample.now = now;
+    cc_->onAck(sample);
+    latency_stats_.addCwndSample(cc_->cwnd());
+  }
+
+  // Slide the window past acknowledged packets and refill it. Returns false
+  // once the whole file is acknowledged.
+  bool advance_window() {
+    while (!in_flight_.empty() && in_flight_.front().acked) {
+      bytes_sent_ += in_flight_.front().packet->data_size;
+      in_flight_.pop_front();
+      send_base_++;
+    }
+    // A compressed transfer's packets are frames, not file offsets
+    source_->release(compressor_ ? compressor_->rawBytesTaken()
+                                 : range_offset_ + bytes_sent_);
+
+    report_progress();
+
+    if (send_base_ == total_packets_) {
+      finish_selective_repeat();
+      return false;
+    }
+
+    fill_window();
+    return true;
+  }
+
+  // Periodically scan the window for packets whose ACK is overdue
+  void schedule_retransmit_tick() {
+    timer_.expires_after(boost::asio::chrono::milliseconds(SR_TICK_MS));
+    timer_.async_wait(boost::bind(&UdpClient::handle_retransmit_tick, this,
+                                  boost::asio::placeholders::error));
+  }
+
+  // Wheel tick a point in time falls in; deadlines round up so that no
+  // timer fires early
+  uint64_t wheelTick(high_resolution_clock::time_point when,
+                     bool round_up = false) const {
+    int64_t us = duration_cast<microseconds>(when - wheel_origin_).count();
+    if (us <= 0) {
+      return 0;
+    }
+    return (static_cast<uint64_t>(us) + (round_up ? SR_WHEEL_TICK_US - 1 : 0)) /
+           SR_WHEEL_TICK_US;
+  }
+
+  // Retransmit only the packets that timed out: the wheel hands over the
+  // ones due since the last tick, and they go out in one batched send.
+  // Packets overdue by the reorder window go first.
+  void handle_retransmit_tick(const boost::system::error_code &error) {
+    // Cancelled, or the final ACK arrived after this tick was already queued
+    if (error || send_base_ == total_packets_ || transfer_failed_) {
+      return;
+    }
+
+    uint64_t start_cycles = readCycleCounter();
+    // Packets past their reorder window with no ACK left to reveal them
+    detect_losses();
+    expired_.clear();
+    rto_wheel_.advance(wheelTick(high_resolution_clock::now()),
+                       [this](TimerWheel::Node &timer) {
+                         expired_.push_back(timer.key);
+                       });
+    for (uint32_t seq_num : expired_) {
+      // Cancelled on ACK, so every expiry is an unacknowledged packet
+      InFlightPacket &entry = in_flight_[seq_num - send_base_];
+
+      // The timer was set with the RTO of its send; if RTT samples have
+      // raised the RTO since (a queue building up), wait out the new one
+      auto deadline =
+          entry.send_time + rtoDuration(rtt_.rtoFor(entry.retries));
+      if (deadline > high_resolution_clock::now()) {
+        rto_wheel_.schedule(entry.timer, wheelTick(deadline, true));
+        continue;
+      }
+
+      if (entry.retries >= SR_MAX_RETRIES) {
+        std::cerr << "Failed to send packet " << ntohl32(entry.packet->seq_num)
+                  << " after " << SR_MAX_RETRIES << " retransmissions"
+                  << std::endl;
+        transfer_failed_ = true;
+        pacing_timer_.cancel();
+        socket_.cancel();
+        return;
+      }
+
+      // One window reduction per loss episode (a window's worth of sends)
+      if (seq_num >= recovery_point_) {
+        start_loss_episode();
+      }
+
+      std::cout << "ACK timeout for seq_num " << seq_num
+                << ", retransmitting..." << std::endl;
+      entry.retries++;
+      undo_pending_++;
+      latency_stats_.addRetransmission();
+      transmit(entry, true);
+    }
+    flush_sends();
+    latency_stats_.addSendCycles(readCycleCounter() - start_cycles);
+
+    schedule_retransmit_tick();
+  }
+
+  // Print progress every 5% of the file
+  void report_progress() {
+    if (verbose_ || range_bytes_ <= static_cast<uint64_t>(payload_size_)) {
+      return;
+    }
+
+    // A compressed transfer counts the file bytes whose frames went out
+    uint64_t done = compressor_ ? compressor_->rawBytesTaken() : bytes_sent_;
+    size_t current_percentage = (done * 100) / range_bytes_;
+    if (current_percentage >= last_progress_percentage_ + 5) {
+      std::cout << "Progress: " << current_percentage << "% (" << done
+                << "/" << range_bytes_ << " bytes)"
+                << " [in flight: " << (next_seq_num_ - send_base_)
+                << " packets]" << std::endl;
+      last_progress_percentage_ = current_percentage;
+    }
+  }
+
+  // All packets acknowledged: stop the timer so io_context.run() returns
+  void finish_selective_repeat() {
+    latency_stats_.endTransfer(range_bytes_ - resumed_bytes_);
+    latency_stats_.addResumed(resumed_bytes_);
+    if (compressor_) {
+      latency_stats_.setCompression(
+          compressor_->threads(), compressor_->streamBytes(),
+          compressor_->blocks(), compressor_->storedBlocks());
+    }
+    latency_stats_.setRttState(rtt_.srtt(), rtt_.rttvar(), rtt_.rto());
+    if (cc_) {
+      latency_stats_.setPacingRate(cc_->pacingRate(rtt_.srtt()));
+    }
+    timer_.cancel();
+    pacing_timer_.cancel();
+    std::cout << "All data sent successfully (" << range_bytes_ << " bytes)"
+              << std::endl;
+  }
+};
+
+// Multi-stream client: announces the file in a manifest, sends one packet
+// range per stream, each with its own socket, UdpClient and thread, then
+// waits at a completion barrier until the server has written the whole file.
+// Resumable transfers (any stream count) go through here as well: the
+// resume query stands in for the manifest and returns the chunks to skip.
+class ParallelTransfer {
+private:
+  std::string server_ip_;
+  int server_port_;
+  int streams_;
+  bool verbose_;
+  int window_size_;
+  int batch_size_;
+  bool gso_;
+  std::string congestion_control_;
+  ChecksumAlgorithm checksum_;
+  int fec_data_;   // FEC shape used by every stream (0 = no FEC)
+  int fec_repair_;
+  bool resume_;    // Resumable: stable transfer ID, skip what the server has
+  bool delta_;     // Send a delta against the server's copy of the file
+  int payload_size_; // Negotiated data bytes per packet, for every stream
+  int route_mtu_;    // Path MTU discovery results, for the report
+  int mtu_probes_;
+  bool timestamps_;  // Kernel-timestamped RTTs on every stream
+
+  // Control exchange (manifest and barrier) on a socket of its own
+  boost::asio::io_context control_context_;
+  udp::socket control_socket_;
+  udp::endpoint server_endpoint_;
+  RttEstimator rtt_;
+  uint32_t transfer_id_;
+
+  LatencyStats latency_stats_;
+
+public:
+  ParallelTransfer(const std::string &server_ip, int server_port, int streams,
+                   bool verbose, int window_size, int batch_size, bool gso,
+                   const std::string &congestion_control,
+                   ChecksumAlgorithm checksum, int fec_data = 0,
+                   int fec_repair = 0, bool resume = false, bool delta = false,
+                   int payload_size = DEFAULT_PAYLOAD_SIZE,
+                   bool timestamps = false)
+      : server_ip_(server_ip), server_port_(server_port), streams_(streams),
+        verbose_(verbose), window_size_(window_size), batch_size_(batch_size),
+        gso_(gso), congestion_control_(congestion_control),
+        checksum_(checksum), fec_data_(fec_data), fec_repair_(fec_repair),
+        resume_(resume), delta_(delta), payload_size_(payload_size),
+        route_mtu_(0), mtu_probes_(0), timestamps_(timestamps),
+        control_socket_(control_context_, udp::endpoint(udp::v4(), 0)),
+        server_endpoint_(boost::asio::ip::address::from_string(server_ip),
+                         server_port),
+        transfer_id_(randomTransferId()) {}
+
+  // Send the file; returns false if any stream or control step failed
+  bool send_file(const std::string &filepath) {
+    if (delta_) {
+      return send_delta(filepath);
+    }
+    return send_stream(filepath, MANIFEST_PLAIN, 0);
+  }
+
+  // Send a directory: each large file as a transfer of its own while the
+  // pack of the rest is built alongside, then the pack, which the server
+  // unpacks into the tree. Returns false if any transfer failed.
+  bool send_tree(const std::string &dirpath) {
+    high_resolution_clock::time_point start = high_resolution_clock::now();
+    std::string parent;
+    std::vector<std::string> skipped;
+    std::vector<TreeEntry> entries = walkTree(dirpath, parent, skipped);
+    std::vector<size_t> separate;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (entries[i].kind == TREE_SEPARATE) {
+        entries[i].transfer_id = randomTransferId();
+        separate.push_back(i);
+      }
+    }
+    std::cout << "Walked " << dirpath << ": " << entries.size()
+              << " entries, " << separate.size() << " of them large files ("
+              << std::fixed << std::setprecision(2)
+              << duration_cast<microseconds>(high_resolution_clock::now() -
+                                             start)
+                         .count() /
+                     1000.0
+              << " ms)" << std::endl;
+    for (const std::string &entry : skipped) {
+      std::cout << "Skipped " << entry << std::endl;
+    }
+
+    // The packer only fills in checksums, which the large files' transfers
+    // do not read
+    std::string pack_path = scratchPath(dirpath, "tree");
+    TreeSummary summary;
+    std::exception_ptr pack_error;
+    std::thread packer([&]() {
+      try {
+        summary = writeTreePack(parent, entries, pack_path);
+      } catch (...) {
+        pack_error = std::current_exception();
+      }
+    });
+
+    LatencyStats total;
+    int transfers = 0;
+    auto collect = [&]() {
+      if (transfers++ == 0) {
+        total = latency_stats_;
+      } else {
+        total.merge(latency_stats_);
+      }
+    };
+    bool sent = true;
+    try {
+      for (size_t i : separate) {
+        transfer_id_ = entries[i].transfer_id;
+        sent = send_stream(parent + entries[i].path, MANIFEST_TREE_FILE, 0);
+        if (!sent) {
+          break;
+        }
+        collect();
+      }
+    } catch (...) {
+      packer.join();
+      std::remove(pack_path.c_str());
+      throw;
+    }
+    packer.join();
+    if (pack_error) {
+      std::remove(pack_path.c_str());
+      std::rethrow_exception(pack_error);
+    }
+    if (sent) {
+      std::cout << "Packed " << summary.files - summary.separate
+                << " files and " << summary.directories
+                << " directories into " << summary.pack_bytes << " bytes"
+                << std::endl;
+      transfer_id_ = randomTransferId();
+      try {
+        sent = send_stream(pack_path, MANIFEST_TREE_PACK, 0);
+      } catch (...) {
+        std::remove(pack_path.c_str());
+        throw;
+      }
+      collect();
+    }
+    std::remove(pack_path.c_str());
+    if (!sent) {
+      return false;
+    }
+
+    // The report covers the walk and every transfer; per-stream figures of
+    // the separate transfers do not add up, so they are left out
+    latency_stats_ = total;
+    latency_stats_.start_time = start;
+    latency_stats_.end_time = high_resolution_clock::now();
+    latency_stats_.streams.clear();
+    latency_stats_.setTree(summary.files, summary.directories,
+                           summary.file_bytes, summary.separate);
+    return true;
+  }
+
+  // Record how the payload size was settled, for the statistics report
+  void setPathMtu(int route_mtu, int probes) {
+    route_mtu_ = route_mtu;
+    mtu_probes_ = probes;
+  }
+
+  // Get latency statistics (merged over the streams)
+  const LatencyStats &getLatencyStats() const { return latency_stats_; }
+
+private:
+  // Transfer ID for a new transfer (never 0)
+  static uint32_t randomTransferId() {
+    static std::random_device random;
+    uint32_t id;
+    do {
+      id = random();
+    } while (id == 0);
+    return id;
+  }
+
+  // Delta transfer: fetch the signatures of the server's copy, encode the
+  // file against them into a temporary file and send only that. With no
+  // copy at the server the file goes whole and becomes the next basis.
+  bool send_delta(const std::string &filepath) {
+    high_resolution_clock::time_point start = high_resolution_clock::now();
+    uint32_t basis_id = deltaBasisId(filepath);
+    SignatureIndex index;
+    uint64_t basis_size = 0;
+    uint32_t block_size = 0;
+    uint64_t signature_bytes = 0;
+    if (!fetch_signatures(basis_id, index, basis_size, block_size,
+                          signature_bytes)) {
+      return false;
+    }
+    if (index.size() == 0) {
+      std::cout << "No copy at the server to diff against, sending the "
+                   "whole file"
+                << std::endl;
+      return send_stream(filepath, MANIFEST_BASIS, basis_id);
+    }
+
+    std::string delta_path = scratchPath(filepath, "delta");
+    DeltaSummary summary;
+    uint64_t file_size;
+    try {
+      FileSource source(filepath);
+      file_size = source.size();
+      summary = encodeDelta(source, index, block_size, basis_size,
+                            delta_path);
+    } catch (...) {
+      std::remove(delta_path.c_str());
+      throw;
+    }
+    std::cout << "Delta against " << index.size() << " blocks of the "
+              << basis_size << "-byte copy at the server: "
+              << summary.matched_bytes << " bytes matched, "
+              << summary.literal_bytes << " literal, " << summary.delta_bytes
+              << " delta bytes (encoded in " << std::fixed
+              << std::setprecision(2)
+              << duration_cast<microseconds>(high_resolution_clock::now() -
+                                             start)
+                         .count() /
+                     1000.0
+              << " ms)" << std::endl;
+
+    bool sent = send_stream(delta_path, MANIFEST_DELTA, basis_id);
+    std::remove(delta_path.c_str());
+    if (!sent) {
+      return false;
+    }
+    // The report covers the signature fetch and the encoding too
+    latency_stats_.start_time = start;
+    latency_stats_.setDelta(file_size, summary.matched_bytes,
+                            summary.delta_bytes, signature_bytes, block_size);
+    return true;
+  }
+
+  // Fetch the signatures of the server's copy. Page 0 gives the block size
+  // and count; the other pages are requested SIGNATURE_WINDOW at a time,
+  // re-requesting the ones that go missing. The index stays empty when the
+  // server has no copy.
+  bool fetch_signatures(uint32_t basis_id, SignatureIndex &index,
+                        uint64_t &basis_size, uint32_t &block_size,
+                        uint64_t &signature_bytes) {
+    SrSignature request;
+    std::memset(&request, 0, SrSignature::headerSize());
+    request.type = SR_SIGNATURE_QUERY;
+    request.transfer_id = htonl32(transfer_id_);
+    request.basis_id = htonl32(basis_id);
+    request.page = 0;
+
+    SrSignature reply;
+    if (!exchange_with_retry(request, SR_SIGNATURE_REPLY, reply)) {
+      std::cerr << "No reply to the signature query" << std::endl;
+      return false;
+    }
+    if (!reply.status) {
+      return true;
+    }
+    basis_size = controlFileSize(reply);
+    block_size = ntohl32(reply.block_size);
+    uint64_t blocks = basis_size / block_size;
+    if (block_size != deltaBlockSize(basis_size) || blocks == 0 ||
+        blocks > UINT32_MAX) {
+      std::cerr << "Malformed signature reply" << std::endl;
+      return false;
+    }
+
+    index.reset(static_cast<uint32_t>(blocks));
+    uint32_t pages = static_cast<uint32_t>(
+        (blocks + SIGNATURES_PER_PAGE - 1) / SIGNATURES_PER_PAGE);
+    std::vector<char> have(pages, 0);
+
+    // Take one page into the index if it is well formed and new
+    auto store = [&](const SrSignature &page_reply, size_t length) {
+      uint32_t page = ntohl32(page_reply.page);
+      uint64_t first = static_cast<uint64_t>(page) * SIGNATURES_PER_PAGE;
+      if (page >= pages || have[page] || !page_reply.status ||
+          controlFileSize(page_reply) != basis_size ||
+          page_reply.count !=
+              std::min<uint64_t>(SIGNATURES_PER_PAGE, blocks - first) ||
+          length != SrSignature::headerSize() +
+                        page_reply.count * sizeof(BlockSignature)) {
+        return false;
+      }
+      for (uint16_t i = 0; i < page_reply.count; ++i) {
+        const BlockSignature &signature = page_reply.signatures[i];
+        index.set(static_cast<uint32_t>(first + i), ntohl32(signature.weak),
+                  (static_cast<uint64_t>(ntohl32(signature.strong_hi))
+                   << 32) |
+                      ntohl32(signature.strong_lo));
+      }
+      have[page] = 1;
+      signature_bytes += length;
+      return true;
+    };
+    store(reply, SrSignature::headerSize() +
+                     reply.count * sizeof(BlockSignature));
+
+    uint32_t missing = static_cast<uint32_t>(
+        std::count(have.begin(), have.end(), 0));
+    uint32_t first_missing = 0;
+    int stalls = 0;
+    while (missing > 0) {
+      // Ask for the next window of missing pages
+      while (have[first_missing]) {
+        first_missing++;
+      }
+      uint32_t requested = 0;
+      for (uint32_t page = first_missing;
+           page < pages && requested < SIGNATURE_WINDOW; ++page) {
+        if (have[page]) {
+          continue;
+        }
+        request.page = htonl32(page);
+        boost::system::error_code error;
+        control_socket_.send_to(
+            boost::asio::buffer(&request, SrSignature::headerSize()),
+            server_endpoint_, 0, error);
+        requested++;
+      }
+
+      // Collect replies until the window is answered or the RTO runs out
+      auto deadline =
+          steady_clock::now() +
+          microseconds(static_cast<int64_t>(rtt_.rtoFor(stalls) * 1000.0));
+      uint32_t answered = 0;
+      size_t length;
+      while (answered < requested &&
+             receive_control(reply, deadline, length)) {
+        if (reply.type == SR_SIGNATURE_REPLY &&
+            reply.transfer_id == request.transfer_id && store(reply, length)) {
+          answered++;
+          missing--;
+        }
+      }
+      if (answered > 0) {
+        stalls = 0;
+      } else if (++stalls >= MAX_RETRIES) {
+        std::cerr << "No reply to the signature query" << std::endl;
+        return false;
+      }
+    }
+    index.build();
+    return true;
+  }
+
+  // Announce the file with a manifest of the given mode, send it over the
+  // streams and wait for the server to confirm it
+  bool send_stream(const std::string &filepath, uint8_t mode,
+                   uint32_t basis_id) {
+    uint64_t file_size;
+    {
+      FileSource probe(filepath);
+      file_size = probe.size();
+    }
+    uint64_t packets = packetCount(file_size, payload_size_);
+    if (packets > UINT32_MAX) {
+      throw std::runtime_error("File too large for 32-bit sequence numbers");
+    }
+    uint32_t total_packets = static_cast<uint32_t>(packets);
+    int streams = static_cast<int>(
+        std::min<uint64_t>(static_cast<uint64_t>(streams_), packets));
+
+    // Manifest: the server sets up the output file for all streams
+    SrControl request;
+    std::memset(&request, 0, sizeof(request));
+    request.type = SR_MANIFEST_PACKET;
+    request.transfer_id = htonl32(transfer_id_);
+    setControlFileSize(request, file_size);
+    request.stream_count = static_cast<uint16_t>(streams);
+    request.payload_size = static_cast<uint16_t>(payload_size_);
+    request.mode = mode;
+    request.basis_id = htonl32(basis_id);
+
+    // A resumable transfer replaces the manifest with the resume query: same
+    // set-up, plus what an earlier run already delivered
+    SrControl reply;
+    ResumeBitmap bitmap;
+    if (resume_) {
+      transfer_id_ = resumeTransferId(filepath, file_size);
+      request.transfer_id = htonl32(transfer_id_);
+      if (!query_resume_state(file_size, streams, bitmap)) {
+        return false;
+      }
+      uint64_t present = std::min<uint64_t>(
+          bitmap.presentPackets() * payload_size_, file_size);
+      std::cout << "Resuming transfer " << std::hex << transfer_id_
+                << std::dec << ": " << present << " of " << file_size
+                << " bytes already at the server" << std::endl;
+    } else {
+      if (!exchange_with_retry(request, SR_MANIFEST_ACK, reply)) {
+        std::cerr << "No reply to the transfer manifest" << std::endl;
+        return false;
+      }
+      if (!reply.status) {
+        std::cerr << "Server rejected the transfer manifest" << std::endl;
+        return false;
+      }
+      std::cout << "Manifest accepted: " << file_size << " bytes over "
+                << streams << " streams (transfer " << std::hex
+                << transfer_id_ << std::dec << ")" << std::endl;
+    }
+
+    // One thread per stream, each with its own io_context and socket
+    std::vector<LatencyStats> results(streams);
+    std::vector<char> failed(streams, 0);
+    std::vector<std::thread> workers;
+    high_resolution_clock::time_point start = high_resolution_clock::now();
+    for (int i = 0; i < streams; ++i) {
+      workers.emplace_back([&, i]() {
+        try {
+          std::pair<uint32_t, uint32_t> range =
+              streamRange(total_packets, streams, i);
+          if (resume_ && bitmap.rangePresent(range.first, range.second)) {
+            // Nothing left to send on this stream
+            results[i].startTransfer();
+            results[i].endTransfer(0);
+            results[i].addResumed(
+                std::min<uint64_t>(
+                    static_cast<uint64_t>(range.second) * payload_size_,
+                    file_size) -
+                static_cast<uint64_t>(range.first) * payload_size_);
+            return;
+          }
+          boost::asio::io_context io_context;
+          FileSource source(filepath);
+          UdpClient client(io_context, server_ip_, server_port_, verbose_,
+                           window_size_, batch_size_, gso_,
+                           congestion_control_, checksum_, fec_data_,
+                           fec_repair_, payload_size_, timestamps_);
+          if (resume_) {
+            client.setResumeBitmap(&bitmap);
+          }
+          client.send_range(source, range.first, range.second, transfer_id_);
+          io_context.run();
+          failed[i] = client.transferFailed();
+          results[i] = client.getLatencyStats();
+        } catch (const std::exception &e) {
+          std::cerr << "Stream " << i << ": " << e.what() << std::endl;
+          failed[i] = 1;
+        }
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+    for (int i = 0; i < streams; ++i) {
+      if (failed[i]) {
+        std::cerr << "Stream " << i << " failed" << std::endl;
+        return false;
+      }
+    }
+
+    // Completion barrier: the file is only done once the server has every
+    // range and has finalized it
+    request.type = SR_BARRIER_PACKET;
+    auto deadline = steady_clock::now() + seconds(BARRIER_TIMEOUT_S);
+    bool complete = false;
+    while (!complete && steady_clock::now() < deadline) {
+      if (!exchange_with_retry(request, SR_BARRIER_ACK, reply)) {
+        break;
+      }
+      if (reply.status == 2) {
+        std::cerr << (mode == MANIFEST_TREE_PACK
+                          ? "Server could not unpack the directory"
+                          : "Server could not rebuild the file from the delta")
+                  << std::endl;
+        return false;
+      }
+      complete = reply.status != 0;
+      if (!complete) {
+        std::this_thread::sleep_for(
+            microseconds(static_cast<int64_t>(rtt_.rto() * 1000.0)));
+      }
+    }
+    if (!complete) {
+      std::cerr << "Server did not confirm the completed file" << std::endl;
+      return false;
+    }
+
+    // Aggregate over the streams, from the manifest to the barrier
+    latency_stats_ = results[0];
+    latency_stats_.start_time = start;
+    for (int i = 1; i < streams; ++i) {
+      latency_stats_.merge(results[i]);
+    }
+    latency_stats_.setPayload(payload_size_, SrPacket::headerSize());
+    latency_stats_.setPathMtu(route_mtu_, mtu_probes_);
+    latency_stats_.end_time = high_resolution_clock::now();
+    for (int i = 0; i < streams; ++i) {
+      latency_stats_.addStream(
+          results[i].total_bytes,
+          duration_cast<microseconds>(results[i].end_time -
+                                      results[i].start_time)
+                  .count() /
+              1000000.0);
+    }
+    std::cout << "All streams complete, server confirmed the file"
+              << std::endl;
+    return true;
+  }
+
+  // Send a control message and wait for its reply, retransmitting on the
+  // backed-off RTO
+  template <typename Message>
+  bool exchange_with_retry(const Message &request, uint8_t reply_type,
+                           Message &reply) {
+    for (int attempt = 0; attempt < MAX_RETRIES; ++attempt) {
+      high_resolution_clock::time_point sent = high_resolution_clock::now();
+      boost::system::error_code error;
+      control_socket_.send_to(
+          boost::asio::buffer(&request, requestSize(request)),
+          server_endpoint_, 0, error);
+      if (!error &&
+          wait_reply(request, reply_type, reply, rtt_.rtoFor(attempt))) {
+        if (attempt == 0) {
+          rtt_.addSample(duration_cast<microseconds>(
+                             high_resolution_clock::now() - sent)
+                             .count() /
+                         1000.0);
+        }
+        return true;
+      }
+      if (verbose_ || error) {
+        std::cout << "Control message timeout, retransmitting..."
+                  << std::endl;
+      }
+    }
+    return false;
+  }
+
+  // Wait up to timeout_ms for the reply to request, skipping strays
+  template <typename Message>
+  bool wait_reply(const Message &request, uint8_t reply_type, Message &reply,
+                  double timeout_ms) {
+    auto deadline = steady_clock::now() +
+                    microseconds(static_cast<int64_t>(timeout_ms * 1000.0));
+    size_t length;
+    while (receive_control(reply, deadline, length)) {
+      if (length > 0 && isReply(request, reply, length) &&
+          reply.type == reply_type &&
+          reply.transfer_id == request.transfer_id) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Receive one datagram on the control socket, waiting until deadline.
+  // False on timeout; length is 0 after a receive error.
+  template <typename Message>
+  bool receive_control(Message &reply, steady_clock::time_point deadline,
+                       size_t &length) {
+    bool done = false;
+    boost::system::error_code error;
+    udp::endpoint from;
+    length = 0;
+    control_socket_.async_receive_from(
+        boost::asio::buffer(&reply, sizeof(reply)), from,
+        [&](const boost::system::error_code &e, size_t n) {
+          done = true;
+          error = e;
+          length = n;
+        });
+    control_context_.restart();
+    control_context_.run_until(deadline);
+    if (!done) {
+      control_socket_.cancel();
+      control_context_.restart();
+      control_context_.run();
+      return false;
+    }
+    if (error) {
+      length = 0;
+    }
+    return true;
+  }
+
+  // Bytes on the wire of a request: resume queries are header only
+  static size_t requestSize(const SrControl &) { return sizeof(SrControl); }
+  static size_t requestSize(const SrResume &) { return SrResume::headerSize(); }
+  static size_t requestSize(const SrSignature &) {
+    return SrSignature::headerSize();
+  }
+
+  // Whether a datagram of length bytes is well formed as the reply to
+  // request (type and transfer ID are checked by the caller)
+  static bool isReply(const SrControl &, const SrControl &, size_t length) {
+    return length == sizeof(SrControl);
+  }
+  static bool isReply(const SrResume &request, const SrResume &reply,
+                      size_t length) {
+    return length >= SrResume::headerSize() &&
+           length == SrResume::headerSize() + reply.page_bytes &&
+           reply.page == request.page;
+  }
+  static bool isReply(const SrSignature &request, const SrSignature &reply,
+                      size_t length) {
+    return length >= SrSignature::headerSize() &&
+           reply.count <= SIGNATURES_PER_PAGE &&
+           length == SrSignature::headerSize() +
+                         reply.count * sizeof(BlockSignature) &&
+           reply.page == request.page;
+  }
+
+  // Resume query: announce the file and fetch the receiver's chunk bitmap,
+  // one page per exchange
+  bool query_resume_state(uint64_t file_size, int streams,
+                          ResumeBitmap &bitmap) {
+    SrResume request;
+    std::memset(&request, 0, SrResume::headerSize());
+    request.type = SR_RESUME_QUERY;
+    request.transfer_id = htonl32(transfer_id_);
+    setControlFileSize(request, file_size);
+    request.stream_count = static_cast<uint16_t>(streams);
+    request.payload_size = static_cast<uint16_t>(payload_size_);
+
+    bitmap.total_packets =
+        static_cast<uint32_t>(packetCount(file_size, payload_size_));
+    bitmap.bits.assign(
+        (ResumeBitmap::chunkCount(bitmap.total_packets) + 7) / 8, 0);
+    for (size_t offset = 0; offset < bitmap.bits.size();
+         offset += RESUME_PAGE_BYTES) {
+      request.page = htonl32(static_cast<uint32_t>(offset / RESUME_PAGE_BYTES));
+      SrResume reply;
+      if (!exchange_with_retry(request, SR_RESUME_REPLY, reply)) {
+        std::cerr << "No reply to the resume query" << std::endl;
+        return false;
+      }
+      if (!reply.status) {
+        std::cerr << "Server rejected the resume query" << std::endl;
+        return false;
+      }
+      std::memcpy(&bitmap.bits[offset], reply.bitmap,
+                  std::min<size_t>(reply.page_bytes,
+                                   bitmap.bits.size() - offset));
+    }
+    return true;
+  }
+};
+
+// ---- Reliable multicast ----
+//
+// One sender, any number of receivers, in the manner of NORM. The sender
+// multicasts every data packet once at a fixed rate (--rate) and never
+// hears an ACK. Receivers (servers started with --join) report what they
+// lost to the group in NACKs, one entry per FEC block. The sender answers
+// with new repair rows of the block: any K rows rebuild any K losses, so
+// one repair packet serves every receiver that lost a different packet of
+// the block. Once a block's K rows are spent, its missing data packets are
+// resent instead. Receivers hearing a NACK leave its blocks out of their
+// own, and the sender ignores NACKs for a block it has just repaired, so
+// repair traffic follows the worst receiver's loss, not the number of
+// receivers. Flush announcements end the transfer: they tell receivers
+// where the file ends, and the sender stops after MCAST_FLUSH_ROUNDS of
+// them pass without a NACK.
+
+class MulticastSender {
+public:
+  MulticastSender(boost::asio::io_context &io_context,
+                  const std::string &group, int port,
+                  const std::string &iface = "",
+                  int ttl = MCAST_DEFAULT_TTL,
+                  double rate_mbit = MCAST_DEFAULT_RATE_MBIT,
+                  int payload_size = DEFAULT_PAYLOAD_SIZE,
+                  ChecksumAlgorithm checksum = ChecksumAlgorithm::CRC32,
+                  int fec_data = MCAST_DEFAULT_FEC_DATA,
+                  int fec_repair = MCAST_DEFAULT_FEC_REPAIR)
+      : socket_(io_context), source_(nullptr),
+        payload_size_(payload_size), checksum_(checksum),
+        fec_data_(fec_data), fec_repair_(fec_repair),
+        bytes_per_second_(rate_mbit * 1000000.0 / 8.0), transfer_id_(0),
+        total_packets_(0), next_seq_num_(0), pacing_timer_(io_context),
+        pacing_wait_(false), flush_timer_(io_context), flushing_(false),
+        quiet_flushes_(0), done_(false) {
+    boost::asio::ip::address_v4 address =
+        boost::asio::ip::make_address_v4(group);
+    if (!address.is_multicast()) {
+      throw std::runtime_error("Not a multicast group: " + group);
+    }
+    group_endpoint_ = udp::endpoint(address, port);
+
+    // The sender joins the group too: that is where receivers NACK
+    namespace multicast = boost::asio::ip::multicast;
+    socket_.open(udp::v4());
+    socket_.set_option(udp::socket::reuse_address(true));
+    socket_.bind(udp::endpoint(udp::v4(), port));
+    if (iface.empty()) {
+      socket_.set_option(multicast::join_group(address));
+    } else {
+      boost::asio::ip::address_v4 local =
+          boost::asio::ip::make_address_v4(iface);
+      socket_.set_option(multicast::join_group(address, local));
+      socket_.set_option(multicast::outbound_interface(local));
+    }
+    socket_.set_option(multicast::hops(ttl));
+    socket_.set_option(multicast::enable_loopback(true));
+
+    latency_stats_.setChecksum(checksumName(checksum_));
+    latency_stats_.setPacingRate(bytes_per_second_);
+    latency_stats_.setPayload(payload_size_, SrPacket::headerSize());
+  }
+
+  // Multicast a file. Packets are read from the source as they are sent;
+  // the source must outlive io_context.run(), which returns once the
+  // receivers have gone quiet.
+  void send_file(FileSource &source) {
+    source_ = &source;
+    uint64_t packets = packetCount(source.size(), payload_size_);
+    if (packets > UINT32_MAX) {
+      throw std::runtime_error("File too large for 32-bit sequence numbers");
+    }
+    total_packets_ = static_cast<uint32_t>(packets);
+    std::random_device random;
+    do {
+      transfer_id_ = random();
+    } while (transfer_id_ == 0);
+
+    std::cout << "Multicasting " << source.size() << " bytes to "
+              << group_endpoint_ << " at " << std::fixed
+              << std::setprecision(1) << bytes_per_second_ * 8 / 1000000.0
+              << " Mbit/s (transfer " << std::hex << transfer_id_ << std::dec
+              << ", FEC " << fec_data_ << ":" << fec_repair_ << ")"
+              << std::endl;
+    latency_stats_.startTransfer();
+    next_send_time_ = steady_clock::now();
+    receive_nacks();
+    send_paced();
+  }
+
+  // Transfer ID the receivers' sessions are keyed by
+  uint32_t transferId() const { return transfer_id_; }
+
+  // Get latency statistics
+  const LatencyStats &getLatencyStats() const { return latency_stats_; }
+
+private:
+  // A queued repair: coded row `row` of a block, or (row < 0) data packet
+  // seq_num resent
+  struct QueuedRepair {
+    uint32_t block_first;
+    int row;
+    uint32_t seq_num;
+  };
+
+  // Repair history of one block: the rows spent, and the last round of
+  // repairs (how many, when the last of them went out, how many are still
+  // queued)
+  struct BlockRepairs {
+    int rows_sent = 0;
+    int round = 0;
+    int queued = 0;
+    steady_clock::time_point last;
+  };
+
+  udp::socket socket_;
+  udp::endpoint group_endpoint_;
+  FileSource *source_;
+  int payload_size_;
+  ChecksumAlgorithm checksum_;
+  int fec_data_;
+  int fec_repair_;
+  double bytes_per_second_; // Data and repairs together
+  uint32_t transfer_id_;
+  uint32_t total_packets_;
+  uint32_t next_seq_num_; // Next data packet sent for the first time
+
+  // Pacing: the send schedule, and the timer waiting on it
+  steady_clock::time_point next_send_time_;
+  boost::asio::steady_timer pacing_timer_;
+  bool pacing_wait_;
+
+  std::deque<QueuedRepair> repairs_;
+  std::unordered_map<uint32_t, BlockRepairs> blocks_;
+
+  boost::asio::steady_timer flush_timer_;
+  bool flushing_;     // Every data packet sent once
+  int quiet_flushes_; // Flushes since the last NACK
+  bool done_;
+
+  SrPacket packet_;
+  SrRepair repair_;
+  Datagram datagram_; // NACKs, and our own packets looped back
+  udp::endpoint from_;
+  LatencyStats latency_stats_;
+
+  // Put packets on the wire while the schedule allows: repairs first, then
+  // new data. The schedule never banks more than a millisecond of idle
+  // time, so a repair after a quiet spell does not go out as a burst.
+  void send_paced() {
+    if (done_) {
+      return;
+    }
+    auto now = steady_clock::now();
+    next_send_time_ = std::max(next_send_time_, now - milliseconds(1));
+    while (next_send_time_ <= now) {
+      size_t bytes;
+      if (!repairs_.empty()) {
+        bytes = send_repair(repairs_.front());
+        repairs_.pop_front();
+      } else if (next_seq_num_ < total_packets_) {
+        bytes = send_data(next_seq_num_++);
+      } else {
+        break;
+      }
+      next_send_time_ += duration_cast<steady_clock::duration>(
+          std::chrono::duration<double>(bytes / bytes_per_second_));
+    }
+
+    if (next_seq_num_ == total_packets_ && !flushing_) {
+      flushing_ = true;
+      schedule_flush();
+    }
+    if (!pacing_wait_ && (!repairs_.empty() || next_seq_num_ < total_packets_)) {
+      pacing_wait_ = true;
+      pacing_timer_.expires_at(next_send_time_);
+      pacing_timer_.async_wait([this](const boost::system::error_code &error) {
+        pacing_wait_ = false;
+        if (!error) {
+          send_paced();
+        }
+      });
+    }
+  }
+
+  // Multicast data packet seq_num; returns its size on the wire
+  size_t send_data(uint32_t seq_num) {
+    uint64_t offset = static_cast<uint64_t>(seq_num) * payload_size_;
+    size_t data_size = static_cast<size_t>(
+        std::min<uint64_t>(payload_size_, source_->size() - offset));
+    packet_.type = SR_MCAST_DATA;
+    packet_.transfer_id = htonl32(transfer_id_);
+    packet_.seq_num = htonl32(seq_num);
+    packet_.timestamp = timestampMicros();
+    packet_.data_size = static_cast<uint16_t>(data_size);
+    packet_.is_last = seq_num + 1 == total_packets_ ? 1 : 0;
+    packet_.checksum = static_cast<uint8_t>(checksum_);
+    packet_.fec_data = static_cast<uint8_t>(fec_data_);
+    packet_.fec_repair = static_cast<uint8_t>(fec_repair_);
+    packet_.encoding = PAYLOAD_RAW;
+    packet_.payload_size = static_cast<uint16_t>(payload_size_);
+    source_->read(offset, packet_.data, data_size);
+    packet_.crc =
+        htonl32(calculateChecksum(checksum_, packet_.data, data_size));
+    latency_stats_.addWireBytes(data_size);
+    send(&packet_, packet_.getTotalSize());
+    return packet_.getTotalSize();
+  }
+
+  // Send a queued repair; returns its size on the wire
+  size_t send_repair(const QueuedRepair &queued) {
+    BlockRepairs &state = blocks_[queued.block_first];
+    state.queued--;
+    state.last = steady_clock::now();
+    if (queued.row < 0) {
+      latency_stats_.addRetransmission();
+      return send_data(queued.seq_num);
+    }
+
+    // The row is coded from the block's data packets on demand
+    uint32_t count = std::min<uint32_t>(fec_data_,
+                                        total_packets_ - queued.block_first);
+    size_t symbol_size = fecSymbolSize(payload_size_);
+    std::memset(repair_.symbol, 0, symbol_size);
+    for (uint32_t index = 0; index < count; ++index) {
+      uint32_t seq_num = queued.block_first + index;
+      uint64_t offset = static_cast<uint64_t>(seq_num) * payload_size_;
+      size_t data_size = static_cast<size_t>(
+          std::min<uint64_t>(payload_size_, source_->size() - offset));
+      const char *data = source_->span(offset, data_size);
+      if (!data) {
+        source_->read(offset, packet_.data, data_size);
+        data = packet_.data;
+      }
+      fecAccumulate(repair_.symbol,
+                    fecCoefficient(fec_repair_, queued.row, index),
+                    static_cast<uint16_t>(data_size),
+                    seq_num + 1 == total_packets_ ? 1 : 0, data);
+    }
+    repair_.type = SR_REPAIR_PACKET;
+    repair_.transfer_id = htonl32(transfer_id_);
+    repair_.block_first = htonl32(queued.block_first);
+    repair_.timestamp = timestampMicros();
+    repair_.fec_data = static_cast<uint8_t>(fec_data_);
+    repair_.fec_repair = static_cast<uint8_t>(fec_repair_);
+    repair_.block_count = static_cast<uint8_t>(count);
+    repair_.repair_index = static_cast<uint8_t>(queued.row);
+    repair_.crc = htonl32(calculateChecksum(
+        ChecksumAlgorithm::CRC32C,
+        reinterpret_cast<const char *>(repair_.symbol), symbol_size));
+    latency_stats_.addWireBytes(symbol_size);
+    latency_stats_.addFecRepair();
+    send(&repair_, SrRepair::headerSize() + symbol_size);
+    return SrRepair::headerSize() + symbol_size;
+  }
+
+  void send(const void *data, size_t size) {
+    boost::system::error_code error;
+    socket_.send_to(boost::asio::buffer(data, size), group_endpoint_, 0,
+                    error);
+    if (error) {
+      std::cerr << "Send error: " << error.message() << std::endl;
+    }
+  }
+
+  void receive_nacks() {
+    socket_.async_receive_from(
+        boost::asio::buffer(&datagram_, sizeof(datagram_)), from_,
+        [this](const boost::system::error_code &error, size_t bytes) {
+          if (done_ || error == boost::asio::error::operation_aborted) {
+            return;
+          }
+          if (!error && bytes >= SrNack::headerSize() &&
+              datagram_.type == SR_NACK_PACKET &&
+              ntohl32(datagram_.nack.transfer_id) == transfer_id_) {
+            handle_nack(datagram_.nack,
+                        std::min<size_t>(datagram_.nack.count,
+                                         (bytes - SrNack::headerSize()) /
+                                             sizeof(SrNackEntry)));
+          }
+          receive_nacks();
+        });
+  }
+
+  // Queue repairs for the blocks a NACK names. A block repaired within
+  // MCAST_REPAIR_HOLDOFF_MS, or with repairs still queued, only gets what
+  // the NACK asks beyond that round: the NACK most likely crossed it.
+  void handle_nack(const SrNack &nack, size_t count) {
+    latency_stats_.addNackPacket();
+    quiet_flushes_ = 0;
+    auto now = steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      const SrNackEntry &entry = nack.entries[i];
+      uint32_t first = ntohl32(entry.block_first);
+      if (first % fec_data_ != 0 || first >= next_seq_num_ ||
+          entry.needed == 0) {
+        continue;
+      }
+      BlockRepairs &state = blocks_[first];
+      int needed = entry.needed;
+      if (state.queued > 0 ||
+          now - state.last < milliseconds(MCAST_REPAIR_HOLDOFF_MS)) {
+        if (needed <= state.round) {
+          continue;
+        }
+        int extra = needed - state.round;
+        state.round = needed;
+        needed = extra;
+      } else {
+        state.round = needed;
+      }
+
+      // Fresh rows while the code has them, then the data packets
+      uint64_t missing =
+          (static_cast<uint64_t>(ntohl32(entry.missing_hi)) << 32) |
+          ntohl32(entry.missing_lo);
+      for (; needed > 0 && state.rows_sent < fec_repair_; --needed) {
+        repairs_.push_back({first, state.rows_sent++, 0});
+        state.queued++;
+      }
+      for (int index = 0; needed > 0 && index < fec_data_; ++index) {
+        uint32_t seq_num = first + index;
+        if ((missing >> index) & 1 && seq_num < total_packets_) {
+          repairs_.push_back({first, -1, seq_num});
+          state.queued++;
+        }
+      }
+    }
+    send_paced();
+  }
+
+  // Announce the end of the data every MCAST_FLUSH_INTERVAL_MS while
+  // repairs are still asked for; stop after enough quiet rounds
+  void schedule_flush() {
+    flush_timer_.expires_after(
+        boost::asio::chrono::milliseconds(MCAST_FLUSH_INTERVAL_MS));
+    flush_timer_.async_wait([this](const boost::system::error_code &error) {
+      if (error || done_) {
+        return;
+      }
+      if (repairs_.empty()) {
+        if (quiet_flushes_ >= MCAST_FLUSH_ROUNDS) {
+          finish();
+          return;
+        }
+        SrControl flush;
+        std::memset(&flush, 0, sizeof(flush));
+        flush.type = SR_MCAST_FLUSH;
+        flush.transfer_id = htonl32(transfer_id_);
+        setControlFileSize(flush, source_->size());
+        flush.stream_count = 1;
+        flush.payload_size = static_cast<uint16_t>(payload_size_);
+        flush.mode = MANIFEST_PLAIN;
+        send(&flush, sizeof(flush));
+        quiet_flushes_++;
+      }
+      schedule_flush();
+    });
+  }
+
+  void finish() {
+    done_ = true;
+    latency_stats_.endTransfer(source_->size());
+    pacing_timer_.cancel();
+    flush_timer_.cancel();
+    socket_.cancel();
+
+    // Everything after the file itself went to repairs; with NACK
+    // suppression this stays flat as receivers are added
+    uint64_t data_bytes = source_->size();
+    std::cout << "Multicast transfer complete: " << data_bytes << " bytes, "
+              << latency_stats_.fec_repairs_sent << " repair packets and "
+              << latency_stats_.retransmitted << " resent for "
+              << latency_stats_.nack_packets << " NACKs, " << std::fixed
+              << std::setprecision(2)
+              << (data_bytes > 0
+                      ? 100.0 * latency_stats_.wire_bytes / data_bytes - 100.0
+                      : 0.0)
+              << "% repair overhead" << std::endl;
+  }
+};
+
+// Limits shared by every server socket (one per thread with --threads)
+struct SessionLimits {
+  size_t max_sessions;  // Concurrent sessions allowed
+  size_t memory_budget; // Bytes of per-session state allowed in total
+  int idle_timeout_s;   // Sessions silent this long are closed
+  std::atomic<size_t> active_sessions;
+  std::atomic<size_t> memory_used;
+  std::atomic<uint64_t> sessions_opened; // Also hands out session IDs
+  std::atomic<uint64_t> sessions_rejected;
+
+  SessionLimits(size_t max_sessions_, size_t memory_budget_,
+                int idle_timeout_s_)
+      : max_sessions(max_sessions_), memory_budget(memory_budget_),
+        idle_timeout_s(idle_timeout_s_), active_sessions(0), memory_used(0),
+        sessions_opened(0), sessions_rejected(0) {}
+
+  // Admit a session needing `bytes` of state, if both limits allow it
+  bool reserve(size_t bytes) {
+    size_t sessions = active_sessions.load();
+    do {
+      if (sessions >= max_sessions) {
+        return false;
+      }
+    } while (!active_sessions.compare_exchange_weak(sessions, sessions + 1));
+
+    size_t used = memory_used.load();
+    do {
+      if (used + bytes > memory_budget) {
+        active_sessions--;
+        return false;
+      }
+    } while (!memory_used.compare_exchange_weak(used, used + bytes));
+    return true;
+  }
+
+  // Return a closed session's share
+  void release(size_t bytes) {
+    active_sessions--;
+    memory_used -= bytes;
+  }
+};
+
+// A multi-stream transfer: one output file written by several sessions,
+// each covering one packet range. Sessions on different server threads
+// share it, so the sink and counters are guarded by a mutex.
+struct TransferGroup : std::enable_shared_from_this<TransferGroup> {
+  uint64_t id;                    // Server-wide session number
+  uint32_t transfer_id;
+  uint64_t file_size;             // From the manifest
+  uint32_t total_packets;
+  int payload_size;               // Data bytes per packet, from the manifest
+  int stream_count;
+  size_t footprint;               // Bytes charged to the memory budget
+  high_resolution_clock::time_point start_time;
+
+  std::mutex mutex;
+  std::unique_ptr<FileSink> sink; // Null when no output file is written
+  std::string output_path;
+  std::vector<char> stream_done;  // Per-stream completion flags
+  int streams_done;
+  bool complete;                  // Every range written and file finalized
+  steady_clock::time_point last_activity;
+
+  // Resumable transfers: chunks already on disk, persisted next to the
+  // output file (null otherwise; set before the group is shared)
+  std::unique_ptr<ResumeJournal> journal;
+  udp::endpoint resume_from;      // Sender of the resume query
+
+  // Delta transfers: the copy the received delta is applied to (empty
+  // otherwise), and whether rebuilding the file from it failed
+  std::string delta_basis;
+  bool failed;
+
+  // Directory pack: the directory the tree is unpacked under (empty
+  // otherwise); failed is set if that fails
+  std::string tree_root;
+
+  // Write one payload (any thread)
+  void write(uint64_t offset, const char *data, size_t len) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (sink) {
+      sink->write(offset, data, len);
+      if (journal) {
+        journal->addPacket(static_cast<uint32_t>(offset / payload_size),
+                           *sink);
+      }
+    }
+    last_activity = steady_clock::now();
+  }
+
+  // Whether a packet is already on disk from an earlier run (any thread)
+  bool hasPacket(uint32_t seq_num) {
+    if (!journal) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    return journal->hasPacket(seq_num);
+  }
+
+  // Stream containing a sequence number
+  int streamOf(uint32_t seq_num) const {
+    for (int i = stream_count - 1; i > 0; --i) {
+      if (seq_num >= streamRange(total_packets, stream_count, i).first) {
+        return i;
+      }
+    }
+    return 0;
+  }
+};
+
+// Multi-stream transfers by transfer ID, shared by every server thread
+struct TransferGroups {
+  std::mutex mutex;
+  std::unordered_map<uint32_t, std::shared_ptr<TransferGroup>> groups;
+
+  std::shared_ptr<TransferGroup> find(uint32_t transfer_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = groups.find(transfer_id);
+    return it == groups.end() ? nullptr : it->second;
+  }
+};
+
+// A transfer is identified by the client endpoint plus the transfer ID the
+// client picked; stop-and-wait clients have no ID and use 0
+struct SessionKey {
+  udp::endpoint endpoint;
+  uint32_t transfer_id;
+
+  bool operator==(const SessionKey &other) const {
+    return transfer_id == other.transfer_id && endpoint == other.endpoint;
+  }
+};
+
+struct SessionKeyHash {
+  size_t operator()(const SessionKey &key) const {
+    size_t h = std::hash<std::string>()(key.endpoint.address().to_string());
+    h ^= (static_cast<size_t>(key.endpoint.port()) << 32) ^ key.transfer_id;
+    return h * 0x9E3779B97F4A7C15ull;
+  }
+};
+
+// Receive state of one transfer
+struct ReceiveSession {
+  uint64_t id;                     // Server-wide session number
+  SessionKey key;
+  std::unique_ptr<FileSink> sink;  // Null when no output file is written
+  std::string output_path;
+  uint64_t bytes_received;         // Payload bytes accepted
+  int payload_size;                // Data bytes per packet, fixed by the
+                                   // first packet (or the group)
+  size_t footprint;                // Bytes charged to the memory budget
+  bool complete;                   // File finalized; kept to re-ACK
+  steady_clock::time_point last_activity;
+  high_resolution_clock::time_point start_time;
+
+  // Multi-stream transfer this session is one range of (null otherwise);
+  // the group owns the output file then
+  std::shared_ptr<TransferGroup> group;
+  int stream_index;
+
+  // Stop-and-wait state
+  uint8_t expected_seq_num;
+
+  // Selective-repeat state
+  uint32_t sr_first;              // First packet of the session's range
+  uint32_t sr_base;               // Next in-order sequence number expected
+  std::vector<char> sr_received;  // Ring of received flags, seq % window
+  uint64_t sr_file_size;          // Known once the last packet arrives
+  uint32_t sr_last_seq_num;       // Sequence number carrying is_last
+  bool sr_last_seen;
+  uint32_t sr_highest;            // One past the highest packet received
+
+  // ACK held back for coalescing: packets it covers, and the newest one
+  // (whose timestamp it echoes) with its arrival time
+  int acks_pending;
+  uint32_t ack_newest;
+  uint32_t ack_ts_echo;
+  steady_clock::time_point ack_arrival;
+
+  // FEC blocks being collected, once the sender's packets announce a code
+  std::unique_ptr<FecDecoder> fec;
+
+  // Multicast transfer (--join): losses are reported to the group in NACKs
+  // instead of being ACKed. A hole arms a NACK after a random backoff; the
+  // NACKs other receivers send meanwhile (repair packets asked for, by
+  // block) suppress the entries they already cover.
+  bool multicast;
+  int nack_block;                     // Sender's FEC block size
+  bool nack_armed;
+  steady_clock::time_point nack_at;   // When the armed NACK goes out
+  steady_clock::time_point nack_hold; // No new NACK before (repairs due)
+  std::unordered_map<uint32_t, int> nacks_heard;
+
+  // Compressed transfer: payloads wait in a window-sized ring until they
+  // can go to the frame decoder in order (null and empty otherwise)
+  std::unique_ptr<FrameDecoder> frames;
+  std::vector<char> sr_payloads;         // seq % window * payload_size
+  std::vector<uint16_t> sr_payload_sizes;
+};
+
+// UDP Server implementation. Each transfer gets its own session, so any
+// number of clients can upload at once; with --threads several servers
+// share the port through SO_REUSEPORT, one socket and io_context per thread.
+class UdpServer {
+private:
+  boost::asio::io_context &io_context_;
+  udp::socket socket_;
+  udp::endpoint remote_endpoint_;
+  bool is_running_;
+  std::string output_filepath_;
+  bool output_is_directory_; // One file per session inside it
+  bool verbose_;
+  LatencyStats latency_stats_;
+  high_resolution_clock::time_point packet_receive_time_;
+  high_resolution_clock::time_point transfer_start_time_;
+
+  // Buffer for incoming data
+  Datagram datagram_;
+  Packet &receive_buffer_; // Stop-and-wait view of datagram_
+
+#ifdef HAVE_IO_URING
+  // io_uring engine, null for the Asio paths. Declared before the sessions
+  // so their files are closed while it can still finish their writes.
+  std::unique_ptr<UringUdpIO> uring_;
+#endif
+
+  // Disk stage (--disk-thread, Asio paths only), null when payloads are
+  // written on the network thread. Outlives the sessions for the same
+  // reason.
+  std::unique_ptr<DiskWriter> disk_;
+
+  // Per-transfer state, created on a transfer's first packet
+  std::unordered_map<SessionKey, std::unique_ptr<ReceiveSession>,
+                     SessionKeyHash>
+      sessions_;
+  SessionLimits &limits_;
+  TransferGroups &groups_; // Multi-stream transfers, shared by all threads
+  boost::asio::steady_timer sweep_timer_; // Idle session expiry
+  SyncPolicy sync_policy_;
+  uint64_t sync_interval_bytes_;
+  uint64_t bytes_received_; // Payload bytes over all sessions
+
+  int receive_window_; // Packets accepted beyond a session's sr_base
+  int max_payload_;    // Largest payload a sender may negotiate
+
+  // Batched receive path (recvmmsg/sendmmsg), null for per-packet I/O
+  std::unique_ptr<BatchedUdpIO> batch_io_;
+  std::vector<SrAck> pending_acks_; // ACKs queued until the batch flushes
+
+  // ACK coalescing: a session's in-order packets share one ACK, sent
+  // every ack_every_ packets or ack_delay_us_ after the first of them
+  int ack_every_;
+  int ack_delay_us_;
+  boost::asio::steady_timer ack_timer_;
+  bool ack_timer_armed_;
+  std::vector<SessionKey> delayed_acks_; // Sessions holding an ACK back
+
+  // Decompression workers for compressed transfers, shared by all threads
+  // (null decodes on the network thread)
+  WorkerPool *decoders_;
+
+  // Reliable multicast (--join): the group NACKs go to (port 0 when the
+  // server did not join one) and the loss scan that sends them
+  udp::endpoint multicast_endpoint_;
+  boost::asio::steady_timer nack_timer_;
+  std::mt19937 nack_random_;
+
+  // Benchmark hook: share of multicast data and repair packets dropped on
+  // arrival, so receivers on one host lose different packets
+  double receive_loss_;
+  std::mt19937_64 loss_random_;
+
+public:
+  UdpServer(boost::asio::io_context &io_context, int port,
+            SessionLimits &limits, TransferGroups &groups,
+            std::string output_filepath = "",
+            bool verbose = false,
+            int receive_window = SR_DEFAULT_RECV_WINDOW,
+            SyncPolicy sync_policy = SyncPolicy::ON_COMPLETE,
+            uint64_t sync_interval_bytes = DEFAULT_SYNC_INTERVAL,
+            int batch_size = 0, bool gro = false, bool reuse_port = false,
+            WorkerPool *decoders = nullptr,
+            int max_payload = MAX_PAYLOAD_SIZE, bool io_uring = false,
+            int ack_every = DEFAULT_ACK_EVERY,
+            int ack_delay_us = DEFAULT_ACK_DELAY_US,
+            const std::string &multicast_group = "",
+            const std::string &multicast_iface = "",
+            bool disk_thread = false)
+      : io_context_(io_context), socket_(io_context), is_running_(true),
+        output_filepath_(output_filepath), output_is_directory_(false),
+        verbose_(verbose), receive_buffer_(datagram_.legacy), limits_(limits),
+        groups_(groups),
+        sweep_timer_(io_context), sync_policy_(sync_policy),
+        sync_interval_bytes_(sync_interval_bytes), bytes_received_(0),
+        receive_window_(receive_window), max_payload_(max_payload),
+        ack_every_(ack_every), ack_delay_us_(ack_delay_us),
+        ack_timer_(io_context), ack_timer_armed_(false),
+        decoders_(decoders), nack_timer_(io_context),
+        nack_random_(std::random_device()()), receive_loss_(0.0) {
+
+    // With --threads every server binds the same port; the kernel spreads
+    // clients over the sockets by address hash, so a session always lands
+    // on the same thread
+    socket_.open(udp::v4());
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+      int one = 1;
+      if (::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_REUSEPORT,
+                       &one, sizeof(one)) != 0) {
+        throw std::runtime_error("SO_REUSEPORT failed: " +
+                                 std::string(std::strerror(errno)));
+      }
+#else
+      throw std::runtime_error("SO_REUSEPORT is not supported here");
+#endif
+    }
+    // Every receiver of a multicast group on this host binds its port
+    if (!multicast_group.empty()) {
+      socket_.set_option(udp::socket::reuse_address(true));
+    }
+    socket_.bind(udp::endpoint(udp::v4(), port));
+    if (!multicast_group.empty()) {
+      join_group(multicast_group, multicast_iface);
+    }
+
+    // A trailing slash names an output directory, made if it is missing
+    size_t last = output_filepath_.find_last_not_of('/');
+    if (last != std::string::npos && last + 1 < output_filepath_.size()) {
+      output_filepath_.erase(last + 1);
+      makeDirectories(output_filepath_);
+    }
+    output_is_directory_ =
+        !output_filepath_.empty() && isDirectory(output_filepath_);
+
+    // Leave room for a full receive window of the largest packets
+    socket_.set_option(boost::asio::socket_base::receive_buffer_size(
+        std::max(8192, receive_window_ * static_cast<int>(
+                                             SrPacket::headerSize() +
+                                             max_payload_))));
+
+    // ACK sends must never block: a server stuck on a full send buffer stops
+    // draining the client's data, and the client stops reading ACKs. A
+    // dropped ACK just costs a retransmission.
+    socket_.non_blocking(true);
+
+    latency_stats_.setWindowSize(receive_window_);
+
+    // io_uring replaces the Asio receive paths when the kernel has it
+    if (io_uring) {
+#ifdef HAVE_IO_URING
+      try {
+        uring_.reset(new UringUdpIO(io_context, socket_, sizeof(Datagram)));
+        latency_stats_.setIoMode("io_uring multishot recvmsg");
+        batch_size = 0;
+        gro = false;
+      } catch (const std::exception &e) {
+        std::cout << "io_uring unavailable (" << e.what()
+                  << "), using Asio" << std::endl;
+      }
+#else
+      std::cout << "io_uring not supported on this platform, using Asio"
+                << std::endl;
+#endif
+    }
+
+    // Payload writes move to a thread of their own; io_uring already
+    // writes asynchronously
+    if (disk_thread) {
+#ifdef HAVE_IO_URING
+      disk_thread = !uring_;
+#endif
+    }
+    if (disk_thread) {
+      disk_.reset(new DiskWriter(DISK_RING_SLOTS, max_payload_));
+    }
+
+    // GRO hands over coalesced buffers, which only the batch path splits
+    if (gro && batch_size == 0) {
+      batch_size = GSO_MIN_BATCH;
+    }
+    if (batch_size > 0) {
+      batch_io_.reset(new BatchedUdpIO(socket_, batch_size, sizeof(Datagram)));
+      pending_acks_.reserve(batch_size);
+      latency_stats_.setIoMode("batched recvmmsg");
+    }
+    if (gro) {
+      if (batch_io_->enableGro()) {
+        latency_stats_.setIoMode("UDP GRO");
+      } else {
+        std::cout << "UDP GRO not supported, using plain batching"
+                  << std::endl;
+      }
+    }
+
+    // Initialize latency stats
+    latency_stats_.startTransfer();
+    transfer_start_time_ = high_resolution_clock::now();
+  }
+
+  // Start receiving data
+  void start_receive() {
+    receive_next();
+    schedule_sweep();
+    if (multicast_endpoint_.port() != 0) {
+      schedule_nack_scan();
+    }
+  }
+
+  // Join a multicast group on the bound port, on the interface with
+  // address iface (the routing table's choice when empty). NACKs go to
+  // the group out of the same interface.
+  void join_group(const std::string &group, const std::string &iface) {
+    boost::asio::ip::address_v4 address =
+        boost::asio::ip::make_address_v4(group);
+    if (!address.is_multicast()) {
+      throw std::runtime_error("Not a multicast group: " + group);
+    }
+    namespace multicast = boost::asio::ip::multicast;
+    if (iface.empty()) {
+      socket_.set_option(multicast::join_group(address));
+    } else {
+      boost::asio::ip::address_v4 local =
+          boost::asio::ip::make_address_v4(iface);
+      socket_.set_option(multicast::join_group(address, local));
+      socket_.set_option(multicast::outbound_interface(local));
+    }
+    multicast_endpoint_ = udp::endpoint(address, port());
+    std::cout << "Joined multicast group " << group;
+    if (!iface.empty()) {
+      std::cout << " on " << iface;
+    }
+    std::cout << std::endl;
+  }
+
+  // Drop this share of arriving multicast data and repair packets
+  // (benchmarks only)
+  void setReceiveLoss(double loss, uint64_t seed) {
+    receive_loss_ = loss;
+    loss_random_.seed(seed);
+  }
+
+  // Arm the next receive: one datagram, or a whole batch when readable
+  void receive_next() {
+#ifdef HAVE_IO_URING
+    if (uring_) {
+      uring_->async_wait_readable(
+          boost::bind(&UdpServer::handle_receive_uring, this,
+                      boost::asio::placeholders::error));
+      return;
+    }
+#endif
+    if (batch_io_) {
+      batch_io_->async_wait_readable(
+          boost::bind(&UdpServer::handle_receive_batch, this,
+                      boost::asio::placeholders::error));
+      return;
+    }
+
+    socket_.async_receive_from(
+        boost::asio::buffer(&datagram_, sizeof(datagram_)), remote_endpoint_,
+        boost::bind(&UdpServer::handle_receive, this,
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred));
+  }
+
+  // Get latency statistics
+  const LatencyStats &getLatencyStats() const { return latency_stats_; }
+
+  // Handle received data
+  void handle_receive(const boost::system::error_code &error,
+                      size_t bytes_received) {
+    if (!error) {
+      process_datagram(reinterpret_cast<const char *>(&datagram_),
+                       bytes_received, remote_endpoint_);
+    } else if (error != boost::asio::error::operation_aborted) {
+      std::cerr << "Receive error: " << error.message() << std::endl;
+    }
+
+    // If we're still running, listen for the next packet
+    if (is_running_) {
+      receive_next();
+    }
+  }
+
+  // Socket readable in batch mode: drain it with as few syscalls as possible
+  void handle_receive_batch(const boost::system::error_code &error) {
+    if (error) {
+      if (error != boost::asio::error::operation_aborted) {
+        std::cerr << "Receive error: " << error.message() << std::endl;
+      }
+      if (is_running_ && error != boost::asio::error::operation_aborted) {
+        receive_next();
+      }
+      return;
+    }
+
+    size_t count;
+    while ((count = batch_io_->receive()) > 0) {
+      for (size_t i = 0; i < count; ++i) {
+        process_datagram(batch_io_->data(i), batch_io_->length(i),
+                         batch_io_->sender(i));
+      }
+      // One sendmmsg for all the ACKs this batch produced
+      flush_acks();
+      if (!batch_io_->mayHaveMore()) {
+        break; // Socket drained
+      }
+    }
+
+    if (is_running_) {
+      receive_next();
+    }
+  }
+
+#ifdef HAVE_IO_URING
+  // Completions ready in io_uring mode: every datagram received so far,
+  // then one submission for the ACKs and writes they produced
+  void handle_receive_uring(const boost::system::error_code &error) {
+    if (error) {
+      if (error != boost::asio::error::operation_aborted) {
+        std::cerr << "Receive error: " << error.message() << std::endl;
+      }
+      if (is_running_ && error != boost::asio::error::operation_aborted) {
+        receive_next();
+      }
+      return;
+    }
+
+    size_t count;
+    while ((count = uring_->receive()) > 0) {
+      for (size_t i = 0; i < count; ++i) {
+        process_datagram(uring_->data(i), uring_->length(i),
+                         uring_->sender(i));
+      }
+      flush_acks();
+    }
+
+    if (is_running_) {
+      receive_next();
+    }
+  }
+#endif
+
+  // Dispatch one datagram on its first byte
+  void process_datagram(const char *data, size_t bytes_received,
+                        const udp::endpoint &from) {
+    if (bytes_received == 0) {
+      return;
+    }
+
+    uint8_t type = static_cast<uint8_t>(data[0]);
+    if (type == SR_MANIFEST_PACKET || type == SR_BARRIER_PACKET) {
+      handle_control(data, bytes_received, from);
+      return;
+    }
+
+    if (type == SR_RESUME_QUERY) {
+      handle_resume_query(data, bytes_received, from);
+      return;
+    }
+
+    if (type == SR_SIGNATURE_QUERY) {
+      handle_signature_query(data, bytes_received, from);
+      return;
+    }
+
+    if (receive_loss_ > 0.0 &&
+        (type == SR_MCAST_DATA || type == SR_REPAIR_PACKET) &&
+        std::uniform_real_distribution<double>(0.0, 1.0)(loss_random_) <
+            receive_loss_) {
+      return;
+    }
+
+    if (type == SR_REPAIR_PACKET) {
+      handle_repair_packet(data, bytes_received, from);
+      return;
+    }
+
+    if (type == SR_NACK_PACKET) {
+      handle_nack(data, bytes_received);
+      return;
+    }
+
+    if (type == SR_MCAST_FLUSH) {
+      handle_flush(data, bytes_received, from);
+      return;
+    }
+
+    if (type == SR_PROBE_PACKET) {
+      handle_probe(data, bytes_received, from);
+      return;
+    }
+
+    if (type == SR_DATA_PACKET || type == SR_DATA_ACK_NOW ||
+        type == SR_MCAST_DATA) {
+      high_resolution_clock::time_point process_start_time =
+          high_resolution_clock::now();
+
+      handle_sr_packet(*reinterpret_cast<const SrPacket *>(data),
+                       bytes_received, from);
+
+      // Record processing latency (time from packet receipt to sending ACK)
+      double processing_time_ms =
+          duration_cast<microseconds>(high_resolution_clock::now() -
+                                      process_start_time)
+              .count() /
+          1000.0;
+      latency_stats_.addLatency(processing_time_ms, false);
+      return;
+    }
+
+    // Stop-and-wait packets are processed from datagram_
+    if (data != reinterpret_cast<const char *>(&datagram_)) {
+      std::memcpy(&datagram_, data,
+                  std::min(bytes_received, sizeof(datagram_)));
+    }
+    remote_endpoint_ = from;
+    handle_legacy_packet();
+  }
+
+  // Find the session for a packet, opening one if `may_open` (the packet
+  // can start a transfer). A session that is one stream of a multi-stream
+  // transfer starts at its range's first packet and writes through the
+  // group. Returns null when there is no session and none can be admitted.
+  ReceiveSession *find_session(const SessionKey &key, bool may_open,
+                               std::shared_ptr<TransferGroup> group = nullptr,
+                               int stream_index = 0,
+                               uint32_t first_packet = 0,
+                               int payload_size = DEFAULT_PAYLOAD_SIZE) {
+    auto it = sessions_.find(key);
+    if (it != sessions_.end()) {
+      it->second->last_activity = steady_clock::now();
+      return it->second.get();
+    }
+    if (!may_open) {
+      return nullptr;
+    }
+
+    size_t footprint = sizeof(ReceiveSession) +
+                       static_cast<size_t>(receive_window_) +
+                       sizeof(SessionKey) + 4 * sizeof(void *);
+    if (!group) {
+      footprint += sizeof(FileSink);
+    }
+    if (!admit(footprint, key.endpoint)) {
+      return nullptr;
+    }
+
+    std::unique_ptr<ReceiveSession> session(new ReceiveSession());
+    session->id = ++limits_.sessions_opened;
+    session->key = key;
+    session->bytes_received = 0;
+    session->payload_size = payload_size;
+    session->footprint = footprint;
+    session->complete = false;
+    session->last_activity = steady_clock::now();
+    session->start_time = high_resolution_clock::now();
+    session->group = group;
+    session->stream_index = stream_index;
+    session->expected_seq_num = 0;
+    session->sr_first = first_packet;
+    session->sr_base = first_packet;
+    session->sr_received.assign(receive_window_, 0);
+    session->sr_file_size = 0;
+    session->sr_last_seq_num = 0;
+    session->sr_last_seen = false;
+    session->acks_pending = 0;
+    session->ack_newest = 0;
+    session->ack_ts_echo = 0;
+    session->multicast = false;
+    session->nack_block = 1;
+    session->nack_armed = false;
+    if (group && group->journal) {
+      // Resumed range: skip what is on disk, and the range end is known
+      uint32_t end = streamRange(group->total_packets, group->stream_count,
+                                 stream_index)
+                         .second;
+      {
+        std::lock_guard<std::mutex> lock(group->mutex);
+        session->sr_base = group->journal->firstMissing(first_packet, end);
+      }
+      session->sr_last_seen = true;
+      session->sr_last_seq_num = end - 1;
+    }
+    session->sr_highest = session->sr_base;
+    if (group) {
+      session->output_path = group->output_path;
+    } else {
+      session->output_path = output_path_for(session->id, key);
+    }
+    if (!group && !session->output_path.empty()) {
+      try {
+        session->sink.reset(new FileSink(session->output_path, sync_policy_,
+                                         sync_interval_bytes_));
+#ifdef HAVE_IO_URING
+        // Payloads are written from the receive buffers they arrived in
+        if (uring_) {
+          session->sink->setOffload(uring_.get());
+        }
+#endif
+        if (disk_) {
+          session->sink->setOffload(disk_.get());
+        }
+      } catch (const std::exception &e) {
+        std::cerr << "Session " << session->id << ": " << e.what()
+                  << std::endl;
+        limits_.release(footprint);
+        return nullptr;
+      }
+    }
+
+    std::cout << "Session " << session->id << " opened for " << key.endpoint
+              << " (transfer " << std::hex << key.transfer_id << std::dec;
+    if (group) {
+      std::cout << ", stream " << stream_index << "/" << group->stream_count;
+    }
+    std::cout << ")";
+    if (!session->output_path.empty()) {
+      std::cout << ", saving to " << session->output_path;
+    }
+    std::cout << std::endl;
+
+    ReceiveSession *raw = session.get();
+    sessions_[key] = std::move(session);
+    return raw;
+  }
+
+  // Charge a new session's state to the shared limits, making room from
+  // idle sessions on this socket before turning it away
+  bool admit(size_t footprint, const udp::endpoint &from) {
+    if (limits_.reserve(footprint)) {
+      return true;
+    }
+    expire_idle_sessions(true);
+    if (limits_.reserve(footprint)) {
+      return true;
+    }
+    if (limits_.sessions_rejected++ % 1000 == 0) {
+      std::cerr << "Session limit reached (" << limits_.max_sessions
+                << " sessions, " << limits_.memory_budget
+                << " bytes), dropping new transfer from " << from
+                << std::endl;
+    }
+    return false;
+  }
+
+  // Output file for a session: inside the output directory, or the output
+  // file itself for the first session and numbered siblings after that
+  std::string output_path_for(uint64_t id, const SessionKey &key) const {
+    if (output_filepath_.empty()) {
+      return "";
+    }
+    if (output_is_directory_) {
+      std::ostringstream name;
+      name << output_filepath_ << "/" << key.endpoint.address().to_string()
+           << "_" << key.endpoint.port() << "_" << std::hex
+           << key.transfer_id;
+      return name.str();
+    }
+    if (id == 1) {
+      return output_filepath_;
+    }
+    return output_filepath_ + "." + std::to_string(id);
+  }
+
+  // Payload handshake or path MTU probe: a probe that arrived whole shows
+  // the path carries a data packet of its size. The ACK is header only, as
+  // only the client-to-server direction carries full-size packets.
+  void handle_probe(const char *data, size_t bytes_received,
+                    const udp::endpoint &from) {
+    SrProbe reply;
+    if (bytes_received < sizeof(reply)) {
+      std::cout << "Malformed probe (" << bytes_received
+                << " bytes), dropping" << std::endl;
+      return;
+    }
+    std::memcpy(&reply, data, sizeof(reply));
+    if (bytes_received != SrPacket::headerSize() + reply.payload_size) {
+      std::cout << "Probe for " << reply.payload_size << " bytes arrived as "
+                << bytes_received << ", dropping" << std::endl;
+      return;
+    }
+    if (verbose_) {
+      std::cout << "Probe for a " << reply.payload_size
+                << "-byte payload from " << from << std::endl;
+    }
+    reply.type = SR_PROBE_ACK;
+    reply.max_payload = static_cast<uint16_t>(max_payload_);
+
+    boost::system::error_code error;
+    socket_.send_to(boost::asio::buffer(&reply, sizeof(reply)), from, 0,
+                    error);
+    if (error && error != boost::asio::error::would_block) {
+      std::cerr << "Failed to send probe ACK: " << error.message()
+                << std::endl;
+    }
+  }
+
+  // Manifest or completion barrier of a multi-stream transfer
+  void handle_control(const char *data, size_t bytes_received,
+                      const udp::endpoint &from) {
+    if (bytes_received != sizeof(SrControl)) {
+      std::cout << "Malformed control message (" << bytes_received
+                << " bytes), dropping" << std::endl;
+      return;
+    }
+    SrControl reply;
+    std::memcpy(&reply, data, sizeof(reply));
+    uint32_t transfer_id = ntohl32(reply.transfer_id);
+
+    if (reply.type == SR_MANIFEST_PACKET) {
+      reply.type = SR_MANIFEST_ACK;
+      reply.status = open_group(reply, transfer_id, from) ? 1 : 0;
+    } else {
+      reply.type = SR_BARRIER_ACK;
+      reply.status = 0;
+      std::shared_ptr<TransferGroup> group = groups_.find(transfer_id);
+      if (group) {
+        std::lock_guard<std::mutex> lock(group->mutex);
+        reply.status = group->complete ? 1 : group->failed ? 2 : 0;
+        group->last_activity = steady_clock::now();
+      }
+    }
+
+    boost::system::error_code error;
+    socket_.send_to(boost::asio::buffer(&reply, sizeof(reply)), from, 0,
+                    error);
+    if (error && error != boost::asio::error::would_block) {
+      std::cerr << "Failed to send control reply: " << error.message()
+                << std::endl;
+    }
+  }
+
+  // Set up the shared output of a multi-stream transfer from its manifest.
+  // A retransmitted manifest finds the group already there.
+  bool open_group(const SrControl &manifest, uint32_t transfer_id,
+                  const udp::endpoint &from) {
+    uint64_t file_size = controlFileSize(manifest);
+    uint64_t packets = packetCount(file_size, std::max<int>(
+                                                  manifest.payload_size, 1));
+    std::string basis = delta_basis_path(ntohl32(manifest.basis_id));
+    if (manifest.payload_size < MIN_PAYLOAD_SIZE ||
+        manifest.payload_size > max_payload_ ||
+        manifest.stream_count < 1 || manifest.stream_count > MAX_STREAMS ||
+        manifest.stream_count > packets || packets > UINT32_MAX ||
+        manifest.mode > MANIFEST_TREE_PACK ||
+        (manifest.mode == MANIFEST_DELTA && basis.empty())) {
+      std::cerr << "Rejected manifest from " << from << std::endl;
+      return false;
+    }
+    bool tree = manifest.mode == MANIFEST_TREE_FILE ||
+                manifest.mode == MANIFEST_TREE_PACK;
+    if (tree && !output_filepath_.empty() && !output_is_directory_) {
+      std::cerr << "Rejected directory transfer from " << from
+                << ": the output is not a directory" << std::endl;
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(groups_.mutex);
+    if (groups_.groups.count(transfer_id)) {
+      return true;
+    }
+
+    size_t footprint = sizeof(TransferGroup) + sizeof(FileSink) +
+                       manifest.stream_count + 4 * sizeof(void *);
+    if (!admit(footprint, from)) {
+      return false;
+    }
+
+    std::shared_ptr<TransferGroup> group =
+        new_group(transfer_id, file_size, manifest.payload_size,
+                  manifest.stream_count, footprint);
+    if (manifest.mode == MANIFEST_PLAIN) {
+      group->output_path =
+          output_path_for(group->id, SessionKey{from, transfer_id});
+    } else if (manifest.mode == MANIFEST_BASIS) {
+      group->output_path = basis;
+    } else if (manifest.mode == MANIFEST_DELTA) {
+      // The delta lands next to the copy it is applied to
+      group->delta_basis = basis;
+      group->output_path = basis + ".delta";
+    } else if (!output_filepath_.empty()) {
+      // Large files wait under a temporary name until the pack places them
+      if (manifest.mode == MANIFEST_TREE_PACK) {
+        group->tree_root = output_filepath_;
+        group->output_path =
+            treeTransferPath(output_filepath_, transfer_id, ".pack");
+      } else {
+        group->output_path =
+            treeTransferPath(output_filepath_, transfer_id, ".part");
+      }
+    }
+    if (!group->output_path.empty()) {
+      try {
+        group->sink.reset(new FileSink(group->output_path, sync_policy_,
+                                       sync_interval_bytes_));
+      } catch (const std::exception &e) {
+        std::cerr << "Transfer " << std::hex << transfer_id << std::dec
+                  << ": " << e.what() << std::endl;
+        limits_.release(footprint);
+        return false;
+      }
+    }
+    groups_.groups[transfer_id] = group;
+
+    std::cout << (manifest.mode == MANIFEST_DELTA    ? "Delta"
+                  : manifest.mode == MANIFEST_TREE_PACK ? "Directory pack"
+                  : manifest.mode == MANIFEST_TREE_FILE ? "Directory file"
+                                                        : "Multi-stream")
+              << " transfer " << std::hex << transfer_id << std::dec
+              << " from " << from.address() << ": " << file_size
+              << " bytes over " << group->stream_count << " streams";
+    if (!group->output_path.empty()) {
+      std::cout << ", saving to " << group->output_path;
+    }
+    std::cout << std::endl;
+    return true;
+  }
+
+  // A group with its bookkeeping set up and no output yet
+  std::shared_ptr<TransferGroup> new_group(uint32_t transfer_id,
+                                           uint64_t file_size,
+                                           int payload_size,
+                                           int stream_count,
+                                           size_t footprint) {
+    std::shared_ptr<TransferGroup> group(new TransferGroup());
+    group->id = ++limits_.sessions_opened;
+    group->transfer_id = transfer_id;
+    group->file_size = file_size;
+    group->payload_size = payload_size;
+    group->total_packets =
+        static_cast<uint32_t>(packetCount(file_size, payload_size));
+    group->stream_count = stream_count;
+    group->footprint = footprint;
+    group->start_time = high_resolution_clock::now();
+    group->stream_done.assign(stream_count, 0);
+    group->streams_done = 0;
+    group->complete = false;
+    group->failed = false;
+    group->last_activity = steady_clock::now();
+    return group;
+  }
+
+  // Output file of a resumable transfer: the same on every run, so the
+  // journal next to it is found again
+  std::string resume_output_path(uint32_t transfer_id) const {
+    if (output_filepath_.empty() || !output_is_directory_) {
+      return output_filepath_;
+    }
+    std::ostringstream name;
+    name << output_filepath_ << "/resume_" << std::hex << transfer_id;
+    return name.str();
+  }
+
+  // The receiver's copy of a file that delta transfers diff against and
+  // replace: the output file, or one file per name in the output directory
+  std::string delta_basis_path(uint32_t basis_id) const {
+    if (output_filepath_.empty() || !output_is_directory_) {
+      return output_filepath_;
+    }
+    std::ostringstream name;
+    name << output_filepath_ << "/delta_" << std::hex << basis_id;
+    return name.str();
+  }
+
+  // Signature query of a delta transfer: every page is read afresh from
+  // the receiver's copy, so nothing is kept between queries
+  void handle_signature_query(const char *data, size_t bytes_received,
+                              const udp::endpoint &from) {
+    if (bytes_received != SrSignature::headerSize()) {
+      std::cout << "Malformed signature query (" << bytes_received
+                << " bytes), dropping" << std::endl;
+      return;
+    }
+    SrSignature reply;
+    std::memcpy(&reply, data, SrSignature::headerSize());
+    reply.type = SR_SIGNATURE_REPLY;
+    reply.count = 0;
+    std::string path = delta_basis_path(ntohl32(reply.basis_id));
+    reply.status =
+        !path.empty() && readSignaturePage(path, ntohl32(reply.page), reply)
+            ? 1
+            : 0;
+    if (!reply.status) {
+      reply.count = 0;
+    }
+
+    boost::system::error_code error;
+    socket_.send_to(
+        boost::asio::buffer(&reply, SrSignature::headerSize() +
+                                        reply.count * sizeof(BlockSignature)),
+        from, 0, error);
+    if (error && error != boost::asio::error::would_block) {
+      std::cerr << "Failed to send signature reply: " << error.message()
+                << std::endl;
+    }
+  }
+
+  // Resume query: page 0 sets the transfer up like a manifest, from the
+  // journal of an earlier run when there is one. Every page is answered
+  // with that slice of the chunk bitmap.
+  void handle_resume_query(const char *data, size_t bytes_received,
+                           const udp::endpoint &from) {
+    if (bytes_received != SrResume::headerSize()) {
+      std::cout << "Malformed resume query (" << bytes_received
+                << " bytes), dropping" << std::endl;
+      return;
+    }
+    SrResume reply;
+    std::memcpy(&reply, data, SrResume::headerSize());
+    uint32_t transfer_id = ntohl32(reply.transfer_id);
+    uint32_t page = ntohl32(reply.page);
+
+    std::shared_ptr<TransferGroup> group =
+        page == 0 ? open_resumable_group(reply, transfer_id, from)
+                  : groups_.find(transfer_id);
+    reply.type = SR_RESUME_REPLY;
+    reply.status = group ? 1 : 0;
+    reply.page_bytes = 0;
+    if (group) {
+      std::lock_guard<std::mutex> lock(group->mutex);
+      group->last_activity = steady_clock::now();
+      size_t bytes =
+          (ResumeBitmap::chunkCount(group->total_packets) + 7) / 8;
+      size_t offset = static_cast<size_t>(page) * RESUME_PAGE_BYTES;
+      size_t length =
+          offset < bytes ? std::min(RESUME_PAGE_BYTES, bytes - offset) : 0;
+      if (group->journal && !group->complete) {
+        length = group->journal->page(page, reply.bitmap);
+      } else {
+        // No journal: nothing is kept. Complete: everything is there.
+        std::memset(reply.bitmap, group->complete ? 0xFF : 0, length);
+      }
+      reply.page_bytes = static_cast<uint16_t>(length);
+    }
+
+    boost::system::error_code error;
+    socket_.send_to(
+        boost::asio::buffer(&reply, SrResume::headerSize() + reply.page_bytes),
+        from, 0, error);
+    if (error && error != boost::asio::error::would_block) {
+      std::cerr << "Failed to send resume reply: " << error.message()
+                << std::endl;
+    }
+  }
+
+  // Set up a resumable transfer, picking up its journal. A repeated query
+  // from the same sender finds the group already there; a query from a new
+  // run replaces the group of the run that died.
+  std::shared_ptr<TransferGroup>
+  open_resumable_group(const SrResume &query, uint32_t transfer_id,
+                       const udp::endpoint &from) {
+    uint64_t file_size = controlFileSize(query);
+    uint64_t packets =
+        packetCount(file_size, std::max<int>(query.payload_size, 1));
+    if (query.payload_size < MIN_PAYLOAD_SIZE ||
+        query.payload_size > max_payload_ || query.stream_count < 1 ||
+        query.stream_count > MAX_STREAMS || query.stream_count > packets ||
+        packets > UINT32_MAX) {
+      std::cerr << "Rejected resume query from " << from << std::endl;
+      return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(groups_.mutex);
+    auto it = groups_.groups.find(transfer_id);
+    if (it != groups_.groups.end()) {
+      TransferGroup &existing = *it->second;
+      if (existing.payload_size == query.payload_size &&
+          (existing.complete || (existing.resume_from == from &&
+                                 existing.file_size == file_size))) {
+        return it->second;
+      }
+      limits_.release(existing.footprint);
+      groups_.groups.erase(it);
+    }
+
+    std::shared_ptr<TransferGroup> group = new_group(
+        transfer_id, file_size, query.payload_size, query.stream_count, 0);
+    group->resume_from = from;
+    group->output_path = resume_output_path(transfer_id);
+    if (!group->output_path.empty()) {
+      try {
+        group->sink.reset(new FileSink(group->output_path, sync_policy_,
+                                       sync_interval_bytes_, false));
+        group->journal.reset(new ResumeJournal(group->output_path +
+                                                   ".journal",
+                                               transfer_id, file_size,
+                                               query.payload_size,
+                                               *group->sink));
+      } catch (const std::exception &e) {
+        std::cerr << "Transfer " << std::hex << transfer_id << std::dec
+                  << ": " << e.what() << std::endl;
+        return nullptr;
+      }
+    }
+
+    group->footprint = sizeof(TransferGroup) + sizeof(FileSink) +
+                       query.stream_count + 4 * sizeof(void *) +
+                       (group->journal ? group->journal->footprint() : 0);
+    if (!admit(group->footprint, from)) {
+      return nullptr;
+    }
+
+    // Ranges already on disk are done before they start
+    uint64_t present = group->journal ? group->journal->presentBytes() : 0;
+    for (int i = 0; i < group->stream_count; ++i) {
+      std::pair<uint32_t, uint32_t> range =
+          streamRange(group->total_packets, group->stream_count, i);
+      uint32_t missing = group->journal
+                             ? group->journal->firstMissing(range.first,
+                                                            range.second)
+                             : range.first;
+      if (missing == range.second) {
+        group->stream_done[i] = 1;
+        group->streams_done++;
+      }
+    }
+    groups_.groups[transfer_id] = group;
+
+    std::cout << "Resumable transfer " << std::hex << transfer_id << std::dec
+              << " from " << from.address() << ": " << file_size
+              << " bytes over " << group->stream_count << " streams, "
+              << present << " already on disk";
+    if (!group->output_path.empty()) {
+      std::cout << ", saving to " << group->output_path;
+    }
+    std::cout << std::endl;
+
+    if (group->streams_done == group->stream_count) {
+      finish_group(*group);
+    }
+    return group;
+  }
+
+  // Close a session and give back its share of the limits
+  void close_session(
+      std::unordered_map<SessionKey, std::unique_ptr<ReceiveSession>,
+                         SessionKeyHash>::iterator it) {
+    limits_.release(it->second->footprint);
+    sessions_.erase(it);
+  }
+
+  // A session received its last packet: finalize the file and report. For
+  // one stream of a multi-stream transfer the file is finalized when the
+  // last stream completes.
+  void complete_session(ReceiveSession &session, uint64_t file_size) {
+    session.complete = true;
+    bytes_received_ += file_size;
+    latency_stats_.endTransfer(bytes_received_);
+    if (session.sink) {
+      session.sink->finish(file_size);
+    }
+    if (session.group) {
+      complete_stream(*session.group, session.stream_index);
+    }
+
+    double seconds = duration_cast<microseconds>(high_resolution_clock::now() -
+                                                 session.start_time)
+                         .count() /
+                     1000000.0;
+    std::cout << "Session " << session.id << " complete: " << file_size
+              << " bytes in " << std::fixed << std::setprecision(2)
+              << seconds * 1000.0 << " ms";
+    if (seconds > 0.0) {
+      std::cout << " (" << (file_size / 1024.0 / seconds) << " KB/s)";
+    }
+    std::cout << std::endl;
+  }
+
+  // Mark one range of a multi-stream transfer written; the last one
+  // finalizes the shared file and releases the completion barrier
+  void complete_stream(TransferGroup &group, int stream_index) {
+    std::lock_guard<std::mutex> lock(group.mutex);
+    if (group.stream_done[stream_index]) {
+      return;
+    }
+    group.stream_done[stream_index] = 1;
+    if (++group.streams_done < group.stream_count) {
+      return;
+    }
+    finish_group(group);
+  }
+
+  // Every range of a multi-stream transfer is written: finalize the file
+  // (with the group's mutex held, or before the group is shared)
+  void finish_group(TransferGroup &group) {
+    if (group.sink) {
+      group.sink->finish(group.file_size);
+    }
+    if (group.journal) {
+      group.journal->remove();
+    }
+    if (!group.delta_basis.empty()) {
+      rebuild_from_delta(group);
+      return;
+    }
+    if (!group.tree_root.empty()) {
+      unpack_tree(group);
+      return;
+    }
+    group.complete = true;
+    double seconds = duration_cast<microseconds>(high_resolution_clock::now() -
+                                                 group.start_time)
+                         .count() /
+                     1000000.0;
+    std::cout << (group.journal ? "Resumable" : "Multi-stream")
+              << " transfer " << std::hex << group.transfer_id
+              << std::dec << " complete: " << group.file_size << " bytes over "
+              << group.stream_count << " streams in " << std::fixed
+              << std::setprecision(2) << seconds * 1000.0 << " ms";
+    if (seconds > 0.0) {
+      std::cout << " (" << (group.file_size / 1024.0 / seconds) << " KB/s)";
+    }
+    std::cout << std::endl;
+  }
+
+  // The delta of a delta transfer is in: rebuild the file from the copy it
+  // was made against. That reads and writes the whole file, so it runs on
+  // a thread of its own and the server keeps answering barrier queries;
+  // the group is complete once the new file has replaced the old one.
+  void rebuild_from_delta(TransferGroup &group) {
+    std::shared_ptr<TransferGroup> shared = group.shared_from_this();
+    SyncPolicy sync_policy = sync_policy_;
+    uint64_t sync_interval = sync_interval_bytes_;
+    std::thread([shared, sync_policy, sync_interval]() {
+      TransferGroup &group = *shared;
+      std::string delta_path = group.output_path;
+      std::string rebuilt = group.delta_basis + ".new";
+      uint64_t size = 0;
+      bool ok = false;
+      try {
+        size = applyDelta(delta_path, group.delta_basis, rebuilt,
+                          sync_policy, sync_interval);
+        if (std::rename(rebuilt.c_str(), group.delta_basis.c_str()) != 0) {
+          throw std::runtime_error("Failed to replace " + group.delta_basis);
+        }
+        ok = true;
+      } catch (const std::exception &e) {
+        std::cerr << "Delta transfer " << std::hex << group.transfer_id
+                  << std::dec << ": " << e.what() << std::endl;
+        std::remove(rebuilt.c_str());
+      }
+      std::remove(delta_path.c_str());
+
+      std::lock_guard<std::mutex> lock(group.mutex);
+      group.sink.reset();
+      group.complete = ok;
+      group.failed = !ok;
+      group.last_activity = steady_clock::now();
+      if (!ok) {
+        return;
+      }
+      double seconds =
+          duration_cast<microseconds>(high_resolution_clock::now() -
+                                      group.start_time)
+              .count() /
+          1000000.0;
+      std::cout << "Delta transfer " << std::hex << group.transfer_id
+                << std::dec << " complete: rebuilt " << size
+                << " bytes from a " << group.file_size << "-byte delta in "
+                << std::fixed << std::setprecision(2) << seconds * 1000.0
+                << " ms" << std::endl;
+    }).detach();
+  }
+
+  // The pack of a directory transfer is in: rebuild the tree from it, on a
+  // thread of its own like a delta rebuild. The group is complete once
+  // every file is in place.
+  void unpack_tree(TransferGroup &group) {
+    std::shared_ptr<TransferGroup> shared = group.shared_from_this();
+    SyncPolicy sync_policy = sync_policy_;
+    std::thread([shared, sync_policy]() {
+      TransferGroup &group = *shared;
+      TreeSummary summary = {0, 0, 0, 0, 0};
+      bool ok = false;
+      try {
+        summary = unpackTree(group.output_path, group.tree_root, sync_policy);
+        ok = true;
+      } catch (const std::exception &e) {
+        std::cerr << "Directory transfer " << std::hex << group.transfer_id
+                  << std::dec << ": " << e.what() << std::endl;
+      }
+      std::remove(group.output_path.c_str());
+
+      std::lock_guard<std::mutex> lock(group.mutex);
+      group.sink.reset();
+      group.complete = ok;
+      group.failed = !ok;
+      group.last_activity = steady_clock::now();
+      if (!ok) {
+        return;
+      }
+      double seconds =
+          duration_cast<microseconds>(high_resolution_clock::now() -
+                                      group.start_time)
+              .count() /
+          1000000.0;
+      std::cout << "Directory transfer " << std::hex << group.transfer_id
+                << std::dec << " complete: " << summary.files << " files ("
+                << summary.separate << " sent on their own) in "
+                << summary.directories << " directories, "
+                << summary.file_bytes << " bytes unpacked under "
+                << group.tree_root << " in " << std::fixed
+                << std::setprecision(2) << seconds * 1000.0 << " ms";
+      if (seconds > 0.0) {
+        std::cout << " (" << std::setprecision(1)
+                  << summary.files / seconds << " files/s)";
+      }
+      std::cout << std::endl;
+    }).detach();
+  }
+
+  // Periodically close sessions that went quiet
+  void schedule_sweep() {
+    sweep_timer_.expires_after(
+        boost::asio::chrono::milliseconds(SESSION_SWEEP_MS));
+    sweep_timer_.async_wait([this](const boost::system::error_code &error) {
+      if (error || !is_running_) {
+        return;
+      }
+      expire_idle_sessions(false);
+      expire_idle_groups();
+      schedule_sweep();
+    });
+  }
+
+  // Close idle sessions. Completed sessions linger for the idle timeout so
+  // a lost final ACK can still be answered; under memory pressure they go
+  // first.
+  void expire_idle_sessions(bool reclaim_completed) {
+    auto now = steady_clock::now();
+    for (auto it = sessions_.begin(); it != sessions_.end();) {
+      ReceiveSession &session = *it->second;
+      bool idle = now - session.last_activity >=
+                  seconds(limits_.idle_timeout_s);
+      if (!idle && !(reclaim_completed && session.complete)) {
+        ++it;
+        continue;
+      }
+      if (!session.complete) {
+        std::cout << "Session " << session.id << " from "
+                  << session.key.endpoint << " expired after "
+                  << limits_.idle_timeout_s << " s idle ("
+                  << session.bytes_received << " bytes received, incomplete)"
+                  << std::endl;
+      }
+      auto next = std::next(it);
+      close_session(it);
+      it = next;
+    }
+  }
+
+  // Close multi-stream transfers nothing was written to or asked about for
+  // the idle timeout. Any server thread may do it.
+  void expire_idle_groups() {
+    auto now = steady_clock::now();
+    std::lock_guard<std::mutex> lock(groups_.mutex);
+    for (auto it = groups_.groups.begin(); it != groups_.groups.end();) {
+      TransferGroup &group = *it->second;
+      std::unique_lock<std::mutex> group_lock(group.mutex);
+      if (now - group.last_activity < seconds(limits_.idle_timeout_s)) {
+        ++it;
+        continue;
+      }
+      if (!group.complete) {
+        std::cout << "Multi-stream transfer " << std::hex << group.transfer_id
+                  << std::dec << " expired after " << limits_.idle_timeout_s
+                  << " s idle (" << group.streams_done << "/"
+                  << group.stream_count << " streams complete)" << std::endl;
+      }
+      limits_.release(group.footprint);
+      group_lock.unlock();
+      it = groups_.groups.erase(it);
+    }
+  }
+
+  // Handle a stop-and-wait packet in receive_buffer_
+  void handle_legacy_packet() {
+    // Record packet receive time
+    packet_receive_time_ = high_resolution_clock::now();
+
+    // Measure processing time for this packet
+    high_resolution_clock::time_point process_start_time =
+        high_resolution_clock::now();
+    double processing_time_ms = 0.0;
+
+    // Only a seq_num 0 packet can start a stop-and-wait transfer
+    SessionKey key = {remote_endpoint_, 0};
+    ReceiveSession *session =
+        find_session(key, receive_buffer_.seq_num == 0);
+    if (!session) {
+      return;
+    }
+
+    if (verbose_) {
+      debugPacket(receive_buffer_, "Received packet");
+    } else {
+      std::cout << "Received packet with seq_num: "
+                << (int)receive_buffer_.seq_num
+                << ", size: " << receive_buffer_.data_size << " bytes"
+                << std::endl;
+    }
+
+    // Verify CRC
+    uint32_t received_crc =
+        ntohl32(receive_buffer_.crc); // Convert from network byte order
+    uint32_t calculated_crc =
+        calculateCRC(receive_buffer_.data, receive_buffer_.data_size);
+    bool crc_valid = (calculated_crc == received_crc);
+
+    if (!crc_valid) {
+      std::cout << "CRC mismatch: expected=" << received_crc
+                << ", calculated=" << calculated_crc << std::endl;
+
+      // Debug information to diagnose CRC issue
+      if (verbose_) {
+        std::cout << "Data for CRC calculation:" << std::endl;
+        for (size_t i = 0; i < receive_buffer_.data_size; ++i) {
+          if (i % 16 == 0)
+            std::cout << std::endl
+                      << std::hex << std::setw(4) << std::setfill('0') << i
+                      << ": ";
+          std::cout << std::hex << std::setw(2) << std::setfill('0')
+                    << static_cast<int>(static_cast<unsigned char>(
+                           receive_buffer_.data[i]))
+                    << " ";
+        }
+        std::cout << std::dec << std::endl;
+      }
+    }
+
+    // Check if this is the packet we're expecting
+    if (receive_buffer_.seq_num == session->expected_seq_num && crc_valid &&
+        !session->complete) {
+      // Process the received data
+      if (receive_buffer_.data_size > 0 &&
+          receive_buffer_.data_size <= max_payload_) {
+        // Write the payload at its place in the output file
+        if (session->sink) {
+          session->sink->write(session->bytes_received, receive_buffer_.data,
+                               receive_buffer_.data_size);
+        }
+        session->bytes_received += receive_buffer_.data_size;
+
+        std::cout << "Wrote " << receive_buffer_.data_size
+                  << " bytes to output (total: " << session->bytes_received
+                  << " bytes)" << std::endl;
+
+        // Flip expected sequence number for next packet (0->1, 1->0)
+        session->expected_seq_num = 1 - session->expected_seq_num;
+      }
+
+      // Check if this was the last packet
+      if (receive_buffer_.is_last) {
+        std::cout << "Last packet received, data reception complete."
+                  << std::endl;
+
+        // Finalize the file before the last ACK goes out
+        complete_session(*session, session->bytes_received);
+      }
+    } else if (receive_buffer_.seq_num != session->expected_seq_num ||
+               session->complete) {
+      std::cout
+          << "Received duplicate or out-of-order packet, expected seq_num: "
+          << (int)session->expected_seq_num << std::endl;
+    } else if (!crc_valid) {
+      std::cout << "Packet with valid sequence number but invalid CRC, "
+                   "requesting retransmission"
+                << std::endl;
+    }
+
+    // Calculate processing time
+    processing_time_ms =
+        duration_cast<microseconds>(high_resolution_clock::now() -
+                                    process_start_time)
+            .count() /
+        1000.0;
+
+    // Send ACK regardless (handles case where ACK was lost)
+    send_ack(receive_buffer_.seq_num);
+
+    // Record processing latency (time from packet receipt to sending ACK)
+    latency_stats_.addLatency(processing_time_ms, false);
+
+    if (verbose_) {
+      std::cout << "Packet processing time: " << std::fixed
+                << std::setprecision(2) << processing_time_ms << " ms"
+                << std::endl;
+    }
+  }
+
+  // Send acknowledgment
+  void send_ack(uint8_t seq_num) {
+    uint8_t ack = ACK_PACKET;
+
+    socket_.async_send_to(
+        boost::asio::buffer(&ack, sizeof(ack)), remote_endpoint_,
+        [seq_num, this](const boost::system::error_code &error,
+                        std::size_t bytes_sent) {
+          if (!error) {
+            if (verbose_) {
+              std::cout << "ACK sent for seq_num: " << (int)seq_num
+                        << std::endl;
+            }
+          } else {
+            std::cerr << "Failed to send ACK: " << error.message() << std::endl;
+          }
+        });
+  }
+
+  // Handle a selective-repeat data packet: write it in place and ACK it
+  void handle_sr_packet(const SrPacket &packet, size_t bytes_received,
+                        const udp::endpoint &from) {
+    if (bytes_received < SrPacket::headerSize() ||
+        bytes_received < packet.getTotalSize()) {
+      std::cout << "Truncated selective-repeat packet (" << bytes_received
+                << " bytes), dropping" << std::endl;
+      return;
+    }
+    if (packet.payload_size < MIN_PAYLOAD_SIZE ||
+        packet.payload_size > max_payload_ ||
+        packet.data_size > packet.payload_size) {
+      std::cout << "Payload of " << packet.data_size << "/"
+                << packet.payload_size << " bytes outside the negotiated "
+                << "range, dropping" << std::endl;
+      return;
+    }
+
+    uint32_t seq_num = ntohl32(packet.seq_num);
+    if (verbose_) {
+      std::cout << "Received packet with seq_num: " << seq_num
+                << ", size: " << packet.data_size << " bytes" << std::endl;
+    }
+
+    // Corrupted packets are dropped without an ACK; the sender times out.
+    // The sender picked the checksum algorithm.
+    if (packet.checksum >= CHECKSUM_ALGORITHM_COUNT) {
+      std::cout << "Unknown checksum algorithm " << (int)packet.checksum
+                << " on seq_num " << seq_num << ", dropping" << std::endl;
+      return;
+    }
+    uint32_t received_crc = ntohl32(packet.crc);
+    uint32_t calculated_crc =
+        calculateChecksum(static_cast<ChecksumAlgorithm>(packet.checksum),
+                          packet.data, packet.data_size);
+    if (calculated_crc != received_crc) {
+      std::cout << "CRC mismatch on seq_num " << seq_num
+                << ": expected=" << received_crc
+                << ", calculated=" << calculated_crc << std::endl;
+      return;
+    }
+    if (packet.encoding > PAYLOAD_FRAMED) {
+      std::cout << "Unknown payload encoding " << (int)packet.encoding
+                << " on seq_num " << seq_num << ", dropping" << std::endl;
+      return;
+    }
+
+    // Any packet of the first window can open the session (they may be
+    // reordered); later ones belong to a session that expired or never was.
+    // A manifest announced a multi-stream transfer: the session is the
+    // stream whose range holds the packet. A multicast receiver may join
+    // mid-transfer and NACKs what it missed, so any packet opens it.
+    bool multicast = packet.type == SR_MCAST_DATA;
+    if (multicast &&
+        (multicast_endpoint_.port() == 0 || packet.fec_data == 0)) {
+      return;
+    }
+    SessionKey key = {from, ntohl32(packet.transfer_id)};
+    ReceiveSession *session = find_session(key, false);
+    if (!session && multicast) {
+      session = find_session(key, true, nullptr, 0, 0, packet.payload_size);
+      if (!session) {
+        return;
+      }
+      session->multicast = true;
+      session->nack_block = packet.fec_data;
+    }
+    if (!session) {
+      std::shared_ptr<TransferGroup> group = groups_.find(key.transfer_id);
+      int stream_index = 0;
+      uint32_t first_packet = 0;
+      if (group) {
+        stream_index = group->streamOf(seq_num);
+        first_packet =
+            streamRange(group->total_packets, group->stream_count,
+                        stream_index)
+                .first;
+      }
+      // A resumed range may restart anywhere past what is on disk
+      bool may_open =
+          seq_num - first_packet < static_cast<uint32_t>(receive_window_) ||
+          (group && group->journal);
+      if (group && group->payload_size != packet.payload_size) {
+        return;
+      }
+      session = find_session(key, may_open, group, stream_index,
+                             first_packet, packet.payload_size);
+      if (!session) {
+        return;
+      }
+    }
+    if (packet.payload_size != session->payload_size) {
+      return;
+    }
+
+    // A transfer is compressed from its first packet to its last
+    if (packet.encoding == PAYLOAD_FRAMED && !session->frames &&
+        !frame_decoder_for(*session)) {
+      return;
+    }
+    if ((packet.encoding == PAYLOAD_FRAMED) != (session->frames != nullptr)) {
+      return;
+    }
+
+    // Beyond the receive window: no room to buffer it, let it be resent
+    if (seq_num >= session->sr_base &&
+        seq_num - session->sr_base >= static_cast<uint32_t>(receive_window_)) {
+      if (verbose_) {
+        std::cout << "Packet " << seq_num << " outside receive window ["
+                  << session->sr_base << ", "
+                  << session->sr_base + receive_window_ << ")" << std::endl;
+      }
+      return;
+    }
+
+    // The disk thread is behind: drop new packets unacknowledged rather
+    // than stall the socket on a write. The ACKs already advertise the
+    // shrinking window, so the sender slows down and resends them.
+    if (disk_ && session->sink && !session->frames && disk_->full() &&
+        seq_num >= session->sr_base && !session->complete) {
+      latency_stats_.addDiskRingDrop();
+      return;
+    }
+
+    // The sender marks the packets whose ACK it is waiting on
+    bool ack_now = packet.type == SR_DATA_ACK_NOW;
+
+    // Every valid packet also counts towards its FEC block (the decoder
+    // skips repeats), which may complete a rebuild the repair packets were
+    // waiting for. Resumed transfers resend whole blocks, so packets already
+    // on disk count too.
+    accept_sr_payload(*session, seq_num, packet.data, packet.data_size,
+                      packet.is_last);
+    if (packet.fec_data > 0 && !session->complete) {
+      FecDecoder *fec =
+          fec_decoder_for(*session, packet.fec_data, packet.fec_repair);
+      FecBlock *block = fec ? fec->addData(seq_num, packet) : nullptr;
+      if (block) {
+        // ACK this packet before the ones it helps rebuild
+        acknowledge(*session, seq_num, packet.timestamp, ack_now, from);
+        recover_block(*session, *fec, *block, from);
+        return;
+      }
+    }
+
+    // ACK duplicates too, in case the original ACK was lost. The file is
+    // already finalized when the last ACK goes out.
+    acknowledge(*session, seq_num, packet.timestamp, ack_now, from);
+  }
+
+  // New packet inside the window: write it at its offset straight away,
+  // out-of-order packets included, and remember it was received. Returns
+  // false for duplicates and packets the session has no use for.
+  bool accept_sr_payload(ReceiveSession &session, uint32_t seq_num,
+                         const char *data, uint16_t data_size,
+                         uint8_t is_last) {
+    if (seq_num < session.sr_base || session.complete ||
+        seq_num - session.sr_base >= static_cast<uint32_t>(receive_window_)) {
+      return false;
+    }
+    char &received = session.sr_received[seq_num % receive_window_];
+    if (received || (session.group && session.group->hasPacket(seq_num))) {
+      return false;
+    }
+
+    // Frames are only decoded in order, so they wait in the ring
+    uint64_t offset = static_cast<uint64_t>(seq_num) * session.payload_size;
+    if (session.frames) {
+      size_t slot = seq_num % receive_window_;
+      std::memcpy(&session.sr_payloads[slot * session.payload_size], data,
+                  data_size);
+      session.sr_payload_sizes[slot] = data_size;
+    } else if (session.group) {
+      session.group->write(offset, data, data_size);
+    } else if (session.sink) {
+      session.sink->write(offset, data, data_size);
+    }
+    session.bytes_received += data_size;
+    received = 1;
+
+    if (is_last) {
+      session.sr_last_seen = true;
+      session.sr_last_seq_num = seq_num;
+      session.sr_file_size = offset + data_size;
+    }
+
+    advance_window(session);
+    return true;
+  }
+
+  // The session's FEC decoder for an N:K code, created on the first packet
+  // that announces one. Null when the code changed mid-transfer or the
+  // memory budget has no room; lost packets are then simply resent.
+  FecDecoder *fec_decoder_for(ReceiveSession &session, int data, int repair) {
+    if (session.fec) {
+      if (session.fec->data() != data || session.fec->repair() != repair) {
+        return nullptr;
+      }
+      return session.fec.get();
+    }
+    if (data > FEC_MAX_DATA || repair < 1 || repair > FEC_MAX_REPAIR) {
+      return nullptr;
+    }
+    size_t footprint = FecDecoder::footprint(data, repair, receive_window_,
+                                             session.payload_size);
+    if (!limits_.reserve(footprint)) {
+      return nullptr;
+    }
+    session.footprint += footprint;
+    session.fec.reset(
+        new FecDecoder(data, repair, session.sr_first, receive_window_,
+                       session.payload_size));
+    return session.fec.get();
+  }
+
+  // The session's frame decoder, created on the first compressed packet.
+  // Null when the transfer has already written plain packets, is one
+  // stream of several, or the memory budget has no room.
+  FrameDecoder *frame_decoder_for(ReceiveSession &session) {
+    if (session.group || session.bytes_received > 0) {
+      return nullptr;
+    }
+    size_t footprint =
+        FrameDecoder::footprint(decoders_) +
+        static_cast<size_t>(receive_window_) *
+            (session.payload_size + sizeof(uint16_t));
+    if (!limits_.reserve(footprint)) {
+      std::cout << "Session " << session.id
+                << ": no memory left to decompress, dropping" << std::endl;
+      return nullptr;
+    }
+    session.footprint += footprint;
+    session.sr_payloads.resize(
+        static_cast<size_t>(receive_window_) * session.payload_size);
+    session.sr_payload_sizes.assign(receive_window_, 0);
+    if (session.sink) {
+      session.sink->setOffload(nullptr); // Decoders write on their threads
+    }
+    session.frames.reset(new FrameDecoder(session.sink.get(), decoders_));
+    return session.frames.get();
+  }
+
+  // A compressed transfer received its last packet: wait for the last
+  // blocks to be written. Returns the file size, or 0 when the frame
+  // stream was corrupt.
+  uint64_t finish_frames(ReceiveSession &session) {
+    try {
+      return session.frames->finish();
+    } catch (const std::exception &e) {
+      std::cerr << "Session " << session.id << ": " << e.what()
+                << std::endl;
+      return 0;
+    }
+  }
+
+  // A repair packet: store its symbol and rebuild the block if it now has
+  // enough. Repair packets are never acknowledged.
+  void handle_repair_packet(const char *data, size_t bytes_received,
+                            const udp::endpoint &from) {
+    if (bytes_received <= SrRepair::headerSize()) {
+      std::cout << "Truncated repair packet (" << bytes_received
+                << " bytes), dropping" << std::endl;
+      return;
+    }
+    const SrRepair &repair = *reinterpret_cast<const SrRepair *>(data);
+    size_t symbol_size = bytes_received - SrRepair::headerSize();
+    uint32_t calculated_crc = calculateChecksum(
+        ChecksumAlgorithm::CRC32C,
+        reinterpret_cast<const char *>(repair.symbol), symbol_size);
+    if (calculated_crc != ntohl32(repair.crc)) {
+      std::cout << "CRC mismatch on repair packet for block "
+                << ntohl32(repair.block_first) << ", dropping" << std::endl;
+      return;
+    }
+
+    // Repairs never open a session: the block's data packets do
+    ReceiveSession *session =
+        find_session({from, ntohl32(repair.transfer_id)}, false);
+    if (!session || session->complete) {
+      return;
+    }
+    // The symbol spans the session's payload plus the length and flag
+    if (symbol_size != fecSymbolSize(session->payload_size)) {
+      return;
+    }
+    FecDecoder *fec =
+        fec_decoder_for(*session, repair.fec_data, repair.fec_repair);
+    FecBlock *block = fec ? fec->addRepair(repair) : nullptr;
+    if (block) {
+      recover_block(*session, *fec, *block, from);
+    }
+  }
+
+  // Rebuild what the block is missing, if it can be, and deliver the
+  // packets as if they had arrived, ACK included
+  void recover_block(ReceiveSession &session, FecDecoder &fec,
+                     FecBlock &block, const udp::endpoint &from) {
+    uint32_t timestamp = block.timestamp;
+    size_t rebuilt = 0;
+    fec.recover(block, [&](uint32_t seq_num, const char *data,
+                           uint16_t data_size, uint8_t is_last) {
+      if (verbose_) {
+        std::cout << "Rebuilt packet " << seq_num << " from FEC repair"
+                  << std::endl;
+      }
+      if (accept_sr_payload(session, seq_num, data, data_size, is_last)) {
+        rebuilt++;
+      }
+      acknowledge(session, seq_num, timestamp, true, from);
+    });
+    latency_stats_.addFecRecovered(rebuilt);
+  }
+
+  // Multicast loss scan. A session with a hole arms a NACK to go out after
+  // a random backoff, so the receivers that lost the same packets do not
+  // all report at once; after sending one it holds off while the repairs
+  // are on their way.
+  void schedule_nack_scan() {
+    nack_timer_.expires_after(
+        boost::asio::chrono::milliseconds(MCAST_NACK_TICK_MS));
+    nack_timer_.async_wait([this](const boost::system::error_code &error) {
+      if (error || !is_running_) {
+        return;
+      }
+      auto now = steady_clock::now();
+      for (auto &entry : sessions_) {
+        ReceiveSession &session = *entry.second;
+        if (!session.multicast || session.complete ||
+            now < session.nack_hold) {
+          continue;
+        }
+        if (!session.nack_armed) {
+          if (session.sr_base < session.sr_highest) {
+            session.nack_armed = true;
+            session.nack_at =
+                now + microseconds(std::uniform_int_distribution<int>(
+                          0, MCAST_NACK_BACKOFF_MS * 1000)(nack_random_));
+            session.nacks_heard.clear();
+          }
+          continue;
+        }
+        if (now >= session.nack_at) {
+          session.nack_armed = false;
+          if (send_nack(session)) {
+            session.nack_hold = now + milliseconds(MCAST_NACK_HOLDOFF_MS);
+          }
+        }
+      }
+      schedule_nack_scan();
+    });
+  }
+
+  // Report the session's incomplete FEC blocks to the group, oldest first:
+  // the packets missing from each and the repair packets still needed
+  // beyond those held. Blocks another receiver already asked as much for
+  // are left out. Only whole blocks inside the window are reported, as the
+  // newest one may still be arriving. Returns whether any block needed a
+  // report, sent or suppressed.
+  bool send_nack(ReceiveSession &session) {
+    uint32_t block = static_cast<uint32_t>(session.nack_block);
+    uint32_t limit = session.sr_last_seen ? session.sr_last_seq_num + 1
+                                          : session.sr_highest;
+    uint32_t end = static_cast<uint32_t>(std::min<uint64_t>(
+        limit, static_cast<uint64_t>(session.sr_base) + receive_window_));
+
+    SrNack nack;
+    nack.type = SR_NACK_PACKET;
+    nack.transfer_id = htonl32(session.key.transfer_id);
+    nack.count = 0;
+    size_t suppressed = 0;
+    for (uint32_t first = session.sr_base - session.sr_base % block;
+         first < end && nack.count < MCAST_NACK_ENTRIES; first += block) {
+      uint32_t block_end = first + block;
+      if (block_end > end) {
+        if (end != limit) {
+          break;
+        }
+        block_end = end;
+      }
+      uint64_t missing = 0;
+      int lost = 0;
+      for (uint32_t seq_num = std::max(first, session.sr_base);
+           seq_num < block_end; ++seq_num) {
+        if (!session.sr_received[seq_num % receive_window_]) {
+          missing |= uint64_t(1) << (seq_num - first);
+          lost++;
+        }
+      }
+      int needed = lost - (session.fec ? session.fec->repairsHeld(first) : 0);
+      if (needed <= 0) {
+        continue;
+      }
+      auto heard = session.nacks_heard.find(first);
+      if (heard != session.nacks_heard.end() && heard->second >= needed) {
+        suppressed++;
+        continue;
+      }
+      SrNackEntry &entry = nack.entries[nack.count++];
+      entry.block_first = htonl32(first);
+      entry.missing_hi = htonl32(static_cast<uint32_t>(missing >> 32));
+      entry.missing_lo = htonl32(static_cast<uint32_t>(missing));
+      entry.needed = static_cast<uint8_t>(std::min(needed, 255));
+    }
+    latency_stats_.addNacksSuppressed(suppressed);
+    if (nack.count == 0) {
+      return suppressed > 0;
+    }
+
+    if (verbose_) {
+      std::cout << "NACK sent for " << (int)nack.count << " blocks from "
+                << ntohl32(nack.entries[0].block_first) << std::endl;
+    }
+    latency_stats_.addNackPacket();
+    size_t size = SrNack::headerSize() + nack.count * sizeof(SrNackEntry);
+    boost::system::error_code error;
+    socket_.send_to(boost::asio::buffer(&nack, size), multicast_endpoint_, 0,
+                    error);
+    if (error && error != boost::asio::error::would_block) {
+      std::cerr << "Failed to send NACK: " << error.message() << std::endl;
+    }
+    return true;
+  }
+
+  // A NACK on the group, from another receiver (or looped back from this
+  // one): while our own NACK waits out its backoff, remember what it asked
+  // for so ours can leave those blocks out
+  void handle_nack(const char *data, size_t bytes_received) {
+    if (multicast_endpoint_.port() == 0 ||
+        bytes_received < SrNack::headerSize()) {
+      return;
+    }
+    const SrNack &nack = *reinterpret_cast<const SrNack *>(data);
+    size_t count = std::min<size_t>(
+        nack.count,
+        (bytes_received - SrNack::headerSize()) / sizeof(SrNackEntry));
+    uint32_t transfer_id = ntohl32(nack.transfer_id);
+    for (auto &entry : sessions_) {
+      ReceiveSession &session = *entry.second;
+      if (!session.multicast || !session.nack_armed ||
+          session.key.transfer_id != transfer_id) {
+        continue;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        int &heard = session.nacks_heard[ntohl32(nack.entries[i].block_first)];
+        heard = std::max<int>(heard, nack.entries[i].needed);
+      }
+    }
+  }
+
+  // The multicast sender has sent every data packet. The announcement
+  // carries the file size, so a receiver that lost the tail learns where
+  // the file ends and NACKs it. It never opens a session.
+  void handle_flush(const char *data, size_t bytes_received,
+                    const udp::endpoint &from) {
+    if (bytes_received != sizeof(SrControl)) {
+      return;
+    }
+    const SrControl &flush = *reinterpret_cast<const SrControl *>(data);
+    ReceiveSession *session =
+        find_session({from, ntohl32(flush.transfer_id)}, false);
+    if (!session || !session->multicast || session->complete ||
+        session->sr_last_seen || flush.payload_size != session->payload_size) {
+      return;
+    }
+    uint64_t file_size = controlFileSize(flush);
+    uint64_t total = packetCount(file_size, session->payload_size);
+    if (total > UINT32_MAX) {
+      return;
+    }
+    session->sr_last_seen = true;
+    session->sr_last_seq_num = static_cast<uint32_t>(total - 1);
+    session->sr_file_size = file_size;
+    session->sr_highest =
+        std::max(session->sr_highest, static_cast<uint32_t>(total));
+  }
+
+  // Slide the window base past the contiguous run of received packets
+  void advance_window(ReceiveSession &session) {
+    while (session.sr_received[session.sr_base % receive_window_] ||
+           (session.group && session.group->hasPacket(session.sr_base))) {
+      size_t slot = session.sr_base % receive_window_;
+      session.sr_received[slot] = 0;
+      if (session.frames) {
+        session.frames->feed(
+            &session.sr_payloads[slot * session.payload_size],
+            session.sr_payload_sizes[slot]);
+      }
+
+      if (session.sr_last_seen && session.sr_base == session.sr_last_seq_num) {
+        session.sr_base++;
+        if (session.group) {
+          // End of one stream's range, not of the file
+          complete_session(session, session.bytes_received);
+          return;
+        }
+        uint64_t file_size = session.sr_file_size;
+        if (session.frames) {
+          file_size = finish_frames(session);
+          std::cout << "Last packet received, data reception complete ("
+                    << file_size << " bytes from "
+                    << session.frames->streamBytes() << " compressed)."
+                    << std::endl;
+        } else {
+          std::cout << "Last packet received, data reception complete ("
+                    << file_size << " bytes)." << std::endl;
+        }
+        complete_session(session, file_size);
+        return;
+      }
+
+      session.sr_base++;
+    }
+  }
+
+  // Acknowledge a data packet. Packets that extend the run received so
+  // far share one ACK, sent every ack_every_ packets or once the first of
+  // them has waited ack_delay_us_. Anything else (a gap opening, a hole
+  // filled, a duplicate, the end of the transfer, a packet the sender
+  // marked) is reported at once, so losses are seen without delay.
+  void acknowledge(ReceiveSession &session, uint32_t seq_num,
+                   uint32_t ts_echo, bool ack_now, const udp::endpoint &from) {
+    // Multicast receivers stay silent; the loss scan NACKs the holes
+    if (session.multicast) {
+      if (seq_num >= session.sr_highest && !session.complete) {
+        session.sr_highest = seq_num + 1;
+      }
+      return;
+    }
+    bool extends = seq_num == session.sr_highest;
+    if (!extends && session.acks_pending > 0) {
+      // The run so far first, while the bitmap still reaches all of it
+      send_sr_ack(session, from);
+    }
+    if (seq_num >= session.sr_highest && !session.complete) {
+      session.sr_highest = seq_num + 1;
+    }
+    session.ack_newest = seq_num;
+    session.ack_ts_echo = ts_echo;
+    session.ack_arrival = steady_clock::now();
+
+    if (!extends || ack_now || session.complete ||
+        ++session.acks_pending >= ack_every_) {
+      send_sr_ack(session, from);
+      return;
+    }
+    if (session.acks_pending > 1) {
+      return;
+    }
+    delayed_acks_.push_back(session.key);
+    if (!ack_timer_armed_) {
+      ack_timer_armed_ = true;
+      ack_timer_.expires_after(microseconds(ack_delay_us_));
+      ack_timer_.async_wait(boost::bind(&UdpServer::handle_ack_timer, this,
+                                        boost::asio::placeholders::error));
+    }
+  }
+
+  // The ACK delay ran out: send every ACK still held back
+  void handle_ack_timer(const boost::system::error_code &error) {
+    ack_timer_armed_ = false;
+    if (error) {
+      return;
+    }
+    for (const SessionKey &key : delayed_acks_) {
+      auto it = sessions_.find(key);
+      if (it != sessions_.end() && it->second->acks_pending > 0) {
+        send_sr_ack(*it->second, key.endpoint);
+      }
+    }
+    delayed_acks_.clear();
+    flush_acks();
+  }
+
+  // Send the session's selective-repeat ACK: the cumulative ACK, a bitmap
+  // of what arrived past it, the newest packet's timestamp for the
+  // sender's RTT sample and the receive window. In batch and io_uring
+  // modes the ACK is queued and goes out with the rest of the batch in
+  // flush_acks().
+  void send_sr_ack(ReceiveSession &session, const udp::endpoint &to) {
+    // The bitmap starts right past the cumulative ACK, or, when packets
+    // arrived further on than it reaches, covers the newest of them
+    uint32_t cumulative = session.sr_base;
+    uint32_t sack_base = cumulative + 1;
+    if (session.sr_highest > sack_base + SR_SACK_BITS) {
+      sack_base = std::max(sack_base,
+                           std::min(session.ack_newest,
+                                    session.sr_highest - SR_SACK_BITS));
+    }
+    uint64_t sack_bits = 0;
+    for (int bit = 0; bit < SR_SACK_BITS; ++bit) {
+      uint32_t seq_num = sack_base + bit;
+      if (seq_num >= session.sr_highest ||
+          seq_num - cumulative >= static_cast<uint32_t>(receive_window_)) {
+        break;
+      }
+      if (session.sr_received[seq_num % receive_window_]) {
+        sack_bits |= uint64_t(1) << bit;
+      }
+    }
+    uint64_t delay = duration_cast<microseconds>(steady_clock::now() -
+                                                 session.ack_arrival)
+                         .count();
+
+    SrAck ack;
+    ack.type = SR_ACK_PACKET;
+    ack.cumulative_ack = htonl32(cumulative);
+    ack.sack_base = htonl32(sack_base);
+    ack.sack_hi = htonl32(static_cast<uint32_t>(sack_bits >> 32));
+    ack.sack_lo = htonl32(static_cast<uint32_t>(sack_bits));
+    ack.ts_echo = session.ack_ts_echo;
+    ack.ack_delay_us = htonl32(static_cast<uint32_t>(
+        std::min<uint64_t>(delay, UINT32_MAX)));
+    size_t window = static_cast<size_t>(receive_window_);
+    if (disk_) {
+      window = std::min(window, disk_->freeSlots());
+    }
+    ack.window = htonl32(static_cast<uint32_t>(window));
+    session.acks_pending = 0;
+    latency_stats_.addAckPacket();
+
+    if (verbose_) {
+      std::cout << "ACK sent up to seq_num " << cumulative << " (SACK "
+                << std::hex << sack_bits << std::dec << " from "
+                << sack_base << ")" << std::endl;
+    }
+
+#ifdef HAVE_IO_URING
+    if (uring_) {
+      uring_->queue(&ack, sizeof(ack), to);
+      return;
+    }
+#endif
+
+    if (batch_io_) {
+      if (pending_acks_.size() == pending_acks_.capacity()) {
+        flush_acks();
+      }
+      pending_acks_.push_back(ack);
+      batch_io_->queue(&pending_acks_.back(), sizeof(ack), to);
+      return;
+    }
+
+    boost::system::error_code error;
+    socket_.send_to(boost::asio::buffer(&ack, sizeof(ack)), to, 0, error);
+    if (error && error != boost::asio::error::would_block) {
+      std::cerr << "Failed to send ACK: " << error.message() << std::endl;
+    }
+  }
+
+  // Send every queued ACK (batch and io_uring modes)
+  void flush_acks() {
+#ifdef HAVE_IO_URING
+    if (uring_) {
+      uring_->flush();
+    }
+#endif
+    if (batch_io_) {
+      batch_io_->flush();
+    }
+    pending_acks_.clear();
+  }
+
+  // Port the server is bound to (useful when it was asked for port 0)
+  unsigned short port() const { return socket_.local_endpoint().port(); }
+
+  // Stop the server
+  void stop() {
+    // Record end time if not already done
+    if (duration_cast<milliseconds>(latency_stats_.end_time -
+                                    latency_stats_.start_time)
+            .count() == 0) {
+      latency_stats_.endTransfer(bytes_received_);
+    }
+
+    if (disk_) {
+      latency_stats_.setDiskWrites(disk_->writes(), disk_->syscalls());
+    }
+
+    is_running_ = false;
+    sweep_timer_.cancel();
+    ack_timer_.cancel();
+    nack_timer_.cancel();
+    socket_.cancel();
+#ifdef HAVE_IO_URING
+    if (uring_) {
+      uring_->cancel();
+    }
+#endif
+  }
+};
+
+// ---- Network emulator ----
+
+// Impairments a NetworkEmulator applies to each direction of a path
+struct NetworkProfile {
+  std::string name;
+  double loss;        // Independent (Bernoulli) loss probability
+  double burst_enter; // Gilbert-Elliott: good -> bad per packet (0 = off)
+  double burst_leave; // Gilbert-Elliott: bad -> good per packet
+  double burst_loss;  // Loss probability in the bad state
+  double delay_ms;    // One-way delay
+  double jitter_ms;   // Extra delay, uniform in [0, jitter)
+  double reorder;     // Probability a packet is held back by reorder_ms
+  double reorder_ms;
+  double duplicate;   // Probability a packet is delivered twice
+  double rate_mbit;   // Bottleneck rate in Mbit/s (0 = unlimited)
+  size_t queue_bytes; // Bottleneck queue; packets beyond it are dropped
+};
+
+// Named impairment profiles for --netem and the --bench-net sweep
+const std::vector<NetworkProfile> &networkProfilePresets() {
+  static const std::vector<NetworkProfile> presets = {
+      // name     loss   GE enter/leave/loss  delay jitter reorder dup rate
+      {"clean", 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 256 * 1024},
+      {"lossy", 0.01, 0, 0, 0, 1, 0, 0, 0, 0, 0, 256 * 1024},
+      {"burst", 0, 0.005, 0.2, 0.5, 1, 0, 0, 0, 0, 0, 256 * 1024},
+      {"wan", 0, 0, 0, 0, 20, 2, 0, 0, 0, 0, 256 * 1024},
+      {"reorder", 0, 0, 0, 0, 2, 0, 0.05, 5, 0, 0, 256 * 1024},
+      {"dup", 0, 0, 0, 0, 1, 0, 0, 0, 0.02, 0, 256 * 1024},
+      {"capped", 0, 0, 0, 0, 1, 0, 0, 0, 0, 100, 256 * 1024},
+      {"mixed", 0.005, 0, 0, 0, 10, 2, 0.01, 5, 0.005, 200, 512 * 1024},
+  };
+  return presets;
+}
+
+// Parse a --netem value: a preset name, or key=value pairs separated by
+// commas (loss, delay, jitter, reorder, reorder_ms, duplicate, rate, queue
+// and burst=ENTER:LEAVE:LOSS; probabilities in percent, times in ms, rate
+// in Mbit/s, queue in KB)
+NetworkProfile parseNetworkProfile(const std::string &spec) {
+  for (const NetworkProfile &preset : networkProfilePresets()) {
+    if (preset.name == spec) {
+      return preset;
+    }
+  }
+  if (spec.find('=') == std::string::npos) {
+    throw std::runtime_error("Unknown network profile: " + spec);
+  }
+
+  NetworkProfile profile = networkProfilePresets()[0];
+  profile.name = "custom";
+  std::istringstream fields(spec);
+  std::string field;
+  while (std::getline(fields, field, ',')) {
+    size_t equals = field.find('=');
+    if (equals == std::string::npos) {
+      throw std::runtime_error("Network impairment must be key=value: " +
+                               field);
+    }
+    std::string key = field.substr(0, equals);
+    std::string value = field.substr(equals + 1);
+    if (key == "burst") {
+      size_t first = value.find(':');
+      size_t second = value.find(':', first + 1);
+      if (first == std::string::npos || second == std::string::npos) {
+        throw std::runtime_error("burst must be ENTER:LEAVE:LOSS: " + value);
+      }
+      profile.burst_enter = std::stod(value.substr(0, first)) / 100.0;
+      profile.burst_leave =
+          std::stod(value.substr(first + 1, second - first - 1)) / 100.0;
+      profile.burst_loss = std::stod(value.substr(second + 1)) / 100.0;
+      continue;
+    }
+    double number = std::stod(value);
+    if (key == "loss") {
+      profile.loss = number / 100.0;
+    } else if (key == "delay") {
+      profile.delay_ms = number;
+    } else if (key == "jitter") {
+      profile.jitter_ms = number;
+    } else if (key == "reorder") {
+      profile.reorder = number / 100.0;
+    } else if (key == "reorder_ms") {
+      profile.reorder_ms = number;
+    } else if (key == "duplicate") {
+      profile.duplicate = number / 100.0;
+    } else if (key == "rate") {
+      profile.rate_mbit = number;
+    } else if (key == "queue") {
+      profile.queue_bytes = static_cast<size_t>(number * 1024);
+    } else {
+      throw std::runtime_error("Unknown network impairment: " + key);
+    }
+  }
+  if (profile.reorder > 0.0 && profile.reorder_ms <= 0.0) {
+    profile.reorder_ms = 5;
+  }
+  return profile;
+}
+
+// UDP relay that impairs traffic between clients and a server: clients
+// send to the emulator's port, and each client endpoint gets a socket of
+// its own towards the server so replies find their way back. Both
+// directions go through the same profile, each with its own random
+// stream seeded from the fixed seed, so a given packet sequence always
+// meets the same losses, delays and duplicates.
+class NetworkEmulator {
+public:
+  // What happened to the packets, over both directions
+  struct Counters {
+    uint64_t forwarded;   // Deliveries, duplicates included
+    uint64_t lost;        // Random and burst losses
+    uint64_t queue_drops; // Dropped at a full bottleneck queue
+    uint64_t reordered;   // Held back to arrive out of order
+    uint64_t duplicated;
+  };
+
+  NetworkEmulator(boost::asio::io_context &io_context,
+                  unsigned short listen_port, const udp::endpoint &server,
+                  const NetworkProfile &profile, uint64_t seed)
+      : io_context_(io_context),
+        front_(io_context,
+               udp::endpoint(boost::asio::ip::address_v4::loopback(),
+                             listen_port)),
+        server_(server), profile_(profile), front_buffer_(MAX_DATAGRAM),
+        timer_(io_context),
+        timer_armed_(false), next_order_(0), counters_() {
+    configure(front_);
+    for (int i = 0; i < 2; ++i) {
+      directions_[i].random.seed(seed * 2 + i);
+      directions_[i].bad = false;
+      directions_[i].link_free = steady_clock::now();
+    }
+    receive_front();
+  }
+
+  // Port clients send to
+  unsigned short port() const { return front_.local_endpoint().port(); }
+
+  const Counters &counters() const { return counters_; }
+
+  // Stop relaying; io_context.run() returns once the handlers drain
+  void stop() {
+    timer_.cancel();
+    front_.cancel();
+    for (auto &flow : flows_) {
+      flow.second->socket.cancel();
+    }
+  }
+
+private:
+  static constexpr size_t MAX_DATAGRAM = 65536;
+
+  // One client endpoint and its socket towards the server
+  struct Flow {
+    udp::endpoint client;
+    udp::socket socket;
+    std::vector<char> buffer;
+    explicit Flow(boost::asio::io_context &io_context)
+        : socket(io_context, udp::endpoint(udp::v4(), 0)),
+          buffer(MAX_DATAGRAM) {}
+  };
+
+  // Random state and bottleneck of one direction
+  struct Direction {
+    std::mt19937_64 random;
+    bool bad; // Gilbert-Elliott state
+    steady_clock::time_point link_free; // Bottleneck idle again
+  };
+
+  // A packet waiting for its delivery time
+  struct Pending {
+    steady_clock::time_point due;
+    uint64_t order; // Ties keep arrival order
+    udp::socket *socket;
+    udp::endpoint to;
+    std::vector<char> data;
+    bool operator>(const Pending &other) const {
+      return due != other.due ? due > other.due : order > other.order;
+    }
+  };
+
+  boost::asio::io_context &io_context_;
+  udp::socket front_;
+  udp::endpoint server_;
+  NetworkProfile profile_;
+  Direction directions_[2]; // 0: client to server, 1: server to client
+  std::unordered_map<std::string, std::unique_ptr<Flow>> flows_;
+  std::vector<char> front_buffer_;
+  udp::endpoint front_sender_;
+  std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>>
+      pending_;
+  boost::asio::steady_timer timer_;
+  bool timer_armed_;
+  steady_clock::time_point timer_due_;
+  uint64_t next_order_;
+  Counters counters_;
+
+  static void configure(udp::socket &socket) {
+    socket.set_option(boost::asio::socket_base::receive_buffer_size(4 << 20));
+    socket.set_option(boost::asio::socket_base::send_buffer_size(4 << 20));
+    socket.non_blocking(true);
+  }
+
+  static std::string keyOf(const udp::endpoint &endpoint) {
+    return endpoint.address().to_string() + ":" +
+           std::to_string(endpoint.port());
+  }
+
+  void receive_front() {
+    front_.async_receive_from(
+        boost::asio::buffer(front_buffer_), front_sender_,
+        [this](const boost::system::error_code &error, size_t bytes) {
+          if (error == boost::asio::error::operation_aborted) {
+            return;
+          }
+          if (!error) {
+            Flow &flow = flow_for(front_sender_);
+            impair(directions_[0], front_buffer_.data(), bytes, flow.socket,
+                   server_);
+          }
+          receive_front();
+        });
+  }
+
+  Flow &flow_for(const udp::endpoint &client) {
+    std::unique_ptr<Flow> &flow = flows_[keyOf(client)];
+    if (!flow) {
+      flow.reset(new Flow(io_context_));
+      flow->client = client;
+      configure(flow->socket);
+      receive_back(*flow);
+    }
+    return *flow;
+  }
+
+  void receive_back(Flow &flow) {
+    flow.socket.async_receive(
+        boost::asio::buffer(flow.buffer),
+        [this, &flow](const boost::system::error_code &error, size_t bytes) {
+          if (error == boost::asio::error::operation_aborted) {
+            return;
+          }
+          if (!error) {
+            impair(directions_[1], flow.buffer.data(), bytes, front_,
+                   flow.client);
+          }
+          receive_back(flow);
+        });
+  }
+
+  // Decide a packet's fate and schedule its delivery
+  void impair(Direction &direction, const char *data, size_t length,
+              udp::socket &socket, const udp::endpoint &to) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    auto now = steady_clock::now();
+
+    // Gilbert-Elliott burst loss: the state changes once per packet
+    if (profile_.burst_enter > 0.0) {
+      double change = uniform(direction.random);
+      if (direction.bad ? change < profile_.burst_leave
+                        : change < profile_.burst_enter) {
+        direction.bad = !direction.bad;
+      }
+    }
+    double loss_draw = uniform(direction.random);
+    if (loss_draw < profile_.loss ||
+        (direction.bad && uniform(direction.random) < profile_.burst_loss)) {
+      counters_.lost++;
+      return;
+    }
+
+    // Bottleneck: serialize at the link rate behind a finite queue
+    steady_clock::time_point departure = now;
+    if (profile_.rate_mbit > 0.0) {
+      double bytes_per_ns = profile_.rate_mbit * 1e6 / 8 / 1e9;
+      steady_clock::time_point start = std::max(now, direction.link_free);
+      if ((start - now).count() * bytes_per_ns >
+          static_cast<double>(profile_.queue_bytes)) {
+        counters_.queue_drops++;
+        return;
+      }
+      direction.link_free =
+          start + nanoseconds(static_cast<int64_t>(length / bytes_per_ns));
+      departure = direction.link_free;
+    }
+
+    double delay_ms = profile_.delay_ms;
+    if (profile_.jitter_ms > 0.0) {
+      delay_ms += profile_.jitter_ms * uniform(direction.random);
+    }
+    if (profile_.reorder > 0.0 &&
+        uniform(direction.random) < profile_.reorder) {
+      delay_ms += profile_.reorder_ms;
+      counters_.reordered++;
+    }
+    steady_clock::time_point due =
+        departure + nanoseconds(static_cast<int64_t>(delay_ms * 1e6));
+    int copies = 1;
+    if (profile_.duplicate > 0.0 &&
+        uniform(direction.random) < profile_.duplicate) {
+      copies = 2;
+      counters_.duplicated++;
+    }
+    for (int i = 0; i < copies; ++i) {
+      pending_.push(Pending{due, next_order_++, &socket, to,
+                            std::vector<char>(data, data + length)});
+    }
+    arm_timer();
+  }
+
+  // Wake up for the earliest pending delivery
+  void arm_timer() {
+    if (pending_.empty()) {
+      return;
+    }
+    steady_clock::time_point due = pending_.top().due;
+    if (timer_armed_ && timer_due_ <= due) {
+      return;
+    }
+    timer_armed_ = true;
+    timer_due_ = due;
+    timer_.expires_at(due);
+    timer_.async_wait([this](const boost::system::error_code &error) {
+      if (error == boost::asio::error::operation_aborted) {
+        return; // Re-armed earlier, or stopped
+      }
+      timer_armed_ = false;
+      deliver_due();
+    });
+  }
+
+  void deliver_due() {
+    auto now = steady_clock::now();
+    while (!pending_.empty() && pending_.top().due <= now) {
+      const Pending &packet = pending_.top();
+      boost::system::error_code error;
+      packet.socket->send_to(boost::asio::buffer(packet.data), packet.to, 0,
+                             error);
+      counters_.forwarded++;
+      pending_.pop();
+    }
+    arm_timer();
+  }
+};
+
+// ---- Low-latency request/response ----
+
+// Echo request and its reply: a small header, then whatever the sender
+// put in data (size - headerSize() bytes of it go on the wire)
+#pragma pack(push, 1)
+struct PingMessage {
+  uint8_t type;     // PING_REQUEST or PING_REPLY
+  uint32_t seq_num; // Round trip it belongs to (network byte order)
+  char data[PING_MAX_MESSAGE - 5];
+
+  static constexpr size_t headerSize() {
+    return sizeof(type) + sizeof(seq_num);
+  }
+};
+#pragma pack(pop)
+
+// Pin the calling thread to one CPU. Returns false where that fails or is
+// not supported.
+bool pinThread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+// Tell the CPU this is a spin-wait loop
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#endif
+}
+
+// Receive side of --busy-poll. The calling thread spins on a non-blocking
+// recvfrom() instead of sleeping in epoll, so it picks a datagram up as
+// soon as the kernel has it, without a wakeup. With SO_BUSY_POLL and
+// SO_PREFER_BUSY_POLL, an empty receive also polls the device queue
+// itself. Spinning costs a whole CPU, so after BUSY_SPIN_IDLE_US without
+// traffic the poller sleeps in poll(), and it spins again from the next
+// datagram on. On a machine with a single CPU each spin yields instead,
+// because the peer it is waiting for needs that CPU to run.
+class BusyPoller {
+private:
+  udp::socket &socket_;
+  std::atomic<bool> stopped_;
+  bool yield_;
+  steady_clock::time_point last_traffic_;
+  uint64_t empty_polls_; // Receives that found nothing
+  uint64_t sleeps_;      // Times traffic went quiet and the poller slept
+
+public:
+  explicit BusyPoller(udp::socket &socket)
+      : socket_(socket), stopped_(false),
+        yield_(std::thread::hardware_concurrency() < 2),
+        last_traffic_(steady_clock::now()), empty_polls_(0), sleeps_(0) {}
+
+  uint64_t emptyPolls() const { return empty_polls_; }
+  uint64_t sleeps() const { return sleeps_; }
+  bool stopped() const { return stopped_.load(); }
+
+  // Make receive() return -1 (from any thread)
+  void stop() { stopped_.store(true); }
+
+  // Make the socket non-blocking and ask the kernel to busy poll it.
+  // Returns whether SO_BUSY_POLL was accepted: going past the
+  // net.core.busy_read sysctl needs CAP_NET_ADMIN.
+  bool configure() {
+    socket_.non_blocking(true);
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    int fd = socket_.native_handle();
+    int budget_us = BUSY_POLL_US;
+    bool accepted = ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &budget_us,
+                                 sizeof(budget_us)) == 0;
+#ifdef SO_PREFER_BUSY_POLL
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+#endif
+    return accepted;
+#else
+    return false;
+#endif
+  }
+
+  // Wait for a datagram until deadline. Returns its length, or -1 on
+  // timeout, stop() or a socket error.
+  ssize_t receive(void *data, size_t len, udp::endpoint &from,
+                  steady_clock::time_point deadline) {
+#ifdef HAVE_MMAP
+    int fd = socket_.native_handle();
+    while (!stopped_.load(std::memory_order_relaxed)) {
+      socklen_t from_len = static_cast<socklen_t>(from.capacity());
+      ssize_t n = ::recvfrom(fd, data, len, 0, from.data(), &from_len);
+      if (n >= 0) {
+        from.resize(from_len);
+        last_traffic_ = steady_clock::now();
+        return n;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return -1;
+      }
+      empty_polls_++;
+      auto now = steady_clock::now();
+      if (now >= deadline) {
+        return -1;
+      }
+      if (now - last_traffic_ < microseconds(BUSY_SPIN_IDLE_US)) {
+        if (yield_) {
+          std::this_thread::yield();
+        } else {
+          cpuRelax();
+        }
+        continue;
+      }
+
+      // Quiet: sleep until traffic, the deadline or the next stop check
+      sleeps_++;
+      struct pollfd waiter = {fd, POLLIN, 0};
+      auto wait = std::min<steady_clock::duration>(
+          deadline - now, milliseconds(BUSY_SLEEP_MS));
+      ::poll(&waiter, 1,
+             static_cast<int>(duration_cast<milliseconds>(wait).count()) + 1);
+    }
+    return -1;
+#else
+    (void)data;
+    (void)len;
+    (void)from;
+    (void)deadline;
+    throw std::runtime_error("Busy polling is not supported here");
+#endif
+  }
+};
+
+// Answers pings (--echo): every PING_REQUEST goes straight back to its
+// sender as a PING_REPLY. Served from the io_context like the servers'
+// sockets, or with busy_poll from a thread of its own spinning on the
+// socket, pinned to cpu unless that is -1. In reactor mode the caller
+// pins the thread that runs the io_context.
+class EchoResponder {
+private:
+  udp::socket socket_;
+  bool busy_poll_;
+  int cpu_;
+  BusyPoller poller_;
+  std::thread thread_;
+  PingMessage message_;
+  udp::endpoint sender_;
+  std::atomic<uint64_t> replies_;
+
+public:
+  EchoResponder(boost::asio::io_context &io_context, unsigned short port,
+                bool busy_poll, int cpu = -1)
+      : socket_(io_context, udp::endpoint(udp::v4(), port)),
+        busy_poll_(busy_poll), cpu_(cpu), poller_(socket_), replies_(0) {}
+
+  ~EchoResponder() { stop(); }
+
+  unsigned short port() const { return socket_.local_endpoint().port(); }
+  uint64_t replies() const { return replies_.load(); }
+  const BusyPoller &poller() const { return poller_; }
+
+  void start() {
+    if (!busy_poll_) {
+      receive();
+      return;
+    }
+    if (!poller_.configure()) {
+      std::cout << "SO_BUSY_POLL not accepted, spinning in user space only"
+                << std::endl;
+    }
+    thread_ = std::thread([this]() { serve_busy(); });
+  }
+
+  // Stop answering. Reactor mode: call from the io_context's thread.
+  void stop() {
+    if (busy_poll_) {
+      poller_.stop();
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+      return;
+    }
+    boost::system::error_code ignored;
+    socket_.cancel(ignored);
+  }
+
+private:
+  // The request becomes its own reply
+  void reply(size_t len) {
+    if (len < PingMessage::headerSize() || message_.type != PING_REQUEST) {
+      return;
+    }
+    message_.type = PING_REPLY;
+    boost::system::error_code error;
+    socket_.send_to(boost::asio::buffer(&message_, len), sender_, 0, error);
+    if (!error) {
+      replies_++;
+    }
+  }
+
+  void receive() {
+    socket_.async_receive_from(
+        boost::asio::buffer(&message_, sizeof(message_)), sender_,
+        [this](const boost::system::error_code &error, size_t len) {
+          if (error == boost::asio::error::operation_aborted) {
+            return;
+          }
+          if (!error) {
+            reply(len);
+          }
+          receive();
+        });
+  }
+
+  void serve_busy() {
+    if (cpu_ >= 0 && !pinThread(cpu_)) {
+      std::cerr << "Could not pin the responder to CPU " << cpu_ << std::endl;
+    }
+    while (!poller_.stopped()) {
+      ssize_t len = poller_.receive(&message_, sizeof(message_), sender_,
+                                    steady_clock::time_point::max());
+      if (len >= 0) {
+        reply(static_cast<size_t>(len));
+      }
+    }
+  }
+};
+
+// Measures request/response round trips against an EchoResponder: one
+// ping of size bytes at a time, the next sent as soon as the reply is in
+// or PING_TIMEOUT_MS has passed. With busy_poll the replies are picked up
+// by spinning on the socket, otherwise through the io_context's reactor
+// the way the transfer's sockets get theirs. run() pins the calling
+// thread to cpu unless that is -1.
+class PingClient {
+private:
+  boost::asio::io_context &io_context_;
+  udp::socket socket_;
+  udp::endpoint server_;
+  size_t size_;
+  bool busy_poll_;
+  int cpu_;
+  BusyPoller poller_;
+  boost::asio::steady_timer timer_;
+  PingMessage request_;
+  PingMessage reply_;
+  udp::endpoint from_;
+  LatencyHistogram rtts_;
+  size_t count_;  // Round trips to run
+  size_t sent_;   // Pings sent so far
+  uint64_t lost_; // Pings with no reply in time
+  bool waiting_;  // Reactor mode: the last ping is still unanswered
+  steady_clock::time_point sent_at_;
+
+public:
+  PingClient(boost::asio::io_context &io_context, const udp::endpoint &server,
+             size_t size, bool busy_poll, int cpu = -1)
+      : io_context_(io_context),
+        socket_(io_context, udp::endpoint(udp::v4(), 0)), server_(server),
+        size_(std::max(PingMessage::headerSize(),
+                       std::min(size, PING_MAX_MESSAGE))),
+        busy_poll_(busy_poll), cpu_(cpu), poller_(socket_),
+        timer_(io_context), count_(0), sent_(0), lost_(0), waiting_(false) {
+    std::memset(&request_, 0x5A, sizeof(request_));
+    request_.type = PING_REQUEST;
+  }
+
+  uint64_t lost() const { return lost_; }
+  const BusyPoller &poller() const { return poller_; }
+
+  // Run count round trips; returns the RTT of every answered one
+  const LatencyHistogram &run(size_t count) {
+    count_ = count;
+    if (cpu_ >= 0 && !pinThread(cpu_)) {
+      std::cerr << "Could not pin the client to CPU " << cpu_ << std::endl;
+    }
+    if (busy_poll_) {
+      run_busy();
+    } else {
+      send_next();
+      receive();
+      io_context_.restart();
+      io_context_.run();
+    }
+    return rtts_;
+  }
+
+private:
+  void send_ping() {
+    request_.seq_num = htonl32(static_cast<uint32_t>(sent_));
+    sent_at_ = steady_clock::now();
+    boost::system::error_code error;
+    socket_.send_to(boost::asio::buffer(&request_, size_), server_, 0, error);
+    sent_++;
+  }
+
+  // A reply to the ping in flight, not a late one to an earlier ping
+  bool answers(ssize_t len) const {
+    return len >= static_cast<ssize_t>(PingMessage::headerSize()) &&
+           reply_.type == PING_REPLY && reply_.seq_num == request_.seq_num;
+  }
+
+  void record() {
+    rtts_.record(duration_cast<nanoseconds>(steady_clock::now() - sent_at_)
+                     .count() /
+                 1e6);
+  }
+
+  void run_busy() {
+    if (!poller_.configure()) {
+      std::cout << "SO_BUSY_POLL not accepted, spinning in user space only"
+                << std::endl;
+    }
+    while (sent_ < count_) {
+      send_ping();
+      auto deadline = sent_at_ + milliseconds(PING_TIMEOUT_MS);
+      while (true) {
+        ssize_t len =
+            poller_.receive(&reply_, sizeof(reply_), from_, deadline);
+        if (len < 0) {
+          lost_++;
+          break;
+        }
+        if (answers(len)) {
+          record();
+          break;
+        }
+      }
+    }
+  }
+
+  // Reactor mode: the next ping, or stop the io_context after the last
+  void send_next() {
+    if (sent_ == count_) {
+      waiting_ = false;
+      timer_.cancel();
+      boost::system::error_code ignored;
+      socket_.cancel(ignored);
+      return;
+    }
+    send_ping();
+    waiting_ = true;
+    size_t seq_num = sent_;
+    timer_.expires_after(boost::asio::chrono::milliseconds(PING_TIMEOUT_MS));
+    timer_.async_wait([this, seq_num](const boost::system::error_code &error) {
+      if (error || !waiting_ || seq_num != sent_) {
+        return; // Answered, or the timer was re-armed
+      }
+      lost_++;
+      send_next();
+    });
+  }
+
+  void receive() {
+    socket_.async_receive_from(
+        boost::asio::buffer(&reply_, sizeof(reply_)), from_,
+        [this](const boost::system::error_code &error, size_t len) {
+          if (error == boost::asio::error::operation_aborted) {
+            return;
+          }
+          if (!error && waiting_ && answers(static_cast<ssize_t>(len))) {
+            record();
+            waiting_ = false;
+            timer_.cancel();
+            send_next();
+          }
+          if (waiting_) {
+            receive();
+          }
+        });
+  }
+};
+
+// Result of one loopback benchmark run
+struct BenchResult {
+  uint64_t sent;      // Datagrams handed to the kernel
+  uint64_t received;  // Datagrams delivered to the receiver
+  uint64_t syscalls;  // Send + receive syscalls
+  double seconds;     // Wall-clock time
+  double cpu_seconds; // Process CPU time (both threads)
+  uint64_t send_cycles; // Cycles spent in the sender loop
+  bool offload;         // GSO/GRO actually in use
+};
+
+// Blast packet_count full-size packets over loopback, either one
+// async_send_to/async_receive_from per datagram (the transfer's per-packet
+// path) or through BatchedUdpIO with batch_size datagrams per syscall,
+// optionally with GSO on the sender and GRO on the receiver. With a file
+// image, batched payloads walk through it the way a transfer walks through
+// the file mapping: copied into a window slot behind the header, or
+// gathered from the image by the kernel. With uring the receiver is the
+// server's io_uring engine instead.
+BenchResult run_loopback_blast(size_t packet_count, int batch_size,
+                               bool offload = false,
+                               int payload_size = DEFAULT_PAYLOAD_SIZE,
+                               const std::vector<char> *image = nullptr,
+                               bool gather = false, bool uring = false) {
+  boost::asio::io_context rx_context;
+  boost::asio::io_context tx_context;
+  udp::socket rx(rx_context,
+                 udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+  udp::socket tx(tx_context, udp::endpoint(udp::v4(), 0));
+  rx.set_option(boost::asio::socket_base::receive_buffer_size(4 << 20));
+  tx.set_option(boost::asio::socket_base::send_buffer_size(4 << 20));
+  udp::endpoint target = rx.local_endpoint();
+
+  SrPacket packet;
+  std::memset(&packet, 0x5A, sizeof(packet));
+  packet.type = SR_DATA_PACKET;
+  packet.data_size = static_cast<uint16_t>(payload_size);
+  const size_t packet_size = packet.getTotalSize();
+
+  BenchResult result = {0, 0, 0, 0.0, 0.0, 0, false};
+  std::atomic<bool> sender_done(false);
+
+  // Receiver: count datagrams until the sender is done and the socket has
+  // been idle for one check interval
+  std::unique_ptr<BatchedUdpIO> rx_batch;
+#ifdef HAVE_IO_URING
+  std::unique_ptr<UringUdpIO> rx_uring;
+  if (uring) {
+    rx_uring.reset(new UringUdpIO(rx_context, rx, sizeof(Datagram)));
+  } else
+#else
+  (void)uring;
+#endif
+  if (batch_size > 0) {
+    rx_batch.reset(new BatchedUdpIO(rx, batch_size, sizeof(Datagram)));
+    if (offload) {
+      result.offload = rx_batch->enableGro();
+    }
+  }
+  Datagram rx_buffer;
+  udp::endpoint rx_sender;
+  uint64_t rx_syscalls = 0;
+  std::function<void()> arm_receive;
+  arm_receive = [&]() {
+#ifdef HAVE_IO_URING
+    if (rx_uring) {
+      rx_uring->async_wait_readable([&](const boost::system::error_code &ec) {
+        if (ec)
+          return;
+        size_t count;
+        while ((count = rx_uring->receive()) > 0) {
+          result.received += count;
+        }
+        arm_receive();
+      });
+      return;
+    }
+#endif
+    if (rx_batch) {
+      rx_batch->async_wait_readable([&](const boost::system::error_code &ec) {
+        if (ec)
+          return;
+        size_t count;
+        while ((count = rx_batch->receive()) > 0) {
+          result.received += count;
+          if (!rx_batch->mayHaveMore())
+            break;
+        }
+        arm_receive();
+      });
+    } else {
+      rx.async_receive_from(
+          boost::asio::buffer(&rx_buffer, sizeof(rx_buffer)), rx_sender,
+          [&](const boost::system::error_code &ec, size_t) {
+            if (ec)
+              return;
+            rx_syscalls++;
+            result.received++;
+            arm_receive();
+          });
+    }
+  };
+
+  boost::asio::steady_timer idle_timer(rx_context);
+  uint64_t last_received = 0;
+  std::function<void()> arm_idle_check;
+  arm_idle_check = [&]() {
+    idle_timer.expires_after(boost::asio::chrono::milliseconds(100));
+    idle_timer.async_wait([&](const boost::system::error_code &ec) {
+      if (ec)
+        return;
+      if (sender_done && result.received == last_received) {
+        rx.cancel();
+#ifdef HAVE_IO_URING
+        if (rx_uring) {
+          rx_uring->cancel();
+        }
+#endif
+        return;
+      }
+      last_received = result.received;
+      arm_idle_check();
+    });
+  };
+
+  std::clock_t cpu_start = std::clock();
+  auto start = high_resolution_clock::now();
+
+  arm_receive();
+  arm_idle_check();
+  std::thread receiver([&]() { rx_context.run(); });
+
+  // Sender
+  uint64_t tx_syscalls = 0;
+  uint64_t start_cycles = readCycleCounter();
+  if (batch_size > 0) {
+    BatchedUdpIO tx_batch(tx, batch_size, sizeof(SrAck));
+    if (offload) {
+      result.offload = tx_batch.enableGso() && result.offload;
+    }
+    // Slots are reused every two batches, after their datagrams have left
+    std::vector<char> slots(image ? 2 * batch_size * packet_size : 0);
+    uint64_t offset = 0;
+    for (size_t i = 0; i < packet_count; ++i) {
+      if (!image) {
+        tx_batch.queue(&packet, packet_size, target);
+        continue;
+      }
+      char *slot = &slots[(i % (2 * batch_size)) * packet_size];
+      std::memcpy(slot, &packet, SrPacket::headerSize());
+      const char *payload = image->data() + offset;
+      if (gather) {
+        tx_batch.queue(slot, SrPacket::headerSize(), payload, payload_size,
+                       target);
+      } else {
+        std::memcpy(slot + SrPacket::headerSize(), payload, payload_size);
+        tx_batch.queue(slot, packet_size, target);
+      }
+      offset += payload_size;
+      if (offset + payload_size > image->size()) {
+        offset = 0;
+      }
+    }
+    tx_batch.flush();
+    tx_syscalls = tx_batch.syscalls();
+  } else {
+    size_t remaining = packet_count;
+    std::function<void()> send_next;
+    send_next = [&]() {
+      if (remaining == 0)
+        return;
+      remaining--;
+      tx.async_send_to(boost::asio::buffer(&packet, packet_size), target,
+                       [&](const boost::system::error_code &, size_t) {
+                         tx_syscalls++;
+                         send_next();
+                       });
+    };
+    send_next();
+    tx_context.run();
+  }
+  result.send_cycles = readCycleCounter() - start_cycles;
+  result.sent = packet_count;
+  sender_done = true;
+
+  receiver.join();
+  // The receiver only notices the end after one idle interval
+  result.seconds =
+      duration_cast<microseconds>(high_resolution_clock::now() - start)
+              .count() /
+          1000000.0 -
+      0.1;
+  result.cpu_seconds =
+      static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+  result.syscalls =
+      tx_syscalls + (rx_batch ? rx_batch->syscalls() : rx_syscalls);
+#ifdef HAVE_IO_URING
+  if (rx_uring) {
+    result.syscalls = tx_syscalls + rx_uring->syscalls();
+  }
+#endif
+  return result;
+}
+
+// Compare the per-packet Asio path with batched sendmmsg/recvmmsg and with
+// UDP GSO/GRO offload
+void run_batch_benchmark(size_t packet_count, int batch_size) {
+  std::cout << "Loopback datagram benchmark: " << packet_count << " packets of "
+            << (SrPacket::headerSize() + DEFAULT_PAYLOAD_SIZE) << " bytes"
+            << std::endl;
+#ifndef HAVE_MMSG
+  std::cout << "Note: sendmmsg/recvmmsg not available, batched path falls "
+               "back to one syscall per datagram"
+            << std::endl;
+#endif
+  std::cout << std::left << std::setw(14) << "Path" << std::right
+            << std::setw(12) << "Delivered" << std::setw(10) << "Lost"
+            << std::setw(14) << "Send pps" << std::setw(14) << "Recv pps"
+            << std::setw(12) << "Syscalls" << std::setw(12) << "CPU s/GB"
+            << std::setw(14)
+            << (std::string("Send ") + cycleCounterUnit() + "/B") << std::endl;
+
+  // CPU and cycles are per delivered byte: datagrams the kernel dropped
+  // cost the sender as much but carried nothing. Savings are only claimed
+  // against a baseline that delivered as much.
+  double baseline_cycles_per_byte = 0.0;
+  uint64_t baseline_received = 0;
+  for (int run = 0; run < 4; ++run) {
+    int batch = run == 0 ? 0 : batch_size;
+    if (run == 2) {
+      batch = std::max(batch_size, GSO_MIN_BATCH);
+    }
+    // Last, the batched sender against the server's io_uring receiver
+    BenchResult r;
+    try {
+      r = run_loopback_blast(packet_count, batch, run == 2,
+                             DEFAULT_PAYLOAD_SIZE, nullptr, false, run == 3);
+    } catch (const std::exception &e) {
+      std::cout << std::left << std::setw(14) << "io_uring(n/a)" << e.what()
+                << std::endl;
+      continue;
+    }
+    double gigabytes =
+        r.received * static_cast<double>(DEFAULT_PAYLOAD_SIZE) /
+        (1024.0 * 1024.0 * 1024.0);
+    double delivered_bytes =
+        r.received * static_cast<double>(DEFAULT_PAYLOAD_SIZE);
+    double cycles_per_byte =
+        delivered_bytes > 0 ? r.send_cycles / delivered_bytes : 0.0;
+    if (run == 0) {
+      baseline_cycles_per_byte = cycles_per_byte;
+      baseline_received = r.received;
+    }
+
+    std::string label = run == 0 ? "per-packet"
+                        : run == 1
+                            ? "batched(" + std::to_string(batch) + ")"
+                        : run == 2 ? (r.offload ? "GSO/GRO" : "GSO/GRO(n/a)")
+                                   : "io_uring";
+    std::cout << std::left << std::setw(14) << label << std::right
+              << std::setw(12) << r.received << std::setw(10)
+              << (r.sent - std::min(r.sent, r.received)) << std::setw(14)
+              << std::fixed << std::setprecision(0) << (r.sent / r.seconds)
+              << std::setw(14) << (r.received / r.seconds) << std::setw(12)
+              << r.syscalls << std::setw(12) << std::setprecision(2)
+              << (gigabytes > 0 ? r.cpu_seconds / gigabytes : 0.0)
+              << std::setw(14) << cycles_per_byte;
+    if (run > 0 && baseline_cycles_per_byte > 0 &&
+        r.received != baseline_received) {
+      std::cout << "  (delivered " << std::setprecision(1)
+                << (100.0 * r.received / r.sent) << "%, not compared)";
+    } else if (run > 0 && baseline_cycles_per_byte > 0) {
+      std::cout << "  (" << std::setprecision(0)
+                << (100.0 * (1.0 - cycles_per_byte / baseline_cycles_per_byte))
+                << "% less)";
     }
+    std::cout << std::endl;
   }
-};
-
-// UDP Server implementation
-class UdpServer {
-private:
-  boost::asio::io_context &io_context_;
-  udp::socket socket_;
-  udp::endpoint remote_endpoint_;
-  uint8_t expected_seq_num_;
-  bool is_running_;
-  std::string output_filepath_;
-  bool verbose_;
-  LatencyStats latency_stats_;
-  high_resolution_clock::time_point packet_receive_time_;
-  high_resolution_clock::time_point transfer_start_time_;
+}
 
-  // Buffer for incoming data
-  Packet receive_buffer_;
-  std::vector<char> assembled_data_;
+// Zero-copy sends: batched blasts whose payloads come from a file image
+// larger than the CPU caches, copied into the packet or gathered by the
+// kernel, and what the avoided copy is worth at 10 Gbit/s
+void run_zero_copy_benchmark(size_t packet_count, int batch_size) {
+  const size_t image_size = 64 * 1024 * 1024;
+  const int payload = DEFAULT_PAYLOAD_SIZE;
+  std::vector<char> image(image_size);
+  std::mt19937_64 random(1);
+  for (size_t i = 0; i < image_size; i += sizeof(uint64_t)) {
+    uint64_t word = random();
+    std::memcpy(&image[i], &word, sizeof(word));
+  }
 
-public:
-  UdpServer(boost::asio::io_context &io_context, int port,
-            std::string output_filepath = "", bool verbose = false)
-      : io_context_(io_context),
-        socket_(io_context, udp::endpoint(udp::v4(), port)),
-        expected_seq_num_(0), is_running_(true),
-        output_filepath_(output_filepath), verbose_(verbose) {
+  std::cout << "Payload from a " << image_size / (1024 * 1024)
+            << " MB file image, batches of " << batch_size << ":"
+            << std::endl;
+  std::cout << std::left << std::setw(14) << "Path" << std::right
+            << std::setw(12) << "Delivered" << std::setw(14) << "Recv pps"
+            << std::setw(14)
+            << (std::string("Send ") + cycleCounterUnit() + "/B")
+            << std::setw(16) << "Copied MB/s" << std::endl;
+  for (bool gather : {false, true}) {
+    BenchResult r = run_loopback_blast(packet_count, batch_size, false,
+                                       payload, &image, gather);
+    double copied = gather ? 0.0 : r.sent * static_cast<double>(payload);
+    std::cout << std::left << std::setw(14)
+              << (gather ? "gathered" : "copied") << std::right
+              << std::setw(12) << r.received << std::setw(14) << std::fixed
+              << std::setprecision(0) << (r.received / r.seconds)
+              << std::setw(14) << std::setprecision(2)
+              << (r.send_cycles / (r.sent * static_cast<double>(payload)))
+              << std::setw(16) << std::setprecision(1)
+              << (copied / r.seconds / (1024.0 * 1024.0)) << std::endl;
+  }
 
-    std::cout << "Server started on port " << port << std::endl;
-    if (!output_filepath_.empty()) {
-      std::cout << "Data will be saved to: " << output_filepath_ << std::endl;
+  // The copy on its own: payload-sized pieces out of the image into a
+  // ring of packet slots, as the copied path does per packet
+  std::vector<char> slots(static_cast<size_t>(SR_DEFAULT_RECV_WINDOW) *
+                          payload);
+  size_t copies = image_size / payload;
+  uint64_t touched = 0;
+  auto start = high_resolution_clock::now();
+  for (int pass = 0; pass < 4; ++pass) {
+    for (size_t i = 0; i < copies; ++i) {
+      char *slot = &slots[(i % SR_DEFAULT_RECV_WINDOW) * payload];
+      std::memcpy(slot, &image[i * payload], payload);
+      touched += static_cast<unsigned char>(slot[i % payload]);
     }
-
-    // Initialize latency stats
-    latency_stats_.startTransfer();
-    transfer_start_time_ = high_resolution_clock::now();
   }
+  volatile uint64_t keep = touched; // The copies must not be optimized away
+  (void)keep;
+  double seconds =
+      duration_cast<nanoseconds>(high_resolution_clock::now() - start)
+          .count() /
+      1e9;
+  double copy_rate = 4.0 * copies * payload / seconds;
+  double line_rate = 10e9 / 8; // Payload bytes per second at 10 Gbit/s
+  std::cout << "memcpy of " << payload << "-byte payloads: " << std::fixed
+            << std::setprecision(0) << copy_rate / (1024 * 1024)
+            << " MB/s; at 10 Gbit/s zero-copy sends save "
+            << line_rate / (1024 * 1024) << " MB/s of copying, "
+            << std::setprecision(1) << (100.0 * line_rate / copy_rate)
+            << "% of one core" << std::endl;
+}
 
-  // Start receiving data
-  void start_receive() {
-    std::cout << "Waiting for data..." << std::endl;
-    socket_.async_receive_from(
-        boost::asio::buffer(&receive_buffer_, sizeof(receive_buffer_)),
-        remote_endpoint_,
-        boost::bind(&UdpServer::handle_receive, this,
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
+// Packet size sweep: the same batched loopback blast with the payload
+// sized for common path MTUs, to show what the per-packet header and the
+// per-packet costs take at each size
+void run_payload_benchmark(size_t packet_count, int batch_size) {
+  std::cout << "Loopback payload benchmark: " << packet_count
+            << " packets per size, batches of " << batch_size << std::endl;
+  std::cout << "Header per packet: " << IPV4_UDP_HEADERS << " IPv4/UDP + "
+            << SrPacket::headerSize() << " protocol bytes" << std::endl;
+  std::cout << std::left << std::setw(10) << "Path MTU" << std::right
+            << std::setw(10) << "Payload" << std::setw(10) << "Datagram"
+            << std::setw(11) << "Overhead" << std::setw(14) << "Recv pps"
+            << std::setw(14) << "Goodput MB/s" << std::setw(14)
+            << (std::string("Send ") + cycleCounterUnit() + "/B") << std::endl;
+
+  // The default payload first, then full packets at each MTU
+  std::vector<std::pair<int, int>> sizes = {{0, DEFAULT_PAYLOAD_SIZE}};
+  for (int mtu : {1280, 1500, 4096, 9000}) {
+    sizes.emplace_back(mtu, mtu - IPV4_UDP_HEADERS -
+                                static_cast<int>(SrPacket::headerSize()));
   }
+  for (const std::pair<int, int> &size : sizes) {
+    int payload = size.second;
+    int datagram = IPV4_UDP_HEADERS + SrPacket::headerSize() + payload;
+    BenchResult r = run_loopback_blast(packet_count, batch_size, false,
+                                       payload);
+    std::cout << std::left << std::setw(10)
+              << (size.first ? std::to_string(size.first) : "default")
+              << std::right << std::setw(10) << payload << std::setw(10)
+              << datagram << std::setw(10) << std::fixed
+              << std::setprecision(2)
+              << (100.0 * (datagram - payload) / datagram) << "%"
+              << std::setw(14) << std::setprecision(0)
+              << (r.received / r.seconds) << std::setw(14)
+              << std::setprecision(1)
+              << (r.received * static_cast<double>(payload) / r.seconds /
+                  (1024.0 * 1024.0))
+              << std::setw(14) << std::setprecision(2)
+              << (r.send_cycles / (r.sent * static_cast<double>(payload)))
+              << std::endl;
+  }
+}
 
-  // Get the assembled data
-  const std::vector<char> &getAssembledData() const { return assembled_data_; }
-
-  // Get latency statistics
-  const LatencyStats &getLatencyStats() const { return latency_stats_; }
+// Parse a byte count with an optional K, M or G suffix (powers of 1024)
+uint64_t parseByteSize(const std::string &text) {
+  size_t digits = 0;
+  uint64_t value = std::stoull(text, &digits);
+  std::string suffix = text.substr(digits);
+  if (suffix == "K" || suffix == "k") {
+    value <<= 10;
+  } else if (suffix == "M" || suffix == "m") {
+    value <<= 20;
+  } else if (suffix == "G" || suffix == "g") {
+    value <<= 30;
+  } else if (!suffix.empty()) {
+    throw std::runtime_error("Invalid size: " + text);
+  }
+  return value;
+}
 
-  // Handle received data
-  void handle_receive(const boost::system::error_code &error,
-                      size_t bytes_received) {
-    // Record packet receive time
-    packet_receive_time_ = high_resolution_clock::now();
+// Impairment sweep: every file size through every profile, each transfer
+// on loopback with a NetworkEmulator between a fresh client and server.
+// The emulator decisions come from the seed, so two runs of the same
+// build meet the same impairments and the tables can be compared across
+// builds. A transfer that averages less than BENCH_STALL_RATE is stopped
+// as stalled. On a path that drops nothing and keeps packets in order
+// (jitter under a quarter of the round trip) every resend is needless; a
+// transfer resending more than BENCH_SPURIOUS_PERCENT of its packets there
+// is flagged as spurious. Returns false if any transfer failed, stalled,
+// resent spuriously or arrived corrupted.
+bool run_network_benchmark(const std::vector<uint64_t> &sizes,
+                           const std::vector<NetworkProfile> &profiles,
+                           uint64_t seed, int window_size, int batch_size,
+                           const std::string &congestion_control,
+                           int fec_data, int fec_repair, int payload_size,
+                           int ack_every, int ack_delay_us) {
+  std::cout << "Network emulator benchmark: window " << window_size
+            << ", cc " << congestion_control << ", seed " << seed
+            << ", ACK every " << ack_every << " packets / " << ack_delay_us
+            << " us";
+  if (fec_data > 0) {
+    std::cout << ", FEC " << fec_data << ":" << fec_repair;
+  }
+  std::cout << std::endl;
+  std::cout << std::left << std::setw(10) << "Profile" << std::right
+            << std::setw(10) << "Size" << std::setw(10) << "Time ms"
+            << std::setw(10) << "MB/s" << std::setw(10) << "Resent"
+            << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms"
+            << std::setw(10) << "Dropped" << std::setw(10) << "ACKs"
+            << std::setw(9) << "Result" << std::endl;
+
+  bool all_ok = true;
+  for (uint64_t size : sizes) {
+    // Random contents so compression or delta cannot shortcut anything
+    std::string input = scratchPath("bench", "bench");
+    std::string output = scratchPath("bench", "bench");
+    {
+      std::mt19937_64 random(seed);
+      std::ofstream file(input, std::ios::binary);
+      std::vector<uint64_t> block(8192);
+      for (uint64_t written = 0; written < size;) {
+        for (uint64_t &word : block) {
+          word = random();
+        }
+        size_t bytes = static_cast<size_t>(
+            std::min<uint64_t>(size - written, block.size() * 8));
+        file.write(reinterpret_cast<const char *>(block.data()), bytes);
+        written += bytes;
+      }
+    }
 
-    // Measure processing time for this packet
-    high_resolution_clock::time_point process_start_time =
-        high_resolution_clock::now();
-    double processing_time_ms = 0.0;
+    for (const NetworkProfile &profile : profiles) {
+      SessionLimits limits(DEFAULT_MAX_SESSIONS, DEFAULT_SESSION_MEMORY,
+                           DEFAULT_IDLE_TIMEOUT_S);
+      TransferGroups groups;
+      boost::asio::io_context server_context;
+      UdpServer server(server_context, 0, limits, groups, output, false,
+                       SR_DEFAULT_RECV_WINDOW, SyncPolicy::NONE, 0, 0,
+                       false, false, nullptr, MAX_PAYLOAD_SIZE, false,
+                       ack_every, ack_delay_us);
+      server.start_receive();
+      boost::asio::io_context emulator_context;
+      NetworkEmulator emulator(
+          emulator_context, 0,
+          udp::endpoint(boost::asio::ip::address_v4::loopback(),
+                        server.port()),
+          profile, seed);
+
+      // The transfers report as they go; keep the table readable
+      std::ostringstream discarded;
+      std::streambuf *saved = std::cout.rdbuf(discarded.rdbuf());
+      std::thread server_thread([&]() { server_context.run(); });
+      std::thread emulator_thread([&]() { emulator_context.run(); });
+
+      bool completed = false;
+      bool stalled = false;
+      LatencyStats stats;
+      try {
+        int payload = DEFAULT_PAYLOAD_SIZE;
+        if (payload_size > 0) {
+          payload = negotiatePayload("127.0.0.1", emulator.port(),
+                                     payload_size)
+                        .payload_size;
+        }
+        FileSource source(input);
+        boost::asio::io_context client_context;
+        UdpClient client(client_context, "127.0.0.1", emulator.port(),
+                         false, window_size, batch_size, false,
+                         congestion_control, ChecksumAlgorithm::CRC32C,
+                         fec_data, fec_repair, payload);
+        client.send_file(source);
+        client_context.run_for(
+            seconds(BENCH_STALL_GRACE_S + size / BENCH_STALL_RATE));
+        stalled = !client_context.stopped();
+        completed = !stalled && !client.transferFailed();
+        stats = client.getLatencyStats();
+      } catch (const std::exception &e) {
+        std::cerr << "Error: " << profile.name << ": " << e.what() << "\n";
+      }
 
-    if (!error) {
-      if (verbose_) {
-        debugPacket(receive_buffer_, "Received packet");
+      boost::asio::post(server_context, [&]() { server.stop(); });
+      boost::asio::post(emulator_context, [&]() { emulator.stop(); });
+      server_thread.join();
+      emulator_thread.join();
+      bool intact = completed && readFileContents(input) ==
+                                     readFileContents(output);
+      std::cout.rdbuf(saved);
+
+      const NetworkEmulator::Counters &counters = emulator.counters();
+      uint64_t dropped = counters.lost + counters.queue_drops;
+      bool in_order = profile.reorder == 0.0 &&
+                      profile.jitter_ms * 2.0 <= profile.delay_ms;
+      bool spurious = intact && in_order && dropped == 0 &&
+                      stats.retransmitted * 100.0 >
+                          BENCH_SPURIOUS_PERCENT *
+                              stats.packet_latencies.count();
+      all_ok = all_ok && intact && !spurious;
+      std::cout << std::left << std::setw(10) << profile.name << std::right
+                << std::setw(10) << size << std::fixed;
+      if (stalled) {
+        // Never finished, so there is no transfer time to report
+        std::cout << std::setw(10) << "-" << std::setw(10) << "-";
       } else {
-        std::cout << "Received packet with seq_num: "
-                  << (int)receive_buffer_.seq_num
-                  << ", size: " << receive_buffer_.data_size << " bytes"
-                  << std::endl;
+        std::cout << std::setw(10) << std::setprecision(0)
+                  << stats.getTotalTransferTime() << std::setw(10)
+                  << std::setprecision(2)
+                  << stats.getThroughput() / (1024.0 * 1024.0);
       }
+      std::cout << std::setw(10) << stats.retransmitted << std::setw(10)
+                << std::setprecision(3) << stats.getPercentileLatency(50)
+                << std::setw(10) << stats.getPercentileLatency(99)
+                << std::setw(10) << dropped << std::setw(10)
+                << stats.ack_packets << std::setw(9)
+                << (stalled      ? "STALLED"
+                    : !completed ? "FAILED"
+                    : !intact    ? "CORRUPT"
+                    : spurious   ? "SPURIOUS"
+                                 : "ok")
+                << std::endl;
+    }
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+  }
+  return all_ok;
+}
 
-      // Verify CRC
-      uint32_t received_crc =
-          ntohl32(receive_buffer_.crc); // Convert from network byte order
-      uint32_t calculated_crc =
-          calculateCRC(receive_buffer_.data, receive_buffer_.data_size);
-      bool crc_valid = (calculated_crc == received_crc);
-
-      if (!crc_valid) {
-        std::cout << "CRC mismatch: expected=" << received_crc
-                  << ", calculated=" << calculated_crc << std::endl;
-
-        // Debug information to diagnose CRC issue
-        if (verbose_) {
-          std::cout << "Data for CRC calculation:" << std::endl;
-          for (size_t i = 0; i < receive_buffer_.data_size; ++i) {
-            if (i % 16 == 0)
-              std::cout << std::endl
-                        << std::hex << std::setw(4) << std::setfill('0') << i
-                        << ": ";
-            std::cout << std::hex << std::setw(2) << std::setfill('0')
-                      << static_cast<int>(static_cast<unsigned char>(
-                             receive_buffer_.data[i]))
-                      << " ";
-          }
-          std::cout << std::dec << std::endl;
-        }
+// Multicast sweep: one sender and N receivers in this process on a
+// loopback multicast group, each receiver dropping its own random share of
+// the data and repair packets. The sender's bytes should stay flat as N
+// grows, as repairs follow the loss rather than the receiver count.
+// Returns false if any receiver's copy is incomplete or corrupted.
+bool run_multicast_benchmark(uint64_t size, const std::vector<int> &counts,
+                             double loss, uint64_t seed, double rate_mbit,
+                             int fec_data, int fec_repair) {
+  const std::string group = "239.255.77.77";
+  const std::string iface = "127.0.0.1";
+  std::cout << "Multicast benchmark: " << size << " bytes to " << group
+            << " at " << std::fixed << std::setprecision(1) << rate_mbit
+            << " Mbit/s, " << std::setprecision(2) << loss * 100.0
+            << "% loss per receiver, FEC " << fec_data << ":" << fec_repair
+            << ", seed " << seed << std::endl;
+  std::cout << std::right << std::setw(10) << "Receivers" << std::setw(10)
+            << "Time ms" << std::setw(10) << "Mbit/s" << std::setw(10)
+            << "Repairs" << std::setw(10) << "Resent" << std::setw(11)
+            << "Overhead" << std::setw(8) << "NACKs" << std::setw(12)
+            << "Suppressed" << std::setw(9) << "Result" << std::endl;
+
+  std::string input = scratchPath("bench", "bench");
+  {
+    std::mt19937_64 random(seed);
+    std::ofstream file(input, std::ios::binary);
+    std::vector<uint64_t> block(8192);
+    for (uint64_t written = 0; written < size;) {
+      for (uint64_t &word : block) {
+        word = random();
       }
+      size_t bytes = static_cast<size_t>(
+          std::min<uint64_t>(size - written, block.size() * 8));
+      file.write(reinterpret_cast<const char *>(block.data()), bytes);
+      written += bytes;
+    }
+  }
+  std::vector<char> original = readFileContents(input);
+
+  bool all_ok = true;
+  for (int count : counts) {
+    // A free port for the group, shared by the sender and every receiver
+    unsigned short port;
+    {
+      boost::asio::io_context probe_context;
+      udp::socket probe(probe_context, udp::endpoint(udp::v4(), 0));
+      port = probe.local_endpoint().port();
+    }
 
-      // Check if this is the packet we're expecting
-      if (receive_buffer_.seq_num == expected_seq_num_ && crc_valid) {
-        // Process the received data
-        if (receive_buffer_.data_size > 0 &&
-            receive_buffer_.data_size <= MAX_BUFFER_SIZE) {
-          // Copy received data to our assembled buffer
-          assembled_data_.insert(assembled_data_.end(), receive_buffer_.data,
-                                 receive_buffer_.data +
-                                     receive_buffer_.data_size);
-
-          std::cout << "Added " << receive_buffer_.data_size
-                    << " bytes to assembled data (total: "
-                    << assembled_data_.size() << " bytes)" << std::endl;
+    std::ostringstream discarded;
+    std::streambuf *saved = std::cout.rdbuf(discarded.rdbuf());
+
+    // Limits of their own, so each receiver's first session writes its
+    // output file rather than a numbered sibling
+    std::vector<std::unique_ptr<SessionLimits>> limits;
+    TransferGroups groups;
+    std::vector<std::string> outputs;
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    std::vector<std::unique_ptr<UdpServer>> receivers;
+    std::vector<std::thread> threads;
+    LatencyStats sender_stats;
+    LatencyStats receiver_stats;
+    bool completed = false;
+    try {
+      for (int i = 0; i < count; ++i) {
+        outputs.push_back(scratchPath("bench", "bench"));
+        limits.emplace_back(new SessionLimits(DEFAULT_MAX_SESSIONS,
+                                              DEFAULT_SESSION_MEMORY,
+                                              DEFAULT_IDLE_TIMEOUT_S));
+        contexts.emplace_back(new boost::asio::io_context());
+        receivers.emplace_back(new UdpServer(
+            *contexts.back(), port, *limits.back(), groups, outputs.back(),
+            false,
+            MCAST_RECV_WINDOW, SyncPolicy::NONE, 0, 0, false, false,
+            nullptr, MAX_PAYLOAD_SIZE, false, DEFAULT_ACK_EVERY,
+            DEFAULT_ACK_DELAY_US, group, iface));
+        receivers.back()->setReceiveLoss(loss, seed + i);
+        receivers.back()->start_receive();
+      }
+      for (auto &context : contexts) {
+        boost::asio::io_context *raw = context.get();
+        threads.emplace_back([raw]() { raw->run(); });
+      }
 
-          // Flip expected sequence number for next packet (0->1, 1->0)
-          expected_seq_num_ = 1 - expected_seq_num_;
-        }
+      FileSource source(input);
+      boost::asio::io_context sender_context;
+      MulticastSender sender(sender_context, group, port, iface,
+                             MCAST_DEFAULT_TTL, rate_mbit,
+                             DEFAULT_PAYLOAD_SIZE, ChecksumAlgorithm::CRC32C,
+                             fec_data, fec_repair);
+      sender.send_file(source);
+      sender_context.run();
+      sender_stats = sender.getLatencyStats();
+      completed = true;
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << count << " receivers: " << e.what() << "\n";
+    }
 
-        // Check if this was the last packet
-        if (receive_buffer_.is_last) {
-          std::cout << "Last packet received, data reception complete."
-                    << std::endl;
+    for (size_t i = 0; i < receivers.size(); ++i) {
+      UdpServer *receiver = receivers[i].get();
+      boost::asio::post(*contexts[i], [receiver]() { receiver->stop(); });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    bool intact = completed;
+    for (size_t i = 0; i < receivers.size(); ++i) {
+      receiver_stats.merge(receivers[i]->getLatencyStats());
+      intact = intact && readFileContents(outputs[i]) == original;
+      std::remove(outputs[i].c_str());
+    }
+    std::cout.rdbuf(saved);
+
+    all_ok = all_ok && intact;
+    std::cout << std::setw(10) << count << std::setw(10) << std::fixed
+              << std::setprecision(0) << sender_stats.getTotalTransferTime()
+              << std::setw(10) << std::setprecision(1)
+              << sender_stats.getThroughput() * 8 / 1000000.0
+              << std::setw(10) << sender_stats.fec_repairs_sent
+              << std::setw(10) << sender_stats.retransmitted << std::setw(10)
+              << std::setprecision(2)
+              << (size > 0
+                      ? 100.0 * sender_stats.wire_bytes / size - 100.0
+                      : 0.0)
+              << "%" << std::setw(8) << sender_stats.nack_packets
+              << std::setw(12) << receiver_stats.nacks_suppressed
+              << std::setw(9) << (intact ? "ok" : "CORRUPT") << std::endl;
+  }
+  std::remove(input.c_str());
+  return all_ok;
+}
 
-          // Record end time and stats
-          latency_stats_.endTransfer(assembled_data_.size());
+// Simple help message
+// Checksum microbenchmark: GB/s of every implementation on 1 KB (one
+// packet) and 64 KB payloads, after checking that all implementations of
+// an algorithm agree. Returns false on a mismatch.
+bool run_checksum_benchmark() {
+  const std::vector<ChecksumImplementation> &implementations =
+      checksumImplementations();
+
+  // Random data that stays cache-resident, as a payload does right after
+  // it is received or read
+  std::vector<char> buffer(4 * 1024 * 1024);
+  std::mt19937 random(12345);
+  for (char &c : buffer) {
+    c = static_cast<char>(random());
+  }
 
-          // Save to file if output path was specified
-          if (!output_filepath_.empty()) {
-            saveToFile(assembled_data_, output_filepath_);
-          }
+  // Known answers for "123456789", then cross-check odd lengths/offsets
+  const char *check = "123456789";
+  bool ok = crc32Slicing(check, 9) == 0xCBF43926 &&
+            crc32cSlicing(check, 9) == 0xE3069283 &&
+            crc32Boost(check, 9) == 0xCBF43926;
+  for (const ChecksumImplementation &impl : implementations) {
+    if (!impl.supported) {
+      continue;
+    }
+    const ChecksumImplementation &reference =
+        implementations[impl.algorithm == ChecksumAlgorithm::CRC32    ? 1
+                        : impl.algorithm == ChecksumAlgorithm::CRC32C ? 2
+                                                                      : 3];
+    for (size_t length : {0, 1, 7, 15, 16, 63, 64, 65, 127, 1000, 1024,
+                          4099, 65536 + 13}) {
+      for (size_t offset : {0, 1, 5}) {
+        const char *data = buffer.data() + offset;
+        if (impl.function(data, length) != reference.function(data, length)) {
+          std::cerr << "Checksum mismatch: " << impl.name << " at length "
+                    << length << std::endl;
+          ok = false;
         }
-      } else if (receive_buffer_.seq_num != expected_seq_num_) {
-        std::cout
-            << "Received duplicate or out-of-order packet, expected seq_num: "
-            << (int)expected_seq_num_ << std::endl;
-      } else if (!crc_valid) {
-        std::cout << "Packet with valid sequence number but invalid CRC, "
-                     "requesting retransmission"
-                  << std::endl;
       }
+    }
+  }
+  if (!ok) {
+    return false;
+  }
 
-      // Calculate processing time
-      processing_time_ms =
-          duration_cast<microseconds>(high_resolution_clock::now() -
-                                      process_start_time)
-              .count() /
-          1000.0;
+  std::cout << "Checksum throughput (GB/s), all implementations verified"
+            << std::endl;
+  std::cout << std::left << std::setw(26) << "Implementation" << std::right
+            << std::setw(10) << "1 KB" << std::setw(10) << "64 KB"
+            << "  In use" << std::endl;
+  for (const ChecksumImplementation &impl : implementations) {
+    std::cout << std::left << std::setw(26) << impl.name << std::right;
+    if (!impl.supported) {
+      std::cout << "  not supported on this CPU" << std::endl;
+      continue;
+    }
+    for (size_t payload : {static_cast<size_t>(DEFAULT_PAYLOAD_SIZE),
+                           static_cast<size_t>(64 * 1024)}) {
+      // Walk the buffer so each call sees fresh (cache-resident) data;
+      // run for at least 200 ms
+      volatile uint32_t sink = 0;
+      uint64_t bytes = 0;
+      auto start = steady_clock::now();
+      double seconds = 0.0;
+      size_t offset = 0;
+      do {
+        for (int i = 0; i < 64; ++i) {
+          if (offset + payload > buffer.size()) {
+            offset = 0;
+          }
+          sink = sink ^ impl.function(buffer.data() + offset, payload);
+          offset += payload;
+          bytes += payload;
+        }
+        seconds =
+            duration_cast<microseconds>(steady_clock::now() - start).count() /
+            1000000.0;
+      } while (seconds < 0.2);
+      std::cout << std::setw(10) << std::fixed << std::setprecision(2)
+                << (bytes / seconds / 1e9);
+    }
+    if (&checksumImplementation(impl.algorithm) == &impl) {
+      std::cout << "  *";
+    }
+    std::cout << std::endl;
+  }
+  return true;
+}
 
-      // Send ACK regardless (handles case where ACK was lost)
-      send_ack(receive_buffer_.seq_num);
+// Retransmission timer microbenchmark: for each count of outstanding
+// packets, the cost of arming and cancelling a timer and of one tick with
+// the timer wheel, against scanning the whole window every tick and one
+// Asio steady_timer per packet. Deadlines are spread over 2000 ticks (RTOs
+// of 1 ms to 2 s) and nine in ten are cancelled, as ACKs would. Returns
+// false if the wheel fires a timer at the wrong tick or loses one.
+bool run_timer_benchmark(const std::vector<size_t> &counts) {
+  const uint64_t horizon = 2000;
+  auto nanos = [](steady_clock::time_point start) {
+    return static_cast<double>(
+        duration_cast<nanoseconds>(steady_clock::now() - start).count());
+  };
+
+  std::cout << "Retransmission timers: cost per timer (ns) and per tick (us)"
+            << std::endl;
+  std::cout << std::setw(10) << "Timers" << std::setw(13) << "Wheel arm"
+            << std::setw(13) << "Wheel cancel" << std::setw(12) << "Wheel tick"
+            << std::setw(12) << "Fired/tick" << std::setw(12) << "Scan tick"
+            << std::setw(12) << "Asio arm" << std::setw(13) << "Asio cancel"
+            << std::endl;
 
-      // Record processing latency (time from packet receipt to sending ACK)
-      latency_stats_.addLatency(processing_time_ms, false);
+  bool ok = true;
+  for (size_t count : counts) {
+    std::mt19937 random(12345);
+    std::uniform_int_distribution<uint64_t> deadline(1, horizon);
+    std::vector<uint64_t> deadlines(count);
+    std::vector<char> cancelled(count);
+    for (size_t i = 0; i < count; ++i) {
+      deadlines[i] = deadline(random);
+      cancelled[i] = random() % 10 != 0;
+    }
 
-      if (verbose_) {
-        std::cout << "Packet processing time: " << std::fixed
-                  << std::setprecision(2) << processing_time_ms << " ms"
-                  << std::endl;
+    // Timer wheel
+    std::vector<TimerWheel::Node> nodes(count);
+    std::unique_ptr<TimerWheel> wheel(new TimerWheel());
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      nodes[i].key = static_cast<uint32_t>(i);
+      wheel->schedule(nodes[i], deadlines[i]);
+    }
+    double wheel_arm = nanos(start) / count;
+    size_t live = 0;
+    start = steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      if (cancelled[i]) {
+        wheel->cancel(nodes[i]);
+      } else {
+        live++;
       }
+    }
+    double wheel_cancel = nanos(start) / count;
+    size_t fired = 0;
+    start = steady_clock::now();
+    for (uint64_t tick = 1; tick <= horizon; ++tick) {
+      fired += wheel->advance(tick, [&](TimerWheel::Node &node) {
+        if (node.expires != tick || cancelled[node.key]) {
+          ok = false;
+        }
+      });
+    }
+    double wheel_tick = nanos(start) / horizon / 1000.0;
+    if (fired != live || wheel->size() != 0) {
+      ok = false;
+    }
 
-      // If we're still running, listen for the next packet
-      if (is_running_) {
-        start_receive();
+    // Linear scan of the window, as one tick of the old sender did
+    volatile size_t due = 0;
+    const int scans = 20;
+    start = steady_clock::now();
+    for (int scan = 0; scan < scans; ++scan) {
+      size_t found = 0;
+      uint64_t now = horizon / 2 + scan;
+      for (size_t i = 0; i < count; ++i) {
+        if (!cancelled[i] && deadlines[i] <= now) {
+          found++;
+        }
       }
-    } else {
-      std::cerr << "Receive error: " << error.message() << std::endl;
-      if (is_running_) {
-        start_receive(); // Try again
+      due = due + found;
+    }
+    double scan_tick = nanos(start) / scans / 1000.0;
+
+    // One Asio timer per packet; cancelled ones complete with an error
+    boost::asio::io_context io_context;
+    std::vector<std::unique_ptr<boost::asio::steady_timer>> timers(count);
+    for (auto &timer : timers) {
+      timer.reset(new boost::asio::steady_timer(io_context));
+    }
+    start = steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      timers[i]->expires_after(
+          boost::asio::chrono::milliseconds(deadlines[i]));
+      timers[i]->async_wait([](const boost::system::error_code &) {});
+    }
+    double asio_arm = nanos(start) / count;
+    start = steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      if (cancelled[i]) {
+        timers[i]->cancel();
       }
     }
+    double asio_cancel = nanos(start) / std::max<size_t>(1, count - live);
+    for (auto &timer : timers) {
+      timer->cancel();
+    }
+    io_context.run();
+
+    std::cout << std::setw(10) << count << std::fixed << std::setprecision(1)
+              << std::setw(13) << wheel_arm << std::setw(13) << wheel_cancel
+              << std::setprecision(2) << std::setw(12) << wheel_tick
+              << std::setprecision(1) << std::setw(12)
+              << static_cast<double>(fired) / horizon << std::setprecision(2)
+              << std::setw(12) << scan_tick << std::setprecision(1)
+              << std::setw(12) << asio_arm << std::setw(13) << asio_cancel
+              << std::endl;
   }
+  if (!ok) {
+    std::cerr << "Timer wheel fired a timer at the wrong tick" << std::endl;
+  }
+  return ok;
+}
 
-  // Send acknowledgment
-  void send_ack(uint8_t seq_num) {
-    uint8_t ack = ACK_PACKET;
-
-    socket_.async_send_to(
-        boost::asio::buffer(&ack, sizeof(ack)), remote_endpoint_,
-        [seq_num, this](const boost::system::error_code &error,
-                        std::size_t bytes_sent) {
-          if (!error) {
-            if (verbose_) {
-              std::cout << "ACK sent for seq_num: " << (int)seq_num
-                        << std::endl;
-            }
-          } else {
-            std::cerr << "Failed to send ACK: " << error.message() << std::endl;
-          }
-        });
+// Ping-pong microbenchmark: round trips of size-byte messages over
+// loopback against an EchoResponder, first with the Asio reactor on both
+// ends, then busy polling on both ends. With cpu not -1 the responder runs
+// on that CPU and the client on the next. Returns false if a mode got no
+// replies at all.
+bool run_pingpong_benchmark(size_t count, size_t size, int cpu) {
+  std::cout << "Ping-pong over loopback: " << count << " round trips of "
+            << size << "-byte messages";
+  if (cpu >= 0) {
+    std::cout << ", responder on CPU " << cpu << ", client on CPU "
+              << cpu + 1;
   }
+  std::cout << std::endl;
+  std::cout << std::left << std::setw(10) << "Mode" << std::right
+            << std::setw(10) << "p50 us" << std::setw(10) << "p90 us"
+            << std::setw(10) << "p99 us" << std::setw(11) << "p99.9 us"
+            << std::setw(10) << "max us" << std::setw(12) << "Round/s"
+            << std::setw(7) << "Lost" << std::setw(8) << "Sleeps"
+            << std::endl;
 
-  // Stop the server
-  void stop() {
-    // Record end time if not already done
-    if (duration_cast<milliseconds>(latency_stats_.end_time -
-                                    latency_stats_.start_time)
-            .count() == 0) {
-      latency_stats_.endTransfer(assembled_data_.size());
+  bool ok = true;
+  for (bool busy_poll : {false, true}) {
+    boost::asio::io_context server_context;
+    EchoResponder responder(server_context, 0, busy_poll, cpu);
+    responder.start();
+    std::thread server_thread;
+    if (!busy_poll) {
+      server_thread = std::thread([&]() {
+        if (cpu >= 0) {
+          pinThread(cpu);
+        }
+        server_context.run();
+      });
     }
 
-    is_running_ = false;
-    socket_.cancel();
+    boost::asio::io_context client_context;
+    PingClient client(
+        client_context,
+        udp::endpoint(boost::asio::ip::address_v4::loopback(),
+                      responder.port()),
+        size, busy_poll, cpu >= 0 ? cpu + 1 : -1);
+    LatencyHistogram rtts;
+    double seconds = 0.0;
+    std::thread client_thread([&]() {
+      auto start = steady_clock::now();
+      rtts = client.run(count);
+      seconds = duration_cast<microseconds>(steady_clock::now() - start)
+                    .count() /
+                1e6;
+    });
+    client_thread.join();
+
+    if (busy_poll) {
+      responder.stop();
+    } else {
+      boost::asio::post(server_context, [&responder]() { responder.stop(); });
+      server_thread.join();
+    }
+
+    std::cout << std::left << std::setw(10)
+              << (busy_poll ? "busy-poll" : "reactor") << std::right
+              << std::fixed << std::setprecision(1) << std::setw(10)
+              << rtts.percentile(50) * 1000 << std::setw(10)
+              << rtts.percentile(90) * 1000 << std::setw(10)
+              << rtts.percentile(99) * 1000 << std::setw(11)
+              << rtts.percentile(99.9) * 1000 << std::setw(10)
+              << rtts.max() * 1000 << std::setprecision(0) << std::setw(12)
+              << (seconds > 0.0 ? rtts.count() / seconds : 0.0)
+              << std::setw(7) << client.lost() << std::setw(8)
+              << client.poller().sleeps() + responder.poller().sleeps()
+              << std::endl;
+    ok = ok && !rtts.empty();
   }
-};
+  return ok;
+}
 
-// Simple help message
 void print_help(const char *program_name) {
   std::cout << "UDP Stop-and-Wait File Transfer with CRC Verification and "
                "Latency Measurement\n";
   std::cout << "Usage:\n";
   std::cout << "  Client mode: " << program_name
             << " --client <server_ip> <port> <filename> [options]\n";
+  std::cout << "  Directory mode: " << program_name
+            << " --client <server_ip> <port> <directory> --window N "
+               "[options]\n";
   std::cout << "  Server mode: " << program_name
-            << " --server <port> [output_file] [options]\n";
+            << " --server <port> [output_file|output_dir/] [options]\n";
+  std::cout << "  Multicast sender: " << program_name
+            << " --multicast <group> <port> <filename> [options]\n";
+  std::cout << "  Echo responder: " << program_name
+            << " --echo <port> [--busy-poll] [--cpu N]\n";
+  std::cout << "  Ping client: " << program_name
+            << " --ping <server_ip> <port> [count] [size] [--busy-poll] "
+               "[--cpu N]\n";
   std::cout << "  Verification mode: " << program_name
             << " --verify <original_file> <received_file>\n";
+  std::cout << "  Batch benchmark: " << program_name
+            << " --bench-batch [packets] [batch_size]\n";
+  std::cout << "  Payload benchmark: " << program_name
+            << " --bench-payload [packets] [batch_size]\n";
+  std::cout << "  Checksum benchmark: " << program_name
+            << " --bench-checksum\n";
+  std::cout << "  Timer benchmark: " << program_name
+            << " --bench-timers [counts]\n";
+  std::cout << "  Ping-pong benchmark: " << program_name
+            << " --bench-pingpong [count] [size] [--cpu N]\n";
+  std::cout << "  Network benchmark: " << program_name
+            << " --bench-net [sizes] [profiles] [options]\n";
+  std::cout << "  Multicast benchmark: " << program_name
+            << " --bench-mcast [size] [receivers] [options]\n";
+  std::cout << "  Network emulator: " << program_name
+            << " --emulate <listen_port> <server_ip> <server_port> "
+               "[options]\n";
+  std::cout << "Directory mode:\n";
+  std::cout << "  Files up to " << TREE_LARGE_FILE / 1024
+            << " KB go packed with the tree's index, larger ones as "
+               "transfers\n"
+               "  of their own. The server unpacks under its output "
+               "directory, which a\n"
+               "  trailing / creates if missing. Links, other special files "
+               "and names\n"
+               "  the receiver would refuse are skipped, each one listed.\n";
   std::cout << "Options:\n";
   std::cout
       << "  -v, --verbose    Enable verbose output with detailed debugging\n";
+  std::cout << "  -w, --window N   Selective-repeat mode with N packets in "
+               "flight\n"
+               "                   (client); receive window size (server, "
+               "default "
+            << SR_DEFAULT_RECV_WINDOW << ")\n";
+  std::cout << "  -b, --batch N    Batch up to N datagrams per "
+               "sendmmsg/recvmmsg call\n"
+               "                   (client needs --window)\n";
+  std::cout << "  --gso           UDP segmentation offload (client) / receive "
+               "offload (server)\n"
+               "                   on Linux, falls back to batching when "
+               "unsupported\n";
+  std::cout << "  --io-uring       Server: io_uring engine (multishot receive "
+               "into provided\n"
+               "                   buffers, batched ACK submissions, payload "
+               "writes from\n"
+               "                   the receive buffers); falls back to Asio "
+               "when unavailable\n";
+  std::cout << "  --disk-thread    Server: write payloads on a thread of "
+               "their own, fed through\n"
+               "                   a ring of "
+            << DISK_RING_SLOTS
+            << " preallocated buffers; a full ring shrinks the\n"
+               "                   advertised window (Asio paths)\n";
+  std::cout << "  --timestamps     Client: kernel send/receive timestamps "
+               "(SO_TIMESTAMPING) to\n"
+               "                   report the wire RTT apart from user-space "
+               "overhead (needs\n"
+               "                   --window; turns GSO off)\n";
+  std::cout << "  --busy-poll      Echo/ping: spin on the socket "
+               "(non-blocking recvfrom,\n"
+               "                   SO_BUSY_POLL) instead of waiting in the "
+               "reactor; sleeps after\n"
+               "                   "
+            << BUSY_SPIN_IDLE_US << " us without traffic\n";
+  std::cout << "  --cpu N          Echo/ping: pin the socket's thread to CPU N "
+               "(the ping-pong\n"
+               "                   benchmark's client goes on N+1)\n";
+  std::cout << "  --ack-every N    Server: one ACK per N in-order packets "
+               "(default "
+            << DEFAULT_ACK_EVERY << ", max " << SR_SACK_BITS
+            << ");\n"
+               "                   gaps and duplicates are ACKed at once\n";
+  std::cout << "  --ack-delay US   Server: longest an ACK is held back "
+               "(default "
+            << DEFAULT_ACK_DELAY_US << " us)\n";
+  std::cout << "  --sync MODE      Server durability: complete (fsync at end, "
+               "default),\n"
+               "                   periodic[:MB] (fdatasync every MB, default "
+            << DEFAULT_SYNC_INTERVAL / (1024 * 1024) << ") or none\n";
+  std::cout << "  --checksum ALGO  Payload checksum for --window: crc32, "
+               "crc32c (default)\n"
+               "                   or xxh64; the server follows the sender\n";
+  std::cout << "  --streams N      Client: split the file over N parallel "
+               "flows (needs --window)\n";
+  std::cout << "  --threads N      Server: N sockets on the port "
+               "(SO_REUSEPORT), one thread each\n";
+  std::cout << "  --max-sessions N Server: concurrent transfers allowed "
+               "(default "
+            << DEFAULT_MAX_SESSIONS << ")\n";
+  std::cout << "  --session-memory MB  Server: budget for per-session state "
+               "(default "
+            << DEFAULT_SESSION_MEMORY / (1024 * 1024) << ")\n";
+  std::cout << "  --idle-timeout S Server: close sessions idle for S seconds "
+               "(default "
+            << DEFAULT_IDLE_TIMEOUT_S << ", min " << MIN_IDLE_TIMEOUT_S
+            << ")\n";
+  std::cout << "  --cc ALGO        Congestion control for --window: none "
+               "(fixed window,\n"
+               "                   default), aimd or bbr (paced)\n";
+  std::cout << "  --resume         Client: resumable transfer (needs "
+               "--window); the server\n"
+               "                   keeps a journal next to the output file "
+               "and a rerun\n"
+               "                   sends only the chunks it is missing\n";
+  std::cout << "  --delta          Client: send only what changed against the "
+               "server's copy\n"
+               "                   (rsync-style, needs --window); the server "
+               "keeps one copy\n"
+               "                   per file name\n";
+  std::cout << "  --compress N     Client: compress the file in "
+            << COMPRESS_BLOCK / 1024
+            << " KB blocks on N threads (zlib,\n"
+               "                   needs --window, one stream); server: N "
+               "decompression\n"
+               "                   threads. 0 = one per core (server "
+               "default)\n";
+  std::cout << "  --payload N|auto Client: data bytes per packet (default "
+            << DEFAULT_PAYLOAD_SIZE
+            << "), settled\n"
+               "                   with the server by path MTU probing; "
+               "auto = the largest\n"
+               "                   the path carries. Server: largest "
+               "payload accepted\n"
+               "                   (default "
+            << MAX_PAYLOAD_SIZE << ")\n";
+  std::cout << "  --fec N:K        Client: K repair packets per N data "
+               "packets (needs --window);\n"
+               "                   K = 1 is XOR parity, larger K Reed-Solomon "
+               "(N <= "
+            << FEC_MAX_DATA << ", K <= " << FEC_MAX_REPAIR << ")\n";
+  std::cout << "  --join GROUP     Server: receive multicast transfers "
+               "sent to GROUP on the\n"
+               "                   port, NACKing losses to the group "
+               "(receive window\n"
+               "                   default "
+            << MCAST_RECV_WINDOW << ")\n";
+  std::cout << "  --iface ADDR     Multicast: join and send on the interface "
+               "with address ADDR\n";
+  std::cout << "  --rate MBIT      Multicast sender: data and repairs in "
+               "Mbit/s (default "
+            << MCAST_DEFAULT_RATE_MBIT << ");\n"
+               "                   --fec sets the repair code (default "
+            << MCAST_DEFAULT_FEC_DATA << ":" << MCAST_DEFAULT_FEC_REPAIR
+            << ")\n";
+  std::cout << "  --ttl N          Multicast sender: hop limit (default "
+            << MCAST_DEFAULT_TTL << ")\n";
+  std::cout << "  --stats-json FILE Write the statistics (latency "
+               "percentiles and histogram)\n"
+               "                   as JSON when the transfer ends\n";
+  std::cout << "  --netem SPEC     Impairment for --emulate, added to the "
+               "--bench-net sweep:\n"
+               "                   a profile (clean, lossy, burst, wan, "
+               "reorder, dup,\n"
+               "                   capped, mixed) or key=value list: loss=%, "
+               "burst=IN:OUT:LOSS\n"
+               "                   (Gilbert-Elliott %), delay=ms, jitter=ms, "
+               "reorder=%,\n"
+               "                   reorder_ms=ms, duplicate=%, rate=Mbit/s, "
+               "queue=KB\n";
+  std::cout << "  --seed N         Emulator random seed (default 1); the "
+               "same seed gives the\n"
+               "                   same impairments for the same packets\n";
   std::cout << "  -h, --help       Display this help message\n";
   std::cout << "Examples:\n";
   std::cout << "  " << program_name << " --client 127.0.0.1 8080 myfile.txt\n";
+  std::cout << "  " << program_name
+            << " --client 127.0.0.1 8080 myfile.txt --window 64\n";
+  std::cout << "  " << program_name
+            << " --client 127.0.0.1 8080 myfile.txt --window 512 --cc bbr\n";
+  std::cout << "  " << program_name
+            << " --client 127.0.0.1 8080 myfile.txt --window 256 --fec 16:2\n";
+  std::cout << "  " << program_name
+            << " --client 127.0.0.1 8080 myfile.txt --window 256 --delta\n";
+  std::cout << "  " << program_name
+            << " --client 127.0.0.1 8080 logs.txt --window 256 --compress 0\n";
+  std::cout << "  " << program_name
+            << " --client 127.0.0.1 8080 photos/ --window 256 --streams 4\n";
+  std::cout << "  " << program_name
+            << " --client 10.0.0.2 8080 myfile.txt --window 256 --payload "
+               "auto\n";
   std::cout << "  " << program_name << " --server 8080 received_file.txt\n";
+  std::cout << "  " << program_name << " --server 8080 received_dir/\n";
+  std::cout << "  " << program_name
+            << " --server 8080 received_file.bin --join 239.1.2.3 --iface "
+               "10.0.0.2\n";
+  std::cout << "  " << program_name
+            << " --multicast 239.1.2.3 8080 artifact.bin --iface 10.0.0.1 "
+               "--rate 500\n";
   std::cout << "  " << program_name << " --verify original.txt received.txt\n";
+  std::cout << "  " << program_name
+            << " --bench-net 256K,4M lossy,burst --window 128 --cc aimd\n";
+  std::cout << "  " << program_name
+            << " --bench-net 3M clean,wan --window 128 --cc bbr --ack-delay "
+               "5000\n";
+  std::cout << "  " << program_name
+            << " --bench-mcast 8M 1,4,16 --netem loss=2\n";
+  std::cout << "  " << program_name << " --bench-timers 10000,100000\n";
+  std::cout << "  " << program_name << " --echo 9000 --busy-poll --cpu 2\n";
+  std::cout << "  " << program_name
+            << " --ping 10.0.0.2 9000 100000 64 --busy-poll --cpu 3\n";
+  std::cout << "  " << program_name << " --bench-pingpong 100000 64 --cpu 2\n";
+  std::cout << "  " << program_name
+            << " --emulate 9090 127.0.0.1 8080 --netem loss=2,delay=10\n";
 }
 
 int main(int argc, char *argv[]) {
@@ -802,12 +12899,175 @@ int main(int argc, char *argv[]) {
       return 0;
     }
 
-    // Check for verbose flag (can be anywhere in arguments)
+    // Check for option flags (can be anywhere in arguments)
+    int window_size = 0;
+    int batch_size = 0;
+    bool gso = false;
+    SyncPolicy sync_policy = SyncPolicy::ON_COMPLETE;
+    uint64_t sync_interval = DEFAULT_SYNC_INTERVAL;
+    std::string congestion_control = "none";
+    int threads = 1;
+    int streams = 1;
+    ChecksumAlgorithm checksum = ChecksumAlgorithm::CRC32C;
+    size_t max_sessions = DEFAULT_MAX_SESSIONS;
+    size_t session_memory = DEFAULT_SESSION_MEMORY;
+    int idle_timeout = DEFAULT_IDLE_TIMEOUT_S;
+    int fec_data = 0;
+    int fec_repair = 0;
+    bool resume = false;
+    bool delta = false;
+    int compress_threads = -1; // -1 = not compressed
+    int payload_size = 0;      // 0 = default size, no handshake
+    bool io_uring = false;     // Server I/O engine: io_uring instead of Asio
+    bool disk_thread = false;  // Server: payload writes on their own thread
+    bool timestamps = false;   // Client: kernel-timestamped RTTs
+    bool busy_poll = false;    // Echo/ping: spin instead of the reactor
+    int cpu = -1;              // Echo/ping: CPU to pin to (-1 = any)
+    int ack_every = DEFAULT_ACK_EVERY;       // Server: packets per ACK
+    int ack_delay_us = DEFAULT_ACK_DELAY_US; // Server: longest ACK hold
+    std::string stats_json;    // JSON statistics export, if set
+    std::string netem;         // Emulator impairment, if set
+    uint64_t seed = 1;         // Emulator random seed
+    std::string join_group;    // Server: multicast group to receive from
+    std::string iface;         // Multicast interface address
+    double rate_mbit = MCAST_DEFAULT_RATE_MBIT; // Multicast sender rate
+    int ttl = MCAST_DEFAULT_TTL;                // Multicast hop limit
     for (int i = 1; i < argc; ++i) {
       std::string arg = argv[i];
       if (arg == "-v" || arg == "--verbose") {
         verbose = true;
-        break;
+      } else if ((arg == "-w" || arg == "--window") && i + 1 < argc) {
+        window_size = std::stoi(argv[++i]);
+        if (window_size < 1 || window_size > SR_MAX_WINDOW) {
+          std::cerr << "Error: Window size must be between 1 and "
+                    << SR_MAX_WINDOW << "\n";
+          return 1;
+        }
+      } else if ((arg == "-b" || arg == "--batch") && i + 1 < argc) {
+        batch_size = std::stoi(argv[++i]);
+        if (batch_size < 1 || batch_size > 1024) {
+          std::cerr << "Error: Batch size must be between 1 and 1024\n";
+          return 1;
+        }
+      } else if (arg == "--gso") {
+        gso = true;
+      } else if (arg == "--io-uring") {
+        io_uring = true;
+      } else if (arg == "--disk-thread") {
+        disk_thread = true;
+      } else if (arg == "--timestamps") {
+        timestamps = true;
+      } else if (arg == "--busy-poll") {
+        busy_poll = true;
+      } else if (arg == "--cpu" && i + 1 < argc) {
+        cpu = std::stoi(argv[++i]);
+        if (cpu < 0) {
+          std::cerr << "Error: CPU must be a CPU number\n";
+          return 1;
+        }
+      } else if (arg == "--ack-every" && i + 1 < argc) {
+        ack_every = std::stoi(argv[++i]);
+        if (ack_every < 1 || ack_every > SR_SACK_BITS) {
+          std::cerr << "Error: ACK frequency must be between 1 and "
+                    << SR_SACK_BITS << " packets\n";
+          return 1;
+        }
+      } else if (arg == "--ack-delay" && i + 1 < argc) {
+        ack_delay_us = std::stoi(argv[++i]);
+        if (ack_delay_us < 0 || ack_delay_us > MIN_RTO_MS * 1000 / 2) {
+          std::cerr << "Error: ACK delay must be between 0 and "
+                    << MIN_RTO_MS * 1000 / 2 << " us\n";
+          return 1;
+        }
+      } else if (arg == "--sync" && i + 1 < argc) {
+        sync_policy = parseSyncPolicy(argv[++i], sync_interval);
+      } else if (arg == "--cc" && i + 1 < argc) {
+        congestion_control = argv[++i];
+      } else if (arg == "--threads" && i + 1 < argc) {
+        threads = std::stoi(argv[++i]);
+        if (threads < 1 || threads > 256) {
+          std::cerr << "Error: Thread count must be between 1 and 256\n";
+          return 1;
+        }
+      } else if (arg == "--checksum" && i + 1 < argc) {
+        checksum = parseChecksumAlgorithm(argv[++i]);
+      } else if (arg == "--streams" && i + 1 < argc) {
+        streams = std::stoi(argv[++i]);
+        if (streams < 1 || streams > MAX_STREAMS) {
+          std::cerr << "Error: Stream count must be between 1 and "
+                    << MAX_STREAMS << "\n";
+          return 1;
+        }
+      } else if (arg == "--max-sessions" && i + 1 < argc) {
+        int sessions = std::stoi(argv[++i]);
+        if (sessions < 1 || sessions > MAX_SESSIONS_LIMIT) {
+          std::cerr << "Error: Session count must be between 1 and "
+                    << MAX_SESSIONS_LIMIT << "\n";
+          return 1;
+        }
+        max_sessions = sessions;
+      } else if (arg == "--session-memory" && i + 1 < argc) {
+        int megabytes = std::stoi(argv[++i]);
+        if (megabytes < 1 || megabytes > MAX_SESSION_MEMORY_MB) {
+          std::cerr << "Error: Session memory must be between 1 and "
+                    << MAX_SESSION_MEMORY_MB << " MB\n";
+          return 1;
+        }
+        session_memory = static_cast<size_t>(megabytes) * 1024 * 1024;
+      } else if (arg == "--idle-timeout" && i + 1 < argc) {
+        idle_timeout = std::stoi(argv[++i]);
+        if (idle_timeout < MIN_IDLE_TIMEOUT_S ||
+            idle_timeout > MAX_IDLE_TIMEOUT_S) {
+          std::cerr << "Error: Idle timeout must be between "
+                    << MIN_IDLE_TIMEOUT_S << " and " << MAX_IDLE_TIMEOUT_S
+                    << " s\n";
+          return 1;
+        }
+      } else if (arg == "--fec" && i + 1 < argc) {
+        parseFecShape(argv[++i], fec_data, fec_repair);
+      } else if (arg == "--resume") {
+        resume = true;
+      } else if (arg == "--delta") {
+        delta = true;
+      } else if (arg == "--compress" && i + 1 < argc) {
+        compress_threads = std::stoi(argv[++i]);
+        if (compress_threads < 0 || compress_threads > 256) {
+          std::cerr << "Error: Compression threads must be between 0 and "
+                       "256\n";
+          return 1;
+        }
+      } else if (arg == "--stats-json" && i + 1 < argc) {
+        stats_json = argv[++i];
+      } else if (arg == "--netem" && i + 1 < argc) {
+        netem = argv[++i];
+      } else if (arg == "--seed" && i + 1 < argc) {
+        seed = std::stoull(argv[++i]);
+      } else if (arg == "--join" && i + 1 < argc) {
+        join_group = argv[++i];
+      } else if (arg == "--iface" && i + 1 < argc) {
+        iface = argv[++i];
+      } else if (arg == "--rate" && i + 1 < argc) {
+        rate_mbit = std::stod(argv[++i]);
+        if (rate_mbit <= 0.0) {
+          std::cerr << "Error: Multicast rate must be positive\n";
+          return 1;
+        }
+      } else if (arg == "--ttl" && i + 1 < argc) {
+        ttl = std::stoi(argv[++i]);
+        if (ttl < 0 || ttl > 255) {
+          std::cerr << "Error: TTL must be between 0 and 255\n";
+          return 1;
+        }
+      } else if (arg == "--payload" && i + 1 < argc) {
+        std::string value = argv[++i];
+        payload_size = value == "auto" ? MAX_PAYLOAD_SIZE : std::stoi(value);
+        if (payload_size < MIN_PAYLOAD_SIZE ||
+            payload_size > MAX_PAYLOAD_SIZE) {
+          std::cerr << "Error: Payload size must be between "
+                    << MIN_PAYLOAD_SIZE << " and " << MAX_PAYLOAD_SIZE
+                    << " (or auto)\n";
+          return 1;
+        }
       }
     }
 
@@ -825,29 +13085,140 @@ int main(int argc, char *argv[]) {
       int server_port = std::stoi(argv[3]);
       std::string filename = argv[4];
 
-      // Read the file
-      std::vector<char> file_data = readFileContents(filename);
+      // Negotiated payload: handshake and path MTU probes before any data
+      PayloadNegotiation negotiation = {DEFAULT_PAYLOAD_SIZE, 0, 0, 0};
+      if (payload_size > 0) {
+        negotiation = negotiatePayload(server_ip, server_port, payload_size);
+        std::cout << "Payload: " << negotiation.payload_size
+                  << " bytes per packet (asked " << payload_size
+                  << ", server limit " << negotiation.server_max
+                  << ", route MTU ";
+        if (negotiation.route_mtu > 0) {
+          std::cout << negotiation.route_mtu;
+        } else {
+          std::cout << "unknown";
+        }
+        std::cout << ")" << std::endl;
+      }
+
+      // Directory mode: a pack of the small files with the tree's index,
+      // and a transfer of its own for each large file, all over the streams
+      if (isDirectory(filename)) {
+        if (window_size == 0) {
+          std::cerr << "Error: sending a directory needs --window\n";
+          return 1;
+        }
+        if (resume || delta || compress_threads >= 0) {
+          std::cerr << "Error: "
+                    << (resume ? "--resume" : delta ? "--delta" : "--compress")
+                    << " does not apply to directories\n";
+          return 1;
+        }
+        ParallelTransfer transfer(server_ip, server_port, streams, verbose,
+                                  window_size, batch_size, gso,
+                                  congestion_control, checksum, fec_data,
+                                  fec_repair, false, false,
+                                  negotiation.payload_size, timestamps);
+        transfer.setPathMtu(negotiation.route_mtu, negotiation.probes);
+        if (!transfer.send_tree(filename)) {
+          std::cerr << "Directory transfer failed: " << filename << std::endl;
+          return 1;
+        }
+        transfer.getLatencyStats().printStats();
+        if (!stats_json.empty()) {
+          transfer.getLatencyStats().writeJsonFile(stats_json);
+        }
+        std::cout << "Directory transfer complete: " << filename << std::endl;
+        return 0;
+      }
+
+      // Multi-stream mode: N flows on their own sockets and threads.
+      // Resumable and delta transfers use the same path with one stream or
+      // more.
+      if (streams > 1 || resume || delta) {
+        if (compress_threads >= 0) {
+          std::cerr << "Error: --compress does not combine with "
+                    << (resume ? "--resume" : delta ? "--delta" : "--streams")
+                    << "\n";
+          return 1;
+        }
+        if (window_size == 0) {
+          std::cerr << "Error: "
+                    << (resume ? "--resume" : delta ? "--delta" : "--streams")
+                    << " needs --window\n";
+          return 1;
+        }
+        if (resume && delta) {
+          std::cerr << "Error: --resume and --delta do not combine\n";
+          return 1;
+        }
+        ParallelTransfer transfer(server_ip, server_port, streams, verbose,
+                                  window_size, batch_size, gso,
+                                  congestion_control, checksum, fec_data,
+                                  fec_repair, resume, delta,
+                                  negotiation.payload_size, timestamps);
+        transfer.setPathMtu(negotiation.route_mtu, negotiation.probes);
+        if (!transfer.send_file(filename)) {
+          std::cerr << "File transfer failed: " << filename << std::endl;
+          return 1;
+        }
+        transfer.getLatencyStats().printStats();
+        if (!stats_json.empty()) {
+          transfer.getLatencyStats().writeJsonFile(stats_json);
+        }
+        std::cout << "File transfer complete: " << filename << std::endl;
+        return 0;
+      }
+
+      if (compress_threads >= 0 && window_size == 0) {
+        std::cerr << "Error: --compress needs --window\n";
+        return 1;
+      }
+
+      // Open the file; packets are streamed from it as they are sent
+      FileSource source(filename);
 
-      if (file_data.empty()) {
+      if (source.size() == 0) {
         std::cout << "Warning: File is empty, but will still be sent."
                   << std::endl;
       }
 
       // Create IO context and client
       boost::asio::io_context io_context;
-      UdpClient client(io_context, server_ip, server_port, verbose);
+      UdpClient client(io_context, server_ip, server_port, verbose,
+                       window_size, batch_size, gso, congestion_control,
+                       checksum, fec_data, fec_repair,
+                       negotiation.payload_size, timestamps);
+      client.setPathMtu(negotiation.route_mtu, negotiation.probes);
+
+      // Compressed transfer: workers build frames ahead of the window
+      std::unique_ptr<BlockCompressor> compressor;
+      if (compress_threads >= 0) {
+        compressor.reset(new BlockCompressor(source, compress_threads));
+        client.setCompressor(compressor.get());
+        std::cout << "Compression: zlib level " << COMPRESS_LEVEL << ", "
+                  << compressor->threads() << " threads" << std::endl;
+      }
 
       // Send the file data
-      client.send_data(file_data);
+      client.send_file(source);
 
       // Run the IO context
       io_context.run();
 
+      if (client.transferFailed()) {
+        std::cerr << "File transfer failed: " << filename << std::endl;
+        return 1;
+      }
+
       // Print latency statistics
       client.getLatencyStats().printStats();
+      if (!stats_json.empty()) {
+        client.getLatencyStats().writeJsonFile(stats_json);
+      }
 
       std::cout << "File transfer complete: " << filename << " ("
-                << file_data.size() << " bytes)" << std::endl;
+                << source.size() << " bytes)" << std::endl;
     } else if (mode == "--server") {
       if (argc < 3) {
         std::cerr << "Error: Server mode requires port number\n";
@@ -858,19 +13229,104 @@ int main(int argc, char *argv[]) {
       // Get server parameters
       int port = std::stoi(argv[2]);
       std::string output_file = (argc > 3 && argv[3][0] != '-') ? argv[3] : "";
+      if (!join_group.empty() && threads > 1) {
+        std::cerr << "Error: --join needs a single socket (no --threads)\n";
+        return 1;
+      }
+      if (window_size == 0) {
+        window_size =
+            join_group.empty() ? SR_DEFAULT_RECV_WINDOW : MCAST_RECV_WINDOW;
+      }
 
-      // Create IO context and server
-      boost::asio::io_context io_context;
-      UdpServer server(io_context, port, output_file, verbose);
+      // One IO context, socket and thread per server; all of them share the
+      // session limits
+      SessionLimits limits(max_sessions, session_memory, idle_timeout);
+      TransferGroups groups;
+      WorkerPool decoders(std::max(compress_threads, 0));
+      std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+      std::vector<std::unique_ptr<UdpServer>> servers;
+      for (int i = 0; i < threads; ++i) {
+        contexts.emplace_back(new boost::asio::io_context());
+        servers.emplace_back(new UdpServer(
+            *contexts.back(), port, limits, groups, output_file, verbose,
+            window_size, sync_policy, sync_interval, batch_size, gso,
+            threads > 1, &decoders,
+            payload_size > 0 ? payload_size : MAX_PAYLOAD_SIZE, io_uring,
+            ack_every, ack_delay_us, join_group, iface, disk_thread));
+        servers.back()->start_receive();
+      }
 
-      // Start server
-      server.start_receive();
+      std::cout << "Server started on port " << port;
+      if (threads > 1) {
+        std::cout << " (" << threads << " sockets with SO_REUSEPORT)";
+      }
+      std::cout << std::endl;
+      if (!output_file.empty()) {
+        std::cout << "Data will be saved to: " << output_file << std::endl;
+      }
+      std::cout << "Waiting for data..." << std::endl;
 
-      // Run the IO context
-      io_context.run();
+      // Ctrl-C stops every server, then the combined statistics print
+      boost::asio::signal_set signals(*contexts[0], SIGINT, SIGTERM);
+      signals.async_wait([&](const boost::system::error_code &error, int) {
+        if (error) {
+          return;
+        }
+        for (size_t i = 0; i < servers.size(); ++i) {
+          UdpServer *server = servers[i].get();
+          boost::asio::post(*contexts[i], [server]() { server->stop(); });
+        }
+      });
+
+      // Run the IO contexts
+      std::vector<std::thread> workers;
+      for (int i = 1; i < threads; ++i) {
+        boost::asio::io_context *context = contexts[i].get();
+        workers.emplace_back([context]() { context->run(); });
+      }
+      contexts[0]->run();
+      for (std::thread &worker : workers) {
+        worker.join();
+      }
 
       // Print latency statistics
-      server.getLatencyStats().printStats();
+      LatencyStats stats = servers[0]->getLatencyStats();
+      for (size_t i = 1; i < servers.size(); ++i) {
+        stats.merge(servers[i]->getLatencyStats());
+      }
+      std::cout << "Sessions: " << limits.sessions_opened << " opened, "
+                << limits.sessions_rejected << " rejected" << std::endl;
+      stats.printStats();
+      if (!stats_json.empty()) {
+        stats.writeJsonFile(stats_json);
+      }
+    } else if (mode == "--multicast") {
+      if (argc < 5) {
+        std::cerr << "Error: Multicast mode requires group, port, and "
+                     "filename\n";
+        print_help(argv[0]);
+        return 1;
+      }
+      if (fec_data == 0) {
+        fec_data = MCAST_DEFAULT_FEC_DATA;
+        fec_repair = MCAST_DEFAULT_FEC_REPAIR;
+      }
+
+      // No handshake with receivers that may not exist yet: --payload is
+      // taken as given, and must fit every path to the group
+      FileSource source(argv[4]);
+      boost::asio::io_context io_context;
+      MulticastSender sender(
+          io_context, argv[2], std::stoi(argv[3]), iface, ttl, rate_mbit,
+          payload_size > 0 ? payload_size : DEFAULT_PAYLOAD_SIZE, checksum,
+          fec_data, fec_repair);
+      sender.send_file(source);
+      io_context.run();
+
+      sender.getLatencyStats().printStats();
+      if (!stats_json.empty()) {
+        sender.getLatencyStats().writeJsonFile(stats_json);
+      }
     } else if (mode == "--verify") {
       if (argc < 4) {
         std::cerr
@@ -891,6 +13347,178 @@ int main(int argc, char *argv[]) {
       bool data_matches = verifyData(original_data, received_data);
 
       return data_matches ? 0 : 1;
+    } else if (mode == "--bench-batch") {
+      size_t packets = (argc > 2 && argv[2][0] != '-') ? std::stoul(argv[2])
+                                                       : 200000;
+      int batch = (argc > 3 && argv[3][0] != '-') ? std::stoi(argv[3]) : 64;
+      run_batch_benchmark(packets, batch);
+      run_zero_copy_benchmark(packets, batch);
+    } else if (mode == "--bench-payload") {
+      size_t packets = (argc > 2 && argv[2][0] != '-') ? std::stoul(argv[2])
+                                                       : 200000;
+      int batch = (argc > 3 && argv[3][0] != '-') ? std::stoi(argv[3]) : 64;
+      run_payload_benchmark(packets, batch);
+    } else if (mode == "--bench-checksum") {
+      return run_checksum_benchmark() ? 0 : 1;
+    } else if (mode == "--bench-timers") {
+      // Comma-separated counts of outstanding timers
+      std::vector<size_t> counts;
+      std::string field;
+      std::istringstream count_fields((argc > 2 && argv[2][0] != '-')
+                                          ? argv[2]
+                                          : "10000,100000,1000000");
+      while (std::getline(count_fields, field, ',')) {
+        counts.push_back(std::stoul(field));
+      }
+      return run_timer_benchmark(counts) ? 0 : 1;
+    } else if (mode == "--bench-net") {
+      // Comma-separated sizes and profiles; every preset by default
+      std::vector<uint64_t> sizes;
+      std::string size_list =
+          (argc > 2 && argv[2][0] != '-') ? argv[2] : "256K,1M";
+      std::istringstream size_fields(size_list);
+      std::string field;
+      while (std::getline(size_fields, field, ',')) {
+        sizes.push_back(parseByteSize(field));
+      }
+      std::vector<NetworkProfile> profiles;
+      if (argc > 3 && argv[3][0] != '-') {
+        std::istringstream profile_fields(argv[3]);
+        while (std::getline(profile_fields, field, ',')) {
+          profiles.push_back(parseNetworkProfile(field));
+        }
+      } else if (netem.empty()) {
+        profiles = networkProfilePresets();
+      }
+      if (!netem.empty()) {
+        profiles.push_back(parseNetworkProfile(netem));
+      }
+      return run_network_benchmark(sizes, profiles, seed,
+                                   window_size > 0 ? window_size : 64,
+                                   batch_size, congestion_control, fec_data,
+                                   fec_repair, payload_size, ack_every,
+                                   ack_delay_us)
+                 ? 0
+                 : 1;
+    } else if (mode == "--bench-mcast") {
+      uint64_t size = parseByteSize(
+          (argc > 2 && argv[2][0] != '-') ? argv[2] : "4M");
+      std::vector<int> counts;
+      std::string field;
+      std::istringstream count_fields(
+          (argc > 3 && argv[3][0] != '-') ? argv[3] : "1,4,16");
+      while (std::getline(count_fields, field, ',')) {
+        counts.push_back(std::stoi(field));
+      }
+      // Each receiver loses its own packets at the --netem loss rate
+      double loss = netem.empty() ? 0.01 : parseNetworkProfile(netem).loss;
+      if (fec_data == 0) {
+        fec_data = MCAST_DEFAULT_FEC_DATA;
+        fec_repair = MCAST_DEFAULT_FEC_REPAIR;
+      }
+      return run_multicast_benchmark(size, counts, loss, seed, rate_mbit,
+                                     fec_data, fec_repair)
+                 ? 0
+                 : 1;
+    } else if (mode == "--echo") {
+      if (argc < 3) {
+        std::cerr << "Error: Echo mode requires a port\n";
+        print_help(argv[0]);
+        return 1;
+      }
+      boost::asio::io_context io_context;
+      EchoResponder responder(io_context,
+                              static_cast<unsigned short>(std::stoi(argv[2])),
+                              busy_poll, cpu);
+      responder.start();
+      std::cout << "Answering pings on port " << responder.port() << " ("
+                << (busy_poll ? "busy polling" : "reactor") << ")"
+                << std::endl;
+      if (!busy_poll && cpu >= 0 && !pinThread(cpu)) {
+        std::cerr << "Could not pin to CPU " << cpu << std::endl;
+      }
+
+      // Ctrl-C stops answering
+      boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+      signals.async_wait([&](const boost::system::error_code &error, int) {
+        if (!error) {
+          responder.stop();
+        }
+      });
+      io_context.run();
+      std::cout << "Answered " << responder.replies() << " pings";
+      if (busy_poll) {
+        std::cout << ", slept " << responder.poller().sleeps()
+                  << " times when idle";
+      }
+      std::cout << std::endl;
+    } else if (mode == "--ping") {
+      if (argc < 4) {
+        std::cerr << "Error: Ping mode requires server_ip and port\n";
+        print_help(argv[0]);
+        return 1;
+      }
+      size_t count = (argc > 4 && argv[4][0] != '-') ? std::stoul(argv[4])
+                                                     : 10000;
+      size_t size = (argc > 5 && argv[5][0] != '-') ? std::stoul(argv[5])
+                                                    : PING_DEFAULT_MESSAGE;
+      boost::asio::io_context io_context;
+      PingClient client(
+          io_context,
+          udp::endpoint(boost::asio::ip::make_address(argv[2]),
+                        static_cast<unsigned short>(std::stoi(argv[3]))),
+          size, busy_poll, cpu);
+      const LatencyHistogram &rtts = client.run(count);
+      std::cout << "Round trips: " << rtts.count() << " answered, "
+                << client.lost() << " lost (" << (busy_poll ? "busy polling"
+                                                             : "reactor")
+                << ")" << std::endl;
+      std::cout << "RTT: " << std::fixed << std::setprecision(1) << "p50 "
+                << rtts.percentile(50) * 1000 << ", p90 "
+                << rtts.percentile(90) * 1000 << ", p99 "
+                << rtts.percentile(99) * 1000 << ", p99.9 "
+                << rtts.percentile(99.9) * 1000 << ", max "
+                << rtts.max() * 1000 << " us" << std::endl;
+      return rtts.empty() ? 1 : 0;
+    } else if (mode == "--bench-pingpong") {
+      size_t count = (argc > 2 && argv[2][0] != '-') ? std::stoul(argv[2])
+                                                     : 100000;
+      size_t size = (argc > 3 && argv[3][0] != '-') ? std::stoul(argv[3])
+                                                    : PING_DEFAULT_MESSAGE;
+      return run_pingpong_benchmark(count, size, cpu) ? 0 : 1;
+    } else if (mode == "--emulate") {
+      if (argc < 5) {
+        std::cerr << "Error: Emulator mode requires listen_port, server_ip "
+                     "and server_port\n";
+        print_help(argv[0]);
+        return 1;
+      }
+      NetworkProfile profile =
+          parseNetworkProfile(netem.empty() ? "clean" : netem);
+      boost::asio::io_context io_context;
+      udp::endpoint server(boost::asio::ip::make_address(argv[3]),
+                           static_cast<unsigned short>(std::stoi(argv[4])));
+      NetworkEmulator emulator(io_context,
+                               static_cast<unsigned short>(std::stoi(argv[2])),
+                               server, profile, seed);
+      std::cout << "Emulating " << profile.name << " network on port "
+                << emulator.port() << " towards " << server << " (seed "
+                << seed << ")" << std::endl;
+
+      // Ctrl-C stops relaying and prints what happened to the packets
+      boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+      signals.async_wait([&](const boost::system::error_code &error, int) {
+        if (!error) {
+          emulator.stop();
+        }
+      });
+      io_context.run();
+      const NetworkEmulator::Counters &counters = emulator.counters();
+      std::cout << "Forwarded: " << counters.forwarded
+                << ", lost: " << counters.lost
+                << ", queue drops: " << counters.queue_drops
+                << ", reordered: " << counters.reordered
+                << ", duplicated: " << counters.duplicated << std::endl;
     } else {
       std::cerr << "Error: Unknown mode '" << mode << "'\n";
       print_help(argv[0]);